@@ -64,12 +64,35 @@ public:
   std::vector<std::pair<std::string, std::vector<std::string>>> get_udev_hw_db_entries() const override;
 };
 
+/**
+ * The whole state of a joypad, as sent by Moonlight in a single CONTROLLER_MULTI packet
+ */
+struct JoypadState {
+  unsigned int buttons = 0; // see: inputtino::Joypad::CONTROLLER_BTN
+  short ls_x = 0;
+  short ls_y = 0;
+  short rs_x = 0;
+  short rs_y = 0;
+  std::int16_t left_trigger = 0;
+  std::int16_t right_trigger = 0;
+};
+
 class XboxOneJoypad : public inputtino::XboxOneJoypad, public VirtualDevice {
 public:
   XboxOneJoypad(inputtino::XboxOneJoypad &&j) noexcept : inputtino::XboxOneJoypad(std::move(j)) {}
 
   std::vector<std::map<std::string, std::string>> get_udev_events() const override;
   std::vector<std::pair<std::string, std::vector<std::string>>> get_udev_hw_db_entries() const override;
+
+  /**
+   * Writes all the buttons and axis that have changed since the last call in a single write(),
+   * followed by a single SYN_REPORT. Nothing is written when the state hasn't changed.
+   * Buttons are compared against inputtino's own pressed state, so it can be mixed with set_pressed_buttons().
+   */
+  void set_state(const JoypadState &state);
+
+private:
+  JoypadState _last_state = {};
 };
 
 class SwitchJoypad : public inputtino::SwitchJoypad, public VirtualDevice {
@@ -78,6 +101,14 @@ public:
 
   std::vector<std::map<std::string, std::string>> get_udev_events() const override;
   std::vector<std::pair<std::string, std::vector<std::string>>> get_udev_hw_db_entries() const override;
+
+  /**
+   * Only updates the buttons, sticks and triggers that have changed since the last call
+   */
+  void set_state(const JoypadState &state);
+
+private:
+  JoypadState _last_state = {};
 };
 
 class PS5Joypad : public inputtino::PS5Joypad, public VirtualDevice {
@@ -86,5 +117,13 @@ public:
 
   std::vector<std::map<std::string, std::string>> get_udev_events() const override;
   std::vector<std::pair<std::string, std::vector<std::string>>> get_udev_hw_db_entries() const override;
+
+  /**
+   * Only updates the buttons, sticks and triggers that have changed since the last call
+   */
+  void set_state(const JoypadState &state);
+
+private:
+  JoypadState _last_state = {};
 };
 } // namespace wolf::core::input
@@ -204,4 +204,100 @@ std::vector<std::pair<std::string, std::vector<std::string>>> PS5Joypad::get_ude
   return result;
 }
 
-} // namespace wolf::core::input
\ No newline at end of file
+/**
+ * Calls the inputtino setters only for the parts of the state that have changed
+ */
+template <typename T> static void set_changed_state(T &pad, const JoypadState &last, const JoypadState &state) {
+  if (state.buttons != last.buttons) {
+    pad.set_pressed_buttons(state.buttons);
+  }
+  if (state.ls_x != last.ls_x || state.ls_y != last.ls_y) {
+    pad.set_stick(inputtino::Joypad::LS, state.ls_x, state.ls_y);
+  }
+  if (state.rs_x != last.rs_x || state.rs_y != last.rs_y) {
+    pad.set_stick(inputtino::Joypad::RS, state.rs_x, state.rs_y);
+  }
+  if (state.left_trigger != last.left_trigger || state.right_trigger != last.right_trigger) {
+    pad.set_triggers(state.left_trigger, state.right_trigger);
+  }
+}
+
+void SwitchJoypad::set_state(const JoypadState &state) {
+  set_changed_state(*this, _last_state, state);
+  _last_state = state;
+}
+
+void PS5Joypad::set_state(const JoypadState &state) {
+  set_changed_state(*this, _last_state, state);
+  _last_state = state;
+}
+
+/**
+ * Same mapping as inputtino::XboxOneJoypad::set_pressed_buttons()
+ */
+static void add_xbox_buttons(std::vector<input_event> &events, unsigned int previous, unsigned int pressed) {
+  using BTN = inputtino::Joypad::CONTROLLER_BTN;
+  auto changed = previous ^ pressed;
+  if (!changed) {
+    return;
+  }
+
+  if (changed & (BTN::DPAD_UP | BTN::DPAD_DOWN)) {
+    events.push_back(make_event(EV_ABS, ABS_HAT0Y, pressed & BTN::DPAD_UP ? -1 : (pressed & BTN::DPAD_DOWN ? 1 : 0)));
+  }
+  if (changed & (BTN::DPAD_LEFT | BTN::DPAD_RIGHT)) {
+    events.push_back(
+        make_event(EV_ABS, ABS_HAT0X, pressed & BTN::DPAD_LEFT ? -1 : (pressed & BTN::DPAD_RIGHT ? 1 : 0)));
+  }
+
+  constexpr std::pair<unsigned int, unsigned short> btn_codes[] = {{BTN::START, BTN_START},
+                                                                   {BTN::BACK, BTN_SELECT},
+                                                                   {BTN::LEFT_STICK, BTN_THUMBL},
+                                                                   {BTN::RIGHT_STICK, BTN_THUMBR},
+                                                                   {BTN::LEFT_BUTTON, BTN_TL},
+                                                                   {BTN::RIGHT_BUTTON, BTN_TR},
+                                                                   {BTN::HOME, BTN_MODE},
+                                                                   {BTN::A, BTN_SOUTH},
+                                                                   {BTN::B, BTN_EAST},
+                                                                   {BTN::X, BTN_NORTH},
+                                                                   {BTN::Y, BTN_WEST}};
+  for (const auto &[flag, code] : btn_codes) {
+    if (changed & flag) {
+      events.push_back(make_event(EV_KEY, code, pressed & flag ? 1 : 0));
+    }
+  }
+}
+
+void XboxOneJoypad::set_state(const JoypadState &state) {
+  if (auto controller = _state->joy.get()) {
+    std::vector<input_event> events;
+    events.reserve(20);
+
+    // inputtino keeps track of the pressed buttons, use (and update) it so that its own setters stay consistent
+    add_xbox_buttons(events, _state->currently_pressed_btns, state.buttons);
+    _state->currently_pressed_btns = (int)state.buttons;
+    if (state.ls_x != _last_state.ls_x) {
+      events.push_back(make_event(EV_ABS, ABS_X, state.ls_x));
+    }
+    if (state.ls_y != _last_state.ls_y) {
+      events.push_back(make_event(EV_ABS, ABS_Y, -state.ls_y));
+    }
+    if (state.rs_x != _last_state.rs_x) {
+      events.push_back(make_event(EV_ABS, ABS_RX, state.rs_x));
+    }
+    if (state.rs_y != _last_state.rs_y) {
+      events.push_back(make_event(EV_ABS, ABS_RY, -state.rs_y));
+    }
+    if (state.left_trigger != _last_state.left_trigger) {
+      events.push_back(make_event(EV_ABS, ABS_Z, state.left_trigger));
+    }
+    if (state.right_trigger != _last_state.right_trigger) {
+      events.push_back(make_event(EV_ABS, ABS_RZ, state.right_trigger));
+    }
+
+    write_events(controller, events);
+  }
+  _last_state = state;
+}
+
+} // namespace wolf::core::input
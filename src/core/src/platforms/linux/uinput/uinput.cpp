@@ -1,5 +1,6 @@
 #include "uinput.hpp"
 #include <helpers/logger.hpp>
+#include <unistd.h>
 
 namespace wolf::core::input {
 
@@ -29,6 +30,24 @@ std::vector<inputtino::libevdev_event_ptr> fetch_events(const libevdev_ptr &dev,
   return events;
 }
 
+bool write_events(const libevdev_uinput *device, std::vector<input_event> &events) {
+  if (events.empty()) {
+    return true;
+  }
+
+  events.push_back(make_event(EV_SYN, SYN_REPORT, 0));
+  auto size = events.size() * sizeof(input_event);
+  auto ret = write(libevdev_uinput_get_fd(device), events.data(), size);
+  if (ret < 0) {
+    logs::log(logs::warning, "Failed writing {} events to uinput fd; ret={}", events.size(), strerror(errno));
+    return false;
+  } else if (ret != (ssize_t)size) {
+    logs::log(logs::warning, "Uinput incorrect write size of {} for {} events", ret, events.size());
+    return false;
+  }
+  return true;
+}
+
 std::vector<inputtino::libevdev_event_ptr> fetch_events(int uinput_fd, int max_events) {
   std::vector<inputtino::libevdev_event_ptr> events = {};
   struct input_event ev {};
@@ -46,6 +46,23 @@ using libevdev_ptr = std::shared_ptr<libevdev>;
  */
 std::vector<inputtino::libevdev_event_ptr> fetch_events(const libevdev_ptr &dev, int max_events = 50);
 
+static input_event make_event(unsigned short type, unsigned short code, int value) {
+  input_event ev = {};
+  ev.type = type;
+  ev.code = code;
+  ev.value = value;
+  return ev;
+}
+
+/**
+ * Writes all the events, followed by a single SYN_REPORT, with one write() call;
+ * libevdev_uinput_write_event() would instead call write() for each event (and for each SYN_REPORT).
+ * Nothing is written when there are no events.
+ *
+ * @returns false if the events couldn't be written
+ */
+bool write_events(const libevdev_uinput *device, std::vector<input_event> &events);
+
 static std::pair<unsigned int, unsigned int> get_major_minor(const std::string &devnode) {
   struct stat buf {};
   if (stat(devnode.c_str(), &buf) == -1) {
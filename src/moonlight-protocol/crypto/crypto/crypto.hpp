@@ -2,6 +2,7 @@
 
 #include <memory>
 #include <openssl/aes.h>
+#include <openssl/evp.h>
 #include <openssl/x509.h>
 #include <optional>
 #include <string>
@@ -69,6 +70,73 @@ std::string aes_decrypt_cbc(std::string_view msg,
                             std::string_view iv = random(AES_BLOCK_SIZE),
                             bool padding = false);
 
+using cipher_ctx_ptr = std::shared_ptr<EVP_CIPHER_CTX>;
+
+/**
+ * Creates an AES CBC (128 bit) encryption context that can be re-used with aes_encrypt_cbc_into():
+ * the key schedule is computed only once.
+ *
+ * @param enc_key: the key used for encryption
+ * @param padding: optional, enables or disables padding
+ */
+cipher_ctx_ptr aes_cbc_encryption_ctx(std::string_view enc_key, bool padding = false);
+
+/**
+ * Encrypt the given msg using AES CBC at 128 bit, re-using a context created by aes_cbc_encryption_ctx()
+ * Nothing is allocated: the ciphertext is written straight into out.
+ *
+ * @param ctx: the encryption context, only the IV will be changed
+ * @param msg: the message to be encrypted
+ * @param iv: the AES_BLOCK_SIZE bytes IV
+ * @param out: where the ciphertext will be written, must have room for msg.size() + AES_BLOCK_SIZE bytes
+ * @return: the number of bytes written into out
+ */
+int aes_encrypt_cbc_into(EVP_CIPHER_CTX *ctx, std::string_view msg, const unsigned char *iv, unsigned char *out);
+
+/**
+ * Creates an AES GCM (128 bit) context that can be re-used with aes_encrypt_gcm_into() or aes_decrypt_gcm_into():
+ * the key schedule is computed only once.
+ *
+ * @param enc_key: the key used for encryption
+ * @param is_encryption: true for an encryption context, false for a decryption one
+ * @param iv_size: the size of the IVs that will be used with this context
+ */
+cipher_ctx_ptr aes_gcm_ctx(std::string_view enc_key, bool is_encryption, int iv_size);
+
+/**
+ * Encrypt the given msg using AES GCM at 128 bit, re-using a context created by aes_gcm_ctx()
+ * Nothing is allocated: the ciphertext is written straight into out and the tag into tag.
+ *
+ * @param ctx: the encryption context, only the IV will be changed
+ * @param msg: the message to be encrypted
+ * @param iv: the IV, must be of the size used to create the context
+ * @param out: where the ciphertext will be written, must have room for msg.size() bytes
+ * @param tag: where the AES_GCM tag (16 bytes) will be written
+ * @return: the number of bytes written into out
+ */
+int aes_encrypt_gcm_into(EVP_CIPHER_CTX *ctx,
+                         std::string_view msg,
+                         std::string_view iv,
+                         unsigned char *out,
+                         unsigned char *tag);
+
+/**
+ * Decrypt the given msg using AES GCM at 128 bit, re-using a context created by aes_gcm_ctx()
+ * Throws if the tag doesn't match.
+ *
+ * @param ctx: the decryption context, only the IV will be changed
+ * @param msg: the message to be decrypted
+ * @param tag: the AES_GCM tag (16 bytes)
+ * @param iv: the IV, must be of the size used to create the context
+ * @param out: where the plaintext will be written, must have room for msg.size() bytes
+ * @return: the number of bytes written into out
+ */
+int aes_decrypt_gcm_into(EVP_CIPHER_CTX *ctx,
+                         std::string_view msg,
+                         std::string_view tag,
+                         std::string_view iv,
+                         unsigned char *out);
+
 /**
  * Encrypt the given msg using AES gcm at 128 bit
  *
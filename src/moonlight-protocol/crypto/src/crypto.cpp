@@ -112,6 +112,93 @@ std::string aes_decrypt_cbc(std::string_view msg, std::string_view enc_key, std:
   return aes::decrypt_symmetric(ctx.get(), msg);
 }
 
+cipher_ctx_ptr aes_cbc_encryption_ctx(std::string_view enc_key, bool padding) {
+  auto iv = std::string(AES_BLOCK_SIZE, '\0');
+  return aes::init(EVP_aes_128_cbc(), enc_key, iv, true, padding);
+}
+
+int aes_encrypt_cbc_into(EVP_CIPHER_CTX *ctx, std::string_view msg, const unsigned char *iv, unsigned char *out) {
+  int c_len = 0;
+  int f_len = 0;
+
+  /* keeps the cipher and the key, only the IV is set */
+  if (EVP_EncryptInit_ex(ctx, nullptr, nullptr, nullptr, iv) != 1)
+    handle_openssl_error("EVP_EncryptInit_ex failed");
+
+  if (EVP_EncryptUpdate(ctx, out, &c_len, (const std::uint8_t *)msg.data(), (int)msg.size()) != 1)
+    handle_openssl_error("EVP_EncryptUpdate failed");
+
+  if (EVP_EncryptFinal_ex(ctx, out + c_len, &f_len) != 1)
+    handle_openssl_error("EVP_EncryptFinal_ex failed");
+
+  return c_len + f_len;
+}
+
+cipher_ctx_ptr aes_gcm_ctx(std::string_view enc_key, bool is_encryption, int iv_size) {
+  cipher_ctx_ptr ctx(EVP_CIPHER_CTX_new(), ::EVP_CIPHER_CTX_free);
+
+  if (EVP_CipherInit_ex(ctx.get(), EVP_aes_128_gcm(), nullptr, nullptr, nullptr, is_encryption) != 1)
+    handle_openssl_error("EVP_CipherInit_ex failed");
+
+  if (EVP_CIPHER_CTX_ctrl(ctx.get(), EVP_CTRL_GCM_SET_IVLEN, iv_size, nullptr) != 1)
+    handle_openssl_error("EVP_CTRL_GCM_SET_IVLEN failed");
+
+  auto key = (const std::uint8_t *)enc_key.data();
+  if (EVP_CipherInit_ex(ctx.get(), nullptr, nullptr, key, nullptr, is_encryption) != 1)
+    handle_openssl_error("EVP_CipherInit_ex (2) failed");
+
+  return ctx;
+}
+
+int aes_encrypt_gcm_into(EVP_CIPHER_CTX *ctx,
+                         std::string_view msg,
+                         std::string_view iv,
+                         unsigned char *out,
+                         unsigned char *tag) {
+  int c_len = 0;
+  int f_len = 0;
+
+  /* keeps the cipher and the key, only the IV is set */
+  if (EVP_EncryptInit_ex(ctx, nullptr, nullptr, nullptr, (const std::uint8_t *)iv.data()) != 1)
+    handle_openssl_error("EVP_EncryptInit_ex failed");
+
+  if (EVP_EncryptUpdate(ctx, out, &c_len, (const std::uint8_t *)msg.data(), (int)msg.size()) != 1)
+    handle_openssl_error("EVP_EncryptUpdate failed");
+
+  // GCM encryption won't ever fill out here but we have to call it anyway
+  if (EVP_EncryptFinal_ex(ctx, out + c_len, &f_len) != 1)
+    handle_openssl_error("EVP_EncryptFinal_ex failed");
+
+  if (EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, aes::AES_GCM_TAG_SIZE, tag) != 1)
+    handle_openssl_error("EVP_CTRL_GCM_GET_TAG failed");
+
+  return c_len + f_len;
+}
+
+int aes_decrypt_gcm_into(EVP_CIPHER_CTX *ctx,
+                         std::string_view msg,
+                         std::string_view tag,
+                         std::string_view iv,
+                         unsigned char *out) {
+  int len = 0;
+  int f_len = 0;
+
+  /* keeps the cipher and the key, only the IV is set */
+  if (EVP_DecryptInit_ex(ctx, nullptr, nullptr, nullptr, (const std::uint8_t *)iv.data()) != 1)
+    handle_openssl_error("EVP_DecryptInit_ex failed");
+
+  if (EVP_DecryptUpdate(ctx, out, &len, (const std::uint8_t *)msg.data(), (int)msg.size()) != 1)
+    handle_openssl_error("EVP_DecryptUpdate failed");
+
+  if (EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, aes::AES_GCM_TAG_SIZE, const_cast<char *>(tag.data())) != 1)
+    handle_openssl_error("EVP_CTRL_GCM_SET_TAG failed");
+
+  if (EVP_DecryptFinal_ex(ctx, out + len, &f_len) != 1)
+    handle_openssl_error("EVP_DecryptFinal_ex failed");
+
+  return len + f_len;
+}
+
 std::pair<std::string, std::string> aes_encrypt_gcm(std::string_view msg,
                                                     std::string_view enc_key,
                                                     std::string_view iv = random(AES_BLOCK_SIZE),
@@ -6,6 +6,7 @@
 #include <cstdint>
 #include <helpers/utils.hpp>
 #include <memory>
+#include <stdexcept>
 
 namespace moonlight::control {
 
@@ -343,6 +344,36 @@ struct ControlRGBLedPacket {
   std::uint8_t b;
 };
 
+#pragma pack(push, 1)
+
+/**
+ * Periodically sent by the client (see LOSS_STATS), all fields are little endian
+ */
+struct ControlLossStatsPacket {
+  ControlPacket header;
+
+  std::int32_t lost_frames;      // Frames lost since the last report
+  std::int32_t interval_ms;      // Time between two reports
+  std::int32_t unknown;          // Always 1000
+  std::uint64_t last_good_frame; // Index of the last frame that has been fully received
+  std::int32_t zero[2];
+  std::int32_t unknown_2; // Always 0x14
+};
+
+/**
+ * Sent by the client (see INVALIDATE_REF_FRAMES) when frames have been lost, all fields are little endian.
+ * Frames from first_frame to last_frame (included) must not be used as references anymore.
+ */
+struct ControlInvalidateRefFramesPacket {
+  ControlPacket header;
+
+  std::uint64_t first_frame;
+  std::uint64_t last_frame;
+  std::uint64_t zero;
+};
+
+#pragma pack(pop)
+
 struct ControlEncryptedPacket {
   ControlPacket header; // Always 0x0001 (see PACKET_TYPE ENCRYPTED)
   std::uint32_t seq;    // Monotonically increasing sequence number (used as IV for AES-GCM)
@@ -409,6 +440,73 @@ encrypt_packet(std::string_view gcm_key, std::uint32_t seq, std::string_view pay
   return std::make_unique<ControlEncryptedPacket>(encrypted_pkt);
 }
 
+/**
+ * The AES GCM state for a single client: the key is converted and expanded once, the two contexts are then
+ * re-used for every packet.
+ */
+struct ControlCipher {
+  std::string key;
+  crypto::cipher_ctx_ptr encrypt_ctx;
+  crypto::cipher_ctx_ptr decrypt_ctx;
+};
+
+static ControlCipher create_cipher(std::string_view gcm_key) {
+  auto key = crypto::hex_to_str(gcm_key, true);
+  return {.key = key,
+          .encrypt_ctx = crypto::aes_gcm_ctx(key, true, GCM_TAG_SIZE),
+          .decrypt_ctx = crypto::aes_gcm_ctx(key, false, GCM_TAG_SIZE)};
+}
+
+using decrypted_buffer = std::array<char, MAX_PAYLOAD_SIZE>;
+
+/**
+ * Same as decrypt_packet() but without any allocation: the payload is decrypted into out.
+ * The decryption context of the cipher is not thread safe.
+ *
+ * @return a view of the decrypted payload inside out
+ */
+static std::string_view
+decrypt_packet(const ControlEncryptedPacket &packet_data, ControlCipher &cipher, decrypted_buffer &out) {
+  auto encrypted_msg = packet_data.encrypted_msg();
+  if (encrypted_msg.size() > out.size()) {
+    throw std::runtime_error("Encrypted control packet too big");
+  }
+
+  std::array<std::uint8_t, GCM_TAG_SIZE> iv_data = {0};
+  iv_data[0] = boost::endian::little_to_native(packet_data.seq);
+
+  auto len = crypto::aes_decrypt_gcm_into(cipher.decrypt_ctx.get(),
+                                          encrypted_msg,
+                                          {packet_data.gcm_tag, GCM_TAG_SIZE},
+                                          {(char *)iv_data.data(), iv_data.size()},
+                                          (unsigned char *)out.data());
+  return {out.data(), static_cast<size_t>(len)};
+}
+
+/**
+ * Same as encrypt_packet() but without any allocation: the packet is written into out.
+ * The encryption context of the cipher is not thread safe.
+ */
+static void
+encrypt_packet(ControlCipher &cipher, std::uint32_t seq, std::string_view payload, ControlEncryptedPacket &out) {
+  if (payload.size() > MAX_PAYLOAD_SIZE) {
+    throw std::runtime_error("Control packet payload too big");
+  }
+
+  std::array<std::uint8_t, GCM_TAG_SIZE> iv_data = {0};
+  iv_data[0] = boost::endian::native_to_little(seq);
+
+  auto len = crypto::aes_encrypt_gcm_into(cipher.encrypt_ctx.get(),
+                                          payload,
+                                          {(char *)iv_data.data(), iv_data.size()},
+                                          (unsigned char *)out.payload,
+                                          (unsigned char *)out.gcm_tag);
+
+  std::uint16_t size = sizeof(seq) + GCM_TAG_SIZE + len;
+  out.header = {.type = pkts::ENCRYPTED, .length = boost::endian::native_to_little(size)};
+  out.seq = boost::endian::native_to_little(seq);
+}
+
 static constexpr const char *packet_type_to_str(pkts::PACKET_TYPE p) noexcept {
   switch (p) {
   case pkts::START_A:
@@ -1,8 +1,14 @@
 #pragma once
 
+#include <cstdint>
+#include <functional>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <utility>
 
 extern "C" {
+#include "rskernels.h"
 #include "rswrapper.h"
 }
 
@@ -23,10 +29,19 @@ namespace moonlight::fec {
 #define DATA_SHARDS_MAX 255
 
 /**
- * One time initialization required by the library
+ * One time initialization required by the library.
+ * Will also pick the fastest GF(2^8) kernel supported by the running CPU, see `kernel_name()`
  */
 inline void init() {
   reed_solomon_init();
+  rs_kernels_init();
+}
+
+/**
+ * @return the name of the GF(2^8) kernel selected by `init()` (ex: "avx2")
+ */
+inline const char *kernel_name() {
+  return rs_kernel_name(rs_kernel_selected);
 }
 
 /**
@@ -47,6 +62,121 @@ inline rs_ptr create(int data_shards, int parity_shards) {
   return std::shared_ptr<reed_solomon>(rs, reed_solomon_release_fn);
 }
 
+/**
+ * Default number of shard geometries that a RSCache will keep around.
+ * With a fixed fec_percentage the video payloader will only ever ask for at most DATA_SHARDS_MAX different geometries.
+ */
+constexpr std::size_t RS_CACHE_DEFAULT_SIZE = DATA_SHARDS_MAX + 1;
+
+/**
+ * A thread safe cache of ready to use Reed Solomon encoders, keyed by (data_shards, parity_shards).
+ *
+ * Creating an encoder means building its parity matrix; payloaders will ask for the same handful of geometries
+ * over and over again (one or more times per frame), so we only pay for it once.
+ * When the cache is full the least recently used geometry is evicted.
+ *
+ * @warning the returned encoders are shared between all callers (and threads):
+ *          they must only be used with `encode()` which doesn't modify the underlying data structure
+ */
+class RSCache {
+public:
+  struct Stats {
+    std::size_t hits;
+    std::size_t misses;
+    std::size_t evictions;
+    std::size_t size;
+  };
+
+  /**
+   * @param max_size the maximum number of geometries that will be kept in the cache
+   * @param on_create optional, called once on every newly created encoder before it's stored in the cache
+   */
+  explicit RSCache(std::size_t max_size = RS_CACHE_DEFAULT_SIZE,
+                   std::function<void(reed_solomon *)> on_create = nullptr)
+      : max_size(max_size > 0 ? max_size : 1), on_create(std::move(on_create)) {}
+
+  /**
+   * Returns a ready to use encoder for the given geometry, creating it on first use
+   */
+  rs_ptr get(int data_shards, int parity_shards) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto key = std::make_pair(data_shards, parity_shards);
+    auto cached = m_entries.find(key);
+    if (cached != m_entries.end()) {
+      hits++;
+      cached->second.last_used = ++m_tick;
+      return cached->second.rs;
+    }
+
+    misses++;
+    if (m_entries.size() >= max_size) {
+      auto lru = m_entries.begin();
+      for (auto it = m_entries.begin(); it != m_entries.end(); it++) {
+        if (it->second.last_used < lru->second.last_used) {
+          lru = it;
+        }
+      }
+      m_entries.erase(lru);
+      evictions++;
+    }
+
+    auto rs = create(data_shards, parity_shards);
+    if (rs && on_create) {
+      on_create(rs.get());
+    }
+    m_entries[key] = {.rs = rs, .last_used = ++m_tick};
+    return rs;
+  }
+
+  [[nodiscard]] Stats stats() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return {.hits = hits, .misses = misses, .evictions = evictions, .size = m_entries.size()};
+  }
+
+  /**
+   * Drops all the cached encoders, encoders that are still in use will be released when going out of scope
+   */
+  void clear() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_entries.clear();
+  }
+
+private:
+  struct Entry {
+    rs_ptr rs;
+    std::uint64_t last_used;
+  };
+
+  const std::size_t max_size;
+  const std::function<void(reed_solomon *)> on_create;
+
+  mutable std::mutex m_mutex;
+  std::map<std::pair<int, int>, Entry> m_entries;
+  std::uint64_t m_tick = 0;
+
+  std::size_t hits = 0;
+  std::size_t misses = 0;
+  std::size_t evictions = 0;
+};
+
+/**
+ * The process wide cache of Reed Solomon encoders
+ */
+inline RSCache &default_cache() {
+  static RSCache cache;
+  return cache;
+}
+
+/**
+ * Returns a shared, ready to use, Reed Solomon encoder for the given geometry (see RSCache).
+ *
+ * @param data_shards Number of data shards to be encoded
+ * @param parity_shards Number of parity shards to be created
+ */
+inline rs_ptr get_cached(int data_shards, int parity_shards) {
+  return default_cache().get(data_shards, parity_shards);
+}
+
 /**
  * Encodes the input data shards using Reed Solomon.
  * It will read \p nr_shards * \p block_size and then append all the newly created parity shards
@@ -63,7 +193,7 @@ inline rs_ptr create(int data_shards, int parity_shards) {
  * @return zero on success or an error code if failing.
  */
 inline int encode(reed_solomon *rs, uint8_t **shards, int nr_shards, int block_size) {
-  return reed_solomon_encode_fn(rs, shards, nr_shards, block_size);
+  return rs_kernel_encode(rs_muladd_fn, rs, shards, nr_shards, block_size);
 }
 
 /**
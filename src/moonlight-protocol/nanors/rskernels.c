@@ -0,0 +1,233 @@
+/**
+ * @file src/rskernels.c
+ * @brief GF(2^8) multiply-accumulate kernels with runtime CPU dispatch
+ */
+
+#include "rskernels.h"
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define RS_KERNELS_X86
+#endif
+
+/* Same field used by nanors (and Moonlight): x^8 + x^4 + x^3 + x^2 + 1 */
+#define GF_POLY 0x11D
+
+static uint8_t gf_mul_table[256][256];
+
+static uint8_t gf_mul_slow(uint8_t a, uint8_t b) {
+  unsigned int x = a, res = 0;
+  while (b) {
+    if (b & 1)
+      res ^= x;
+    x <<= 1;
+    if (x & 0x100)
+      x ^= GF_POLY;
+    b >>= 1;
+  }
+  return (uint8_t)res;
+}
+
+static void gf_init_tables(void) {
+  for (int a = 0; a < 256; a++) {
+    for (int b = 0; b < 256; b++) {
+      gf_mul_table[a][b] = gf_mul_slow((uint8_t)a, (uint8_t)b);
+    }
+  }
+}
+
+static void muladd_scalar(uint8_t *dst, const uint8_t *src, uint8_t c, int bs) {
+  const uint8_t *mul = gf_mul_table[c];
+  for (int i = 0; i < bs; i++) {
+    dst[i] ^= mul[src[i]];
+  }
+}
+
+#ifdef RS_KERNELS_X86
+
+/**
+ * Split tables for the PSHUFB based kernels: c * x = lo[x & 0x0F] ^ hi[x >> 4]
+ */
+static void gf_nibble_tables(uint8_t c, uint8_t lo[16], uint8_t hi[16]) {
+  for (int x = 0; x < 16; x++) {
+    lo[x] = gf_mul_table[c][x];
+    hi[x] = gf_mul_table[c][x << 4];
+  }
+}
+
+/**
+ * 8x8 bit matrix for GF2P8AFFINEQB so that affine(x) = c * x.
+ * Row i (stored in byte 7 - i) selects the input bits that contribute to the output bit i.
+ */
+static uint64_t gf_affine_matrix(uint8_t c) {
+  uint64_t matrix = 0;
+  for (int i = 0; i < 8; i++) {
+    uint64_t row = 0;
+    for (int j = 0; j < 8; j++) {
+      row |= (uint64_t)((gf_mul_table[c][1 << j] >> i) & 1) << j;
+    }
+    matrix |= row << (8 * (7 - i));
+  }
+  return matrix;
+}
+
+__attribute__((target("ssse3"))) static void muladd_ssse3(uint8_t *dst, const uint8_t *src, uint8_t c, int bs) {
+  uint8_t lo[16], hi[16];
+  gf_nibble_tables(c, lo, hi);
+  const __m128i lo_tbl = _mm_loadu_si128((const __m128i *)lo);
+  const __m128i hi_tbl = _mm_loadu_si128((const __m128i *)hi);
+  const __m128i mask = _mm_set1_epi8(0x0F);
+
+  int i = 0;
+  for (; i + 16 <= bs; i += 16) {
+    __m128i x = _mm_loadu_si128((const __m128i *)(src + i));
+    __m128i l = _mm_shuffle_epi8(lo_tbl, _mm_and_si128(x, mask));
+    __m128i h = _mm_shuffle_epi8(hi_tbl, _mm_and_si128(_mm_srli_epi16(x, 4), mask));
+    __m128i d = _mm_loadu_si128((const __m128i *)(dst + i));
+    _mm_storeu_si128((__m128i *)(dst + i), _mm_xor_si128(d, _mm_xor_si128(l, h)));
+  }
+  muladd_scalar(dst + i, src + i, c, bs - i);
+}
+
+__attribute__((target("avx2"))) static void muladd_avx2(uint8_t *dst, const uint8_t *src, uint8_t c, int bs) {
+  uint8_t lo[16], hi[16];
+  gf_nibble_tables(c, lo, hi);
+  const __m256i lo_tbl = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)lo));
+  const __m256i hi_tbl = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)hi));
+  const __m256i mask = _mm256_set1_epi8(0x0F);
+
+  int i = 0;
+  for (; i + 32 <= bs; i += 32) {
+    __m256i x = _mm256_loadu_si256((const __m256i *)(src + i));
+    __m256i l = _mm256_shuffle_epi8(lo_tbl, _mm256_and_si256(x, mask));
+    __m256i h = _mm256_shuffle_epi8(hi_tbl, _mm256_and_si256(_mm256_srli_epi16(x, 4), mask));
+    __m256i d = _mm256_loadu_si256((const __m256i *)(dst + i));
+    _mm256_storeu_si256((__m256i *)(dst + i), _mm256_xor_si256(d, _mm256_xor_si256(l, h)));
+  }
+  muladd_scalar(dst + i, src + i, c, bs - i);
+}
+
+__attribute__((target("avx512f,avx512bw"))) static void
+muladd_avx512(uint8_t *dst, const uint8_t *src, uint8_t c, int bs) {
+  uint8_t lo[16], hi[16];
+  gf_nibble_tables(c, lo, hi);
+  const __m512i lo_tbl = _mm512_broadcast_i32x4(_mm_loadu_si128((const __m128i *)lo));
+  const __m512i hi_tbl = _mm512_broadcast_i32x4(_mm_loadu_si128((const __m128i *)hi));
+  const __m512i mask = _mm512_set1_epi8(0x0F);
+
+  int i = 0;
+  for (; i + 64 <= bs; i += 64) {
+    __m512i x = _mm512_loadu_si512((const void *)(src + i));
+    __m512i l = _mm512_shuffle_epi8(lo_tbl, _mm512_and_si512(x, mask));
+    __m512i h = _mm512_shuffle_epi8(hi_tbl, _mm512_and_si512(_mm512_srli_epi16(x, 4), mask));
+    __m512i d = _mm512_loadu_si512((const void *)(dst + i));
+    _mm512_storeu_si512((void *)(dst + i), _mm512_xor_si512(d, _mm512_xor_si512(l, h)));
+  }
+  muladd_scalar(dst + i, src + i, c, bs - i);
+}
+
+__attribute__((target("avx2,gfni"))) static void muladd_gfni(uint8_t *dst, const uint8_t *src, uint8_t c, int bs) {
+  const __m256i matrix = _mm256_set1_epi64x((long long)gf_affine_matrix(c));
+
+  int i = 0;
+  for (; i + 32 <= bs; i += 32) {
+    __m256i x = _mm256_loadu_si256((const __m256i *)(src + i));
+    __m256i d = _mm256_loadu_si256((const __m256i *)(dst + i));
+    _mm256_storeu_si256((__m256i *)(dst + i), _mm256_xor_si256(d, _mm256_gf2p8affine_epi64_epi8(x, matrix, 0)));
+  }
+  muladd_scalar(dst + i, src + i, c, bs - i);
+}
+
+#endif
+
+rs_muladd_t rs_muladd_fn = muladd_scalar;
+rs_kernel_t rs_kernel_selected = RS_KERNEL_SCALAR;
+
+int rs_kernel_supported(rs_kernel_t kernel) {
+  switch (kernel) {
+  case RS_KERNEL_SCALAR:
+    return 1;
+#ifdef RS_KERNELS_X86
+  case RS_KERNEL_SSSE3:
+    return __builtin_cpu_supports("ssse3");
+  case RS_KERNEL_AVX2:
+    return __builtin_cpu_supports("avx2");
+  case RS_KERNEL_AVX512:
+    return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw");
+  case RS_KERNEL_GFNI:
+    return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("gfni");
+#endif
+  default:
+    return 0;
+  }
+}
+
+const char *rs_kernel_name(rs_kernel_t kernel) {
+  switch (kernel) {
+  case RS_KERNEL_SCALAR:
+    return "scalar";
+  case RS_KERNEL_SSSE3:
+    return "ssse3";
+  case RS_KERNEL_AVX2:
+    return "avx2";
+  case RS_KERNEL_AVX512:
+    return "avx512bw";
+  case RS_KERNEL_GFNI:
+    return "gfni";
+  default:
+    return "unknown";
+  }
+}
+
+rs_muladd_t rs_kernel_muladd(rs_kernel_t kernel) {
+  switch (kernel) {
+  case RS_KERNEL_SCALAR:
+    return muladd_scalar;
+#ifdef RS_KERNELS_X86
+  case RS_KERNEL_SSSE3:
+    return muladd_ssse3;
+  case RS_KERNEL_AVX2:
+    return muladd_avx2;
+  case RS_KERNEL_AVX512:
+    return muladd_avx512;
+  case RS_KERNEL_GFNI:
+    return muladd_gfni;
+#endif
+  default:
+    return NULL;
+  }
+}
+
+void rs_kernels_init(void) {
+  gf_init_tables();
+
+  /* From the fastest to the slowest, scalar is always supported */
+  static const rs_kernel_t preference[] = {
+      RS_KERNEL_GFNI, RS_KERNEL_AVX512, RS_KERNEL_AVX2, RS_KERNEL_SSSE3, RS_KERNEL_SCALAR};
+  for (unsigned int i = 0; i < sizeof(preference) / sizeof(preference[0]); i++) {
+    if (rs_kernel_supported(preference[i]) && rs_kernel_muladd(preference[i]) != NULL) {
+      rs_kernel_selected = preference[i];
+      rs_muladd_fn = rs_kernel_muladd(preference[i]);
+      return;
+    }
+  }
+}
+
+int rs_kernel_encode(rs_muladd_t muladd, reed_solomon *rs, uint8_t **shards, int nr_shards, int bs) {
+  if (nr_shards < rs->ds + rs->ps)
+    return -1;
+
+  for (int row = 0; row < rs->ps; row++) {
+    uint8_t *parity = shards[rs->ds + row];
+    const uint8_t *coefficients = rs->p + (row * rs->ds);
+
+    memset(parity, 0, bs);
+    for (int col = 0; col < rs->ds; col++) {
+      if (coefficients[col] != 0) {
+        muladd(parity, shards[col], coefficients[col], bs);
+      }
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,54 @@
+/**
+ * @file src/rskernels.h
+ * @brief GF(2^8) multiply-accumulate kernels used to Reed Solomon encode
+ * @details Parity is computed using the matrix generated by nanors, only the field arithmetic is done here
+ */
+#pragma once
+
+#include "rswrapper.h"
+#include <stdint.h>
+
+/**
+ * dst[i] ^= c * src[i] for each i in [0, bs), multiplication is done in GF(2^8) (polynomial 0x11D)
+ */
+typedef void (*rs_muladd_t)(uint8_t *dst, const uint8_t *src, uint8_t c, int bs);
+
+typedef enum {
+  RS_KERNEL_SCALAR,
+  RS_KERNEL_SSSE3,
+  RS_KERNEL_AVX2,
+  RS_KERNEL_AVX512,
+  RS_KERNEL_GFNI,
+  RS_KERNEL_MAX
+} rs_kernel_t;
+
+extern rs_muladd_t rs_muladd_fn;
+extern rs_kernel_t rs_kernel_selected;
+
+/**
+ * @brief Selects the fastest kernel supported by the running CPU.
+ * @details Must be called once before using any of the kernels.
+ */
+void rs_kernels_init(void);
+
+/**
+ * @return 1 if the running CPU supports the given kernel, 0 otherwise
+ */
+int rs_kernel_supported(rs_kernel_t kernel);
+
+/**
+ * @return a human readable name for the given kernel
+ */
+const char *rs_kernel_name(rs_kernel_t kernel);
+
+/**
+ * @return the multiply-accumulate function for the given kernel, NULL if not compiled in
+ */
+rs_muladd_t rs_kernel_muladd(rs_kernel_t kernel);
+
+/**
+ * @brief Drop-in replacement for reed_solomon_encode using the given multiply-accumulate kernel.
+ * @details Shards are laid out as in nanors: the first rs->ds are data, the following rs->ps are parity.
+ * @return 0 on success, -1 if there aren't enough shards
+ */
+int rs_kernel_encode(rs_muladd_t muladd, reed_solomon *rs, uint8_t **shards, int nr_shards, int bs);
@@ -1,9 +1,15 @@
 #include "core/input.hpp"
+#include <cerrno>
 #include <control/control.hpp>
 #include <control/input_handler.hpp>
+#include <cstring>
 #include <immer/box.hpp>
+#include <poll.h>
 #include <state/sessions.hpp>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
+#include <unistd.h>
+#include <vector>
 
 namespace control {
 
@@ -34,12 +40,25 @@ bool init() {
   return true;
 }
 
-enet_host create_host(std::string_view host, std::uint16_t port, std::size_t peers) {
+enet_host create_host(std::string_view host, std::uint16_t port, std::size_t peers, bool reuse_port = false) {
   ENetAddress addr;
   enet_address_set_host(&addr, host.data());
   enet_address_set_port(&addr, port);
 
-  auto enet_host = enet_host_create(AF_INET, &addr, peers, 0, 0, 0);
+  // ENet binds the socket straight away, SO_REUSEPORT has to be set before that so we bind it ourselves
+  auto enet_host = enet_host_create(AF_INET, reuse_port ? nullptr : &addr, peers, 0, 0, 0);
+  if (enet_host != nullptr && reuse_port) {
+    int enable = 1;
+    if (setsockopt(enet_host->socket, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)) < 0 ||
+        bind(enet_host->socket, (sockaddr *)&addr.address, addr.addressLength) < 0) {
+      logs::log(logs::error, "Unable to bind the ENet host to port {}: {}", port, std::strerror(errno));
+      enet_host_destroy(enet_host);
+      enet_host = nullptr;
+    } else {
+      enet_socket_get_address(enet_host->socket, &enet_host->address);
+    }
+  }
+
   if (enet_host == nullptr) {
     logs::log(logs::error, "An error occurred while trying to create an ENet server host.");
   }
@@ -69,10 +88,11 @@ std::pair<std::string /* ip */, int /* port */> get_ip(const sockaddr *const ip_
   return {std::string{data}, port};
 }
 
-bool send_packet(std::string_view payload, ENetPeer *peer) {
+bool send_packet(std::string_view payload, ENetPeer *peer, Delivery delivery) {
   logs::log(logs::trace, "[ENET] Sending packet");
-  auto packet = enet_packet_create(payload.data(), payload.size(), ENET_PACKET_FLAG_RELIABLE);
-  if (enet_peer_send(peer, 0, packet) < 0) {
+  // Without the reliable flag ENet sends the packet unreliable but sequenced: older packets are dropped
+  auto packet = enet_packet_create(payload.data(), payload.size(), delivery.reliable ? ENET_PACKET_FLAG_RELIABLE : 0);
+  if (enet_peer_send(peer, delivery.channel, packet) < 0) {
     logs::log(logs::warning, "[ENET] Failed to send packet");
     enet_packet_destroy(packet);
     return false;
@@ -81,63 +101,160 @@ bool send_packet(std::string_view payload, ENetPeer *peer) {
 }
 
 bool encrypt_and_send(std::string_view payload,
-                      std::string_view aes_key,
                       const immer::atom<enet_clients_map> &connected_clients,
                       std::size_t session_id) {
   auto clients = connected_clients.load();
-  auto enet_peer = clients->find(session_id);
-  if (enet_peer == nullptr) {
+  auto client = clients->find(session_id);
+  if (client == nullptr) {
     logs::log(logs::debug, "[ENET] Unable to find enet client {}", session_id);
     return false;
   } else {
-    auto encrypted = control::encrypt_packet(aes_key, 0, payload); // TODO: seq?
-    return send_packet({(char *)encrypted.get(), encrypted->full_size()}, enet_peer->get().get());
+    queue_message(*(*client)->outbound, payload);
+    return true;
   }
 }
 
-void run_control(int port,
-                 const state::SessionsAtoms &running_sessions,
-                 const std::shared_ptr<dp::event_bus> &event_bus,
-                 int peers,
-                 std::chrono::milliseconds timeout,
-                 const std::string &host_ip) {
+/**
+ * Movements are never held for longer than a frame, so that they are flushed at least at the display refresh rate
+ */
+static std::chrono::microseconds input_coalescing_window(const state::StreamSession &session) {
+  auto window = session.app->input_coalescing_window;
+  if (window > 0us && session.display_mode.refreshRate > 0) {
+    window = std::min<std::chrono::microseconds>(window, 1000000us / session.display_mode.refreshRate);
+  }
+  return window;
+}
 
-  enet_host host = create_host(host_ip, port, peers);
-  logs::log(logs::info, "Control server started on port: {}", port);
+/**
+ * Encrypts and sends whatever is queued for the connected clients, must be called from the control thread
+ */
+static void flush_outbound(const enet_clients_map &clients) {
+  auto now = std::chrono::steady_clock::now();
+  for (const auto &entry : clients) {
+    const ControlClient &client = *entry.second;
+    flush_queue(*client.outbound, now, [&client](std::uint32_t seq, std::string_view payload) {
+      ControlEncryptedPacket encrypted;
+      encrypt_packet(*client.cipher, seq, payload, encrypted);
+      send_packet({(char *)&encrypted, encrypted.full_size()},
+                  client.peer.get(),
+                  message_delivery(payload, client.peer->channelCount));
+    });
+  }
+}
 
-  ENetEvent event;
+static void fire_client_stats(const enet_clients_map &clients, dp::event_bus &event_bus) {
+  for (const auto &entry : clients) {
+    const ControlClient &client = *entry.second;
+    event_bus.fire_event(immer::box<ClientStatsEvent>(
+        ClientStatsEvent{.session_id = entry.first,
+                         .rtt = std::chrono::milliseconds(client.peer->roundTripTime),
+                         .rtt_variance = std::chrono::milliseconds(client.peer->roundTripTimeVariance)}));
+  }
+}
 
-  immer::atom<enet_clients_map> connected_clients;
+using clients_atom = std::shared_ptr<immer::atom<enet_clients_map>>;
 
-  auto stop_ev = event_bus->register_handler<immer::box<StopStreamEvent>>(
-      [&connected_clients, &running_sessions](const immer::box<StopStreamEvent> &ev) {
-        auto client_session = get_session_by_id(running_sessions->load(), ev->session_id);
-        auto terminate_pkt = ControlTerminatePacket{};
-        std::string plaintext = {(char *)&terminate_pkt, sizeof(terminate_pkt)};
-        encrypt_and_send(plaintext, client_session->aes_key, connected_clients, ev->session_id);
-      });
+/**
+ * Lets other threads wake up the ENet loop of a worker, see OutboundQueue::on_queued.
+ * If the eventfd can't be created the loop will simply wait for its service timeout.
+ */
+struct ControlWaker {
+  int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+  ~ControlWaker() {
+    if (fd >= 0) {
+      close(fd);
+    }
+  }
+
+  void wake() const {
+    eventfd_write(fd, 1);
+  }
+};
+
+/**
+ * Waits, up to timeout, for some traffic on the ENet socket or for the worker to be woken up
+ */
+static void wait_for_activity(ENetHost *host, const ControlWaker &waker, std::chrono::milliseconds timeout) {
+  pollfd fds[] = {{.fd = host->socket, .events = POLLIN, .revents = 0},
+                  {.fd = waker.fd, .events = POLLIN, .revents = 0}};
+  if (poll(fds, 2, (int)timeout.count()) > 0 && (fds[1].revents & POLLIN)) {
+    eventfd_t wakeups;
+    eventfd_read(waker.fd, &wakeups);
+  }
+}
+
+/**
+ * The ENet loop of a single worker, the host and the clients are only touched by this thread
+ */
+static void run_control_worker(ENetHost *host,
+                               const state::SessionsAtoms &running_sessions,
+                               const std::shared_ptr<dp::event_bus> &event_bus,
+                               const clients_atom &connected_clients,
+                               std::chrono::milliseconds service_timeout,
+                               const std::atomic<bool> &stop) {
+  ENetEvent event;
+  auto last_stats = std::chrono::steady_clock::now();
+  // Shared with the outbound queues of the clients, which might outlive this function
+  auto waker = std::make_shared<ControlWaker>();
+  bool idle = false;
 
-  while (true) {
-    if (enet_host_service(host.get(), &event, timeout.count()) > 0) {
+  while (!stop) {
+    // Only block when ENet has nothing left to dispatch: queued outbound messages will cut the wait short
+    if (idle) {
+      wait_for_activity(host, *waker, service_timeout);
+    }
+    idle = enet_host_service(host, &event, 0) <= 0;
+    if (!idle) {
       auto [client_ip, client_port] = get_ip((sockaddr *)&event.peer->address.address);
       auto client_session = get_session_by_ip(running_sessions->load(), client_ip);
       if (client_session) {
         switch (event.type) {
         case ENET_EVENT_TYPE_NONE:
           break;
-        case ENET_EVENT_TYPE_CONNECT:
-          logs::log(logs::debug, "[ENET] connected client: {}:{}", client_ip, client_port);
-          connected_clients.update([&event, sess_id = client_session->session_id](const enet_clients_map &m) {
-            return m.set(sess_id, std::shared_ptr<ENetPeer>(event.peer, [](auto peer) {
-                           // DO NOTHING, we don't want to free peer, the lifecycle is dictated by enet
-                         }));
+        case ENET_EVENT_TYPE_CONNECT: {
+          logs::log(logs::debug,
+                    "[ENET] connected client: {}:{} with {} channels",
+                    client_ip,
+                    client_port,
+                    event.peer->channelCount);
+          if (auto previous = connected_clients->load()->find(client_session->session_id)) {
+            stop_input_dispatcher(*(*previous)->input);
+          }
+          auto input = start_input_dispatcher(
+              client_session->session_id,
+              [session = client_session, connected_clients](INPUT_PKT *pkt) {
+                handle_input(*session, *connected_clients, pkt);
+              },
+              input_coalescing_window(*client_session));
+          connected_clients->update([&event, &client_session, &input, &waker](const enet_clients_map &m) {
+            auto peer = std::shared_ptr<ENetPeer>(event.peer, [](auto peer) {
+              // DO NOTHING, we don't want to free peer, the lifecycle is dictated by enet
+            });
+            auto cipher = std::make_shared<ControlCipher>(create_cipher(client_session->aes_key));
+            auto outbound = std::make_shared<OutboundQueue>();
+            outbound->unreliable_feedback = event.peer->channelCount > CONTROL_CHANNEL_GAMEPAD_BASE;
+            outbound->on_queued = [waker]() { waker->wake(); };
+            return m.set(client_session->session_id,
+                         ControlClient{.peer = peer, .cipher = cipher, .outbound = outbound, .input = input});
           });
           event_bus->fire_event(
               immer::box<ResumeStreamEvent>(ResumeStreamEvent{.session_id = client_session->session_id}));
           break;
+        }
         case ENET_EVENT_TYPE_DISCONNECT:
           logs::log(logs::debug, "[ENET] disconnected client: {}:{}", client_ip, client_port);
-          connected_clients.update(
+          if (auto client = connected_clients->load()->find(client_session->session_id)) {
+            stop_input_dispatcher(*(*client)->input);
+            logs::log(logs::debug,
+                      "[ENET] client {}:{} outbound messages queued: {}, coalesced: {}, sent: {}",
+                      client_ip,
+                      client_port,
+                      (*client)->outbound->queued.load(),
+                      (*client)->outbound->dropped.load(),
+                      (*client)->outbound->sent.load());
+          }
+          connected_clients->update(
               [sess_id = client_session->session_id](const enet_clients_map &m) { return m.erase(sess_id); });
           event_bus->fire_event(
               immer::box<PauseStreamEvent>(PauseStreamEvent{.session_id = client_session->session_id}));
@@ -156,9 +273,16 @@ void run_control(int port,
                     crypto::str_to_hex({(char *)packet->data, packet->dataLength}));
 
           if (type == ENCRYPTED) {
+            auto client = connected_clients->load()->find(client_session->session_id);
+            if (client == nullptr) {
+              logs::log(logs::warning, "[ENET] Received packet from disconnected client {}:{}", client_ip, client_port);
+              break;
+            }
+
             try {
               auto enc_pkt = (ControlEncryptedPacket *)(packet->data);
-              auto decrypted = decrypt_packet(*enc_pkt, client_session->aes_key);
+              decrypted_buffer decrypted_data;
+              auto decrypted = decrypt_packet(*enc_pkt, *(*client)->cipher, decrypted_data);
               auto sub_type = ((ControlPacket *)decrypted.data())->type;
 
               logs::log(logs::trace,
@@ -170,7 +294,8 @@ void run_control(int port,
                 event_bus->fire_event(
                     immer::box<PauseStreamEvent>(PauseStreamEvent{.session_id = client_session->session_id}));
               } else if (sub_type == INPUT_DATA) {
-                handle_input(client_session.value(), connected_clients, (INPUT_PKT *)decrypted.data());
+                // Applied by the session worker, writing to the devices must not hold up the ENet loop
+                dispatch_input(*(*client)->input, decrypted);
               } else {
                 auto ev = ControlEvent{client_session->session_id, sub_type, decrypted};
                 event_bus->fire_event(immer::box<ControlEvent>{ev});
@@ -191,8 +316,72 @@ void run_control(int port,
         enet_peer_disconnect_now(event.peer, 0);
       }
     }
+
+    flush_outbound(*connected_clients->load());
+    // enet_peer_send() only queues them, the worker might be about to wait for the next service tick
+    enet_host_flush(host);
+
+    if (auto now = std::chrono::steady_clock::now(); now - last_stats >= CLIENT_STATS_INTERVAL) {
+      fire_client_stats(*connected_clients->load(), *event_bus);
+      last_stats = now;
+    }
+  }
+
+  for (const auto &entry : *connected_clients->load()) {
+    stop_input_dispatcher(*entry.second->input);
+  }
+}
+
+void run_control(int port,
+                 const state::SessionsAtoms &running_sessions,
+                 const std::shared_ptr<dp::event_bus> &event_bus,
+                 int peers,
+                 std::chrono::milliseconds timeout,
+                 const std::string &host_ip,
+                 std::size_t workers,
+                 const std::shared_ptr<std::atomic<bool>> &stop) {
+  workers = std::max<std::size_t>(workers, 1);
+
+  std::vector<enet_host> hosts;
+  // Shared with the input workers, which might outlive this function
+  std::vector<clients_atom> connected_clients;
+  for (std::size_t i = 0; i < workers; i++) {
+    hosts.push_back(create_host(host_ip, port, peers, workers > 1));
+    if (!hosts.back()) {
+      return;
+    }
+    connected_clients.push_back(std::make_shared<immer::atom<enet_clients_map>>());
+  }
+  logs::log(logs::info, "Control server started on port: {} ({} workers)", port, workers);
+
+  auto stop_ev = event_bus->register_handler<immer::box<StopStreamEvent>>(
+      [connected_clients](const immer::box<StopStreamEvent> &ev) {
+        auto terminate_pkt = ControlTerminatePacket{};
+        std::string plaintext = {(char *)&terminate_pkt, sizeof(terminate_pkt)};
+        // Only the worker that owns the client will find it
+        for (const auto &clients : connected_clients) {
+          if (clients->load()->find(ev->session_id)) {
+            encrypt_and_send(plaintext, *clients, ev->session_id);
+            return;
+          }
+        }
+        logs::log(logs::debug, "[ENET] Unable to find enet client {}", ev->session_id);
+      });
+
+  // Wake up regularly so that the coalesced outbound messages are sent and `stop` is checked
+  auto service_timeout = std::min<std::chrono::milliseconds>(timeout, OUTBOUND_FLUSH_INTERVAL);
+  std::vector<std::thread> threads;
+  for (std::size_t i = 1; i < workers; i++) {
+    threads.emplace_back([host = hosts[i].get(), clients = connected_clients[i], &running_sessions, &event_bus,
+                          service_timeout, stop]() {
+      run_control_worker(host, running_sessions, event_bus, clients, service_timeout, *stop);
+    });
   }
+  run_control_worker(hosts[0].get(), running_sessions, event_bus, connected_clients[0], service_timeout, *stop);
 
+  for (auto &thread : threads) {
+    thread.join();
+  }
   stop_ev.unregister();
 }
 
@@ -1,6 +1,9 @@
 #pragma once
 
+#include <atomic>
 #include <chrono>
+#include <control/input_dispatcher.hpp>
+#include <control/outbound.hpp>
 #include <enet/enet.h>
 #include <helpers/logger.hpp>
 #include <moonlight/control.hpp>
@@ -35,17 +38,60 @@ struct StopStreamEvent {
 
 using namespace std::chrono_literals;
 
+/**
+ * How often a ClientStatsEvent is fired for each connected client
+ */
+constexpr auto CLIENT_STATS_INTERVAL = 500ms;
+
+struct ClientStatsEvent {
+  std::size_t session_id;
+  /* As measured by ENet on the control stream */
+  std::chrono::milliseconds rtt;
+  std::chrono::milliseconds rtt_variance;
+};
+
+/**
+ * Runs the control server, blocks until `stop` is set.
+ *
+ * With more than one worker each thread runs its own ENet host, all bound to the same port with SO_REUSEPORT:
+ * the kernel picks the socket by hashing the client 4-tuple, so a client always ends up on the same worker.
+ *
+ * @param peers: the max number of clients for each worker
+ */
 void run_control(int port,
                  const state::SessionsAtoms &running_sessions,
                  const std::shared_ptr<dp::event_bus> &event_bus,
                  int peers = 20,
                  std::chrono::milliseconds timeout = 1000ms,
-                 const std::string &host_ip = "0.0.0.0");
+                 const std::string &host_ip = "0.0.0.0",
+                 std::size_t workers = 1,
+                 const std::shared_ptr<std::atomic<bool>> &stop = std::make_shared<std::atomic<bool>>(false));
 
-using enet_clients_map = immer::map<std::size_t, immer::box<std::shared_ptr<ENetPeer>>>;
+struct ControlClient {
+  std::shared_ptr<ENetPeer> peer;
+  /* Only used by the control thread */
+  std::shared_ptr<moonlight::control::ControlCipher> cipher;
+  std::shared_ptr<OutboundQueue> outbound;
+  /* Input packets are applied to the session devices by a worker thread, see InputDispatcher */
+  std::shared_ptr<InputDispatcher> input;
+};
+
+using enet_clients_map = immer::map<std::size_t, immer::box<ControlClient>>;
 
+/**
+ * Sends the payload as it is, must be called from the control thread
+ */
+bool send_packet(std::string_view payload,
+                 ENetPeer *peer,
+                 Delivery delivery = {.reliable = true, .channel = CONTROL_CHANNEL_GENERIC});
+
+/**
+ * Queues the payload, it'll be encrypted and sent by the control thread.
+ * Rumble and LED updates are coalesced, see OutboundQueue
+ *
+ * @return false if the client is not connected
+ */
 bool encrypt_and_send(std::string_view payload,
-                      std::string_view aes_key,
                       const immer::atom<enet_clients_map> &connected_clients,
                       std::size_t session_id);
 
@@ -0,0 +1,318 @@
+#include <algorithm>
+#include <boost/endian/conversion.hpp>
+#include <control/input_dispatcher.hpp>
+#include <helpers/logger.hpp>
+#include <limits>
+#include <map>
+#include <optional>
+#include <thread>
+
+namespace control {
+
+using namespace moonlight::control;
+
+template <typename T> static void update_max(std::atomic<T> &max, T value) {
+  auto current = max.load();
+  while (value > current && !max.compare_exchange_weak(current, value)) {
+  }
+}
+
+static void apply_event(InputDispatcher &dispatcher, InputEvent &event, const input_fn &apply) {
+  auto latency_us = (std::uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(
+                        std::chrono::steady_clock::now() - event.received)
+                        .count();
+  dispatcher.latency_sum_us += latency_us;
+  update_max(dispatcher.latency_max_us, latency_us);
+
+  try {
+    apply((pkts::INPUT_PKT *)event.data.data());
+  } catch (std::exception &e) {
+    logs::log(logs::warning, "[INPUT] Unable to apply input packet: {}", e.what());
+  }
+  dispatcher.dispatched++;
+}
+
+template <typename T> static const T *as_packet(const InputEvent &event) {
+  return event.size >= sizeof(T) ? (const T *)event.data.data() : nullptr;
+}
+
+/**
+ * @return the key of the events that can be merged together or std::nullopt if the event is a barrier
+ */
+static std::optional<std::uint64_t> merge_key(const InputEvent &event) {
+  auto pkt = as_packet<pkts::INPUT_PKT>(event);
+  if (!pkt) {
+    return std::nullopt;
+  }
+
+  auto type = (std::uint64_t)(std::uint32_t)pkt->type << 32;
+  switch (pkt->type) {
+  case pkts::MOUSE_MOVE_REL:
+    return as_packet<pkts::MOUSE_MOVE_REL_PACKET>(event) ? std::optional(type) : std::nullopt;
+  case pkts::MOUSE_MOVE_ABS:
+    return as_packet<pkts::MOUSE_MOVE_ABS_PACKET>(event) ? std::optional(type) : std::nullopt;
+  case pkts::MOUSE_SCROLL:
+    return as_packet<pkts::MOUSE_SCROLL_PACKET>(event) ? std::optional(type) : std::nullopt;
+  case pkts::MOUSE_HSCROLL:
+    return as_packet<pkts::MOUSE_HSCROLL_PACKET>(event) ? std::optional(type) : std::nullopt;
+  case pkts::TOUCH: {
+    auto touch = as_packet<pkts::TOUCH_PACKET>(event);
+    if (touch && (touch->event_type == pkts::TOUCH_EVENT_MOVE || touch->event_type == pkts::TOUCH_EVENT_HOVER)) {
+      return type | boost::endian::little_to_native(touch->pointer_id);
+    }
+    return std::nullopt;
+  }
+  case pkts::PEN: {
+    auto pen = as_packet<pkts::PEN_PACKET>(event);
+    if (pen && (pen->event_type == pkts::TOUCH_EVENT_MOVE || pen->event_type == pkts::TOUCH_EVENT_HOVER)) {
+      return type;
+    }
+    return std::nullopt;
+  }
+  default:
+    return std::nullopt;
+  }
+}
+
+/**
+ * Adds two big endian shorts
+ *
+ * @return std::nullopt instead of overflowing
+ */
+static std::optional<short> add_be(short a, short b) {
+  int sum = boost::endian::big_to_native(a) + boost::endian::big_to_native(b);
+  if (sum < std::numeric_limits<short>::min() || sum > std::numeric_limits<short>::max()) {
+    return std::nullopt;
+  }
+  return boost::endian::native_to_big((short)sum);
+}
+
+/**
+ * Merges `event` into `target`, they must share the same merge_key()
+ *
+ * @return false if they can't be merged
+ */
+static bool merge_into(InputEvent &target, const InputEvent &event) {
+  auto pkt = (pkts::INPUT_PKT *)target.data.data();
+  switch (pkt->type) {
+  case pkts::MOUSE_MOVE_REL: {
+    auto move = (pkts::MOUSE_MOVE_REL_PACKET *)pkt;
+    auto next = as_packet<pkts::MOUSE_MOVE_REL_PACKET>(event);
+    auto delta_x = add_be(move->delta_x, next->delta_x);
+    auto delta_y = add_be(move->delta_y, next->delta_y);
+    if (!delta_x || !delta_y) {
+      return false;
+    }
+    move->delta_x = *delta_x;
+    move->delta_y = *delta_y;
+    return true;
+  }
+  case pkts::MOUSE_SCROLL: {
+    auto scroll = (pkts::MOUSE_SCROLL_PACKET *)pkt;
+    if (auto amount = add_be(scroll->scroll_amt1, as_packet<pkts::MOUSE_SCROLL_PACKET>(event)->scroll_amt1)) {
+      scroll->scroll_amt1 = *amount;
+      return true;
+    }
+    return false;
+  }
+  case pkts::MOUSE_HSCROLL: {
+    auto scroll = (pkts::MOUSE_HSCROLL_PACKET *)pkt;
+    if (auto amount = add_be(scroll->scroll_amount, as_packet<pkts::MOUSE_HSCROLL_PACKET>(event)->scroll_amount)) {
+      scroll->scroll_amount = *amount;
+      return true;
+    }
+    return false;
+  }
+  case pkts::PEN: {
+    // Buttons or tool changes must not be lost
+    auto pen = (pkts::PEN_PACKET *)pkt;
+    auto next = as_packet<pkts::PEN_PACKET>(event);
+    if (pen->pen_buttons != next->pen_buttons || pen->tool_type != next->tool_type ||
+        pen->event_type != next->event_type) {
+      return false;
+    }
+    break;
+  }
+  case pkts::TOUCH:
+    if (((pkts::TOUCH_PACKET *)pkt)->event_type != as_packet<pkts::TOUCH_PACKET>(event)->event_type) {
+      return false;
+    }
+    break;
+  default: // MOUSE_MOVE_ABS
+    break;
+  }
+
+  // Only the latest position matters, we keep the time of the first event so that the latency stats are honest
+  target.size = event.size;
+  target.data = event.data;
+  return true;
+}
+
+std::size_t coalesce_input(std::vector<InputEvent> &events) {
+  std::size_t merged = 0;
+  std::size_t out = 0;
+  std::map<std::uint64_t, std::size_t /* index in events */> pending;
+  for (std::size_t i = 0; i < events.size(); i++) {
+    auto key = merge_key(events[i]);
+    if (!key) {
+      pending.clear();
+    } else if (auto slot = pending.find(*key); slot != pending.end() && merge_into(events[slot->second], events[i])) {
+      merged++;
+      continue;
+    } else {
+      pending[*key] = out;
+    }
+    if (out != i) {
+      events[out] = events[i];
+    }
+    out++;
+  }
+  events.resize(out);
+  return merged;
+}
+
+static void log_stats(const InputDispatcher &dispatcher) {
+  auto dispatched = dispatcher.dispatched.load();
+  logs::log(logs::debug,
+            "[INPUT] session {} inputs queued: {}, dropped: {}, overflowed: {}, merged: {}, dispatched: {}, "
+            "max queue depth: {}, latency avg {}us max {}us",
+            dispatcher.session_id,
+            dispatcher.queued.load(),
+            dispatcher.dropped.load(),
+            dispatcher.overflowed.load(),
+            dispatcher.merged.load(),
+            dispatched,
+            dispatcher.max_queue_depth.load(),
+            dispatched > 0 ? dispatcher.latency_sum_us.load() / dispatched : 0,
+            dispatcher.latency_max_us.load());
+}
+
+/**
+ * Pops everything that is in the queue into `batch`
+ *
+ * @return true if there are only events that can be merged in the batch
+ */
+static bool drain_queue(InputDispatcher &dispatcher, std::vector<InputEvent> &batch) {
+  InputEvent event;
+  while (dispatcher.queue.pop(event)) {
+    batch.push_back(event);
+  }
+  if (dispatcher.overflowing) {
+    std::lock_guard lock(dispatcher.m);
+    // The control thread stopped using the queue when the overflow started: what's left there comes first
+    while (dispatcher.queue.pop(event)) {
+      batch.push_back(event);
+    }
+    batch.insert(batch.end(), dispatcher.overflow.begin(), dispatcher.overflow.end());
+    dispatcher.overflow.clear();
+    dispatcher.overflowing = false;
+  }
+  return std::all_of(batch.begin(), batch.end(), [](const InputEvent &event) { return merge_key(event); });
+}
+
+/**
+ * Parks the worker until there's something in the queue, it's stopping or the deadline has passed
+ */
+static void wait_for_input(InputDispatcher &dispatcher, std::optional<std::chrono::steady_clock::time_point> deadline) {
+  std::unique_lock lock(dispatcher.m);
+  dispatcher.sleeping = true;
+  // Pairs with the fence in dispatch_input(): either we see the new packet or the producer sees us sleeping
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  auto has_input = [&dispatcher]() {
+    return dispatcher.stopping || dispatcher.overflowing || dispatcher.queue.read_available() > 0;
+  };
+  if (deadline) {
+    dispatcher.cv.wait_until(lock, *deadline, has_input);
+  } else {
+    dispatcher.cv.wait(lock, has_input);
+  }
+  dispatcher.sleeping = false;
+}
+
+std::shared_ptr<InputDispatcher>
+start_input_dispatcher(std::size_t session_id, input_fn apply, std::chrono::microseconds coalesce_window) {
+  auto dispatcher = std::make_shared<InputDispatcher>();
+  dispatcher->session_id = session_id;
+  dispatcher->coalesce_window = coalesce_window;
+
+  dispatcher->worker = std::thread([dispatcher, apply = std::move(apply)]() {
+    std::vector<InputEvent> batch;
+    batch.reserve(INPUT_QUEUE_SIZE);
+    while (!dispatcher->stopping) {
+      bool only_movements = drain_queue(*dispatcher, batch);
+      if (batch.empty()) {
+        wait_for_input(*dispatcher, std::nullopt);
+        continue;
+      }
+
+      if (dispatcher->coalesce_window > 0us) {
+        // Hold movements for a bit, anything else (ex: a button press) flushes them straight away
+        auto deadline = batch.front().received + dispatcher->coalesce_window;
+        while (only_movements && !dispatcher->stopping && std::chrono::steady_clock::now() < deadline) {
+          wait_for_input(*dispatcher, deadline);
+          only_movements = drain_queue(*dispatcher, batch);
+        }
+        dispatcher->merged += coalesce_input(batch);
+      }
+
+      for (auto &event : batch) {
+        apply_event(*dispatcher, event, apply);
+      }
+      batch.clear();
+    }
+    log_stats(*dispatcher);
+  });
+
+  return dispatcher;
+}
+
+bool dispatch_input(InputDispatcher &dispatcher,
+                    std::string_view packet,
+                    std::chrono::steady_clock::time_point received) {
+  dispatcher.queued++;
+  if (packet.size() > MAX_PAYLOAD_SIZE) {
+    logs::log(logs::warning, "[INPUT] Dropping input packet of {} bytes", packet.size());
+    dispatcher.dropped++;
+    return false;
+  }
+
+  InputEvent event = {.received = received, .size = (std::uint16_t)packet.size()};
+  std::copy(packet.begin(), packet.end(), event.data.begin());
+  if (dispatcher.overflowing || !dispatcher.queue.push(event)) {
+    if (merge_key(event)) {
+      logs::log(logs::warning, "[INPUT] Session {} input queue is full, dropping movement", dispatcher.session_id);
+      dispatcher.dropped++;
+      return false;
+    }
+
+    // A button or key release that never makes it would leave it stuck down on the host
+    std::lock_guard lock(dispatcher.m);
+    dispatcher.overflow.push_back(event);
+    dispatcher.overflowing = true;
+    dispatcher.overflowed++;
+    dispatcher.cv.notify_one();
+    return true;
+  }
+  update_max(dispatcher.max_queue_depth, INPUT_QUEUE_SIZE - dispatcher.queue.write_available());
+
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (dispatcher.sleeping) {
+    std::lock_guard lock(dispatcher.m);
+    dispatcher.cv.notify_one();
+  }
+  return true;
+}
+
+void stop_input_dispatcher(InputDispatcher &dispatcher) {
+  {
+    std::lock_guard lock(dispatcher.m);
+    dispatcher.stopping = true;
+  }
+  dispatcher.cv.notify_one();
+
+  if (dispatcher.worker.joinable() && dispatcher.worker.get_id() != std::this_thread::get_id()) {
+    dispatcher.worker.join();
+  }
+}
+
+} // namespace control
@@ -0,0 +1,115 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <boost/lockfree/spsc_queue.hpp>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <moonlight/control.hpp>
+#include <mutex>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+namespace control {
+
+using namespace std::chrono_literals;
+
+/**
+ * Max number of input packets waiting to be applied for a single session.
+ * When the queue is full new movements are dropped: the control thread must never wait on a slow device.
+ * Anything else (buttons, keys, ...) can't be lost or it'll be stuck on the host, it goes to the overflow instead.
+ */
+constexpr std::size_t INPUT_QUEUE_SIZE = 256;
+
+/**
+ * A decrypted input packet, as received by the control thread
+ */
+struct InputEvent {
+  std::chrono::steady_clock::time_point received;
+  std::uint16_t size;
+  std::array<char, moonlight::control::MAX_PAYLOAD_SIZE> data;
+};
+
+using input_fn = std::function<void(moonlight::control::pkts::INPUT_PKT * /* pkt */)>;
+
+/**
+ * Merges, in place, the input events that can be applied as a single one:
+ *  - relative mouse movements and scroll amounts are added up
+ *  - only the latest absolute position of the mouse and of each touch or pen pointer is kept
+ *
+ * Any other event (buttons, keys, touch down/up, ...) is a barrier: nothing is merged across it,
+ * so that they are all applied in the exact order they've been received.
+ *
+ * @return the number of events that have been merged
+ */
+std::size_t coalesce_input(std::vector<InputEvent> &events);
+
+/**
+ * Applies the input of a single session on its own worker thread, so that writing to uinput/Wayland
+ * (or creating a new virtual device) never blocks the ENet loop nor the input of the other sessions.
+ *
+ * The control thread is the only producer and the worker the only consumer of the lock-free queue;
+ * the mutex is only used to park the worker when there's nothing to do and to guard the overflow.
+ */
+struct InputDispatcher {
+  std::size_t session_id;
+  /* When set, movements are held up to this long (after the first one) so that they can be merged together */
+  std::chrono::microseconds coalesce_window = 0us;
+  boost::lockfree::spsc_queue<InputEvent, boost::lockfree::capacity<INPUT_QUEUE_SIZE>> queue;
+
+  std::mutex m;
+  std::condition_variable cv;
+  std::atomic<bool> sleeping = false;
+  std::atomic<bool> stopping = false;
+  /* Joined by stop_input_dispatcher() */
+  std::thread worker;
+
+  /*
+   * The packets that can't be dropped when the queue is full, guarded by m.
+   * While it's not empty the control thread doesn't use the queue, so that everything is applied in order.
+   */
+  std::deque<InputEvent> overflow;
+  std::atomic<bool> overflowing = false;
+
+  /* Stats */
+  std::atomic<std::uint64_t> queued = 0;
+  std::atomic<std::uint64_t> dropped = 0; // the queue was full
+  std::atomic<std::uint64_t> overflowed = 0; // the queue was full, but the packet couldn't be dropped
+  std::atomic<std::uint64_t> dispatched = 0;
+  std::atomic<std::uint64_t> merged = 0; // see coalesce_input()
+  std::atomic<std::size_t> max_queue_depth = 0;
+  /* Time between the packet being received by the control thread and being applied */
+  std::atomic<std::uint64_t> latency_sum_us = 0;
+  std::atomic<std::uint64_t> latency_max_us = 0;
+};
+
+/**
+ * Starts a worker thread that will call `apply` for each dispatched input packet, in order.
+ * The worker keeps a reference to the dispatcher and `apply`, it'll exit after stop_input_dispatcher()
+ *
+ * @param coalesce_window: see InputDispatcher::coalesce_window, 0 disables coalescing
+ */
+std::shared_ptr<InputDispatcher>
+start_input_dispatcher(std::size_t session_id, input_fn apply, std::chrono::microseconds coalesce_window = 0us);
+
+/**
+ * Copies the packet into the queue, must only be called from the control thread
+ *
+ * @return false if the packet has been dropped, only movements are dropped when the queue is full
+ */
+bool dispatch_input(InputDispatcher &dispatcher,
+                    std::string_view packet,
+                    std::chrono::steady_clock::time_point received = std::chrono::steady_clock::now());
+
+/**
+ * Signals the worker to stop and waits for it to exit, packets still in the queue are discarded.
+ * Once this returns `apply` will not be called anymore, a new dispatcher for the same session can be started.
+ */
+void stop_input_dispatcher(InputDispatcher &dispatcher);
+
+} // namespace control
@@ -21,21 +21,19 @@ std::shared_ptr<state::JoypadTypes> create_new_joypad(const state::StreamSession
 
   auto on_rumble_fn = ([clients = &connected_clients,
                         controller_number,
-                        session_id = session.session_id,
-                        aes_key = session.aes_key](int low_freq, int high_freq) {
+                        session_id = session.session_id](int low_freq, int high_freq) {
     auto rumble_pkt = ControlRumblePacket{
         .header = {.type = RUMBLE_DATA, .length = sizeof(ControlRumblePacket) - sizeof(ControlPacket)},
         .controller_number = boost::endian::native_to_little((uint16_t)controller_number),
         .low_freq = boost::endian::native_to_little((uint16_t)low_freq),
         .high_freq = boost::endian::native_to_little((uint16_t)high_freq)};
     std::string plaintext = {(char *)&rumble_pkt, sizeof(rumble_pkt)};
-    encrypt_and_send(plaintext, aes_key, *clients, session_id);
+    encrypt_and_send(plaintext, *clients, session_id);
   });
 
   auto on_led_fn = ([clients = &connected_clients,
                      controller_number,
-                     session_id = session.session_id,
-                     aes_key = session.aes_key](int r, int g, int b) {
+                     session_id = session.session_id](int r, int g, int b) {
     auto led_pkt = ControlRGBLedPacket{
         .header{.type = RGB_LED_EVENT, .length = sizeof(ControlRGBLedPacket) - sizeof(ControlPacket)},
         .controller_number = boost::endian::native_to_little((uint16_t)controller_number),
@@ -43,7 +41,7 @@ std::shared_ptr<state::JoypadTypes> create_new_joypad(const state::StreamSession
         .g = static_cast<uint8_t>(g),
         .b = static_cast<uint8_t>(b)};
     std::string plaintext = {(char *)&led_pkt, sizeof(led_pkt)};
-    encrypt_and_send(plaintext, aes_key, *clients, session_id);
+    encrypt_and_send(plaintext, *clients, session_id);
   });
 
   std::shared_ptr<state::JoypadTypes> new_pad;
@@ -123,7 +121,7 @@ std::shared_ptr<state::JoypadTypes> create_new_joypad(const state::StreamSession
         .reportrate = 100,
         .type = ACCELERATION};
     std::string plaintext = {(char *)&accelerometer_pkt, sizeof(accelerometer_pkt)};
-    encrypt_and_send(plaintext, session.aes_key, connected_clients, session.session_id);
+    encrypt_and_send(plaintext, connected_clients, session.session_id);
   }
 
   if (capabilities & GYRO && final_type == PS) {
@@ -135,7 +133,7 @@ std::shared_ptr<state::JoypadTypes> create_new_joypad(const state::StreamSession
         .reportrate = 100,
         .type = GYROSCOPE};
     std::string plaintext = {(char *)&gyro_pkt, sizeof(gyro_pkt)};
-    encrypt_and_send(plaintext, session.aes_key, connected_clients, session.session_id);
+    encrypt_and_send(plaintext, connected_clients, session.session_id);
   }
 
   session.joypads->update([&](state::JoypadList joypads) {
@@ -158,7 +156,7 @@ std::shared_ptr<state::JoypadTypes> create_new_joypad(const state::StreamSession
  * Creates a new PenTablet and saves it into the session;
  * will also trigger a PlugDeviceEvent
  */
-bool create_pen_tablet(state::StreamSession &session) {
+bool create_pen_tablet(const state::StreamSession &session) {
   logs::log(logs::debug, "[INPUT] Creating new pen tablet");
   auto tablet = PenTablet::create();
   if (!tablet) {
@@ -183,7 +181,7 @@ bool create_pen_tablet(state::StreamSession &session) {
  * Creates a new Touch screen and saves it into the session;
  * will also trigger a PlugDeviceEvent
  */
-bool create_touch_screen(state::StreamSession &session) {
+bool create_touch_screen(const state::StreamSession &session) {
   logs::log(logs::debug, "[INPUT] Creating new touch screen");
   auto touch = TouchScreen::create();
   if (!touch) {
@@ -212,7 +210,7 @@ static inline float deg2rad(float degree) {
   return degree * (M_PI / 180.f);
 }
 
-void mouse_move_rel(const MOUSE_MOVE_REL_PACKET &pkt, state::StreamSession &session) {
+void mouse_move_rel(const MOUSE_MOVE_REL_PACKET &pkt, const state::StreamSession &session) {
   if (session.mouse->has_value()) {
     short delta_x = boost::endian::big_to_native(pkt.delta_x);
     short delta_y = boost::endian::big_to_native(pkt.delta_y);
@@ -222,7 +220,7 @@ void mouse_move_rel(const MOUSE_MOVE_REL_PACKET &pkt, state::StreamSession &sess
   }
 }
 
-void mouse_move_abs(const MOUSE_MOVE_ABS_PACKET &pkt, state::StreamSession &session) {
+void mouse_move_abs(const MOUSE_MOVE_ABS_PACKET &pkt, const state::StreamSession &session) {
   if (session.mouse->has_value()) {
     float x = boost::endian::big_to_native(pkt.x);
     float y = boost::endian::big_to_native(pkt.y);
@@ -234,7 +232,7 @@ void mouse_move_abs(const MOUSE_MOVE_ABS_PACKET &pkt, state::StreamSession &sess
   }
 }
 
-void mouse_button(const MOUSE_BUTTON_PACKET &pkt, state::StreamSession &session) {
+void mouse_button(const MOUSE_BUTTON_PACKET &pkt, const state::StreamSession &session) {
   if (session.mouse->has_value()) {
     if (std::holds_alternative<state::input::Mouse>(session.mouse->value())) {
       Mouse::MOUSE_BUTTON btn_type;
@@ -273,7 +271,7 @@ void mouse_button(const MOUSE_BUTTON_PACKET &pkt, state::StreamSession &session)
   }
 }
 
-void mouse_scroll(const MOUSE_SCROLL_PACKET &pkt, state::StreamSession &session) {
+void mouse_scroll(const MOUSE_SCROLL_PACKET &pkt, const state::StreamSession &session) {
   if (session.mouse->has_value()) {
     std::visit([scroll_amount = boost::endian::big_to_native(pkt.scroll_amt1)](
                    auto &mouse) { mouse.vertical_scroll(scroll_amount); },
@@ -283,7 +281,7 @@ void mouse_scroll(const MOUSE_SCROLL_PACKET &pkt, state::StreamSession &session)
   }
 }
 
-void mouse_h_scroll(const MOUSE_HSCROLL_PACKET &pkt, state::StreamSession &session) {
+void mouse_h_scroll(const MOUSE_HSCROLL_PACKET &pkt, const state::StreamSession &session) {
   if (session.mouse->has_value()) {
     std::visit([scroll_amount = boost::endian::big_to_native(pkt.scroll_amount)](
                    auto &mouse) { mouse.horizontal_scroll(scroll_amount); },
@@ -293,7 +291,7 @@ void mouse_h_scroll(const MOUSE_HSCROLL_PACKET &pkt, state::StreamSession &sessi
   }
 }
 
-void keyboard_key(const KEYBOARD_PACKET &pkt, state::StreamSession &session) {
+void keyboard_key(const KEYBOARD_PACKET &pkt, const state::StreamSession &session) {
   // moonlight always sets the high bit; not sure why but mask it off here
   short moonlight_key = (short)boost::endian::little_to_native(pkt.key_code) & (short)0x7fff;
   if (session.keyboard->has_value()) {
@@ -329,7 +327,7 @@ void keyboard_key(const KEYBOARD_PACKET &pkt, state::StreamSession &session) {
   }
 }
 
-void utf8_text(const UTF8_TEXT_PACKET &pkt, state::StreamSession &session) {
+void utf8_text(const UTF8_TEXT_PACKET &pkt, const state::StreamSession &session) {
   if (session.keyboard->has_value()) {
     /* Here we receive a single UTF-8 encoded char at a time,
      * the trick is to convert it to UTF-32 then send CTRL+SHIFT+U+<HEXCODE> in order to produce any
@@ -352,7 +350,7 @@ void utf8_text(const UTF8_TEXT_PACKET &pkt, state::StreamSession &session) {
   }
 }
 
-void touch(const TOUCH_PACKET &pkt, state::StreamSession &session) {
+void touch(const TOUCH_PACKET &pkt, const state::StreamSession &session) {
   bool has_touch_device = session.touch_screen->has_value();
   if (!has_touch_device) {
     has_touch_device = create_touch_screen(session);
@@ -394,7 +392,7 @@ void touch(const TOUCH_PACKET &pkt, state::StreamSession &session) {
   }
 }
 
-void pen(const PEN_PACKET &pkt, state::StreamSession &session) {
+void pen(const PEN_PACKET &pkt, const state::StreamSession &session) {
   bool has_pen_device = session.pen_tablet->has_value();
   if (!has_pen_device) {
     create_pen_tablet(session);
@@ -457,7 +455,7 @@ void pen(const PEN_PACKET &pkt, state::StreamSession &session) {
 }
 
 void controller_arrival(const CONTROLLER_ARRIVAL_PACKET &pkt,
-                        state::StreamSession &session,
+                        const state::StreamSession &session,
                         const immer::atom<enet_clients_map> &connected_clients) {
   auto joypads = session.joypads->load();
   if (joypads->find(pkt.controller_number)) {
@@ -475,7 +473,7 @@ void controller_arrival(const CONTROLLER_ARRIVAL_PACKET &pkt,
 }
 
 void controller_multi(const CONTROLLER_MULTI_PACKET &pkt,
-                      state::StreamSession &session,
+                      const state::StreamSession &session,
                       const immer::atom<enet_clients_map> &connected_clients) {
   auto joypads = session.joypads->load();
   std::shared_ptr<state::JoypadTypes> selected_pad;
@@ -502,19 +500,20 @@ void controller_multi(const CONTROLLER_MULTI_PACKET &pkt,
     // Old Moonlight doesn't support CONTROLLER_ARRIVAL, we create a default pad when it's first mentioned
     selected_pad = create_new_joypad(session, connected_clients, pkt.controller_number, XBOX, ANALOG_TRIGGERS | RUMBLE);
   }
-  std::visit(
-      [pkt](inputtino::Joypad &pad) {
-        std::uint16_t bf = pkt.button_flags;
-        std::uint32_t bf2 = pkt.buttonFlags2;
-        pad.set_pressed_buttons(bf | (bf2 << 16));
-        pad.set_stick(inputtino::Joypad::LS, pkt.left_stick_x, pkt.left_stick_y);
-        pad.set_stick(inputtino::Joypad::RS, pkt.right_stick_x, pkt.right_stick_y);
-        pad.set_triggers(pkt.left_trigger, pkt.right_trigger);
-      },
-      *selected_pad);
+  std::uint16_t bf = pkt.button_flags;
+  std::uint32_t bf2 = pkt.buttonFlags2;
+  // Only what has changed will be written to the device
+  auto pad_state = JoypadState{.buttons = bf | (bf2 << 16),
+                               .ls_x = pkt.left_stick_x,
+                               .ls_y = pkt.left_stick_y,
+                               .rs_x = pkt.right_stick_x,
+                               .rs_y = pkt.right_stick_y,
+                               .left_trigger = pkt.left_trigger,
+                               .right_trigger = pkt.right_trigger};
+  std::visit([&pad_state](auto &pad) { pad.set_state(pad_state); }, *selected_pad);
 }
 
-void controller_touch(const CONTROLLER_TOUCH_PACKET &pkt, state::StreamSession &session) {
+void controller_touch(const CONTROLLER_TOUCH_PACKET &pkt, const state::StreamSession &session) {
   auto joypads = session.joypads->load();
   std::shared_ptr<state::JoypadTypes> selected_pad;
   if (auto joypad = joypads->find(pkt.controller_number)) {
@@ -552,7 +551,7 @@ void controller_touch(const CONTROLLER_TOUCH_PACKET &pkt, state::StreamSession &
   }
 }
 
-void controller_motion(const CONTROLLER_MOTION_PACKET &pkt, state::StreamSession &session) {
+void controller_motion(const CONTROLLER_MOTION_PACKET &pkt, const state::StreamSession &session) {
   auto joypads = session.joypads->load();
   std::shared_ptr<state::JoypadTypes> selected_pad;
   if (auto joypad = joypads->find(pkt.controller_number)) {
@@ -572,7 +571,7 @@ void controller_motion(const CONTROLLER_MOTION_PACKET &pkt, state::StreamSession
   }
 }
 
-void controller_battery(const CONTROLLER_BATTERY_PACKET &pkt, state::StreamSession &session) {
+void controller_battery(const CONTROLLER_BATTERY_PACKET &pkt, const state::StreamSession &session) {
   auto joypads = session.joypads->load();
   std::shared_ptr<state::JoypadTypes> selected_pad;
   if (auto joypad = joypads->find(pkt.controller_number)) {
@@ -603,7 +602,7 @@ void controller_battery(const CONTROLLER_BATTERY_PACKET &pkt, state::StreamSessi
   }
 }
 
-void handle_input(state::StreamSession &session,
+void handle_input(const state::StreamSession &session,
                   const immer::atom<enet_clients_map> &connected_clients,
                   INPUT_PKT *pkt) {
   switch (pkt->type) {
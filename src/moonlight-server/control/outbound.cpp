@@ -0,0 +1,127 @@
+#include <boost/endian/conversion.hpp>
+#include <control/outbound.hpp>
+#include <moonlight/control.hpp>
+
+namespace control {
+
+using namespace moonlight::control;
+
+std::optional<FeedbackMessage> feedback_message(std::string_view payload) {
+  if (payload.size() < sizeof(ControlPacket)) {
+    return std::nullopt;
+  }
+
+  auto type = ((const ControlPacket *)payload.data())->type;
+  switch (type) {
+  case pkts::RUMBLE_DATA:
+    if (payload.size() < sizeof(ControlRumblePacket)) {
+      return std::nullopt;
+    }
+    return FeedbackMessage{
+        .type = type,
+        .subtype = 0,
+        .controller_number =
+            boost::endian::little_to_native(((const ControlRumblePacket *)payload.data())->controller_number)};
+  case pkts::RUMBLE_TRIGGERS:
+    if (payload.size() < sizeof(ControlRumbleTriggerPacket)) {
+      return std::nullopt;
+    }
+    return FeedbackMessage{
+        .type = type,
+        .subtype = 0,
+        .controller_number =
+            boost::endian::little_to_native(((const ControlRumbleTriggerPacket *)payload.data())->controller_number)};
+  case pkts::RGB_LED_EVENT:
+    if (payload.size() < sizeof(ControlRGBLedPacket)) {
+      return std::nullopt;
+    }
+    return FeedbackMessage{
+        .type = type,
+        .subtype = 0,
+        .controller_number =
+            boost::endian::little_to_native(((const ControlRGBLedPacket *)payload.data())->controller_number)};
+  case pkts::MOTION_EVENT: {
+    if (payload.size() < sizeof(ControlMotionEventPacket)) {
+      return std::nullopt;
+    }
+    auto motion_pkt = (const ControlMotionEventPacket *)payload.data();
+    return FeedbackMessage{.type = type,
+                           .subtype = motion_pkt->type,
+                           .controller_number = boost::endian::little_to_native(motion_pkt->controller_number)};
+  }
+  default:
+    return std::nullopt;
+  }
+}
+
+std::optional<std::uint32_t> coalescing_key(std::string_view payload) {
+  if (auto msg = feedback_message(payload)) {
+    return ((std::uint32_t)msg->type << 16) | ((std::uint32_t)msg->subtype << 8) | (msg->controller_number & 0xFF);
+  }
+  return std::nullopt;
+}
+
+Delivery message_delivery(std::string_view payload, std::size_t channel_count) {
+  auto msg = feedback_message(payload);
+  if (msg && msg->controller_number < CONTROL_MAX_GAMEPADS &&
+      CONTROL_CHANNEL_GAMEPAD_BASE + msg->controller_number < channel_count) {
+    return {.reliable = false, .channel = (std::uint8_t)(CONTROL_CHANNEL_GAMEPAD_BASE + msg->controller_number)};
+  }
+  return {.reliable = true, .channel = CONTROL_CHANNEL_GENERIC};
+}
+
+void queue_message(OutboundQueue &queue, std::string_view payload) {
+  queue.queued++;
+  {
+    std::lock_guard lock(queue.m);
+    if (auto key = coalescing_key(payload)) {
+      auto &state = queue.latest[*key];
+      if (state.pending) {
+        queue.dropped++;
+      }
+      state.payload.assign(payload);
+      state.pending = true;
+      state.resends_left = queue.unreliable_feedback ? OUTBOUND_UNRELIABLE_RESENDS : 0;
+    } else {
+      queue.messages.emplace_back(payload);
+    }
+  }
+  if (queue.on_queued) {
+    queue.on_queued();
+  }
+}
+
+std::size_t flush_queue(OutboundQueue &queue, std::chrono::steady_clock::time_point now, const send_fn &send) {
+  std::size_t sent = 0;
+  std::lock_guard lock(queue.m);
+
+  while (!queue.messages.empty()) {
+    send(queue.seq++, queue.messages.front());
+    queue.messages.pop_front();
+    sent++;
+  }
+
+  // An update after a quiet period goes out straight away, the following ones will wait for the next tick
+  if (now - queue.last_coalesced_flush >= OUTBOUND_FLUSH_INTERVAL) {
+    bool flushed = false;
+    for (auto &[key, state] : queue.latest) {
+      if (state.pending || state.resends_left > 0) {
+        send(queue.seq++, state.payload);
+        if (!state.pending) {
+          state.resends_left--;
+        }
+        state.pending = false;
+        flushed = true;
+        sent++;
+      }
+    }
+    if (flushed) {
+      queue.last_coalesced_flush = now;
+    }
+  }
+
+  queue.sent += sent;
+  return sent;
+}
+
+} // namespace control
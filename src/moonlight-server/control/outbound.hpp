@@ -0,0 +1,117 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+
+namespace control {
+
+using namespace std::chrono_literals;
+
+/**
+ * Rumble and LED updates for the same controller are coalesced: only the latest state is sent,
+ * at most once every OUTBOUND_FLUSH_INTERVAL.
+ */
+constexpr auto OUTBOUND_FLUSH_INTERVAL = 10ms;
+
+/**
+ * Feedback sent over an unreliable channel can get lost, the latest state is sent again this many times
+ * (one per OUTBOUND_FLUSH_INTERVAL) unless it's replaced by a newer one.
+ */
+constexpr int OUTBOUND_UNRELIABLE_RESENDS = 2;
+
+/**
+ * Same channels as defined in moonlight-common-c, clients that support them will ask for at least
+ * CONTROL_CHANNEL_GAMEPAD_BASE + CONTROL_MAX_GAMEPADS channels when connecting.
+ */
+constexpr std::uint8_t CONTROL_CHANNEL_GENERIC = 0x00;
+constexpr std::uint8_t CONTROL_CHANNEL_GAMEPAD_BASE = 0x10;
+constexpr std::size_t CONTROL_MAX_GAMEPADS = 16;
+
+/**
+ * Rumble, LED and motion messages, where a newer message always replaces an older one for the same controller
+ */
+struct FeedbackMessage {
+  std::uint16_t type;
+  std::uint8_t subtype; // only used by motion events: accelerometer or gyroscope
+  std::uint16_t controller_number;
+};
+
+/**
+ * How a message should be sent over ENet
+ */
+struct Delivery {
+  bool reliable;
+  std::uint8_t channel;
+};
+
+/**
+ * Messages to be encrypted and sent to a single client.
+ *
+ * Any thread can queue messages; they are flushed by the control thread, which is the only one that
+ * touches the ENet host and the sequence number.
+ * The control thread is woken up through on_queued, so that messages don't have to wait for its next service tick.
+ */
+struct OutboundQueue {
+  std::mutex m;
+
+  /* Messages that must all be delivered, in order */
+  std::deque<std::string> messages;
+
+  struct CoalescedState {
+    std::string payload;
+    bool pending;
+    int resends_left;
+  };
+  /* The latest state for each (packet type, controller number), see coalescing_key() */
+  std::map<std::uint32_t, CoalescedState> latest;
+  std::chrono::steady_clock::time_point last_coalesced_flush;
+  /* Set when the client can receive feedback over unreliable channels, see message_delivery() */
+  bool unreliable_feedback = false;
+
+  /* Called (without holding m) after a message has been queued, might be empty */
+  std::function<void()> on_queued;
+
+  /* Sequence number of the next encrypted packet */
+  std::uint32_t seq = 0;
+
+  /* Stats */
+  std::atomic<std::uint64_t> queued = 0;
+  std::atomic<std::uint64_t> dropped = 0; // coalesced updates that have been replaced before being sent
+  std::atomic<std::uint64_t> sent = 0;
+};
+
+std::optional<FeedbackMessage> feedback_message(std::string_view payload);
+
+/**
+ * @return the key used to coalesce the payload or std::nullopt if the message must always be delivered
+ */
+std::optional<std::uint32_t> coalescing_key(std::string_view payload);
+
+/**
+ * Feedback messages go over an unreliable sequenced channel dedicated to their controller, so that they are never
+ * stuck behind retransmissions, when the client negotiated enough channels.
+ * Everything else (ex: termination) is reliable.
+ */
+Delivery message_delivery(std::string_view payload, std::size_t channel_count);
+
+void queue_message(OutboundQueue &queue, std::string_view payload);
+
+using send_fn = std::function<void(std::uint32_t /* seq */, std::string_view /* payload */)>;
+
+/**
+ * Sends all the queued messages and, if OUTBOUND_FLUSH_INTERVAL has passed since the last time,
+ * the latest state of any coalesced update (or its resends, if unreliable_feedback is set).
+ *
+ * @return the number of messages that have been sent
+ */
+std::size_t flush_queue(OutboundQueue &queue, std::chrono::steady_clock::time_point now, const send_fn &send);
+
+} // namespace control
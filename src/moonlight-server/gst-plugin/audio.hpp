@@ -1,5 +1,6 @@
 #pragma once
 
+#include <atomic>
 #include <gst-plugin/gstrtpmoonlightpay_audio.hpp>
 #include <gst-plugin/utils.hpp>
 #include <helpers/logger.hpp>
@@ -26,6 +27,18 @@ struct AudioFECPacket {
 
 constexpr auto RTP_HEADER_SIZE = sizeof(AudioRTPHeaders);
 constexpr auto FEC_HEADER_SIZE = sizeof(AudioFECPacket);
+constexpr std::size_t CBC_BLOCK_SIZE = 16;
+
+static void write_rtp_header(const gst_rtp_moonlight_pay_audio &rtpmoonlightpay, AudioRTPHeaders *packet) {
+  *packet = {};
+  packet->rtp.header = 0x80;
+  packet->rtp.packetType = 97;
+  packet->rtp.ssrc = 0;
+
+  auto timestamp = rtpmoonlightpay.cur_seq_number * rtpmoonlightpay.packet_duration;
+  packet->rtp.sequenceNumber = boost::endian::native_to_big((uint16_t)rtpmoonlightpay.cur_seq_number);
+  packet->rtp.timestamp = boost::endian::native_to_big((uint32_t)timestamp);
+}
 
 /**
  * Creates an RTP header and returns a GstBuffer to it
@@ -38,31 +51,17 @@ static GstBuffer *create_rtp_header(const gst_rtp_moonlight_pay_audio &rtpmoonli
   gst_buffer_map(buf, &info, GST_MAP_WRITE);
 
   /* set RTP headers */
-  auto packet = (AudioRTPHeaders *)info.data;
-
-  packet->rtp.header = 0x80;
-  packet->rtp.packetType = 97;
-  packet->rtp.ssrc = 0;
-
-  auto timestamp = rtpmoonlightpay.cur_seq_number * rtpmoonlightpay.packet_duration;
-  packet->rtp.sequenceNumber = boost::endian::native_to_big((uint16_t)rtpmoonlightpay.cur_seq_number);
-  packet->rtp.timestamp = boost::endian::native_to_big((uint32_t)timestamp);
+  write_rtp_header(rtpmoonlightpay, (AudioRTPHeaders *)info.data);
 
   gst_buffer_unmap(buf, &info);
 
   return buf;
 }
 
-static GstBuffer *create_rtp_fec_header(const gst_rtp_moonlight_pay_audio &rtpmoonlightpay, int fec_packet_idx) {
-  GstBuffer *buf = gst_buffer_new_and_fill(FEC_HEADER_SIZE, 0x00);
-
-  /* get WRITE access to the memory */
-  GstMapInfo info;
-  gst_buffer_map(buf, &info, GST_MAP_WRITE);
-
-  /* set RTP headers */
-  auto packet = (AudioFECPacket *)info.data;
-
+static void write_rtp_fec_header(const gst_rtp_moonlight_pay_audio &rtpmoonlightpay,
+                                 int fec_packet_idx,
+                                 AudioFECPacket *packet) {
+  *packet = {};
   packet->rtp.header = 0x80;
   packet->rtp.packetType = 127;
   packet->rtp.ssrc = 0;
@@ -78,18 +77,123 @@ static GstBuffer *create_rtp_fec_header(const gst_rtp_moonlight_pay_audio &rtpmo
   packet->rtp.sequenceNumber =
       boost::endian::native_to_big((uint16_t)(rtpmoonlightpay.cur_seq_number + fec_packet_idx));
   packet->fec_header.fecShardIndex = fec_packet_idx;
+}
 
-  gst_buffer_unmap(buf, &info);
+/**
+ * Parity packets are sent straight from their shard: the FEC header is bigger than the RTP header that it
+ * replaces, each slot has this much room in front of the shard to accommodate it.
+ */
+constexpr auto FEC_HEADROOM = FEC_HEADER_SIZE - RTP_HEADER_SIZE;
 
-  return buf;
+/**
+ * A set of AUDIO_TOTAL_SHARDS shards, ref counted: the payloader holds one reference and each outgoing
+ * GstBuffer that wraps one of the shards holds another one.
+ */
+struct FECShards {
+  std::atomic<int> refs = 1;
+  unsigned char *shards[AUDIO_TOTAL_SHARDS] = {};
+  unsigned char slots[AUDIO_TOTAL_SHARDS][FEC_HEADROOM + AUDIO_MAX_BLOCK_SIZE] = {};
+};
+
+static FECShards *fec_shards_new() {
+  auto fec_shards = new FECShards();
+  for (int i = 0; i < AUDIO_TOTAL_SHARDS; i++) {
+    fec_shards->shards[i] = fec_shards->slots[i] + FEC_HEADROOM;
+  }
+  return fec_shards;
+}
+
+static void fec_shards_unref(gpointer data) {
+  auto fec_shards = (FECShards *)data;
+  if (fec_shards->refs.fetch_sub(1) == 1) {
+    delete fec_shards;
+  }
+}
+
+/**
+ * Wraps (without copying) size bytes starting at data, which must point inside fec_shards
+ */
+static GstBuffer *wrap_fec_shards(FECShards *fec_shards, unsigned char *data, gsize size) {
+  fec_shards->refs++;
+  return gst_buffer_new_wrapped_full(GST_MEMORY_FLAG_READONLY, data, size, 0, size, fec_shards, fec_shards_unref);
+}
+
+static FECShards *current_fec_shards(const gst_rtp_moonlight_pay_audio &rtpmoonlightpay) {
+  return rtpmoonlightpay.fec_ring[rtpmoonlightpay.fec_ring_idx];
+}
+
+static void init_fec_ring(gst_rtp_moonlight_pay_audio &rtpmoonlightpay) {
+  for (auto &fec_shards : rtpmoonlightpay.fec_ring) {
+    fec_shards = fec_shards_new();
+  }
+  rtpmoonlightpay.fec_ring_idx = 0;
+  rtpmoonlightpay.packets_buffer = current_fec_shards(rtpmoonlightpay)->shards;
+}
+
+static void release_fec_ring(gst_rtp_moonlight_pay_audio &rtpmoonlightpay) {
+  for (auto &fec_shards : rtpmoonlightpay.fec_ring) {
+    if (fec_shards != nullptr) {
+      fec_shards_unref(fec_shards);
+      fec_shards = nullptr;
+    }
+  }
+  rtpmoonlightpay.packets_buffer = nullptr;
+}
+
+/**
+ * Moves to the next FEC set that isn't used downstream anymore.
+ * If all of them are still in flight the next one is left to the packets that use it and replaced by a new set.
+ */
+static void next_fec_shards(gst_rtp_moonlight_pay_audio &rtpmoonlightpay) {
+  for (int i = 1; i <= AUDIO_FEC_RING_SIZE; i++) {
+    auto idx = (rtpmoonlightpay.fec_ring_idx + i) % AUDIO_FEC_RING_SIZE;
+    if (rtpmoonlightpay.fec_ring[idx]->refs.load() == 1) {
+      rtpmoonlightpay.fec_ring_idx = idx;
+      rtpmoonlightpay.packets_buffer = current_fec_shards(rtpmoonlightpay)->shards;
+      return;
+    }
+  }
+
+  auto idx = (rtpmoonlightpay.fec_ring_idx + 1) % AUDIO_FEC_RING_SIZE;
+  fec_shards_unref(rtpmoonlightpay.fec_ring[idx]);
+  rtpmoonlightpay.fec_ring[idx] = fec_shards_new();
+  rtpmoonlightpay.fec_ring_idx = idx;
+  rtpmoonlightpay.packets_buffer = current_fec_shards(rtpmoonlightpay)->shards;
+}
+
+/**
+ * The cipher context is set up once, with the key expanded; the IV base is parsed only once as well.
+ * aes_key and aes_iv can be changed from any thread: the context is only ever rebuilt here, by the streaming thread.
+ */
+static EVP_CIPHER_CTX *get_cipher_ctx(gst_rtp_moonlight_pay_audio &rtpmoonlightpay) {
+  std::string aes_key, aes_iv;
+  GST_OBJECT_LOCK(&rtpmoonlightpay);
+  bool rebuild = !rtpmoonlightpay.cipher_ctx || rtpmoonlightpay.cipher_changed;
+  if (rebuild) {
+    aes_key = rtpmoonlightpay.aes_key;
+    aes_iv = rtpmoonlightpay.aes_iv;
+    rtpmoonlightpay.cipher_changed = false;
+  }
+  GST_OBJECT_UNLOCK(&rtpmoonlightpay);
+
+  if (rebuild) {
+    rtpmoonlightpay.cipher_ctx = crypto::aes_cbc_encryption_ctx(aes_key, true);
+    rtpmoonlightpay.iv_base = std::stoul(aes_iv);
+  }
+  return rtpmoonlightpay.cipher_ctx.get();
 }
 
 static GstBuffer *create_rtp_audio_buffer(const gst_rtp_moonlight_pay_audio &rtpmoonlightpay, GstBuffer *inbuf) {
   GstBuffer *payload = inbuf;
 
   if (rtpmoonlightpay.encrypt) {
-    auto derived_iv = derive_iv(rtpmoonlightpay.aes_iv, rtpmoonlightpay.cur_seq_number);
-    payload = encrypt_payload(rtpmoonlightpay.aes_key, derived_iv, inbuf);
+    GST_OBJECT_LOCK(&rtpmoonlightpay);
+    auto aes_key = rtpmoonlightpay.aes_key;
+    auto aes_iv = rtpmoonlightpay.aes_iv;
+    GST_OBJECT_UNLOCK(&rtpmoonlightpay);
+
+    auto derived_iv = derive_iv(aes_iv, rtpmoonlightpay.cur_seq_number);
+    payload = encrypt_payload(aes_key, derived_iv, inbuf);
   }
 
   auto rtp_header = create_rtp_header(rtpmoonlightpay);
@@ -99,6 +203,53 @@ static GstBuffer *create_rtp_audio_buffer(const gst_rtp_moonlight_pay_audio &rtp
   return full_rtp_buf;
 }
 
+/**
+ * Same output as create_rtp_audio_buffer() but the header and the (encrypted) payload are written straight
+ * into the shard for the current sequence number, the returned buffer wraps it.
+ * Falls back to create_rtp_audio_buffer() if the packet might not fit in a shard; the FEC is computed over the
+ * shards so the packet is copied there as well, when it doesn't fit the whole set is marked as unprotected.
+ */
+static GstBuffer *create_rtp_audio_packet(gst_rtp_moonlight_pay_audio &rtpmoonlightpay, GstBuffer *inbuf) {
+  auto in_buf_size = gst_buffer_get_size(inbuf);
+  auto shard = rtpmoonlightpay.packets_buffer[rtpmoonlightpay.cur_seq_number % AUDIO_DATA_SHARDS];
+  // AES CBC with padding will add at most a block
+  if (RTP_HEADER_SIZE + in_buf_size + CBC_BLOCK_SIZE > AUDIO_MAX_BLOCK_SIZE) {
+    auto rtp_packet = create_rtp_audio_buffer(rtpmoonlightpay, inbuf);
+    auto rtp_packet_size = gst_buffer_get_size(rtp_packet);
+    if (rtp_packet_size <= AUDIO_MAX_BLOCK_SIZE) {
+      gst_buffer_extract(rtp_packet, 0, shard, rtp_packet_size);
+    } else {
+      rtpmoonlightpay.fec_set_unprotected = true;
+    }
+    return rtp_packet;
+  }
+
+  write_rtp_header(rtpmoonlightpay, (AudioRTPHeaders *)shard);
+
+  GstMapInfo in_info;
+  gst_buffer_map(inbuf, &in_info, GST_MAP_READ);
+  auto payload_size = in_buf_size;
+  if (rtpmoonlightpay.encrypt) {
+    auto ctx = get_cipher_ctx(rtpmoonlightpay);
+    // Same as derive_iv(): the IV base + the sequence number (big endian) followed by zeros
+    std::array<std::uint8_t, CBC_BLOCK_SIZE> iv = {};
+    std::uint32_t seq_iv = rtpmoonlightpay.iv_base + rtpmoonlightpay.cur_seq_number;
+    *(std::uint32_t *)iv.data() = boost::endian::native_to_big(seq_iv);
+    payload_size = crypto::aes_encrypt_cbc_into(ctx,
+                                                {(const char *)in_info.data, in_buf_size},
+                                                iv.data(),
+                                                shard + RTP_HEADER_SIZE);
+  } else {
+    std::memcpy(shard + RTP_HEADER_SIZE, in_info.data, in_buf_size);
+  }
+  gst_buffer_unmap(inbuf, &in_info);
+
+  auto rtp_packet = wrap_fec_shards(current_fec_shards(rtpmoonlightpay), shard, RTP_HEADER_SIZE + payload_size);
+  gst_copy_timestamps(inbuf, rtp_packet);
+
+  return rtp_packet;
+}
+
 /**
  * Our main function:
  * Given an input buffer containing some kind of payload
@@ -107,21 +258,28 @@ static GstBuffer *create_rtp_audio_buffer(const gst_rtp_moonlight_pay_audio &rtp
  * @return a list of buffers, each element representing a single RTP packet
  */
 static GstBufferList *split_into_rtp(gst_rtp_moonlight_pay_audio *rtpmoonlightpay, GstBuffer *inbuf) {
+  if (rtpmoonlightpay->cur_seq_number % AUDIO_DATA_SHARDS == 0) {
+    next_fec_shards(*rtpmoonlightpay);
+    rtpmoonlightpay->fec_set_unprotected = false;
+  }
   bool time_to_fec = (rtpmoonlightpay->cur_seq_number + 1) % AUDIO_DATA_SHARDS == 0;
 
   GstBufferList *rtp_packets = gst_buffer_list_new();
 
-  auto rtp_audio_buf = create_rtp_audio_buffer(*rtpmoonlightpay, inbuf);
+  auto rtp_audio_buf = create_rtp_audio_packet(*rtpmoonlightpay, inbuf);
   gst_buffer_list_add(rtp_packets, rtp_audio_buf);
 
-  // save the payload locally
-  gst_buffer_copy_into(rtp_audio_buf,
-                       rtpmoonlightpay->packets_buffer[rtpmoonlightpay->cur_seq_number % AUDIO_DATA_SHARDS]);
+  /* Here the assumption is that all audio blocks will have the exact same size */
+  auto rtp_block_size = (int)gst_buffer_get_size(rtp_audio_buf);
+  if (rtp_block_size > AUDIO_MAX_BLOCK_SIZE) {
+    logs::log(logs::warning, "Audio packet too big ({} bytes), skipping FEC", rtp_block_size);
+  }
+  if (rtpmoonlightpay->fec_set_unprotected) {
+    time_to_fec = false;
+  }
 
   // Time to generate FEC based on the previous payloads
   if (time_to_fec) {
-    /* Here the assumption is that all audio blocks will have the exact same size */
-    auto rtp_block_size = (int)gst_buffer_get_size(rtp_audio_buf);
     auto payload_size = rtp_block_size - RTP_HEADER_SIZE;
     if (moonlight::fec::encode(rtpmoonlightpay->rs.get(),
                                rtpmoonlightpay->packets_buffer,
@@ -131,16 +289,13 @@ static GstBufferList *split_into_rtp(gst_rtp_moonlight_pay_audio *rtpmoonlightpa
     }
 
     for (auto fec_packet_idx = 0; fec_packet_idx < AUDIO_FEC_SHARDS; fec_packet_idx++) {
-      auto fec_packet = create_rtp_fec_header(*rtpmoonlightpay, fec_packet_idx);
-
-      GstBuffer *fec_payload_buf = gst_buffer_new_allocate(nullptr, payload_size, nullptr);
-      gst_buffer_fill(fec_payload_buf,
-                      0,
-                      rtpmoonlightpay->packets_buffer[AUDIO_DATA_SHARDS + fec_packet_idx] + RTP_HEADER_SIZE,
-                      payload_size);
+      // The FEC header overwrites the parity of the RTP header (which is never sent) and takes the headroom
+      auto fec_packet = rtpmoonlightpay->packets_buffer[AUDIO_DATA_SHARDS + fec_packet_idx] - FEC_HEADROOM;
+      write_rtp_fec_header(*rtpmoonlightpay, fec_packet_idx, (AudioFECPacket *)fec_packet);
 
-      fec_packet = gst_buffer_append(fec_packet, fec_payload_buf);
-      gst_buffer_list_add(rtp_packets, fec_packet);
+      gst_buffer_list_add(
+          rtp_packets,
+          wrap_fec_shards(current_fec_shards(*rtpmoonlightpay), fec_packet, FEC_HEADER_SIZE + payload_size));
     }
   }
   rtpmoonlightpay->cur_seq_number++;
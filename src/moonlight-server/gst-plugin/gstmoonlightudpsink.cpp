@@ -0,0 +1,413 @@
+/**
+ * SECTION:element-gstmoonlightudpsink
+ *
+ * The moonlightudpsink element sends RTP packets over UDP, batching all the packets of a buffer list
+ * in as few syscalls as possible (sendmmsg and, when supported, UDP GSO).
+ *
+ * <refsect2>
+ * <title>Example launch line</title>
+ * |[
+ * gst-launch-1.0 -v videotestsrc ! x264enc ! rtpmoonlightpay_video ! moonlightudpsink host=127.0.0.1 port=48100
+ * ]|
+ * </refsect2>
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <gst-plugin/gstmoonlightudpsink.hpp>
+#include <gst-plugin/pacing.hpp>
+#include <gst-plugin/udp.hpp>
+#include <gst/base/gstbasesink.h>
+#include <gst/gst.h>
+
+GST_DEBUG_CATEGORY_STATIC(gst_moonlight_udp_sink_debug_category);
+#define GST_CAT_DEFAULT gst_moonlight_udp_sink_debug_category
+
+/* prototypes */
+
+static void
+gst_moonlight_udp_sink_set_property(GObject *object, guint property_id, const GValue *value, GParamSpec *pspec);
+static void gst_moonlight_udp_sink_get_property(GObject *object, guint property_id, GValue *value, GParamSpec *pspec);
+static void gst_moonlight_udp_sink_finalize(GObject *object);
+
+static gboolean gst_moonlight_udp_sink_start(GstBaseSink *sink);
+static gboolean gst_moonlight_udp_sink_stop(GstBaseSink *sink);
+static GstFlowReturn gst_moonlight_udp_sink_render(GstBaseSink *sink, GstBuffer *buffer);
+static GstFlowReturn gst_moonlight_udp_sink_render_list(GstBaseSink *sink, GstBufferList *buffer_list);
+
+enum {
+  /**
+   * The host/IP to send the packets to
+   */
+  PROP_HOST = 19,
+
+  /**
+   * The port to send the packets to
+   */
+  PROP_PORT = 20,
+
+  /**
+   * Local port to bind the socket to, 0 will let the OS pick one
+   */
+  PROP_BIND_PORT = 21,
+
+  /**
+   * DSCP (Differentiated Services Code Point) to be set on the packets, -1 to leave the default
+   */
+  PROP_DSCP = 22,
+
+  /**
+   * SO_PRIORITY of the socket, -1 to leave the default
+   */
+  PROP_PRIORITY = 23,
+
+  /**
+   * If TRUE will use UDP GSO (Generic Segmentation Offload) when supported by the kernel
+   */
+  PROP_GSO = 24,
+
+  /**
+   * Fraction (0.0 - 1.0) of the frame interval over which the packets of each frame are spread, 0 disables pacing
+   */
+  PROP_PACING = 25,
+
+  /**
+   * Frames per second of the stream, used to compute the frame interval when pacing
+   */
+  PROP_REFRESH_RATE = 26,
+
+  /**
+   * Read only: bytes waiting in the socket send queue, a growing queue means that the stream is over the link capacity
+   */
+  PROP_QUEUED_BYTES = 27,
+};
+
+/* pad templates */
+
+static GstStaticPadTemplate gst_moonlight_udp_sink_sink_template = GST_STATIC_PAD_TEMPLATE(
+    "sink", GST_PAD_SINK, GST_PAD_ALWAYS, GST_STATIC_CAPS("ANY"));
+
+/* class initialization */
+
+G_DEFINE_TYPE_WITH_CODE(gst_moonlight_udp_sink,
+                        gst_moonlight_udp_sink,
+                        GST_TYPE_BASE_SINK,
+                        GST_DEBUG_CATEGORY_INIT(gst_moonlight_udp_sink_debug_category,
+                                                "moonlightudpsink",
+                                                0,
+                                                "debug category for moonlightudpsink element"));
+
+static void gst_moonlight_udp_sink_class_init(gst_moonlight_udp_sinkClass *klass) {
+  GObjectClass *gobject_class = G_OBJECT_CLASS(klass);
+  GstBaseSinkClass *base_sink_class = GST_BASE_SINK_CLASS(klass);
+
+  gst_element_class_add_static_pad_template(GST_ELEMENT_CLASS(klass), &gst_moonlight_udp_sink_sink_template);
+
+  gst_element_class_set_static_metadata(GST_ELEMENT_CLASS(klass),
+                                        "Moonlight UDP sink",
+                                        "Sink/Network",
+                                        "Sends buffer lists over UDP using sendmmsg and UDP GSO",
+                                        "Games on Whales <https://github.com/games-on-whales/wolf>");
+
+  gobject_class->set_property = gst_moonlight_udp_sink_set_property;
+  gobject_class->get_property = gst_moonlight_udp_sink_get_property;
+
+  g_object_class_install_property(
+      gobject_class,
+      PROP_HOST,
+      g_param_spec_string("host", "host", "The host/IP to send the packets to", "127.0.0.1", G_PARAM_READWRITE));
+
+  g_object_class_install_property(
+      gobject_class,
+      PROP_PORT,
+      g_param_spec_int("port", "port", "The port to send the packets to", 0, 65535, 5004, G_PARAM_READWRITE));
+
+  g_object_class_install_property(gobject_class,
+                                  PROP_BIND_PORT,
+                                  g_param_spec_int("bind-port",
+                                                   "bind-port",
+                                                   "Local port to bind the socket to, 0 will let the OS pick one",
+                                                   0,
+                                                   65535,
+                                                   0,
+                                                   G_PARAM_READWRITE));
+
+  g_object_class_install_property(
+      gobject_class,
+      PROP_DSCP,
+      g_param_spec_int("dscp",
+                       "dscp",
+                       "DSCP (Differentiated Services Code Point) to be set on the packets, -1 to leave the default",
+                       -1,
+                       63,
+                       -1,
+                       G_PARAM_READWRITE));
+
+  g_object_class_install_property(gobject_class,
+                                  PROP_PRIORITY,
+                                  g_param_spec_int("priority",
+                                                   "priority",
+                                                   "SO_PRIORITY of the socket, -1 to leave the default",
+                                                   -1,
+                                                   7,
+                                                   -1,
+                                                   G_PARAM_READWRITE));
+
+  g_object_class_install_property(
+      gobject_class,
+      PROP_GSO,
+      g_param_spec_boolean("gso",
+                           "gso",
+                           "If TRUE will use UDP GSO (Generic Segmentation Offload) when supported by the kernel",
+                           TRUE,
+                           G_PARAM_READWRITE));
+
+  g_object_class_install_property(gobject_class,
+                                  PROP_PACING,
+                                  g_param_spec_double("pacing",
+                                                      "pacing",
+                                                      "Fraction (0.0 - 1.0) of the frame interval over which the "
+                                                      "packets of each frame are spread, 0 disables pacing",
+                                                      0.0,
+                                                      1.0,
+                                                      0.0,
+                                                      G_PARAM_READWRITE));
+
+  g_object_class_install_property(gobject_class,
+                                  PROP_REFRESH_RATE,
+                                  g_param_spec_int("refresh-rate",
+                                                   "refresh-rate",
+                                                   "Frames per second of the stream, used to compute the frame "
+                                                   "interval when pacing",
+                                                   1,
+                                                   1000,
+                                                   60,
+                                                   G_PARAM_READWRITE));
+
+  g_object_class_install_property(gobject_class,
+                                  PROP_QUEUED_BYTES,
+                                  g_param_spec_uint64("queued-bytes",
+                                                      "queued-bytes",
+                                                      "Bytes waiting in the socket send queue",
+                                                      0,
+                                                      G_MAXUINT64,
+                                                      0,
+                                                      G_PARAM_READABLE));
+
+  gobject_class->finalize = gst_moonlight_udp_sink_finalize;
+
+  base_sink_class->start = GST_DEBUG_FUNCPTR(gst_moonlight_udp_sink_start);
+  base_sink_class->stop = GST_DEBUG_FUNCPTR(gst_moonlight_udp_sink_stop);
+  base_sink_class->render = GST_DEBUG_FUNCPTR(gst_moonlight_udp_sink_render);
+  base_sink_class->render_list = GST_DEBUG_FUNCPTR(gst_moonlight_udp_sink_render_list);
+}
+
+static void gst_moonlight_udp_sink_init(gst_moonlight_udp_sink *moonlight_udp_sink) {
+  moonlight_udp_sink->host = g_strdup("127.0.0.1");
+  moonlight_udp_sink->port = 5004;
+  moonlight_udp_sink->bind_port = 0;
+
+  moonlight_udp_sink->dscp = -1;
+  moonlight_udp_sink->priority = -1;
+  moonlight_udp_sink->gso = true;
+
+  moonlight_udp_sink->pacing = 0.0;
+  moonlight_udp_sink->refresh_rate = 60;
+
+  moonlight_udp_sink->socket_fd = -1;
+  moonlight_udp_sink->destination_len = 0;
+  moonlight_udp_sink->gso_supported = false;
+
+  moonlight_udp_sink->packets_sent = 0;
+  moonlight_udp_sink->send_calls = 0;
+  moonlight_udp_sink->send_errors = 0;
+
+  moonlight_udp_sink->latency_frames = 0;
+  moonlight_udp_sink->latency_sum_ns = 0;
+  moonlight_udp_sink->latency_max_ns = 0;
+
+  moonlight_udp_sink->pacer = nullptr;
+  moonlight_udp_sink->paced_frames = 0;
+  moonlight_udp_sink->flushed_frames = 0;
+  moonlight_udp_sink->pacing_gaps = 0;
+  moonlight_udp_sink->pacing_gap_sum_ns = 0;
+  moonlight_udp_sink->pacing_gap_min_ns = 0;
+  moonlight_udp_sink->pacing_gap_max_ns = 0;
+}
+
+void gst_moonlight_udp_sink_set_property(GObject *object,
+                                         guint property_id,
+                                         const GValue *value,
+                                         GParamSpec *pspec) {
+  gst_moonlight_udp_sink *moonlight_udp_sink = gst_moonlight_udp_sink(object);
+
+  GST_DEBUG_OBJECT(moonlight_udp_sink, "set_property");
+
+  switch (property_id) {
+  case PROP_HOST:
+    g_free(moonlight_udp_sink->host);
+    moonlight_udp_sink->host = g_value_dup_string(value);
+    break;
+  case PROP_PORT:
+    moonlight_udp_sink->port = g_value_get_int(value);
+    break;
+  case PROP_BIND_PORT:
+    moonlight_udp_sink->bind_port = g_value_get_int(value);
+    break;
+  case PROP_DSCP:
+    moonlight_udp_sink->dscp = g_value_get_int(value);
+    break;
+  case PROP_PRIORITY:
+    moonlight_udp_sink->priority = g_value_get_int(value);
+    break;
+  case PROP_GSO:
+    moonlight_udp_sink->gso = g_value_get_boolean(value);
+    break;
+  case PROP_PACING:
+    moonlight_udp_sink->pacing = g_value_get_double(value);
+    break;
+  case PROP_REFRESH_RATE:
+    moonlight_udp_sink->refresh_rate = g_value_get_int(value);
+    break;
+  default:
+    G_OBJECT_WARN_INVALID_PROPERTY_ID(object, property_id, pspec);
+    break;
+  }
+}
+
+void gst_moonlight_udp_sink_get_property(GObject *object, guint property_id, GValue *value, GParamSpec *pspec) {
+  gst_moonlight_udp_sink *moonlight_udp_sink = gst_moonlight_udp_sink(object);
+
+  GST_DEBUG_OBJECT(moonlight_udp_sink, "get_property");
+
+  switch (property_id) {
+  case PROP_HOST:
+    g_value_set_string(value, moonlight_udp_sink->host);
+    break;
+  case PROP_PORT:
+    g_value_set_int(value, moonlight_udp_sink->port);
+    break;
+  case PROP_BIND_PORT:
+    g_value_set_int(value, moonlight_udp_sink->bind_port);
+    break;
+  case PROP_DSCP:
+    g_value_set_int(value, moonlight_udp_sink->dscp);
+    break;
+  case PROP_PRIORITY:
+    g_value_set_int(value, moonlight_udp_sink->priority);
+    break;
+  case PROP_GSO:
+    g_value_set_boolean(value, moonlight_udp_sink->gso);
+    break;
+  case PROP_PACING:
+    g_value_set_double(value, moonlight_udp_sink->pacing);
+    break;
+  case PROP_REFRESH_RATE:
+    g_value_set_int(value, moonlight_udp_sink->refresh_rate);
+    break;
+  case PROP_QUEUED_BYTES:
+    g_value_set_uint64(value, gst_moonlight_udp::socket_queued_bytes(*moonlight_udp_sink));
+    break;
+  default:
+    G_OBJECT_WARN_INVALID_PROPERTY_ID(object, property_id, pspec);
+    break;
+  }
+}
+
+void gst_moonlight_udp_sink_finalize(GObject *object) {
+  gst_moonlight_udp_sink *moonlight_udp_sink = gst_moonlight_udp_sink(object);
+
+  GST_DEBUG_OBJECT(moonlight_udp_sink, "finalize");
+
+  gst_moonlight_udp::stop_pacer(*moonlight_udp_sink);
+  gst_moonlight_udp::close_socket(*moonlight_udp_sink);
+  g_free(moonlight_udp_sink->host);
+
+  G_OBJECT_CLASS(gst_moonlight_udp_sink_parent_class)->finalize(object);
+}
+
+static gboolean gst_moonlight_udp_sink_start(GstBaseSink *sink) {
+  gst_moonlight_udp_sink *moonlight_udp_sink = gst_moonlight_udp_sink(sink);
+  if (!gst_moonlight_udp::open_socket(*moonlight_udp_sink)) {
+    return false;
+  }
+
+  if (gst_moonlight_udp::pacing_window_ns(*moonlight_udp_sink) > 0) {
+    gst_moonlight_udp::start_pacer(*moonlight_udp_sink);
+  }
+  return true;
+}
+
+static gboolean gst_moonlight_udp_sink_stop(GstBaseSink *sink) {
+  gst_moonlight_udp_sink *moonlight_udp_sink = gst_moonlight_udp_sink(sink);
+
+  gst_moonlight_udp::stop_pacer(*moonlight_udp_sink);
+  logs::log(logs::debug,
+            "[GSTREAMER] moonlightudpsink sent {} packets in {} syscalls, {} errors",
+            moonlight_udp_sink->packets_sent,
+            moonlight_udp_sink->send_calls,
+            moonlight_udp_sink->send_errors);
+  if (moonlight_udp_sink->latency_frames > 0) {
+    logs::log(logs::debug,
+              "[GSTREAMER] moonlightudpsink encoder to first packet latency over {} frames: avg {}us max {}us",
+              moonlight_udp_sink->latency_frames,
+              moonlight_udp_sink->latency_sum_ns / moonlight_udp_sink->latency_frames / GST_USECOND,
+              moonlight_udp_sink->latency_max_ns / GST_USECOND);
+  }
+  gst_moonlight_udp::close_socket(*moonlight_udp_sink);
+  return true;
+}
+
+static GstFlowReturn gst_moonlight_udp_sink_render(GstBaseSink *sink, GstBuffer *buffer) {
+  gst_moonlight_udp_sink *moonlight_udp_sink = gst_moonlight_udp_sink(sink);
+
+  GstBufferList *buffer_list = gst_buffer_list_new_sized(1);
+  gst_buffer_list_add(buffer_list, gst_buffer_ref(buffer));
+  auto ret = gst_moonlight_udp_sink_render_list(sink, buffer_list);
+  gst_buffer_list_unref(buffer_list);
+
+  return ret;
+}
+
+/**
+ * All the packets of a frame come in a single buffer list, this is where batching pays off.
+ * When pacing, the list is handed over to the pacer thread which will spread it over the frame interval.
+ */
+static GstFlowReturn gst_moonlight_udp_sink_render_list(GstBaseSink *sink, GstBufferList *buffer_list) {
+  gst_moonlight_udp_sink *moonlight_udp_sink = gst_moonlight_udp_sink(sink);
+  if (moonlight_udp_sink->pacer != nullptr) {
+    gst_moonlight_udp::queue_frame(*moonlight_udp_sink, buffer_list);
+    return GST_FLOW_OK;
+  }
+  return gst_moonlight_udp::send_packets(*moonlight_udp_sink, buffer_list);
+}
+
+static gboolean plugin_init(GstPlugin *plugin) {
+  return gst_element_register(plugin, "moonlightudpsink", GST_RANK_NONE, gst_TYPE_moonlight_udp_sink);
+}
+
+/* These are normally defined by the GStreamer build system, the plugin is built (and versioned) as part of Wolf */
+#ifndef VERSION
+#define VERSION "0.1"
+#endif
+#ifndef PACKAGE
+#define PACKAGE "wolf"
+#endif
+#ifndef PACKAGE_NAME
+#define PACKAGE_NAME "Wolf"
+#endif
+#ifndef GST_PACKAGE_ORIGIN
+#define GST_PACKAGE_ORIGIN "https://github.com/games-on-whales/wolf"
+#endif
+
+GST_PLUGIN_DEFINE(GST_VERSION_MAJOR,
+                  GST_VERSION_MINOR,
+                  moonlightudpsink,
+                  "Batched and paced UDP sink for the Moonlight video and audio streams",
+                  plugin_init,
+                  VERSION,
+                  "MIT/X11",
+                  PACKAGE_NAME,
+                  GST_PACKAGE_ORIGIN)
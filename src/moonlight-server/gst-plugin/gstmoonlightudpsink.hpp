@@ -0,0 +1,70 @@
+#pragma once
+
+#include <gst/base/gstbasesink.h>
+#include <sys/socket.h>
+
+namespace gst_moonlight_udp {
+struct Pacer;
+}
+
+G_BEGIN_DECLS
+
+#define gst_TYPE_moonlight_udp_sink (gst_moonlight_udp_sink_get_type())
+#define gst_moonlight_udp_sink(obj)                                                                                    \
+  (G_TYPE_CHECK_INSTANCE_CAST((obj), gst_TYPE_moonlight_udp_sink, gst_moonlight_udp_sink))
+#define gst_moonlight_udp_sink_CLASS(klass)                                                                            \
+  (G_TYPE_CHECK_CLASS_CAST((klass), gst_TYPE_moonlight_udp_sink, gst_moonlight_udp_sinkClass))
+#define gst_IS_moonlight_udp_sink(obj) (G_TYPE_CHECK_INSTANCE_TYPE((obj), gst_TYPE_moonlight_udp_sink))
+#define gst_IS_moonlight_udp_sink_CLASS(obj) (G_TYPE_CHECK_CLASS_TYPE((klass), gst_TYPE_moonlight_udp_sink))
+
+typedef struct _gst_moonlight_udp_sink gst_moonlight_udp_sink;
+typedef struct _gst_moonlight_udp_sinkClass gst_moonlight_udp_sinkClass;
+
+struct _gst_moonlight_udp_sink {
+  GstBaseSink base_moonlight_udp_sink;
+
+  gchar *host;
+  int port;
+  int bind_port;
+
+  int dscp;
+  int priority;
+  bool gso;
+
+  /* Fraction of the frame interval used to spread the packets of a frame, 0 disables pacing */
+  double pacing;
+  int refresh_rate;
+
+  /* Runtime state, set when the sink starts */
+  int socket_fd;
+  struct sockaddr_storage destination;
+  socklen_t destination_len;
+  bool gso_supported;
+
+  /* Stats */
+  guint64 packets_sent;
+  guint64 send_calls;
+  guint64 send_errors;
+
+  /* Time between the encoder output reaching the payloader and the first packet of the frame being sent */
+  guint64 latency_frames;
+  guint64 latency_sum_ns;
+  guint64 latency_max_ns;
+
+  /* Pacing, only used when pacing > 0 */
+  gst_moonlight_udp::Pacer *pacer;
+  guint64 paced_frames;
+  guint64 flushed_frames;
+  guint64 pacing_gaps;
+  guint64 pacing_gap_sum_ns;
+  guint64 pacing_gap_min_ns;
+  guint64 pacing_gap_max_ns;
+};
+
+struct _gst_moonlight_udp_sinkClass {
+  GstBaseSinkClass base_moonlight_udp_sink_class;
+};
+
+GType gst_moonlight_udp_sink_get_type(void);
+
+G_END_DECLS
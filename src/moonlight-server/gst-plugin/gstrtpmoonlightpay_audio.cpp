@@ -142,14 +142,14 @@ static void gst_rtp_moonlight_pay_audio_init(gst_rtp_moonlight_pay_audio *rtpmoo
   rtpmoonlightpay_audio->encrypt = true;
 
   rtpmoonlightpay_audio->packet_duration = 5;
-  rtpmoonlightpay_audio->packets_buffer = new unsigned char *[AUDIO_TOTAL_SHARDS];
-  for (int i = 0; i < AUDIO_TOTAL_SHARDS; i++) {
-    rtpmoonlightpay_audio->packets_buffer[i] = new unsigned char[AUDIO_MAX_BLOCK_SIZE];
-  }
+  audio::init_fec_ring(*rtpmoonlightpay_audio);
+  rtpmoonlightpay_audio->fec_set_unprotected = false;
+
+  rtpmoonlightpay_audio->rs = audio_fec_cache().get(AUDIO_DATA_SHARDS, AUDIO_FEC_SHARDS);
 
-  auto rs = moonlight::fec::create(AUDIO_DATA_SHARDS, AUDIO_FEC_SHARDS);
-  memcpy(rs->p, AUDIO_FEC_PARITY, sizeof(AUDIO_FEC_PARITY));
-  rtpmoonlightpay_audio->rs = std::move(rs);
+  rtpmoonlightpay_audio->cipher_ctx = nullptr;
+  rtpmoonlightpay_audio->cipher_changed = false;
+  rtpmoonlightpay_audio->iv_base = 0;
 }
 
 void gst_rtp_moonlight_pay_audio_set_property(GObject *object,
@@ -160,15 +160,19 @@ void gst_rtp_moonlight_pay_audio_set_property(GObject *object,
 
   GST_DEBUG_OBJECT(rtpmoonlightpay_audio, "set_property");
 
+  /* The cipher context might be in use by the streaming thread, it'll rebuild it, see audio::get_cipher_ctx() */
+  GST_OBJECT_LOCK(rtpmoonlightpay_audio);
   switch (property_id) {
   case PROP_AES_ENCRYPTION:
     rtpmoonlightpay_audio->encrypt = g_value_get_boolean(value);
     break;
   case PROP_AES_KEY:
     rtpmoonlightpay_audio->aes_key = crypto::hex_to_str(g_value_get_string(value), true);
+    rtpmoonlightpay_audio->cipher_changed = true;
     break;
   case PROP_AES_IV:
     rtpmoonlightpay_audio->aes_iv = g_value_get_string(value);
+    rtpmoonlightpay_audio->cipher_changed = true;
     break;
   case PROP_PACKET_DURATION:
     rtpmoonlightpay_audio->packet_duration = g_value_get_int(value);
@@ -177,6 +181,7 @@ void gst_rtp_moonlight_pay_audio_set_property(GObject *object,
     G_OBJECT_WARN_INVALID_PROPERTY_ID(object, property_id, pspec);
     break;
   }
+  GST_OBJECT_UNLOCK(rtpmoonlightpay_audio);
 }
 
 void gst_rtp_moonlight_pay_audio_get_property(GObject *object, guint property_id, GValue *value, GParamSpec *pspec) {
@@ -184,6 +189,7 @@ void gst_rtp_moonlight_pay_audio_get_property(GObject *object, guint property_id
 
   GST_DEBUG_OBJECT(rtpmoonlightpay_audio, "get_property");
 
+  GST_OBJECT_LOCK(rtpmoonlightpay_audio);
   switch (property_id) {
   case PROP_AES_ENCRYPTION:
     g_value_set_boolean(value, rtpmoonlightpay_audio->encrypt);
@@ -201,6 +207,7 @@ void gst_rtp_moonlight_pay_audio_get_property(GObject *object, guint property_id
     G_OBJECT_WARN_INVALID_PROPERTY_ID(object, property_id, pspec);
     break;
   }
+  GST_OBJECT_UNLOCK(rtpmoonlightpay_audio);
 }
 
 void gst_rtp_moonlight_pay_audio_dispose(GObject *object) {
@@ -208,11 +215,10 @@ void gst_rtp_moonlight_pay_audio_dispose(GObject *object) {
 
   GST_DEBUG_OBJECT(rtpmoonlightpay_audio, "dispose");
 
-  // free rtpmoonlightpay_audio->packets_buffer matrix
-  for (int i = 0; i < AUDIO_TOTAL_SHARDS; i++) {
-    delete[] rtpmoonlightpay_audio->packets_buffer[i];
-  }
-  delete[] rtpmoonlightpay_audio->packets_buffer;
+  // packets still in flight keep their FEC set alive
+  audio::release_fec_ring(*rtpmoonlightpay_audio);
+
+  rtpmoonlightpay_audio->cipher_ctx = nullptr;
 
   G_OBJECT_CLASS(gst_rtp_moonlight_pay_audio_parent_class)->dispose(object);
 }
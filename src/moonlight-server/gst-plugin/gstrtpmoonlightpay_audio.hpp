@@ -1,6 +1,8 @@
 #pragma once
 
 #include <array>
+#include <crypto/crypto.hpp>
+#include <cstring>
 #include <gst/base/gstbasetransform.h>
 #include <moonlight/fec.hpp>
 #include <vector>
@@ -10,6 +12,16 @@ constexpr int AUDIO_FEC_SHARDS = 2;
 constexpr int AUDIO_TOTAL_SHARDS = AUDIO_DATA_SHARDS + AUDIO_FEC_SHARDS;
 constexpr int AUDIO_MAX_BLOCK_SIZE = 1400;
 
+/**
+ * Number of FEC shards sets that the payloader will cycle through, a set is only re-used once every packet that
+ * points to it has been released downstream.
+ */
+constexpr int AUDIO_FEC_RING_SIZE = 4;
+
+namespace audio {
+struct FECShards;
+}
+
 // For unknown reasons, the RS parity matrix computed by our RS implementation
 // doesn't match the one Nvidia uses for audio data. I'm not exactly sure why,
 // but we can simply replace it with the matrix generated by OpenFEC which
@@ -17,6 +29,17 @@ constexpr int AUDIO_MAX_BLOCK_SIZE = 1400;
 // constant and known in advance.
 constexpr unsigned char AUDIO_FEC_PARITY[] = {0x77, 0x40, 0x38, 0x0e, 0xc7, 0xa7, 0x0d, 0x6c};
 
+/**
+ * Audio encoders can't be shared with the video ones since we replace the parity matrix,
+ * all the audio payloaders will share the same (and only) encoder from this cache.
+ */
+inline moonlight::fec::RSCache &audio_fec_cache() {
+  static moonlight::fec::RSCache cache(1, [](reed_solomon *rs) {
+    memcpy(rs->p, AUDIO_FEC_PARITY, sizeof(AUDIO_FEC_PARITY));
+  });
+  return cache;
+}
+
 G_BEGIN_DECLS
 
 #define gst_TYPE_rtp_moonlight_pay_audio (gst_rtp_moonlight_pay_audio_get_type())
@@ -38,11 +61,22 @@ struct _gst_rtp_moonlight_pay_audio {
   bool encrypt;
   std::string aes_key;
   std::string aes_iv;
+  /* Initialised from aes_key and aes_iv on the first encrypted packet, rebuilt when any of them changes */
+  crypto::cipher_ctx_ptr cipher_ctx;
+  /* Set (under the object lock) when aes_key or aes_iv change, see audio::get_cipher_ctx() */
+  bool cipher_changed;
+  uint32_t iv_base;
 
   int packet_duration;
 
+  /* The shards of the current FEC set, outgoing RTP packets are written (and sent) straight from here */
   unsigned char **packets_buffer;
   moonlight::fec::rs_ptr rs;
+
+  audio::FECShards *fec_ring[AUDIO_FEC_RING_SIZE];
+  int fec_ring_idx;
+  /* Set when a packet of the current FEC set didn't fit in its shard, the set will be sent without FEC */
+  bool fec_set_unprotected;
 };
 
 struct _gst_rtp_moonlight_pay_audioClass {
@@ -16,6 +16,7 @@
 #include "config.h"
 #endif
 
+#include <algorithm>
 #include <gst-plugin/gstrtpmoonlightpay_video.hpp>
 #include <gst-plugin/video.hpp>
 #include <gst/base/gstbasetransform.h>
@@ -34,6 +35,7 @@ static void gst_rtp_moonlight_pay_video_dispose(GObject *object);
 static void gst_rtp_moonlight_pay_video_finalize(GObject *object);
 
 static GstFlowReturn gst_rtp_moonlight_pay_video_generate_output(GstBaseTransform *trans, GstBuffer **outbuf);
+static gboolean gst_rtp_moonlight_pay_video_sink_event(GstBaseTransform *trans, GstEvent *event);
 
 enum {
   /**
@@ -55,6 +57,40 @@ enum {
    * Minimum number of FEC packages required by Moonlight
    */
   PROP_MIN_REQUIRED_FEC_PACKETS = 22,
+
+  /**
+   * Number of threads in the shared pool used to encode multi block FEC in parallel, 0 will encode inline
+   */
+  PROP_FEC_WORKERS = 23,
+
+  /**
+   * Number of slices that the encoder produces for each frame; when > 1 every input buffer is treated as a slice and
+   * packets are sent as soon as a slice is ready. Frames must be terminated by a buffer flagged as MARKER.
+   */
+  PROP_SLICES_PER_FRAME = 24,
+
+  /**
+   * If TRUE the packets of multi block frames are interleaved across blocks so that a burst loss is spread over
+   * all the blocks instead of wiping out a single one
+   */
+  PROP_INTERLEAVE_FEC_BLOCKS = 25,
+
+  /**
+   * The count of the forced key unit (GstForceKeyUnit event) that asks the encoder to stop referencing the frames that
+   * the client has lost, 0 if none. The P-frame that answers it will be marked as such so that the client can resume
+   * decoding.
+   */
+  PROP_RECOVERY_KEY_UNIT = 26,
+
+  /**
+   * CLOCK_MONOTONIC time (in ns) at which the last key frame went through, 0 if none did yet (read only)
+   */
+  PROP_LAST_KEY_FRAME_NS = 27,
+
+  /**
+   * Set to TRUE when the encoder uses periodic intra refresh: P-frames will be marked as carrying intra refresh blocks
+   */
+  PROP_INTRA_REFRESH = 28,
 };
 
 /* pad templates */
@@ -135,10 +171,80 @@ static void gst_rtp_moonlight_pay_video_class_init(gst_rtp_moonlight_pay_videoCl
                                                    2,
                                                    G_PARAM_READWRITE));
 
+  g_object_class_install_property(
+      gobject_class,
+      PROP_FEC_WORKERS,
+      g_param_spec_int("fec_workers",
+                       "fec_workers",
+                       "Number of threads in the shared pool used to encode multi block FEC in parallel, 0 will "
+                       "encode inline",
+                       0,
+                       16,
+                       2,
+                       G_PARAM_READWRITE));
+
+  g_object_class_install_property(
+      gobject_class,
+      PROP_SLICES_PER_FRAME,
+      g_param_spec_int("slices_per_frame",
+                       "slices_per_frame",
+                       "Number of slices that the encoder produces for each frame; when > 1 every input buffer is "
+                       "treated as a slice and packets are sent as soon as a slice is ready. Frames must be "
+                       "terminated by a buffer flagged as MARKER (ex: h264parse with alignment=nal)",
+                       1,
+                       64,
+                       1,
+                       G_PARAM_READWRITE));
+
+  g_object_class_install_property(
+      gobject_class,
+      PROP_INTERLEAVE_FEC_BLOCKS,
+      g_param_spec_boolean("interleave_fec_blocks",
+                           "interleave_fec_blocks",
+                           "If TRUE the packets of multi block frames are interleaved across blocks so that a burst "
+                           "loss is spread over all the blocks instead of wiping out a single one",
+                           FALSE,
+                           G_PARAM_READWRITE));
+
+  g_object_class_install_property(
+      gobject_class,
+      PROP_RECOVERY_KEY_UNIT,
+      g_param_spec_uint("recovery_key_unit",
+                        "recovery_key_unit",
+                        "Count of the forced key unit that asks the encoder to recover from a reference frame "
+                        "invalidation, 0 if none: the P-frame that answers it will be marked as the first one that "
+                        "doesn't reference the lost frames",
+                        0,
+                        G_MAXUINT,
+                        0,
+                        G_PARAM_READWRITE));
+
+  g_object_class_install_property(gobject_class,
+                                  PROP_LAST_KEY_FRAME_NS,
+                                  g_param_spec_uint64("last_key_frame_ns",
+                                                      "last_key_frame_ns",
+                                                      "CLOCK_MONOTONIC time (in ns) at which the last key frame went "
+                                                      "through, 0 if none did yet",
+                                                      0,
+                                                      G_MAXUINT64,
+                                                      0,
+                                                      G_PARAM_READABLE));
+
+  g_object_class_install_property(
+      gobject_class,
+      PROP_INTRA_REFRESH,
+      g_param_spec_boolean("intra_refresh",
+                           "intra_refresh",
+                           "Set to TRUE when the encoder uses periodic intra refresh: P-frames will be marked as "
+                           "carrying intra refresh blocks",
+                           FALSE,
+                           G_PARAM_READWRITE));
+
   gobject_class->dispose = gst_rtp_moonlight_pay_video_dispose;
   gobject_class->finalize = gst_rtp_moonlight_pay_video_finalize;
 
   base_transform_class->generate_output = GST_DEBUG_FUNCPTR(gst_rtp_moonlight_pay_video_generate_output);
+  base_transform_class->sink_event = GST_DEBUG_FUNCPTR(gst_rtp_moonlight_pay_video_sink_event);
 }
 
 static void gst_rtp_moonlight_pay_video_init(gst_rtp_moonlight_pay_video *rtpmoonlightpay_video) {
@@ -147,9 +253,29 @@ static void gst_rtp_moonlight_pay_video_init(gst_rtp_moonlight_pay_video *rtpmoo
 
   rtpmoonlightpay_video->fec_percentage = 20;
   rtpmoonlightpay_video->min_required_fec_packets = 2;
+  rtpmoonlightpay_video->fec_settings_changed = false;
+  rtpmoonlightpay_video->next_fec_percentage = rtpmoonlightpay_video->fec_percentage;
+  rtpmoonlightpay_video->next_min_required_fec_packets = rtpmoonlightpay_video->min_required_fec_packets;
+  rtpmoonlightpay_video->fec_workers = 2;
+  rtpmoonlightpay_video->interleave_fec_blocks = false;
+  std::fill(std::begin(rtpmoonlightpay_video->fec_layouts), std::end(rtpmoonlightpay_video->fec_layouts), 0);
+  rtpmoonlightpay_video->intra_refresh = false;
+  rtpmoonlightpay_video->recovery_key_unit = 0;
+  rtpmoonlightpay_video->ref_frames_invalidated = false;
+  rtpmoonlightpay_video->last_key_frame_ns = 0;
 
   rtpmoonlightpay_video->cur_seq_number = 0;
   rtpmoonlightpay_video->frame_num = 0;
+
+  rtpmoonlightpay_video->packets_pool = nullptr;
+  rtpmoonlightpay_video->packets_slab_size = 0;
+
+  rtpmoonlightpay_video->slices_per_frame = 1;
+  rtpmoonlightpay_video->pending_slices = nullptr;
+  rtpmoonlightpay_video->pending_slices_count = 0;
+  rtpmoonlightpay_video->frame_blocks_sent = 0;
+  rtpmoonlightpay_video->frame_pts = GST_CLOCK_TIME_NONE;
+  rtpmoonlightpay_video->frame_encoder_done_ns = 0;
 }
 
 void gst_rtp_moonlight_pay_video_set_property(GObject *object,
@@ -160,6 +286,8 @@ void gst_rtp_moonlight_pay_video_set_property(GObject *object,
 
   GST_DEBUG_OBJECT(rtpmoonlightpay_video, "set_property");
 
+  /* Properties can be changed while streaming, see apply_fec_settings() */
+  GST_OBJECT_LOCK(rtpmoonlightpay_video);
   switch (property_id) {
   case PROP_PAYLOAD_SIZE:
     rtpmoonlightpay_video->payload_size = g_value_get_int(value);
@@ -168,15 +296,33 @@ void gst_rtp_moonlight_pay_video_set_property(GObject *object,
     rtpmoonlightpay_video->add_padding = g_value_get_boolean(value);
     break;
   case PROP_FEC_PERCENTAGE:
-    rtpmoonlightpay_video->fec_percentage = g_value_get_int(value);
+    rtpmoonlightpay_video->next_fec_percentage = g_value_get_int(value);
+    rtpmoonlightpay_video->fec_settings_changed = true;
     break;
   case PROP_MIN_REQUIRED_FEC_PACKETS:
-    rtpmoonlightpay_video->min_required_fec_packets = g_value_get_int(value);
+    rtpmoonlightpay_video->next_min_required_fec_packets = g_value_get_int(value);
+    rtpmoonlightpay_video->fec_settings_changed = true;
+    break;
+  case PROP_FEC_WORKERS:
+    rtpmoonlightpay_video->fec_workers = g_value_get_int(value);
+    break;
+  case PROP_SLICES_PER_FRAME:
+    rtpmoonlightpay_video->slices_per_frame = g_value_get_int(value);
+    break;
+  case PROP_INTERLEAVE_FEC_BLOCKS:
+    rtpmoonlightpay_video->interleave_fec_blocks = g_value_get_boolean(value);
+    break;
+  case PROP_RECOVERY_KEY_UNIT:
+    rtpmoonlightpay_video->recovery_key_unit = g_value_get_uint(value);
+    break;
+  case PROP_INTRA_REFRESH:
+    rtpmoonlightpay_video->intra_refresh = g_value_get_boolean(value);
     break;
   default:
     G_OBJECT_WARN_INVALID_PROPERTY_ID(object, property_id, pspec);
     break;
   }
+  GST_OBJECT_UNLOCK(rtpmoonlightpay_video);
 }
 
 void gst_rtp_moonlight_pay_video_get_property(GObject *object, guint property_id, GValue *value, GParamSpec *pspec) {
@@ -184,6 +330,7 @@ void gst_rtp_moonlight_pay_video_get_property(GObject *object, guint property_id
 
   GST_DEBUG_OBJECT(rtpmoonlightpay_video, "get_property");
 
+  GST_OBJECT_LOCK(rtpmoonlightpay_video);
   switch (property_id) {
   case PROP_PAYLOAD_SIZE:
     g_value_set_int(value, rtpmoonlightpay_video->payload_size);
@@ -192,15 +339,38 @@ void gst_rtp_moonlight_pay_video_get_property(GObject *object, guint property_id
     g_value_set_boolean(value, rtpmoonlightpay_video->add_padding);
     break;
   case PROP_FEC_PERCENTAGE:
-    g_value_set_int(value, rtpmoonlightpay_video->fec_percentage);
+    g_value_set_int(value,
+                    rtpmoonlightpay_video->fec_settings_changed ? rtpmoonlightpay_video->next_fec_percentage
+                                                                : rtpmoonlightpay_video->fec_percentage);
     break;
   case PROP_MIN_REQUIRED_FEC_PACKETS:
-    g_value_set_int(value, rtpmoonlightpay_video->min_required_fec_packets);
+    g_value_set_int(value,
+                    rtpmoonlightpay_video->fec_settings_changed ? rtpmoonlightpay_video->next_min_required_fec_packets
+                                                                : rtpmoonlightpay_video->min_required_fec_packets);
+    break;
+  case PROP_FEC_WORKERS:
+    g_value_set_int(value, rtpmoonlightpay_video->fec_workers);
+    break;
+  case PROP_SLICES_PER_FRAME:
+    g_value_set_int(value, rtpmoonlightpay_video->slices_per_frame);
+    break;
+  case PROP_INTERLEAVE_FEC_BLOCKS:
+    g_value_set_boolean(value, rtpmoonlightpay_video->interleave_fec_blocks);
+    break;
+  case PROP_RECOVERY_KEY_UNIT:
+    g_value_set_uint(value, rtpmoonlightpay_video->recovery_key_unit);
+    break;
+  case PROP_LAST_KEY_FRAME_NS:
+    g_value_set_uint64(value, rtpmoonlightpay_video->last_key_frame_ns);
+    break;
+  case PROP_INTRA_REFRESH:
+    g_value_set_boolean(value, rtpmoonlightpay_video->intra_refresh);
     break;
   default:
     G_OBJECT_WARN_INVALID_PROPERTY_ID(object, property_id, pspec);
     break;
   }
+  GST_OBJECT_UNLOCK(rtpmoonlightpay_video);
 }
 
 void gst_rtp_moonlight_pay_video_dispose(GObject *object) {
@@ -209,6 +379,17 @@ void gst_rtp_moonlight_pay_video_dispose(GObject *object) {
   GST_DEBUG_OBJECT(rtpmoonlightpay_video, "dispose");
 
   /* clean up as possible.  may be called multiple times */
+  gst_moonlight_video::release_packets_pool(*rtpmoonlightpay_video);
+  if (rtpmoonlightpay_video->pending_slices != nullptr) {
+    gst_buffer_unref(rtpmoonlightpay_video->pending_slices);
+    rtpmoonlightpay_video->pending_slices = nullptr;
+  }
+  if (rtpmoonlightpay_video->frame_num > 0) {
+    logs::log(logs::debug,
+              "[GSTREAMER] Video FEC layouts over {} frames, by number of blocks: {}",
+              rtpmoonlightpay_video->frame_num,
+              fmt::join(rtpmoonlightpay_video->fec_layouts, ", "));
+  }
 
   G_OBJECT_CLASS(gst_rtp_moonlight_pay_video_parent_class)->dispose(object);
 }
@@ -239,10 +420,19 @@ static GstFlowReturn gst_rtp_moonlight_pay_video_generate_output(GstBaseTransfor
   if (inbuf == nullptr)
     return GST_FLOW_OK;
 
-  auto rtp_packets = gst_moonlight_video::split_into_rtp(rtpmoonlightpay_video, inbuf);
+  // A frame that started in slice mode has to end in slice mode, whatever the new FEC settings are
+  bool in_progress = gst_moonlight_video::frame_in_progress(*rtpmoonlightpay_video);
+  if (!in_progress) {
+    gst_moonlight_video::apply_fec_settings(*rtpmoonlightpay_video);
+  }
+  auto rtp_packets = in_progress || gst_moonlight_video::is_slice_mode(*rtpmoonlightpay_video)
+                         ? gst_moonlight_video::split_slice_into_rtp(rtpmoonlightpay_video, inbuf)
+                         : gst_moonlight_video::split_into_rtp(rtpmoonlightpay_video, inbuf);
 
-  /* Send the generated packets to any downstream listener */
-  gst_pad_push_list(trans->srcpad, rtp_packets);
+  /* Send the generated packets to any downstream listener, in slice mode we might still be waiting for more data */
+  if (rtp_packets != nullptr) {
+    gst_pad_push_list(trans->srcpad, rtp_packets);
+  }
 
   gst_buffer_unref(inbuf);
 
@@ -251,6 +441,16 @@ static GstFlowReturn gst_rtp_moonlight_pay_video_generate_output(GstBaseTransfor
   return GST_BASE_TRANSFORM_FLOW_DROPPED;
 }
 
+/**
+ * The encoder pushes a downstream GstForceKeyUnit event right before the frame that answers a forced key unit
+ */
+static gboolean gst_rtp_moonlight_pay_video_sink_event(GstBaseTransform *trans, GstEvent *event) {
+  if (GST_EVENT_TYPE(event) == GST_EVENT_CUSTOM_DOWNSTREAM && gst_event_has_name(event, "GstForceKeyUnit")) {
+    gst_moonlight_video::on_force_key_unit(*gst_rtp_moonlight_pay_video(trans), gst_event_get_structure(event));
+  }
+  return GST_BASE_TRANSFORM_CLASS(gst_rtp_moonlight_pay_video_parent_class)->sink_event(trans, event);
+}
+
 static gboolean plugin_init(GstPlugin *plugin) {
   return gst_element_register(plugin, "rtpmoonlightpay_video", GST_RANK_PRIMARY, gst_TYPE_rtp_moonlight_pay_video);
 }
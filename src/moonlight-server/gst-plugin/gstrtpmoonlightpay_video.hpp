@@ -13,6 +13,11 @@ G_BEGIN_DECLS
 #define gst_IS_rtp_moonlight_pay_video(obj) (G_TYPE_CHECK_INSTANCE_TYPE((obj), gst_TYPE_rtp_moonlight_pay_video))
 #define gst_IS_rtp_moonlight_pay_video_CLASS(obj) (G_TYPE_CHECK_CLASS_TYPE((klass), gst_TYPE_rtp_moonlight_pay_video))
 
+/**
+ * Moonlight encodes the FEC block index (and the last block index) using 2 bits
+ */
+#define MAX_FEC_BLOCKS 4
+
 typedef struct _gst_rtp_moonlight_pay_video gst_rtp_moonlight_pay_video;
 typedef struct _gst_rtp_moonlight_pay_videoClass gst_rtp_moonlight_pay_videoClass;
 
@@ -22,11 +27,43 @@ struct _gst_rtp_moonlight_pay_video {
   int payload_size;
   bool add_padding;
 
+  /* FEC settings of the frame that is being streamed, only ever changed by the streaming thread */
   int fec_percentage;
   int min_required_fec_packets;
+  /* Set through the properties (under the object lock), picked up at the start of the next frame */
+  bool fec_settings_changed;
+  int next_fec_percentage;
+  int next_min_required_fec_packets;
+  int fec_workers;
+  /* If true the shards of multi block frames are interleaved on the wire, see fec_send_order() */
+  bool interleave_fec_blocks;
+  /* How many frames have been split in N FEC blocks, index 0 counts frames sent without FEC */
+  guint64 fec_layouts[MAX_FEC_BLOCKS + 1];
+
+  /* If true P-frames are marked as carrying intra refresh blocks */
+  bool intra_refresh;
+  /* Count of the forced key unit that recovers from a reference frame invalidation, 0 if none is on its way */
+  guint recovery_key_unit;
+  /* If true the next P-frame is marked as the first one after a reference frame invalidation, see on_force_key_unit() */
+  bool ref_frames_invalidated;
+  /* CLOCK_MONOTONIC time at which the last key frame went through, 0 if none did yet */
+  guint64 last_key_frame_ns;
 
   u_int32_t cur_seq_number;
   u_int32_t frame_num;
+
+  /* The RTP packets of each frame are carved out of a single slab from this pool */
+  GstBufferPool *packets_pool;
+  gsize packets_slab_size;
+
+  /* When > 1 every input buffer is a slice (or any other NAL) and frames end on GST_BUFFER_FLAG_MARKER */
+  int slices_per_frame;
+  /* Slice mode: state of the frame that is being streamed */
+  GstBuffer *pending_slices;
+  int pending_slices_count;
+  int frame_blocks_sent;
+  GstClockTime frame_pts;
+  guint64 frame_encoder_done_ns;
 };
 
 struct _gst_rtp_moonlight_pay_videoClass {
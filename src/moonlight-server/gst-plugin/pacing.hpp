@@ -0,0 +1,199 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <gst-plugin/gstmoonlightudpsink.hpp>
+#include <gst-plugin/udp.hpp>
+#include <gst-plugin/utils.hpp>
+#include <gst/gst.h>
+#include <helpers/logger.hpp>
+#include <mutex>
+#include <sys/prctl.h>
+#include <thread>
+#include <time.h>
+
+namespace gst_moonlight_udp {
+
+/**
+ * Sleeping for less than this is not reliable (and wakes up the CPU for nothing):
+ * when the gap between packets would be shorter we send small bursts instead of single packets.
+ */
+constexpr guint64 MIN_PACING_INTERVAL_NS = 50 * 1000;
+
+/**
+ * Frames are handed over by the streaming thread and sent by a dedicated thread that sleeps on
+ * CLOCK_MONOTONIC (with the minimum timer slack) between bursts.
+ */
+struct Pacer {
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::deque<GstBufferList *> frames;
+  std::atomic<std::size_t> queued = 0;
+  std::atomic<bool> stopping = false;
+  std::thread thread;
+};
+
+static void sleep_until_ns(guint64 deadline_ns) {
+  timespec ts = {.tv_sec = (time_t)(deadline_ns / GST_SECOND), .tv_nsec = (long)(deadline_ns % GST_SECOND)};
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr) == EINTR) {
+  }
+}
+
+/**
+ * @return the time window (in ns) over which the packets of a single frame will be spread
+ */
+static guint64 pacing_window_ns(const gst_moonlight_udp_sink &sink) {
+  if (sink.pacing <= 0 || sink.refresh_rate <= 0) {
+    return 0;
+  }
+  return (guint64)(sink.pacing * GST_SECOND / sink.refresh_rate);
+}
+
+static void record_pacing_gap(gst_moonlight_udp_sink &sink, guint64 gap_ns) {
+  sink.pacing_gaps++;
+  sink.pacing_gap_sum_ns += gap_ns;
+  sink.pacing_gap_min_ns = std::min(sink.pacing_gap_min_ns, gap_ns);
+  sink.pacing_gap_max_ns = std::max(sink.pacing_gap_max_ns, gap_ns);
+}
+
+/**
+ * How the packets of a single frame are spread over the pacing window
+ */
+struct PacingSchedule {
+  guint64 window_ns;
+  guint nr_packets;
+  /* How many packets are sent back to back, gaps shorter than MIN_PACING_INTERVAL_NS are merged into bursts */
+  guint burst_size;
+
+  /**
+   * @return the offset (in ns) from the start of the frame at which the packet at index `first` should be sent
+   */
+  guint64 send_offset_ns(guint first) const {
+    return nr_packets > 0 ? window_ns * first / nr_packets : 0;
+  }
+};
+
+static PacingSchedule pacing_schedule(guint64 window_ns, guint nr_packets) {
+  auto packet_gap_ns = nr_packets > 0 ? window_ns / nr_packets : 0;
+  guint burst_size = packet_gap_ns >= MIN_PACING_INTERVAL_NS
+                         ? 1
+                         : (guint)((MIN_PACING_INTERVAL_NS + packet_gap_ns - 1) / std::max<guint64>(packet_gap_ns, 1));
+  return {.window_ns = window_ns, .nr_packets = nr_packets, .burst_size = burst_size};
+}
+
+/**
+ * Sends the packets of a frame evenly spread over the pacing window.
+ * If the next frame is already waiting (or we are stopping) whatever is left is sent straight away:
+ * we never want to add more latency than a frame interval.
+ */
+static void pace_frame(gst_moonlight_udp_sink &sink, Pacer &pacer, GstBufferList *frame) {
+  auto nr_packets = gst_buffer_list_length(frame);
+  if (nr_packets == 0) {
+    return;
+  }
+
+  auto schedule = pacing_schedule(pacing_window_ns(sink), nr_packets);
+  auto burst_size = schedule.burst_size;
+
+  auto frame_start = monotonic_now_ns();
+  guint64 last_send = 0;
+  guint last_burst_size = 0;
+  for (guint first = 0; first < nr_packets; first += burst_size) {
+    if (pacer.queued.load() > 0 || pacer.stopping.load()) {
+      send_packets(sink, frame, first);
+      sink.flushed_frames++;
+      return;
+    }
+
+    if (first > 0) {
+      sleep_until_ns(frame_start + schedule.send_offset_ns(first));
+    }
+
+    auto now = monotonic_now_ns();
+    if (last_send > 0) {
+      record_pacing_gap(sink, (now - last_send) / last_burst_size);
+    }
+    last_send = now;
+    last_burst_size = std::min(burst_size, nr_packets - first);
+
+    send_packets(sink, frame, first, first + burst_size);
+  }
+  sink.paced_frames++;
+}
+
+static void queue_frame(gst_moonlight_udp_sink &sink, GstBufferList *frame) {
+  auto &pacer = *sink.pacer;
+  {
+    std::lock_guard<std::mutex> lock(pacer.mutex);
+    pacer.frames.push_back(gst_buffer_list_ref(frame));
+    pacer.queued++;
+  }
+  pacer.cv.notify_one();
+}
+
+static void start_pacer(gst_moonlight_udp_sink &sink) {
+  sink.pacer = new Pacer();
+  sink.pacing_gap_min_ns = G_MAXUINT64;
+  sink.pacer->thread = std::thread([&sink, &pacer = *sink.pacer]() {
+    prctl(PR_SET_TIMERSLACK, 1); // Default slack is 50us, way too coarse for the gaps we are after
+    while (true) {
+      GstBufferList *frame;
+      {
+        std::unique_lock<std::mutex> lock(pacer.mutex);
+        pacer.cv.wait(lock, [&pacer]() { return !pacer.frames.empty() || pacer.stopping; });
+        if (pacer.frames.empty()) {
+          return;
+        }
+        frame = pacer.frames.front();
+        pacer.frames.pop_front();
+        pacer.queued--;
+      }
+
+      if (pacer.stopping) {
+        send_packets(sink, frame);
+      } else {
+        pace_frame(sink, pacer, frame);
+      }
+      gst_buffer_list_unref(frame);
+    }
+  });
+
+  logs::log(logs::debug,
+            "[GSTREAMER] moonlightudpsink pacing frames over {:.2f}ms",
+            (double)pacing_window_ns(sink) / GST_MSECOND);
+}
+
+/**
+ * Sends any frame left in the queue and waits for the pacing thread to exit
+ */
+static void stop_pacer(gst_moonlight_udp_sink &sink) {
+  if (sink.pacer == nullptr) {
+    return;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(sink.pacer->mutex);
+    sink.pacer->stopping = true;
+  }
+  sink.pacer->cv.notify_one();
+  sink.pacer->thread.join();
+
+  if (sink.pacing_gaps > 0) {
+    logs::log(logs::debug,
+              "[GSTREAMER] moonlightudpsink paced {} frames ({} flushed early), target gap {}us, "
+              "achieved gap avg {}us min {}us max {}us",
+              sink.paced_frames,
+              sink.flushed_frames,
+              pacing_window_ns(sink) / GST_USECOND /
+                  std::max<guint64>(1, sink.packets_sent / (sink.paced_frames + sink.flushed_frames)),
+              sink.pacing_gap_sum_ns / sink.pacing_gaps / GST_USECOND,
+              sink.pacing_gap_min_ns / GST_USECOND,
+              sink.pacing_gap_max_ns / GST_USECOND);
+  }
+
+  delete sink.pacer;
+  sink.pacer = nullptr;
+}
+
+} // namespace gst_moonlight_udp
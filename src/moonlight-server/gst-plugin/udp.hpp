@@ -0,0 +1,304 @@
+#pragma once
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <gst-plugin/gstmoonlightudpsink.hpp>
+#include <gst-plugin/utils.hpp>
+#include <gst/gst.h>
+#include <helpers/logger.hpp>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/udp.h>
+#include <linux/sockios.h>
+#include <string>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <vector>
+
+#ifndef SOL_UDP
+#define SOL_UDP 17
+#endif
+
+#ifndef UDP_SEGMENT // Only defined by recent libc headers, the kernel supports it since 4.18
+#define UDP_SEGMENT 103
+#endif
+
+namespace gst_moonlight_udp {
+
+/**
+ * The kernel will refuse to split a single send in more than this amount of segments
+ */
+constexpr std::size_t MAX_GSO_SEGMENTS = 64;
+
+/**
+ * The whole GSO send has to fit in a single (max size) IP datagram
+ */
+constexpr std::size_t MAX_GSO_SIZE = 65000;
+
+/**
+ * Max number of messages that sendmmsg() will accept in a single call
+ */
+constexpr std::size_t MAX_MMSG_BATCH = 1024;
+
+/**
+ * Sets DSCP (IP_TOS / IPV6_TCLASS) and SO_PRIORITY on the socket.
+ * Failures are not fatal: packets will just be sent with the default priority.
+ */
+static void set_socket_priority(const gst_moonlight_udp_sink &sink, int family) {
+  if (sink.dscp >= 0) {
+    int tos = sink.dscp << 2;
+    int res = family == AF_INET6 ? setsockopt(sink.socket_fd, IPPROTO_IPV6, IPV6_TCLASS, &tos, sizeof(tos))
+                                 : setsockopt(sink.socket_fd, IPPROTO_IP, IP_TOS, &tos, sizeof(tos));
+    if (res < 0) {
+      logs::log(logs::warning, "[GSTREAMER] Unable to set DSCP {} on UDP socket: {}", sink.dscp, strerror(errno));
+    }
+  }
+
+  if (sink.priority >= 0) {
+    if (setsockopt(sink.socket_fd, SOL_SOCKET, SO_PRIORITY, &sink.priority, sizeof(sink.priority)) < 0) {
+      logs::log(logs::warning,
+                "[GSTREAMER] Unable to set SO_PRIORITY {} on UDP socket: {}",
+                sink.priority,
+                strerror(errno));
+    }
+  }
+}
+
+/**
+ * Setting UDP_SEGMENT to 0 on the socket is a no-op, it'll only fail on kernels that don't support GSO
+ */
+static bool probe_gso(int socket_fd) {
+  int segment_size = 0;
+  return setsockopt(socket_fd, SOL_UDP, UDP_SEGMENT, &segment_size, sizeof(segment_size)) == 0;
+}
+
+/**
+ * Resolves the destination, creates the socket and binds it to bind_port (if set)
+ *
+ * @return false if the socket can't be created
+ */
+static bool open_socket(gst_moonlight_udp_sink &sink) {
+  if (sink.host == nullptr) {
+    logs::log(logs::error, "[GSTREAMER] moonlightudpsink: host is not set");
+    return false;
+  }
+
+  addrinfo hints = {};
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_DGRAM;
+  addrinfo *result = nullptr;
+  auto port = std::to_string(sink.port);
+  if (auto err = getaddrinfo(sink.host, port.c_str(), &hints, &result); err != 0) {
+    logs::log(logs::error, "[GSTREAMER] Unable to resolve {}: {}", sink.host, gai_strerror(err));
+    return false;
+  }
+  std::memcpy(&sink.destination, result->ai_addr, result->ai_addrlen);
+  sink.destination_len = result->ai_addrlen;
+  auto family = result->ai_family;
+  freeaddrinfo(result);
+
+  sink.socket_fd = socket(family, SOCK_DGRAM | SOCK_CLOEXEC, IPPROTO_UDP);
+  if (sink.socket_fd < 0) {
+    logs::log(logs::error, "[GSTREAMER] Unable to create UDP socket: {}", strerror(errno));
+    return false;
+  }
+
+  // The RTP ping server is bound to the same port, see rtp::UDP_Server
+  int reuse = 1;
+  setsockopt(sink.socket_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+  if (sink.bind_port > 0) {
+    sockaddr_storage local = {};
+    socklen_t local_len;
+    if (family == AF_INET6) {
+      auto addr = (sockaddr_in6 *)&local;
+      addr->sin6_family = AF_INET6;
+      addr->sin6_addr = in6addr_any;
+      addr->sin6_port = htons(sink.bind_port);
+      local_len = sizeof(sockaddr_in6);
+    } else {
+      auto addr = (sockaddr_in *)&local;
+      addr->sin_family = AF_INET;
+      addr->sin_addr.s_addr = htonl(INADDR_ANY);
+      addr->sin_port = htons(sink.bind_port);
+      local_len = sizeof(sockaddr_in);
+    }
+
+    if (bind(sink.socket_fd, (sockaddr *)&local, local_len) < 0) {
+      logs::log(logs::error, "[GSTREAMER] Unable to bind UDP socket to port {}: {}", sink.bind_port, strerror(errno));
+      close(sink.socket_fd);
+      sink.socket_fd = -1;
+      return false;
+    }
+  }
+
+  set_socket_priority(sink, family);
+
+  sink.gso_supported = sink.gso && probe_gso(sink.socket_fd);
+  logs::log(logs::debug,
+            "[GSTREAMER] moonlightudpsink sending to {}:{}, GSO: {}",
+            sink.host,
+            sink.port,
+            sink.gso_supported);
+  return true;
+}
+
+/**
+ * @return the bytes waiting in the socket send queue, not yet handed over to the network card
+ */
+static guint64 socket_queued_bytes(const gst_moonlight_udp_sink &sink) {
+  int queued = 0;
+  if (sink.socket_fd < 0 || ioctl(sink.socket_fd, SIOCOUTQ, &queued) < 0) {
+    return 0;
+  }
+  return (guint64)queued;
+}
+
+static void close_socket(gst_moonlight_udp_sink &sink) {
+  if (sink.socket_fd >= 0) {
+    close(sink.socket_fd);
+    sink.socket_fd = -1;
+  }
+}
+
+union GSOControl {
+  char buf[CMSG_SPACE(sizeof(uint16_t))];
+  cmsghdr align;
+};
+
+struct UDPBatch {
+  std::vector<mmsghdr> msgs;
+  /* For each message the index of the first packet that it contains */
+  std::vector<std::size_t> first_packet;
+  std::vector<GSOControl> controls;
+};
+
+/**
+ * Groups packets into messages starting from first_packet.
+ *
+ * With GSO consecutive packets of the same size are sent as a single message that the kernel will split in
+ * segments; only the last segment of a message is allowed to be shorter.
+ * Without GSO each packet is a message on its own.
+ */
+static void build_batch(gst_moonlight_udp_sink &sink,
+                        std::vector<iovec> &packets,
+                        std::size_t first_packet,
+                        bool use_gso,
+                        UDPBatch &batch) {
+  batch.msgs.clear();
+  batch.first_packet.clear();
+  batch.controls.clear();
+  batch.controls.reserve(packets.size()); // pointers to controls will be stored in msgs, avoid reallocations
+
+  for (auto idx = first_packet; idx < packets.size();) {
+    auto segment_size = packets[idx].iov_len;
+    auto end = idx + 1;
+    if (use_gso) {
+      auto total_size = segment_size;
+      while (end < packets.size() && end - idx < MAX_GSO_SEGMENTS && packets[end].iov_len <= segment_size &&
+             total_size + packets[end].iov_len <= MAX_GSO_SIZE) {
+        total_size += packets[end].iov_len;
+        end++;
+        if (packets[end - 1].iov_len < segment_size) {
+          break;
+        }
+      }
+    }
+
+    mmsghdr msg = {};
+    msg.msg_hdr.msg_name = &sink.destination;
+    msg.msg_hdr.msg_namelen = sink.destination_len;
+    msg.msg_hdr.msg_iov = &packets[idx];
+    msg.msg_hdr.msg_iovlen = end - idx;
+
+    if (end - idx > 1) {
+      auto &control = batch.controls.emplace_back();
+      std::memset(&control, 0, sizeof(control));
+      msg.msg_hdr.msg_control = control.buf;
+      msg.msg_hdr.msg_controllen = sizeof(control.buf);
+
+      auto cmsg = CMSG_FIRSTHDR(&msg.msg_hdr);
+      cmsg->cmsg_level = SOL_UDP;
+      cmsg->cmsg_type = UDP_SEGMENT;
+      cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+      uint16_t gso_size = segment_size;
+      std::memcpy(CMSG_DATA(cmsg), &gso_size, sizeof(gso_size));
+    }
+
+    batch.msgs.push_back(msg);
+    batch.first_packet.push_back(idx);
+    idx = end;
+  }
+}
+
+/**
+ * Sends the packets in [first, last) of the list, in order, using as few syscalls as possible.
+ *
+ * If the kernel (or the network device) refuses a GSO send, GSO will be disabled for this sink and the
+ * remaining packets will be sent one message per packet.
+ * Network errors are counted and logged but will not stop the pipeline, same as udpsink does.
+ */
+static GstFlowReturn
+send_packets(gst_moonlight_udp_sink &sink, GstBufferList *buffers, guint first = 0, guint last = G_MAXUINT) {
+  last = std::min(last, gst_buffer_list_length(buffers));
+  auto nr_packets = last > first ? last - first : 0;
+  std::vector<GstMapInfo> maps(nr_packets);
+  std::vector<iovec> packets(nr_packets);
+  for (guint idx = 0; idx < nr_packets; idx++) {
+    gst_buffer_map(gst_buffer_list_get(buffers, first + idx), &maps[idx], GST_MAP_READ);
+    packets[idx] = {.iov_base = maps[idx].data, .iov_len = maps[idx].size};
+  }
+
+  UDPBatch batch;
+  build_batch(sink, packets, 0, sink.gso_supported, batch);
+
+  std::size_t sent = 0;
+  while (sent < batch.msgs.size()) {
+    auto to_send = std::min(batch.msgs.size() - sent, MAX_MMSG_BATCH);
+    auto res = sendmmsg(sink.socket_fd, &batch.msgs[sent], to_send, 0);
+    sink.send_calls++;
+
+    if (res >= 0) {
+      sent += res;
+      continue;
+    }
+
+    if (errno == EINTR) {
+      continue;
+    }
+
+    if (batch.msgs[sent].msg_hdr.msg_control != nullptr && (errno == EIO || errno == EINVAL || errno == EOPNOTSUPP)) {
+      logs::log(logs::warning, "[GSTREAMER] UDP GSO send failed ({}), falling back to sendmmsg", strerror(errno));
+      sink.gso_supported = false;
+      build_batch(sink, packets, batch.first_packet[sent], false, batch);
+      sent = 0;
+      continue;
+    }
+
+    // Skip the message that failed (ex: ECONNREFUSED when the client went away) and keep going
+    sink.send_errors++;
+    logs::log(logs::trace, "[GSTREAMER] Error sending UDP packet: {}", strerror(errno));
+    sent++;
+  }
+
+  for (guint idx = 0; idx < nr_packets; idx++) {
+    gst_buffer_unmap(gst_buffer_list_get(buffers, first + idx), &maps[idx]);
+  }
+  sink.packets_sent += nr_packets;
+
+  if (first == 0 && nr_packets > 0) {
+    if (auto encoder_done = gst_buffer_get_encoder_done(gst_buffer_list_get(buffers, 0))) {
+      auto latency = monotonic_now_ns() - *encoder_done;
+      sink.latency_frames++;
+      sink.latency_sum_ns += latency;
+      sink.latency_max_ns = std::max(sink.latency_max_ns, latency);
+    }
+  }
+
+  return GST_FLOW_OK;
+}
+
+} // namespace gst_moonlight_udp
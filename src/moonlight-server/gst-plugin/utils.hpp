@@ -7,6 +7,8 @@
 #include <gst/base/gstbasetransform.h>
 #include <gst/gst.h>
 #include <moonlight/fec.hpp>
+#include <optional>
+#include <time.h>
 #include <vector>
 
 static void gst_buffer_copy_into(GstBuffer *buf, unsigned char *destination) {
@@ -105,6 +107,37 @@ static void gst_copy_timestamps(GstBuffer *src, GstBuffer *dest) {
   dest->offset_end = src->offset_end;
 }
 
+static guint64 monotonic_now_ns() {
+  timespec ts = {};
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (guint64)ts.tv_sec * GST_SECOND + ts.tv_nsec;
+}
+
+/**
+ * The payloader marks the first packet of each frame with the (CLOCK_MONOTONIC) time at which the encoder output
+ * reached it, so that the sink can measure how long it took to get the first packet of a frame on the wire.
+ */
+static GstCaps *encoder_done_caps() {
+  static GstStaticCaps caps = GST_STATIC_CAPS("timestamp/x-wolf-encoder-done");
+  return gst_static_caps_get(&caps);
+}
+
+static void gst_buffer_set_encoder_done(GstBuffer *buf, guint64 timestamp_ns) {
+  auto caps = encoder_done_caps();
+  gst_buffer_add_reference_timestamp_meta(buf, caps, timestamp_ns, GST_CLOCK_TIME_NONE);
+  gst_caps_unref(caps);
+}
+
+static std::optional<guint64> gst_buffer_get_encoder_done(GstBuffer *buf) {
+  auto caps = encoder_done_caps();
+  auto meta = gst_buffer_get_reference_timestamp_meta(buf, caps);
+  gst_caps_unref(caps);
+  if (meta == nullptr) {
+    return std::nullopt;
+  }
+  return meta->timestamp;
+}
+
 /**
  * Derives the proper IV following Moonlight implementation
  */
@@ -1,10 +1,20 @@
 #pragma once
+#include <algorithm>
+#include <boost/asio/post.hpp>
+#include <boost/asio/thread_pool.hpp>
 #include <boost/endian.hpp>
 #include <cmath>
+#include <cstring>
+#include <future>
 #include <gst-plugin/gstrtpmoonlightpay_video.hpp>
 #include <gst-plugin/utils.hpp>
 #include <helpers/logger.hpp>
+#include <map>
+#include <memory>
 #include <moonlight/data-structures.hpp>
+#include <mutex>
+#include <utility>
+#include <vector>
 
 namespace gst_moonlight_video {
 
@@ -35,33 +45,37 @@ struct VideoShortHeader {
 #pragma pack(pop)
 
 /**
- * Creates an RTP header and returns a GstBuffer to it
+ * Returns the RTP header fields that are shared between all the packets of the current frame
  */
-static GstBuffer *
-create_rtp_header(const gst_rtp_moonlight_pay_video &rtpmoonlightpay, int packet_nr, int tot_packets) {
-  constexpr auto rtp_header_size = sizeof(VideoRTPHeaders);
-  GstBuffer *buf = gst_buffer_new_and_fill(rtp_header_size, 0x00);
+static VideoRTPHeaders create_rtp_header_template(const gst_rtp_moonlight_pay_video &rtpmoonlightpay) {
+  VideoRTPHeaders packet = {};
 
-  /* get WRITE access to the memory */
-  GstMapInfo info;
-  gst_buffer_map(buf, &info, GST_MAP_WRITE);
+  packet.rtp.header = 0x80 | FLAG_EXTENSION;
+  packet.rtp.packetType = 0x00;
+  packet.rtp.timestamp = 0x00;
+  packet.rtp.ssrc = 0x00;
 
-  /* set RTP headers */
-  auto packet = (VideoRTPHeaders *)info.data;
+  packet.packet.frameIndex = rtpmoonlightpay.frame_num;
 
-  packet->rtp.header = 0x80 | FLAG_EXTENSION;
-  packet->rtp.packetType = 0x00;
-  packet->rtp.timestamp = 0x00;
-  packet->rtp.ssrc = 0x00;
+  packet.packet.multiFecFlags = 0x10;
+  packet.packet.multiFecBlocks = 0;
+
+  return packet;
+}
+
+/**
+ * Writes the RTP header for the packet_nr packet, starting from the frame template
+ */
+static void write_rtp_header(const gst_rtp_moonlight_pay_video &rtpmoonlightpay,
+                             const VideoRTPHeaders &header_template,
+                             VideoRTPHeaders *packet,
+                             int packet_nr,
+                             int tot_packets) {
+  *packet = header_template;
 
   uint32_t sequence_number = rtpmoonlightpay.cur_seq_number + packet_nr;
   packet->rtp.sequenceNumber = boost::endian::native_to_big((uint16_t)sequence_number);
-
-  packet->packet.frameIndex = rtpmoonlightpay.frame_num;
   packet->packet.streamPacketIndex = sequence_number << 8;
-
-  packet->packet.multiFecFlags = 0x10;
-  packet->packet.multiFecBlocks = 0;
   packet->packet.fecInfo = (packet_nr << 12 | tot_packets << 22 | 0 << 4);
 
   packet->packet.flags = FLAG_CONTAINS_PIC_DATA;
@@ -73,20 +87,81 @@ create_rtp_header(const gst_rtp_moonlight_pay_video &rtpmoonlightpay, int packet
   if (packet_nr == tot_packets - 1) {
     packet->packet.flags |= FLAG_EOF;
   }
+}
+
+/**
+ * Creates an RTP header and returns a GstBuffer to it
+ */
+static GstBuffer *
+create_rtp_header(const gst_rtp_moonlight_pay_video &rtpmoonlightpay, int packet_nr, int tot_packets) {
+  constexpr auto rtp_header_size = sizeof(VideoRTPHeaders);
+  GstBuffer *buf = gst_buffer_new_and_fill(rtp_header_size, 0x00);
+
+  /* get WRITE access to the memory */
+  GstMapInfo info;
+  gst_buffer_map(buf, &info, GST_MAP_WRITE);
+
+  /* set RTP headers */
+  write_rtp_header(rtpmoonlightpay,
+                   create_rtp_header_template(rtpmoonlightpay),
+                   (VideoRTPHeaders *)info.data,
+                   packet_nr,
+                   tot_packets);
 
   gst_buffer_unmap(buf, &info);
 
   return buf;
 }
 
-static GstBuffer *prepend_video_header(const gst_rtp_moonlight_pay_video &rtpmoonlightpay, GstBuffer *inbuf) {
+/**
+ * Called with the downstream GstForceKeyUnit event that the encoder pushes right before the frame that answers a
+ * forced key unit. If it's the one that has been asked to recover from a reference frame invalidation
+ * (see recovery_key_unit) the next frame is marked as such; any other frame keeps its usual type.
+ */
+static void on_force_key_unit(gst_rtp_moonlight_pay_video &rtpmoonlightpay, const GstStructure *event) {
+  guint count = 0;
+  if (!gst_structure_get_uint(event, "count", &count) || count == 0) {
+    return;
+  }
+
+  GST_OBJECT_LOCK(&rtpmoonlightpay);
+  if (count == rtpmoonlightpay.recovery_key_unit) {
+    rtpmoonlightpay.ref_frames_invalidated = true;
+    rtpmoonlightpay.recovery_key_unit = 0;
+  }
+  GST_OBJECT_UNLOCK(&rtpmoonlightpay);
+}
+
+/**
+ * Prepends the frame header to the payload.
+ * When whole_frame is false inbuf is only the first part of the frame: the final payload size is not known yet,
+ * last_payload_len is left to 0 so that the client will not trim the last packet.
+ */
+static GstBuffer *prepend_video_header(gst_rtp_moonlight_pay_video &rtpmoonlightpay,
+                                       GstBuffer *inbuf,
+                                       bool whole_frame = true) {
   constexpr auto video_payload_header_size = 8;
   auto in_buf_size = gst_buffer_get_size(inbuf);
   GstBuffer *video_header = gst_buffer_new_and_fill(video_payload_header_size, 0x00);
   bool is_key = !GST_BUFFER_FLAG_IS_SET(inbuf, GST_BUFFER_FLAG_DELTA_UNIT);
 
+  // intra_refresh, ref_frames_invalidated and last_key_frame_ns are shared with the properties and on_force_key_unit().
+  // Either way the client can resume decoding from here, read and clear ref_frames_invalidated in one go
+  GST_OBJECT_LOCK(&rtpmoonlightpay);
+  bool intra_refresh = rtpmoonlightpay.intra_refresh;
+  bool ref_frames_invalidated = std::exchange(rtpmoonlightpay.ref_frames_invalidated, false);
+  if (is_key) {
+    rtpmoonlightpay.last_key_frame_ns = monotonic_now_ns();
+  }
+  GST_OBJECT_UNLOCK(&rtpmoonlightpay);
+
+  uint8_t frame_type = intra_refresh ? 0x04 : 0x01;
   if (is_key) {
     logs::log(logs::trace, "[GStreamer] KEYFRAME!");
+    frame_type = 0x02;
+  } else if (ref_frames_invalidated) {
+    logs::log(logs::trace, "[GStreamer] First frame after reference frame invalidation");
+    frame_type = 0x05;
   }
 
   /* get WRITE access to the memory */
@@ -96,10 +171,12 @@ static GstBuffer *prepend_video_header(const gst_rtp_moonlight_pay_video &rtpmoo
   /* set headers */
   auto packet = (VideoShortHeader *)info.data;
   packet->header_type = 0x01;
-  packet->frame_type = is_key ? 0x02 : 0x01;
+  packet->frame_type = frame_type;
   packet->last_payload_len = (in_buf_size + video_payload_header_size) %
                              (rtpmoonlightpay.payload_size - sizeof(moonlight::NV_VIDEO_PACKET));
-  if (packet->last_payload_len == 0) {
+  if (!whole_frame) {
+    packet->last_payload_len = 0;
+  } else if (packet->last_payload_len == 0) {
     packet->last_payload_len = rtpmoonlightpay.payload_size - sizeof(moonlight::NV_VIDEO_PACKET);
   }
 
@@ -110,9 +187,10 @@ static GstBuffer *prepend_video_header(const gst_rtp_moonlight_pay_video &rtpmoo
 }
 
 /**
- * Split the input buffer into packets, will prepend the RTP header and append any padding if needed
+ * Split the input buffer into packets, allocating a new buffer for each RTP header and padding.
+ * This is the fallback for when the packets pool is not able to provide a slab.
  */
-static GstBufferList *generate_rtp_packets(const gst_rtp_moonlight_pay_video &rtpmoonlightpay, GstBuffer *inbuf) {
+static GstBufferList *allocate_rtp_packets(const gst_rtp_moonlight_pay_video &rtpmoonlightpay, GstBuffer *inbuf) {
   auto in_buf_size = gst_buffer_get_size(inbuf);
   auto payload_size = rtpmoonlightpay.payload_size - MAX_RTP_HEADER_SIZE;
   auto tot_packets = std::ceil((float)in_buf_size / payload_size);
@@ -140,13 +218,124 @@ static GstBufferList *generate_rtp_packets(const gst_rtp_moonlight_pay_video &rt
   return buffers;
 }
 
+/**
+ * Packets slabs will never be smaller than this, avoids re-creating the pool on the first few frames
+ */
+constexpr gsize PACKETS_SLAB_MIN_SIZE = 64 * 1024;
+
+/**
+ * Deactivates and drops the packets pool.
+ * Slabs that are still in use downstream hold a reference to the pool and will be freed once released.
+ */
+static void release_packets_pool(gst_rtp_moonlight_pay_video &rtpmoonlightpay) {
+  if (rtpmoonlightpay.packets_pool != nullptr) {
+    gst_buffer_pool_set_active(rtpmoonlightpay.packets_pool, FALSE);
+    gst_object_unref(rtpmoonlightpay.packets_pool);
+    rtpmoonlightpay.packets_pool = nullptr;
+    rtpmoonlightpay.packets_slab_size = 0;
+  }
+}
+
+/**
+ * Returns a slab of at least `size` bytes from the packets pool.
+ * When a frame doesn't fit, the pool is replaced with a new one that has (at least) twice the slab size.
+ *
+ * @return nullptr if the pool can't be configured or fails to provide a buffer
+ */
+static GstBuffer *acquire_packets_slab(gst_rtp_moonlight_pay_video &rtpmoonlightpay, gsize size) {
+  if (rtpmoonlightpay.packets_pool == nullptr || rtpmoonlightpay.packets_slab_size < size) {
+    auto slab_size = MAX(PACKETS_SLAB_MIN_SIZE, rtpmoonlightpay.packets_slab_size);
+    while (slab_size < size) {
+      slab_size *= 2;
+    }
+    release_packets_pool(rtpmoonlightpay);
+
+    GstBufferPool *pool = gst_buffer_pool_new();
+    GstStructure *config = gst_buffer_pool_get_config(pool);
+    gst_buffer_pool_config_set_params(config, nullptr, slab_size, 0, 0);
+    if (!gst_buffer_pool_set_config(pool, config) || !gst_buffer_pool_set_active(pool, TRUE)) {
+      gst_object_unref(pool);
+      return nullptr;
+    }
+
+    logs::log(logs::debug, "[GSTREAMER] Video packets pool, slab size: {} bytes", slab_size);
+    rtpmoonlightpay.packets_pool = pool;
+    rtpmoonlightpay.packets_slab_size = slab_size;
+  }
+
+  GstBuffer *slab = nullptr;
+  if (gst_buffer_pool_acquire_buffer(rtpmoonlightpay.packets_pool, &slab, nullptr) != GST_FLOW_OK) {
+    return nullptr;
+  }
+  return slab;
+}
+
+/**
+ * Split the input buffer into packets, will prepend the RTP header and append any padding if needed.
+ *
+ * All the packets of a frame are carved out of a single slab that comes from the element GstBufferPool:
+ * headers are written from a per frame template and the payload is copied only once.
+ * Each packet holds a reference to the slab, which goes back to the pool once the last packet has been released.
+ */
+static GstBufferList *generate_rtp_packets(gst_rtp_moonlight_pay_video &rtpmoonlightpay, GstBuffer *inbuf) {
+  constexpr auto rtp_header_size = sizeof(VideoRTPHeaders);
+  auto in_buf_size = gst_buffer_get_size(inbuf);
+  auto payload_size = rtpmoonlightpay.payload_size - MAX_RTP_HEADER_SIZE;
+  auto tot_packets = (int)std::ceil((float)in_buf_size / payload_size);
+  auto packet_size = rtp_header_size + payload_size;
+
+  GstBuffer *slab = acquire_packets_slab(rtpmoonlightpay, tot_packets * packet_size);
+  if (slab == nullptr) {
+    logs::log(logs::warning, "[GSTREAMER] Unable to get a slab from the packets pool, allocating each packet");
+    return allocate_rtp_packets(rtpmoonlightpay, inbuf);
+  }
+
+  GstMapInfo info;
+  gst_buffer_map(slab, &info, GST_MAP_WRITE);
+
+  auto header_template = create_rtp_header_template(rtpmoonlightpay);
+  GstBufferList *buffers = gst_buffer_list_new_sized(tot_packets);
+
+  for (int packet_nr = 0; packet_nr < tot_packets; packet_nr++) {
+    auto begin = packet_nr * payload_size;
+    auto remaining = in_buf_size - begin;
+    auto packet_payload_size = MIN(remaining, payload_size);
+    auto packet_data = info.data + (packet_nr * packet_size);
+
+    write_rtp_header(rtpmoonlightpay, header_template, (VideoRTPHeaders *)packet_data, packet_nr, tot_packets);
+    gst_buffer_extract(inbuf, begin, packet_data + rtp_header_size, packet_payload_size);
+
+    auto rtp_packet_size = rtp_header_size + packet_payload_size;
+    if ((remaining < payload_size) && rtpmoonlightpay.add_padding) {
+      std::memset(packet_data + rtp_packet_size, 0x00, payload_size - remaining);
+      rtp_packet_size = packet_size;
+    }
+
+    GstBuffer *rtp_packet = gst_buffer_new_wrapped_full((GstMemoryFlags)0,
+                                                        packet_data,
+                                                        rtp_packet_size,
+                                                        0,
+                                                        rtp_packet_size,
+                                                        gst_buffer_ref(slab),
+                                                        (GDestroyNotify)gst_buffer_unref);
+    gst_copy_timestamps(inbuf, rtp_packet);
+    gst_buffer_list_add(buffers, rtp_packet);
+  }
+
+  gst_buffer_unmap(slab, &info);
+  gst_buffer_unref(slab);
+
+  return buffers;
+}
+
 static void update_fec_info(const gst_rtp_moonlight_pay_video &rtpmoonlightpay,
                             VideoRTPHeaders *rtp_packet,
                             int shard_idx,
                             int data_shards,
                             int fec_percentage,
                             int block_index = 0,
-                            int last_block_index = 0) {
+                            int last_block_index = 0,
+                            int seq_offset = 0) {
   rtp_packet->packet.frameIndex = rtpmoonlightpay.frame_num;
 
   rtp_packet->packet.fecInfo = (shard_idx << 12 | data_shards << 22 | fec_percentage << 4);
@@ -154,7 +343,7 @@ static void update_fec_info(const gst_rtp_moonlight_pay_video &rtpmoonlightpay,
   rtp_packet->packet.multiFecFlags = 0x10;
 
   rtp_packet->rtp.header = 0x80 | FLAG_EXTENSION;
-  uint32_t sequence_number = rtpmoonlightpay.cur_seq_number + shard_idx;
+  uint32_t sequence_number = rtpmoonlightpay.cur_seq_number + seq_offset + shard_idx;
   rtp_packet->rtp.sequenceNumber = boost::endian::native_to_big((uint16_t)sequence_number);
 }
 
@@ -176,139 +365,316 @@ static BLOCKS determine_split(const gst_rtp_moonlight_pay_video &rtpmoonlightpay
     fec_percentage = (100 * parity_shards) / data_shards;
   }
 
+  // decrease the FEC percentage (but never under the min required packets) in order to fit in DATA_SHARDS_MAX
+  if (data_shards + parity_shards > DATA_SHARDS_MAX &&
+      DATA_SHARDS_MAX - data_shards >= rtpmoonlightpay.min_required_fec_packets) {
+    parity_shards = DATA_SHARDS_MAX - data_shards;
+    fec_percentage = (100 * parity_shards) / data_shards;
+  }
+
   return {.block_size = blocksize,
           .data_shards = data_shards,
           .parity_shards = parity_shards,
           .fec_percentage = fec_percentage};
 }
 
+struct FEC_PLAN {
+  /**
+   * How many FEC blocks the frame will be split into; 0 when the frame is too big to be protected
+   */
+  int nr_blocks;
+  /**
+   * All blocks will have this amount of data shards, except for the last one that might have less
+   */
+  int data_shards_per_block;
+  /**
+   * When a frame is sent in multiple chunks (see split_slice_into_rtp) these are the index of the first block of the
+   * chunk and the total number of blocks of the frame; by default the plan covers the whole frame.
+   */
+  int first_block = 0;
+  int frame_blocks = 0;
+};
+
 /**
- * Given the RTP packets that contains payload,
+ * Picks the smallest number of FEC blocks (up to MAX_FEC_BLOCKS) so that each block can be encoded with the
+ * requested fec_percentage without going over DATA_SHARDS_MAX.
+ * When not even MAX_FEC_BLOCKS are enough, determine_split() will lower the percentage of each block;
+ * only when a block can't fit the min required FEC packets the frame will be left unprotected.
+ */
+static FEC_PLAN plan_fec_blocks(const gst_rtp_moonlight_pay_video &rtpmoonlightpay, int data_shards) {
+  for (int nr_blocks = 1; nr_blocks <= MAX_FEC_BLOCKS; nr_blocks++) {
+    auto per_block = (data_shards + nr_blocks - 1) / nr_blocks;
+    auto requested_parity = MAX((per_block * rtpmoonlightpay.fec_percentage + 99) / 100,
+                                rtpmoonlightpay.min_required_fec_packets);
+    if (per_block + requested_parity <= DATA_SHARDS_MAX) {
+      return {.nr_blocks = (data_shards + per_block - 1) / per_block, .data_shards_per_block = per_block};
+    }
+  }
+
+  auto per_block = (data_shards + MAX_FEC_BLOCKS - 1) / MAX_FEC_BLOCKS;
+  if (per_block + rtpmoonlightpay.min_required_fec_packets <= DATA_SHARDS_MAX) {
+    return {.nr_blocks = MAX_FEC_BLOCKS, .data_shards_per_block = per_block};
+  }
+  return {.nr_blocks = 0, .data_shards_per_block = 0};
+}
+
+/**
+ * Given the RTP packets that contains payload (split as in blocks),
  * will generate extra RTP packets with the FEC information.
  *
- * Will modify the input rtp_packets with the correct FEC info
- * and will append the FEC packets at the end
+ * The block is made of the blocks.data_shards packets of rtp_packets starting at first_packet.
+ * Shards are read straight from the (read only) mapped memory of the data packets, only packets that are shorter than
+ * the block size (ex: the last one when padding is disabled) are copied into a zero padded block.
+ * Parity shards are encoded directly into the newly allocated FEC packets.
+ *
+ * Will modify the input rtp_packets with the correct FEC info and will return the FEC packets.
+ * Sequence numbers will start at cur_seq_number + seq_offset; rtpmoonlightpay is never modified so that
+ * multiple blocks of the same frame can be encoded concurrently.
  */
-static void generate_fec_packets(const gst_rtp_moonlight_pay_video &rtpmoonlightpay,
-                                 GstBufferList *rtp_packets,
-                                 GstBuffer *inbuf,
-                                 int block_index = 0,
-                                 int last_block_index = 0) {
-  GstMapInfo info;
-  GstBuffer *rtp_payload = gst_buffer_list_unfold(rtp_packets);
-
-  auto payload_size = (int)gst_buffer_get_size(rtp_payload);
-  auto blocks = determine_split(rtpmoonlightpay, gst_buffer_list_length(rtp_packets));
+static std::vector<GstBuffer *> generate_fec_packets(const gst_rtp_moonlight_pay_video &rtpmoonlightpay,
+                                                     GstBufferList *rtp_packets,
+                                                     int first_packet,
+                                                     GstBuffer *inbuf,
+                                                     const BLOCKS &blocks,
+                                                     int block_index,
+                                                     int last_block_index,
+                                                     int seq_offset) {
   const auto nr_shards = blocks.data_shards + blocks.parity_shards;
+  bool with_fec = nr_shards <= DATA_SHARDS_MAX;
+  std::vector<GstBuffer *> fec_packets;
 
-  if (nr_shards > DATA_SHARDS_MAX) {
+  if (!with_fec) {
     logs::log(logs::warning,
               "[GSTREAMER] Size of frame too large, {} packets is bigger than the max ({}); skipping FEC",
               nr_shards,
               DATA_SHARDS_MAX);
-    gst_buffer_unref(rtp_payload);
-    return;
-  }
+  } else {
+    std::vector<unsigned char *> ptr(nr_shards);
+    std::vector<GstMapInfo> data_infos(blocks.data_shards);
+    std::vector<unsigned char> padded_shard;
+
+    for (int shard_idx = 0; shard_idx < blocks.data_shards; shard_idx++) {
+      auto data_pkt = gst_buffer_list_get(rtp_packets, first_packet + shard_idx);
+      auto &data_info = data_infos[shard_idx];
+      gst_buffer_map(data_pkt, &data_info, GST_MAP_READ);
+
+      if (data_info.size >= blocks.block_size) {
+        ptr[shard_idx] = data_info.data;
+      } else {
+        // Only the last packet can be shorter than the block size
+        padded_shard.assign(blocks.block_size, 0x00);
+        std::copy(data_info.data, data_info.data + data_info.size, padded_shard.begin());
+        ptr[shard_idx] = padded_shard.data();
+      }
+    }
 
-  // pads rtp_payload to blocksize
-  if (payload_size % blocks.block_size != 0) {
-    GstBuffer *pad = gst_buffer_new_and_fill((blocks.data_shards * blocks.block_size) - payload_size, 0x00);
-    rtp_payload = gst_buffer_append(rtp_payload, pad);
-  }
+    // Allocate the FEC packets, Reed Solomon will write the parity there
+    fec_packets.resize(blocks.parity_shards);
+    std::vector<GstMapInfo> fec_infos(blocks.parity_shards);
+    for (int fec_idx = 0; fec_idx < blocks.parity_shards; fec_idx++) {
+      fec_packets[fec_idx] = gst_buffer_new_allocate(nullptr, blocks.block_size, nullptr);
+      gst_buffer_map(fec_packets[fec_idx], &fec_infos[fec_idx], GST_MAP_WRITE);
+      memset(fec_infos[fec_idx].data, 0x00, blocks.block_size);
+      ptr[blocks.data_shards + fec_idx] = fec_infos[fec_idx].data;
+    }
 
-  // Allocate space for FEC packets
-  auto fec_buff = gst_buffer_new_and_fill((blocks.parity_shards * blocks.block_size), 0x00);
-  rtp_payload = gst_buffer_append(rtp_payload, fec_buff);
-  gst_buffer_map(rtp_payload, &info, GST_MAP_WRITE);
+    // Reed Solomon encode the shards
+    auto rs = moonlight::fec::get_cached(blocks.data_shards, blocks.parity_shards);
+    if (moonlight::fec::encode(rs.get(), &ptr.front(), nr_shards, blocks.block_size) != 0) {
+      logs::log(logs::warning, "Error during video FEC encoding");
+    }
 
-  // Reed Solomon encode the full stream of bytes
-  auto rs = moonlight::fec::create(blocks.data_shards, blocks.parity_shards);
-  std::vector<unsigned char *> ptr(nr_shards);
-  for (int shard_idx = 0; shard_idx < nr_shards; shard_idx++) {
-    ptr[shard_idx] = info.data + (shard_idx * blocks.block_size);
-  }
-  if (moonlight::fec::encode(rs.get(), &ptr.front(), nr_shards, blocks.block_size) != 0) {
-    logs::log(logs::warning, "Error during video FEC encoding");
+    for (int shard_idx = 0; shard_idx < blocks.data_shards; shard_idx++) {
+      gst_buffer_unmap(gst_buffer_list_get(rtp_packets, first_packet + shard_idx), &data_infos[shard_idx]);
+    }
+
+    for (int fec_idx = 0; fec_idx < blocks.parity_shards; fec_idx++) {
+      update_fec_info(rtpmoonlightpay,
+                      (VideoRTPHeaders *)(fec_infos[fec_idx].data),
+                      blocks.data_shards + fec_idx,
+                      blocks.data_shards,
+                      blocks.fec_percentage,
+                      block_index,
+                      last_block_index,
+                      seq_offset);
+
+      gst_buffer_unmap(fec_packets[fec_idx], &fec_infos[fec_idx]);
+      gst_copy_timestamps(inbuf, fec_packets[fec_idx]);
+    }
   }
 
-  // update FEC info of the already created RTP packets
+  // update FEC info of the already created RTP packets, only now that the parity has been encoded.
+  // Data packets are never shared (see generate_fec_multi_blocks) so mapping them for writing will not copy them.
+  // When skipping FEC the block is still announced as part of the frame, just without any parity packet.
   for (int shard_idx = 0; shard_idx < blocks.data_shards; shard_idx++) {
+    auto data_pkt = gst_buffer_list_get(rtp_packets, first_packet + shard_idx);
     GstMapInfo data_info;
-    auto data_pkt = gst_buffer_list_get(rtp_packets, shard_idx);
     gst_buffer_map(data_pkt, &data_info, GST_MAP_WRITE);
-
     update_fec_info(rtpmoonlightpay,
                     (VideoRTPHeaders *)(data_info.data),
                     shard_idx,
                     blocks.data_shards,
-                    blocks.fec_percentage,
+                    with_fec ? blocks.fec_percentage : 0,
                     block_index,
-                    last_block_index);
-    gst_copy_timestamps(inbuf, data_pkt);
+                    last_block_index,
+                    seq_offset);
     gst_buffer_unmap(data_pkt, &data_info);
+    gst_copy_timestamps(inbuf, data_pkt);
   }
 
-  // Push back the newly created RTP packets with the FEC info
-  for (int shard_idx = blocks.data_shards; shard_idx < nr_shards; shard_idx++) {
-    auto position = shard_idx * blocks.block_size;
-    auto rtp_packet = (VideoRTPHeaders *)(info.data + position);
+  return fec_packets;
+}
 
-    update_fec_info(rtpmoonlightpay,
-                    rtp_packet,
-                    shard_idx,
-                    blocks.data_shards,
-                    blocks.fec_percentage,
-                    block_index,
-                    last_block_index);
+/**
+ * Single block version: the whole rtp_packets list is a single FEC block, FEC packets are appended at the end
+ */
+static void
+generate_fec_packets(const gst_rtp_moonlight_pay_video &rtpmoonlightpay, GstBufferList *rtp_packets, GstBuffer *inbuf) {
+  auto blocks = determine_split(rtpmoonlightpay, gst_buffer_list_length(rtp_packets));
+  for (auto fec_packet : generate_fec_packets(rtpmoonlightpay, rtp_packets, 0, inbuf, blocks, 0, 0, 0)) {
+    gst_buffer_list_add(rtp_packets, fec_packet);
+  }
+}
+
+/**
+ * Multi block frames with less than this amount of data shards will have their FEC encoded inline,
+ * waking up the workers would cost more than what we'll save.
+ */
+constexpr int PARALLEL_FEC_MIN_DATA_SHARDS = 128;
 
-    GstBuffer *packet_buf = gst_buffer_new_allocate(nullptr, blocks.block_size, nullptr);
-    gst_buffer_fill(packet_buf, 0, rtp_packet, blocks.block_size);
-    gst_copy_timestamps(inbuf, packet_buf);
-    gst_buffer_list_add(rtp_packets, packet_buf);
+/**
+ * Returns the process wide worker pool used to encode FEC blocks in parallel.
+ * Payloaders configured with the same number of workers will share the same pool.
+ */
+inline std::shared_ptr<boost::asio::thread_pool> fec_worker_pool(int nr_workers) {
+  static std::mutex pools_mutex;
+  static std::map<int, std::shared_ptr<boost::asio::thread_pool>> pools;
+
+  std::lock_guard<std::mutex> lock(pools_mutex);
+  auto &pool = pools[nr_workers];
+  if (!pool) {
+    logs::log(logs::debug, "[GSTREAMER] Starting FEC worker pool with {} threads", nr_workers);
+    pool = std::make_shared<boost::asio::thread_pool>(nr_workers);
+  }
+  return pool;
+}
+
+/**
+ * Returns the (block index, packet index) pairs in the order in which the packets should be sent.
+ *
+ * By default blocks are sent one after the other: [Payloads + FEC], [Payloads + FEC], ...
+ * When interleaving, each block is spread evenly over the whole frame: packet i of a block with n packets goes at
+ * relative position (i + 0.5) / n. Parity ends up interleaved at the end of the frame and a burst of N lost packets
+ * costs each block about N / nr_blocks packets, instead of all N hitting the same block.
+ */
+static std::vector<std::pair<int, int>> fec_send_order(const std::vector<int> &block_sizes, bool interleave) {
+  std::vector<std::pair<int, int>> order;
+  for (int block_idx = 0; block_idx < block_sizes.size(); block_idx++) {
+    for (int packet_idx = 0; packet_idx < block_sizes[block_idx]; packet_idx++) {
+      order.emplace_back(block_idx, packet_idx);
+    }
   }
 
-  gst_buffer_unmap(rtp_payload, &info);
-  gst_buffer_unref(rtp_payload);
+  if (interleave) {
+    // (2a + 1) / 2n_a < (2b + 1) / 2n_b without going through floating point; ties keep the block order
+    std::stable_sort(order.begin(), order.end(), [&block_sizes](const auto &a, const auto &b) {
+      return (2 * a.second + 1) * block_sizes[b.first] < (2 * b.second + 1) * block_sizes[a.first];
+    });
+  }
+  return order;
 }
 
 /**
- * Given a list of RTP packets will split them in 3 macro blocks of:
- * [Payloads + FEC], [Payloads + FEC], [Payloads + FEC]
+ * Given a list of RTP packets will split them in plan.nr_blocks macro blocks of:
+ * [Payloads + FEC], [Payloads + FEC], ...
  *
- * Returns a new linear list of all the blocks
+ * Blocks are independent: when fec_workers > 0 and the frame is big enough the first block is encoded on the
+ * calling thread while the others are encoded on the shared worker pool.
+ * Each block works on its own range of rtp_packets, data packets are never copied (not even the buffer objects).
+ *
+ * Returns a new linear list of all the blocks, in the order given by fec_send_order()
  * Will modify the input rtp_packets with the correct FEC info
  */
 static GstBufferList *generate_fec_multi_blocks(gst_rtp_moonlight_pay_video *rtpmoonlightpay,
                                                 GstBufferList *rtp_packets,
-                                                int data_shards,
+                                                const FEC_PLAN &plan,
                                                 GstBuffer *inbuf) {
-  auto rtp_packets_size = gst_buffer_list_length(rtp_packets);
-
-  constexpr auto nr_blocks = 3;
-  constexpr auto last_block_index = 2 << 6;
+  auto data_shards = (int)gst_buffer_list_length(rtp_packets);
+
+  const auto nr_blocks = plan.nr_blocks;
+  const auto last_block_index = ((plan.frame_blocks > 0 ? plan.frame_blocks : nr_blocks) - 1) << 6;
+
+  // Split the packets upfront so that we can compute where the sequence numbers of each block will start
+  std::vector<int> blocks_start(nr_blocks);
+  std::vector<BLOCKS> blocks_split(nr_blocks);
+  std::vector<int> blocks_seq_offset(nr_blocks);
+  std::vector<std::vector<GstBuffer *>> blocks_fec_packets(nr_blocks);
+  auto packets_per_block = plan.data_shards_per_block;
+  for (int block_idx = 0, seq_offset = 0; block_idx < nr_blocks; block_idx++) {
+    auto list_start = MIN(block_idx * packets_per_block, data_shards);
+    auto list_end = MIN((block_idx + 1) * packets_per_block, data_shards);
+    blocks_start[block_idx] = list_start;
+    blocks_seq_offset[block_idx] = seq_offset;
+
+    auto block_data_shards = list_end - list_start;
+    blocks_split[block_idx] = determine_split(*rtpmoonlightpay, block_data_shards);
+    auto block_nr_shards = block_data_shards + blocks_split[block_idx].parity_shards;
+    seq_offset += block_nr_shards <= DATA_SHARDS_MAX ? block_nr_shards : block_data_shards;
+  }
 
-  GstBufferList *final_packets = gst_buffer_list_new(); // we'll increase the size on each block iteration
+  auto encode_block = [&](int block_idx) {
+    blocks_fec_packets[block_idx] = generate_fec_packets(*rtpmoonlightpay,
+                                                         rtp_packets,
+                                                         blocks_start[block_idx],
+                                                         inbuf,
+                                                         blocks_split[block_idx],
+                                                         plan.first_block + block_idx,
+                                                         last_block_index,
+                                                         blocks_seq_offset[block_idx]);
+  };
+
+  if (rtpmoonlightpay->fec_workers > 0 && data_shards >= PARALLEL_FEC_MIN_DATA_SHARDS) {
+    auto pool = fec_worker_pool(rtpmoonlightpay->fec_workers);
+    std::vector<std::future<void>> pending;
+    for (int block_idx = 1; block_idx < nr_blocks; block_idx++) {
+      auto task = std::make_shared<std::packaged_task<void()>>([&encode_block, block_idx]() {
+        encode_block(block_idx);
+      });
+      pending.push_back(task->get_future());
+      boost::asio::post(*pool, [task]() { (*task)(); });
+    }
+    encode_block(0);
+    for (auto &block : pending) {
+      block.get();
+    }
+  } else {
+    for (int block_idx = 0; block_idx < nr_blocks; block_idx++) {
+      encode_block(block_idx);
+    }
+  }
 
-  auto packets_per_block = (int)std::ceil((float)data_shards / nr_blocks);
+  // We have to interleave the additional FEC packets; we just put them all back into a new linear list
+  std::vector<int> block_sizes(nr_blocks);
   for (int block_idx = 0; block_idx < nr_blocks; block_idx++) {
-    auto list_start = block_idx * packets_per_block;
-    auto list_end = MIN((block_idx + 1) * packets_per_block, rtp_packets_size);
-    auto block_packets = gst_buffer_list_sub(rtp_packets, list_start, list_end);
-
-    // bear in mind that since no actual data copy is done,
-    // this will also modify the FEC information in the original rtp_packets list
-    generate_fec_packets(*rtpmoonlightpay, block_packets, inbuf, block_idx, last_block_index);
-
-    // We have to copy out the additional FEC packets; we just put them all back into a new linear list
-    auto total_block_packets = gst_buffer_list_length(block_packets);
-    for (int packet_idx = 0; packet_idx < total_block_packets; packet_idx++) {
-      // copy here is about the buffer object, not the data
-      gst_buffer_list_add(final_packets, gst_buffer_copy(gst_buffer_list_get(block_packets, packet_idx)));
+    auto block_data_shards = blocks_split[block_idx].data_shards;
+    block_sizes[block_idx] = block_data_shards + (int)blocks_fec_packets[block_idx].size();
+  }
+
+  GstBufferList *final_packets = gst_buffer_list_new();
+  for (auto [block_idx, packet_idx] : fec_send_order(block_sizes, rtpmoonlightpay->interleave_fec_blocks)) {
+    auto block_data_shards = blocks_split[block_idx].data_shards;
+    if (packet_idx < block_data_shards) {
+      gst_buffer_list_add(final_packets,
+                          gst_buffer_ref(gst_buffer_list_get(rtp_packets, blocks_start[block_idx] + packet_idx)));
+    } else {
+      // The list takes ownership of the FEC packets
+      gst_buffer_list_add(final_packets, blocks_fec_packets[block_idx][packet_idx - block_data_shards]);
     }
+  }
 
+  for (int block_idx = 0; block_idx < nr_blocks; block_idx++) {
     // This will adjust the sequenceNumber of the RTP packet
-    rtpmoonlightpay->cur_seq_number += total_block_packets;
-    gst_buffer_list_unref(block_packets);
+    rtpmoonlightpay->cur_seq_number += block_sizes[block_idx];
   }
 
   gst_buffer_list_unref(rtp_packets);
@@ -324,27 +690,234 @@ static GstBufferList *generate_fec_multi_blocks(gst_rtp_moonlight_pay_video *rtp
  * @return a list of buffers, each element representing a single RTP packet
  */
 static GstBufferList *split_into_rtp(gst_rtp_moonlight_pay_video *rtpmoonlightpay, GstBuffer *inbuf) {
+  auto encoder_done = monotonic_now_ns();
   auto full_payload_buf = prepend_video_header(*rtpmoonlightpay, inbuf);
 
   GstBufferList *rtp_packets = generate_rtp_packets(*rtpmoonlightpay, full_payload_buf);
 
   if (rtpmoonlightpay->fec_percentage > 0) {
-    auto rtp_packets_size = gst_buffer_list_length(rtp_packets);
-    auto blocks = determine_split(*rtpmoonlightpay, rtp_packets_size);
-
-    // With a fec_percentage of 255, if payload is broken up into more than a 100 data_shards
-    // it will generate greater than DATA_SHARDS_MAX shards and FEC will fail to encode.
-    if (blocks.data_shards > 90) {
-      rtp_packets = generate_fec_multi_blocks(rtpmoonlightpay, rtp_packets, blocks.data_shards, inbuf);
+    auto data_shards = (int)gst_buffer_list_length(rtp_packets);
+    auto plan = plan_fec_blocks(*rtpmoonlightpay, data_shards);
+    rtpmoonlightpay->fec_layouts[plan.nr_blocks]++;
+
+    if (plan.nr_blocks == 0) {
+      logs::log(logs::warning,
+                "[GSTREAMER] Size of frame too large, {} packets can't fit in {} FEC blocks; sending it without FEC",
+                data_shards,
+                MAX_FEC_BLOCKS);
+      rtpmoonlightpay->cur_seq_number += data_shards;
+    } else if (plan.nr_blocks > 1) {
+      rtp_packets = generate_fec_multi_blocks(rtpmoonlightpay, rtp_packets, plan, inbuf);
     } else {
-      generate_fec_packets(*rtpmoonlightpay, rtp_packets, inbuf, 0, 0);
+      generate_fec_packets(*rtpmoonlightpay, rtp_packets, inbuf);
       rtpmoonlightpay->cur_seq_number += gst_buffer_list_length(rtp_packets);
     }
   }
 
+  gst_buffer_set_encoder_done(gst_buffer_list_get_writable(rtp_packets, 0), encoder_done);
   rtpmoonlightpay->frame_num++;
   gst_buffer_unref(full_payload_buf);
   return rtp_packets;
 }
 
+/**
+ * Slice mode needs FEC: frames are split in blocks as the slices come in
+ */
+static bool is_slice_mode(const gst_rtp_moonlight_pay_video &rtpmoonlightpay) {
+  return rtpmoonlightpay.slices_per_frame > 1 && rtpmoonlightpay.fec_percentage > 0;
+}
+
+/**
+ * @return true if some slices of the current frame have been received (or sent) already
+ */
+static bool frame_in_progress(const gst_rtp_moonlight_pay_video &rtpmoonlightpay) {
+  return rtpmoonlightpay.pending_slices != nullptr || rtpmoonlightpay.frame_blocks_sent > 0;
+}
+
+/**
+ * The FEC properties can be changed from any thread while streaming (see FecController); they are only picked up
+ * here, by the streaming thread, when a new frame starts so that all the blocks of a frame (and the FEC workers
+ * encoding them) see the same settings.
+ */
+static void apply_fec_settings(gst_rtp_moonlight_pay_video &rtpmoonlightpay) {
+  GST_OBJECT_LOCK(&rtpmoonlightpay);
+  if (rtpmoonlightpay.fec_settings_changed) {
+    rtpmoonlightpay.fec_percentage = rtpmoonlightpay.next_fec_percentage;
+    rtpmoonlightpay.min_required_fec_packets = rtpmoonlightpay.next_min_required_fec_packets;
+    rtpmoonlightpay.fec_settings_changed = false;
+  }
+  GST_OBJECT_UNLOCK(&rtpmoonlightpay);
+}
+
+/**
+ * Since the frame is split across multiple calls to generate_rtp_packets() only the first packet of the frame
+ * can have FLAG_SOF and only the last one FLAG_EOF.
+ */
+static void set_frame_boundaries(GstBufferList *rtp_packets, bool first_chunk, bool last_chunk) {
+  auto nr_packets = gst_buffer_list_length(rtp_packets);
+  GstMapInfo info;
+  if (!first_chunk) {
+    gst_buffer_map(gst_buffer_list_get(rtp_packets, 0), &info, GST_MAP_WRITE);
+    ((VideoRTPHeaders *)info.data)->packet.flags &= ~FLAG_SOF;
+    gst_buffer_unmap(gst_buffer_list_get(rtp_packets, 0), &info);
+  }
+  if (!last_chunk) {
+    gst_buffer_map(gst_buffer_list_get(rtp_packets, nr_packets - 1), &info, GST_MAP_WRITE);
+    ((VideoRTPHeaders *)info.data)->packet.flags &= ~FLAG_EOF;
+    gst_buffer_unmap(gst_buffer_list_get(rtp_packets, nr_packets - 1), &info);
+  }
+}
+
+/**
+ * Sends the slices accumulated so far as the next nr_blocks FEC blocks of the current frame.
+ *
+ * The client knows how many blocks a frame has from its very first packet, so the last chunk of a frame has to fill
+ * exactly all the remaining blocks; when it's too small it'll be zero padded (which is harmless between NALs).
+ * When the whole frame is still pending it can be re-planned (see plan_fec_blocks) if it doesn't fit the usual
+ * blocks; otherwise the remaining blocks that can't fit DATA_SHARDS_MAX are sent without FEC.
+ */
+static GstBufferList *
+send_pending_slices(gst_rtp_moonlight_pay_video *rtpmoonlightpay, int nr_blocks, bool last_chunk) {
+  auto frame_blocks = MIN(rtpmoonlightpay->slices_per_frame, MAX_FEC_BLOCKS);
+  const bool first_chunk = rtpmoonlightpay->frame_blocks_sent == 0;
+  // All the slices might have gone into the previous blocks already
+  auto chunk = rtpmoonlightpay->pending_slices != nullptr ? rtpmoonlightpay->pending_slices : gst_buffer_new();
+
+  auto payload_size = rtpmoonlightpay->payload_size - MAX_RTP_HEADER_SIZE;
+  auto chunk_size = (int)gst_buffer_get_size(chunk);
+  auto data_shards = MAX((chunk_size + payload_size - 1) / payload_size, 1);
+  auto fits_in_blocks = [rtpmoonlightpay](int shards, int blocks) {
+    auto split = determine_split(*rtpmoonlightpay, (shards + blocks - 1) / blocks);
+    return split.data_shards + split.parity_shards <= DATA_SHARDS_MAX;
+  };
+
+  bool with_fec = true;
+  if (first_chunk && last_chunk && !fits_in_blocks(data_shards, nr_blocks)) {
+    auto plan = plan_fec_blocks(*rtpmoonlightpay, data_shards);
+    if (plan.nr_blocks == 0) {
+      logs::log(logs::warning,
+                "[GSTREAMER] Size of frame too large, {} packets can't fit in {} FEC blocks; sending it without FEC",
+                data_shards,
+                MAX_FEC_BLOCKS);
+      with_fec = false;
+    } else {
+      nr_blocks = frame_blocks = plan.nr_blocks;
+    }
+  }
+
+  auto blocks_for = [nr_blocks](int shards) {
+    auto per_block = (shards + nr_blocks - 1) / nr_blocks;
+    return (shards + per_block - 1) / per_block;
+  };
+  auto padded_shards = data_shards;
+  while (with_fec && blocks_for(padded_shards) != nr_blocks) {
+    padded_shards++;
+  }
+  if (padded_shards > data_shards) {
+    chunk = gst_buffer_append(chunk, gst_buffer_new_and_fill(padded_shards * payload_size - chunk_size, 0x00));
+  }
+
+  GstBufferList *rtp_packets = generate_rtp_packets(*rtpmoonlightpay, chunk);
+  set_frame_boundaries(rtp_packets, first_chunk, last_chunk);
+
+  if (with_fec) {
+    with_fec = fits_in_blocks(padded_shards, nr_blocks);
+    auto plan = FEC_PLAN{.nr_blocks = nr_blocks,
+                         .data_shards_per_block = (padded_shards + nr_blocks - 1) / nr_blocks,
+                         .first_block = rtpmoonlightpay->frame_blocks_sent,
+                         .frame_blocks = frame_blocks};
+    rtp_packets = generate_fec_multi_blocks(rtpmoonlightpay, rtp_packets, plan, chunk);
+  } else {
+    // Just like split_into_rtp() the headers of a frame without FEC are already set by generate_rtp_packets()
+    rtpmoonlightpay->cur_seq_number += gst_buffer_list_length(rtp_packets);
+  }
+
+  if (first_chunk) {
+    gst_buffer_set_encoder_done(gst_buffer_list_get_writable(rtp_packets, 0),
+                                rtpmoonlightpay->frame_encoder_done_ns);
+  }
+
+  gst_buffer_unref(chunk);
+  rtpmoonlightpay->pending_slices = nullptr;
+  rtpmoonlightpay->pending_slices_count = 0;
+  rtpmoonlightpay->frame_blocks_sent += nr_blocks;
+
+  if (last_chunk) {
+    // Blocks sent before the last one always fit, see split_slice_into_rtp()
+    rtpmoonlightpay->fec_layouts[with_fec ? frame_blocks : 0]++;
+    rtpmoonlightpay->frame_blocks_sent = 0;
+    rtpmoonlightpay->frame_pts = GST_CLOCK_TIME_NONE;
+    rtpmoonlightpay->frame_num++;
+  }
+  return rtp_packets;
+}
+
+/**
+ * Slice mode: inbuf is just a part (a slice, or any other NAL) of the current frame.
+ *
+ * Each frame is split into MIN(slices_per_frame, MAX_FEC_BLOCKS) FEC blocks; as soon as enough slices for a block
+ * come in they are packetized, FEC encoded and sent downstream without waiting for the rest of the frame.
+ * The frame ends with the buffer flagged as MARKER: whatever is left goes in the remaining blocks.
+ * Encoders (or parsers) that don't set MARKER will work too, with an extra frame of latency, since the frame is
+ * closed as soon as a buffer with a new PTS comes in.
+ *
+ * @return the packets to be sent, nullptr if we are still waiting for more slices
+ */
+static GstBufferList *split_slice_into_rtp(gst_rtp_moonlight_pay_video *rtpmoonlightpay, GstBuffer *inbuf) {
+  const auto frame_blocks = MIN(rtpmoonlightpay->slices_per_frame, MAX_FEC_BLOCKS);
+  GstBufferList *previous_frame = nullptr;
+
+  bool in_progress = frame_in_progress(*rtpmoonlightpay);
+  if (in_progress && GST_BUFFER_PTS_IS_VALID(inbuf) && GST_CLOCK_TIME_IS_VALID(rtpmoonlightpay->frame_pts) &&
+      GST_BUFFER_PTS(inbuf) != rtpmoonlightpay->frame_pts) {
+    logs::log(logs::trace, "[GSTREAMER] Frame {} ended without a MARKER buffer", rtpmoonlightpay->frame_num);
+    previous_frame = send_pending_slices(rtpmoonlightpay, frame_blocks - rtpmoonlightpay->frame_blocks_sent, true);
+    in_progress = false;
+  }
+
+  if (!in_progress) {
+    apply_fec_settings(*rtpmoonlightpay);
+    rtpmoonlightpay->frame_encoder_done_ns = monotonic_now_ns();
+    rtpmoonlightpay->frame_pts = GST_BUFFER_PTS(inbuf);
+    rtpmoonlightpay->pending_slices = prepend_video_header(*rtpmoonlightpay, inbuf, false);
+    gst_copy_timestamps(inbuf, rtpmoonlightpay->pending_slices);
+  } else if (rtpmoonlightpay->pending_slices == nullptr) {
+    rtpmoonlightpay->pending_slices = gst_buffer_ref(inbuf);
+  } else {
+    rtpmoonlightpay->pending_slices = gst_buffer_append(rtpmoonlightpay->pending_slices, gst_buffer_ref(inbuf));
+  }
+
+  // Parameter sets (SPS, PPS, ...) are not slices
+  if (!GST_BUFFER_FLAG_IS_SET(inbuf, GST_BUFFER_FLAG_HEADER)) {
+    rtpmoonlightpay->pending_slices_count++;
+  }
+
+  GstBufferList *rtp_packets = nullptr;
+  // GST_BUFFER_FLAG_MARKER is the same as GST_VIDEO_BUFFER_FLAG_MARKER: the end of the access unit
+  if (GST_BUFFER_FLAG_IS_SET(inbuf, GST_BUFFER_FLAG_MARKER)) {
+    rtp_packets = send_pending_slices(rtpmoonlightpay, frame_blocks - rtpmoonlightpay->frame_blocks_sent, true);
+  } else if (rtpmoonlightpay->frame_blocks_sent < frame_blocks - 1) {
+    // The last block is always left to the end of the frame
+    auto slices_per_block = (rtpmoonlightpay->slices_per_frame + frame_blocks - 1) / frame_blocks;
+    auto payload_size = rtpmoonlightpay->payload_size - MAX_RTP_HEADER_SIZE;
+    auto pending_shards = ((int)gst_buffer_get_size(rtpmoonlightpay->pending_slices) + payload_size - 1) / payload_size;
+    auto split = determine_split(*rtpmoonlightpay, pending_shards);
+    if (rtpmoonlightpay->pending_slices_count >= slices_per_block &&
+        split.data_shards + split.parity_shards <= DATA_SHARDS_MAX) {
+      rtp_packets = send_pending_slices(rtpmoonlightpay, 1, false);
+    }
+  }
+
+  if (previous_frame == nullptr) {
+    return rtp_packets;
+  }
+  if (rtp_packets != nullptr) {
+    for (guint idx = 0; idx < gst_buffer_list_length(rtp_packets); idx++) {
+      gst_buffer_list_add(previous_frame, gst_buffer_ref(gst_buffer_list_get(rtp_packets, idx)));
+    }
+    gst_buffer_list_unref(rtp_packets);
+  }
+  return previous_frame;
+}
+
 } // namespace gst_moonlight_video
\ No newline at end of file
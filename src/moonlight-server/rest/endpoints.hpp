@@ -61,8 +61,8 @@ void serverinfo(const std::shared_ptr<typename SimpleWeb::Server<T>::Response> &
   bool is_https = std::is_same_v<SimpleWeb::HTTPS, T>;
 
   auto session = get_session_by_ip(state->running_sessions->load(), get_client_ip<T>(request));
-  bool is_busy = session.has_value();
-  int app_id = session.has_value() ? std::stoi(session->app->base.id) : 0;
+  bool is_busy = session != nullptr;
+  int app_id = session ? std::stoi(session->app->base.id) : 0;
 
   auto local_ip = get_host_ip<T>(request, state);
 
@@ -305,7 +305,7 @@ void launch(const std::shared_ptr<typename SimpleWeb::Server<SimpleWeb::HTTPS>::
   auto new_session = create_run_session(request->parse_query_string(), client_ip, current_client, state, app);
   state->event_bus->fire_event(immer::box<state::StreamSession>(new_session));
   state->running_sessions->update(
-      [&new_session](const immer::vector<state::StreamSession> &ses_v) { return ses_v.push_back(new_session); });
+      [&new_session](const state::SessionsRegistry &sessions) { return add_session(sessions, new_session); });
 
   start_rtp_ping(new_session);
 
@@ -326,18 +326,18 @@ void resume(const std::shared_ptr<typename SimpleWeb::Server<SimpleWeb::HTTPS>::
     auto new_session =
         create_run_session(request->parse_query_string(), client_ip, current_client, state, *old_session->app);
     // Carry over the old session display handle
-    new_session.wayland_display = std::move(old_session->wayland_display);
+    new_session.wayland_display = old_session->wayland_display;
     // Carry over the old session devices, they'll be already plugged into the container
-    new_session.mouse = std::move(old_session->mouse);
-    new_session.keyboard = std::move(old_session->keyboard);
-    new_session.joypads = std::move(old_session->joypads);
-    new_session.pen_tablet = std::move(old_session->pen_tablet);
-    new_session.touch_screen = std::move(old_session->touch_screen);
+    new_session.mouse = old_session->mouse;
+    new_session.keyboard = old_session->keyboard;
+    new_session.joypads = old_session->joypads;
+    new_session.pen_tablet = old_session->pen_tablet;
+    new_session.touch_screen = old_session->touch_screen;
 
     start_rtp_ping(new_session);
 
-    state->running_sessions->update([&old_session, &new_session](const immer::vector<state::StreamSession> ses_v) {
-      return remove_session(ses_v, old_session.value()).push_back(new_session);
+    state->running_sessions->update([&old_session, &new_session](const state::SessionsRegistry &sessions) {
+      return add_session(remove_session(sessions, old_session->session_id), new_session);
     });
   } else {
     logs::log(logs::warning, "[HTTPS] Received resume event from an unregistered session, ip: {}", client_ip);
@@ -363,8 +363,8 @@ void cancel(const std::shared_ptr<typename SimpleWeb::Server<SimpleWeb::HTTPS>::
     state->event_bus->fire_event(
         immer::box<StopStreamEvent>(StopStreamEvent{.session_id = client_session->session_id}));
 
-    state->running_sessions->update([&client_session](const immer::vector<state::StreamSession> &ses_v) {
-      return remove_session(ses_v, client_session.value());
+    state->running_sessions->update([&client_session](const state::SessionsRegistry &sessions) {
+      return remove_session(sessions, client_session->session_id);
     });
   } else {
     logs::log(logs::warning, "[HTTPS] Received resume event from an unregistered session, ip: {}", client_ip);
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "streaming/data-structures.hpp"
+#include <algorithm>
 #include <chrono>
 #include <helpers/logger.hpp>
 #include <helpers/utils.hpp>
@@ -184,7 +185,10 @@ announce(const RTSP_PACKET &req, const state::StreamSession &session) {
   }
 
   auto audio_channels = args["x-nv-audio.surround.numChannels"].value_or(session.audio_channel_count);
-  auto fec_percentage = 20; // TODO: setting?
+  // Adjusted while streaming based on the client losses, see FecController
+  auto fec_percentage = std::clamp(20,
+                                   session.app->fec_percentage_min,
+                                   std::max(session.app->fec_percentage_min, session.app->fec_percentage_max));
 
   long bitrate = args["x-nv-vqos[0].bw.maximumBitrateKbps"].value_or(15500);
   // If the client sent a configured bitrate adjust it (Moonlight extension)
@@ -193,8 +197,9 @@ announce(const RTSP_PACKET &req, const state::StreamSession &session) {
 
     // If the FEC percentage isn't too high, adjust the configured bitrate to ensure video
     // traffic doesn't exceed the user's selected bitrate when the FEC shards are included.
-    if (fec_percentage <= 80) {
-      bitrate /= 100.f / (100 - fec_percentage);
+    // The FEC percentage can go up to the max while streaming.
+    if (auto max_fec_percentage = std::max(fec_percentage, session.app->fec_percentage_max); max_fec_percentage <= 80) {
+      bitrate /= 100.f / (100 - max_fec_percentage);
     }
 
     // Adjust the bitrate to account for audio traffic bandwidth usage (capped at 20% reduction).
@@ -220,9 +225,14 @@ announce(const RTSP_PACKET &req, const state::StreamSession &session) {
       .packet_size = args["x-nv-video[0].packetSize"].value_or(1024),
       .frames_with_invalid_ref_threshold = args["x-nv-video[0].framesWithInvalidRefThreshold"].value_or(0),
       .fec_percentage = fec_percentage,
+      .fec_percentage_min = session.app->fec_percentage_min,
+      .fec_percentage_max = session.app->fec_percentage_max,
       .min_required_fec_packets = args["x-nv-vqos[0].fec.minRequiredFecPackets"].value_or(0),
+      .fec_workers = session.app->fec_workers,
       .bitrate_kbps = bitrate,
+      .bitrate_min_kbps = session.app->bitrate_min_kbps,
       .slices_per_frame = args["x-nv-video[0].videoEncoderSlicesPerFrame"].value_or(1),
+      .intra_refresh = session.app->intra_refresh,
 
       .color_range = (csc & 0x1) ? state::JPEG : state::MPEG,
       .color_space = state::ColorSpace(csc >> 1),
@@ -333,7 +333,14 @@ Config load_or_default(const std::string &source, const std::shared_ptr<dp::even
                           .opus_gst_pipeline = opus_gst_pipeline,
                           .start_virtual_compositor = toml::find_or<bool>(item, "start_virtual_compositor", true),
                           .runner = get_runner(item, ev_bus),
-                          .joypad_type = joypad_type_enum};
+                          .joypad_type = joypad_type_enum,
+                          .input_coalescing_window =
+                              std::chrono::milliseconds(toml::find_or<uint>(item, "input_coalescing_window_ms", 0)),
+                          .fec_percentage_min = toml::find_or<int>(item, "fec_percentage_min", 20),
+                          .fec_percentage_max = toml::find_or<int>(item, "fec_percentage_max", 20),
+                          .fec_workers = toml::find_or<int>(item, "fec_workers", 2),
+                          .bitrate_min_kbps = toml::find_or<long>(item, "bitrate_min_kbps", 0),
+                          .intra_refresh = toml::find_or<bool>(item, "intra_refresh", false)};
       }) |                                     //
       ranges::to<immer::vector<state::App>>(); //
 
@@ -111,6 +111,17 @@ struct App {
   bool start_virtual_compositor;
   std::shared_ptr<Runner> runner;
   moonlight::control::pkts::CONTROLLER_TYPE joypad_type;
+  /* Optional: mouse, touch and pen movements received within this window are merged, 0 disables it */
+  std::chrono::microseconds input_coalescing_window = 0us;
+  /* The video FEC percentage is adjusted within these bounds based on the losses reported by the client */
+  int fec_percentage_min = 20;
+  int fec_percentage_max = 20;
+  /* The video FEC blocks of a frame are encoded in parallel on this many threads, 0 encodes them inline */
+  int fec_workers = 2;
+  /* Optional: the video bitrate is lowered down to this when the link can't keep up, 0 disables it */
+  long bitrate_min_kbps = 0;
+  /* Optional: the video encoder uses periodic intra refresh instead of IDR frames, where supported */
+  bool intra_refresh = false;
 };
 
 /**
@@ -213,7 +224,25 @@ struct StreamSession {
 
 // TODO: unplug device event? Or should this be tied to the session?
 
-using SessionsAtoms = std::shared_ptr<immer::atom<immer::vector<StreamSession>>>;
+/**
+ * A shared, immutable handle to a running session; lookups hand these out instead of copying the whole session
+ */
+using StreamSessionHandle = std::shared_ptr<const StreamSession>;
+
+/**
+ * All the running sessions, indexed by session_id and by client IP.
+ * The indexes are always updated together with `sessions` (see state/sessions.hpp) so that they can be
+ * swapped atomically as a single value.
+ */
+struct SessionsRegistry {
+  /* All the sessions, in insertion order */
+  immer::vector<StreamSessionHandle> sessions;
+
+  immer::map<std::size_t /* session_id */, StreamSessionHandle> by_id;
+  immer::map<std::string /* client IP */, StreamSessionHandle> by_ip;
+};
+
+using SessionsAtoms = std::shared_ptr<immer::atom<SessionsRegistry>>;
 
 /**
  * The whole application state as a composition of immutable datastructures
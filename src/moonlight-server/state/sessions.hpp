@@ -2,48 +2,35 @@
 
 #include <helpers/logger.hpp>
 #include <immer/vector.hpp>
-#include <optional>
 #include <range/v3/view.hpp>
 #include <state/data-structures.hpp>
 
-inline std::optional<state::StreamSession> get_session_by_ip(const immer::vector<state::StreamSession> &sessions,
-                                                             const std::string &ip) {
-  auto results = sessions |                                                                                     //
-                 ranges::views::filter([&ip](const state::StreamSession &session) { return session.ip == ip; }) //
-                 | ranges::views::take(1)                                                                       //
-                 | ranges::to_vector;                                                                           //
-  if (results.size() == 1) {
-    return results[0];
-  } else if (results.empty()) {
-    return {};
-  } else {
-    logs::log(logs::warning, "Found multiple sessions for a given IP: {}", ip);
-    return {};
+/**
+ * @return the session for the given client IP or nullptr if there's none.
+ * When there are multiple sessions for the same IP, the oldest one is returned.
+ */
+inline state::StreamSessionHandle get_session_by_ip(const state::SessionsRegistry &sessions, const std::string &ip) {
+  if (auto session = sessions.by_ip.find(ip)) {
+    return *session;
   }
+  return nullptr;
 }
 
-inline std::optional<state::StreamSession> get_session_by_id(const immer::vector<state::StreamSession> &sessions,
-                                                             const std::size_t id) {
-  auto results =
-      sessions |                                                                                            //
-      ranges::views::filter([id](const state::StreamSession &session) { return session.session_id == id; }) //
-      | ranges::views::take(1)                                                                              //
-      | ranges::to_vector;                                                                                  //
-  if (results.size() == 1) {
-    return results[0];
-  } else if (results.empty()) {
-    return {};
-  } else {
-    logs::log(logs::warning, "Found multiple sessions for a given ID: {}", id);
-    return {};
+/**
+ * @return the session with the given id or nullptr if there's none
+ */
+inline state::StreamSessionHandle get_session_by_id(const state::SessionsRegistry &sessions, const std::size_t id) {
+  if (auto session = sessions.by_id.find(id)) {
+    return *session;
   }
+  return nullptr;
 }
 
-inline unsigned short get_next_available_port(const immer::vector<state::StreamSession> &sessions, bool video) {
-  auto ports = sessions |                                                              //
-               ranges::views::transform([video](const state::StreamSession &session) { //
-                 return video ? session.video_stream_port : session.audio_stream_port; //
-               })                                                                      //
+inline unsigned short get_next_available_port(const state::SessionsRegistry &sessions, bool video) {
+  auto ports = sessions.sessions |                                                             //
+               ranges::views::transform([video](const state::StreamSessionHandle &session) { //
+                 return video ? session->video_stream_port : session->audio_stream_port;     //
+               })                                                                            //
                | ranges::to_vector;
   unsigned short port = video ? state::VIDEO_PING_PORT : state::AUDIO_PING_PORT;
   while (std::find(ports.begin(), ports.end(), port) != ports.end()) {
@@ -52,11 +39,50 @@ inline unsigned short get_next_available_port(const immer::vector<state::StreamS
   return port;
 }
 
-inline immer::vector<state::StreamSession> remove_session(const immer::vector<state::StreamSession> &sessions,
-                                                          const state::StreamSession &session) {
-  return sessions                                                                                          //
-         | ranges::views::filter([remove_hash = session.session_id](const state::StreamSession &cur_ses) { //
-             return cur_ses.session_id != remove_hash;                                                     //
-           })                                                                                              //
-         | ranges::to<immer::vector<state::StreamSession>>();                                              //
-}
\ No newline at end of file
+/**
+ * @return a new registry that includes the given session.
+ * The IP index keeps pointing to the oldest session when another one is already using the same IP.
+ */
+inline state::SessionsRegistry add_session(const state::SessionsRegistry &sessions,
+                                           const state::StreamSession &session) {
+  auto handle = std::make_shared<const state::StreamSession>(session);
+  auto by_ip = sessions.by_ip;
+  if (auto previous = sessions.by_ip.find(session.ip); previous && (*previous)->session_id != session.session_id) {
+    logs::log(logs::warning, "Found multiple sessions for a given IP: {}", session.ip);
+  } else {
+    by_ip = by_ip.set(session.ip, handle);
+  }
+  return {.sessions = sessions.sessions.push_back(handle),
+          .by_id = sessions.by_id.set(session.session_id, handle),
+          .by_ip = by_ip};
+}
+
+/**
+ * @return a new registry without any session with the given id
+ */
+inline state::SessionsRegistry remove_session(const state::SessionsRegistry &sessions, std::size_t session_id) {
+  auto removed = get_session_by_id(sessions, session_id);
+  if (!removed) {
+    return sessions;
+  }
+
+  auto remaining = sessions.sessions                                                                //
+                   | ranges::views::filter([session_id](const state::StreamSessionHandle &cur_ses) { //
+                       return cur_ses->session_id != session_id;                                    //
+                     })                                                                             //
+                   | ranges::to<immer::vector<state::StreamSessionHandle>>();                       //
+
+  auto by_ip = sessions.by_ip;
+  if (auto indexed = by_ip.find(removed->ip); indexed && (*indexed)->session_id == session_id) {
+    by_ip = by_ip.erase(removed->ip);
+    // The oldest remaining session from the same IP (if any) takes over the index
+    for (const auto &session : remaining) {
+      if (session->ip == removed->ip) {
+        by_ip = by_ip.set(session->ip, session);
+        break;
+      }
+    }
+  }
+
+  return {.sessions = remaining, .by_id = sessions.by_id.erase(session_id), .by_ip = by_ip};
+}
@@ -0,0 +1,104 @@
+#include <algorithm>
+#include <helpers/logger.hpp>
+#include <streaming/bitrate_control.hpp>
+
+namespace streaming {
+
+BitrateController create_bitrate_controller(std::size_t session_id, int fps, long min_kbps, long max_kbps) {
+  max_kbps = std::max(max_kbps, 1L);
+  min_kbps = std::clamp(min_kbps, 1L, max_kbps);
+  return {.session_id = session_id,
+          .fps = std::max(fps, 1),
+          .min_kbps = min_kbps,
+          .max_kbps = max_kbps,
+          .bitrate_kbps = max_kbps,
+          // The first congestion is acted upon straight away
+          .since_last_decrease = BITRATE_DECREASE_INTERVAL};
+}
+
+void record_loss(BitrateController &controller, const LossReport &report) {
+  controller.lost_frames += report.lost_frames;
+  controller.loss_interval += report.interval;
+}
+
+/**
+ * @return true if any of the signals says that the stream doesn't fit the link
+ */
+static bool is_congested(BitrateController &controller, const LinkSample &sample) {
+  bool congested = false;
+
+  if (controller.loss_interval > 0ms) {
+    auto expected_frames = std::max(1.0, (double)controller.fps * controller.loss_interval.count() / 1000.0);
+    congested |= controller.lost_frames / expected_frames > BITRATE_LOSS_THRESHOLD;
+  }
+
+  if (sample.rtt > 0ms) {
+    auto lowest = [&sample](std::chrono::milliseconds rtt) {
+      return rtt > 0ms ? std::min(rtt, sample.rtt) : sample.rtt;
+    };
+    controller.min_rtt = lowest(controller.min_rtt);
+    controller.window_min_rtt = lowest(controller.window_min_rtt);
+    controller.rtt_window_elapsed += sample.elapsed;
+    if (controller.rtt_window_elapsed >= BITRATE_RTT_WINDOW) {
+      controller.min_rtt = controller.window_min_rtt;
+      controller.window_min_rtt = 0ms;
+      controller.rtt_window_elapsed = 0ms;
+    }
+    congested |= sample.rtt > controller.min_rtt + BITRATE_RTT_MARGIN;
+  }
+
+  // 1 Kbps for 1 ms is 1 bit
+  auto queue_threshold_bytes = (std::uint64_t)controller.bitrate_kbps * BITRATE_QUEUE_THRESHOLD.count() / 8;
+  congested |= sample.queued_bytes > queue_threshold_bytes;
+
+  return congested;
+}
+
+std::optional<long> on_link_sample(BitrateController &controller, const LinkSample &sample) {
+  controller.samples++;
+  controller.since_last_decrease += sample.elapsed;
+  controller.since_last_increase += sample.elapsed;
+
+  auto bitrate_kbps = controller.bitrate_kbps;
+  if (is_congested(controller, sample)) {
+    controller.congested_samples++;
+    controller.without_congestion = 0ms;
+    if (controller.since_last_decrease >= BITRATE_DECREASE_INTERVAL) {
+      bitrate_kbps = std::max((long)(bitrate_kbps * BITRATE_DECREASE_FACTOR), controller.min_kbps);
+      controller.since_last_decrease = 0ms;
+    }
+  } else {
+    controller.without_congestion += sample.elapsed;
+    if (controller.without_congestion >= BITRATE_INCREASE_AFTER &&
+        controller.since_last_increase >= BITRATE_INCREASE_INTERVAL) {
+      bitrate_kbps = std::min(bitrate_kbps + std::max(controller.max_kbps / BITRATE_INCREASE_STEPS, 1L),
+                              controller.max_kbps);
+      controller.since_last_increase = 0ms;
+    }
+  }
+
+  controller.lost_frames = 0;
+  controller.loss_interval = 0ms;
+
+  if (bitrate_kbps == controller.bitrate_kbps) {
+    return std::nullopt;
+  }
+
+  if (bitrate_kbps > controller.bitrate_kbps) {
+    controller.increases++;
+  } else {
+    controller.decreases++;
+  }
+  logs::log(logs::debug,
+            "[BITRATE] Session {} RTT {}ms (min {}ms), queued {} bytes, bitrate {} -> {} Kbps",
+            controller.session_id,
+            sample.rtt.count(),
+            controller.min_rtt.count(),
+            sample.queued_bytes,
+            controller.bitrate_kbps,
+            bitrate_kbps);
+  controller.bitrate_kbps = bitrate_kbps;
+  return bitrate_kbps;
+}
+
+} // namespace streaming
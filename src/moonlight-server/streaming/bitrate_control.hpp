@@ -0,0 +1,98 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <optional>
+#include <streaming/fec_control.hpp>
+
+namespace streaming {
+
+using namespace std::chrono_literals;
+
+/**
+ * The link is considered congested when more than this fraction of the frames is lost
+ */
+constexpr double BITRATE_LOSS_THRESHOLD = 0.02;
+/**
+ * Or when the RTT goes this much over the lowest recent one (queues are building up along the path)
+ */
+constexpr auto BITRATE_RTT_MARGIN = 30ms;
+/**
+ * The lowest RTT only holds for (at most) two windows of this length: a path that gets slower for good
+ * (ex: a new route) becomes the new baseline instead of looking congested forever
+ */
+constexpr auto BITRATE_RTT_WINDOW = 10s;
+/**
+ * Or when the host socket holds more than this much video at the current bitrate
+ */
+constexpr auto BITRATE_QUEUE_THRESHOLD = 50ms;
+
+/**
+ * On congestion the bitrate is multiplied by this, at most once every BITRATE_DECREASE_INTERVAL
+ */
+constexpr double BITRATE_DECREASE_FACTOR = 0.85;
+constexpr auto BITRATE_DECREASE_INTERVAL = 500ms;
+/**
+ * After BITRATE_INCREASE_AFTER without congestion, the bitrate grows by 1/BITRATE_INCREASE_STEPS of the max
+ * every BITRATE_INCREASE_INTERVAL
+ */
+constexpr auto BITRATE_INCREASE_AFTER = 2000ms;
+constexpr auto BITRATE_INCREASE_INTERVAL = 1000ms;
+constexpr int BITRATE_INCREASE_STEPS = 20;
+
+/**
+ * What has been observed on the link since the previous sample
+ */
+struct LinkSample {
+  std::chrono::milliseconds elapsed;
+  /* 0 when unknown */
+  std::chrono::milliseconds rtt;
+  /* Video waiting to be sent by the host */
+  std::uint64_t queued_bytes;
+};
+
+/**
+ * Picks the encoder bitrate of a single session, AIMD style: it's cut as soon as loss, a growing RTT or
+ * the host send queue show that the stream doesn't fit the link anymore, then slowly raised back to the max.
+ */
+struct BitrateController {
+  std::size_t session_id;
+  int fps;
+  long min_kbps;
+  /* The bitrate negotiated with the client, never exceeded */
+  long max_kbps;
+
+  long bitrate_kbps;
+
+  /* The baseline for the RTT growth: the lowest RTT of the previous and the current window */
+  std::chrono::milliseconds min_rtt = 0ms;
+  std::chrono::milliseconds window_min_rtt = 0ms;
+  std::chrono::milliseconds rtt_window_elapsed = 0ms;
+  /* Loss reported by the client since the last sample */
+  int lost_frames = 0;
+  std::chrono::milliseconds loss_interval = 0ms;
+
+  std::chrono::milliseconds since_last_decrease = 0ms;
+  std::chrono::milliseconds without_congestion = 0ms;
+  std::chrono::milliseconds since_last_increase = 0ms;
+
+  /* Stats */
+  std::uint64_t samples = 0;
+  std::uint64_t congested_samples = 0;
+  std::uint64_t increases = 0;
+  std::uint64_t decreases = 0;
+};
+
+BitrateController create_bitrate_controller(std::size_t session_id, int fps, long min_kbps, long max_kbps);
+
+/**
+ * Adds a LOSS_STATS report, it'll be taken into account on the next sample
+ */
+void record_loss(BitrateController &controller, const LossReport &report);
+
+/**
+ * @return the new encoder bitrate (in kbps), std::nullopt if it doesn't have to change
+ */
+std::optional<long> on_link_sample(BitrateController &controller, const LinkSample &sample);
+
+} // namespace streaming
@@ -40,9 +40,18 @@ struct VideoSession {
   int packet_size;
   int frames_with_invalid_ref_threshold;
   int fec_percentage;
+  /* Bounds for the adaptive FEC, see FecController */
+  int fec_percentage_min;
+  int fec_percentage_max;
   int min_required_fec_packets;
+  /* Threads shared by all the sessions to encode the FEC blocks of a frame in parallel, 0 encodes them inline */
+  int fec_workers;
   long bitrate_kbps;
+  /* See BitrateController, 0 keeps bitrate_kbps for the whole session */
+  long bitrate_min_kbps;
   int slices_per_frame;
+  /* Periodic intra refresh instead of IDR frames, when the encoder pipeline supports it */
+  bool intra_refresh;
 
   ColorRange color_range;
   ColorSpace color_space;
@@ -0,0 +1,119 @@
+#include <algorithm>
+#include <boost/endian/conversion.hpp>
+#include <helpers/logger.hpp>
+#include <moonlight/control.hpp>
+#include <streaming/fec_control.hpp>
+
+namespace streaming {
+
+using namespace moonlight::control;
+
+/**
+ * Weight of the latest report in the moving average of the frame loss
+ */
+constexpr double FRAME_LOSS_ALPHA = 0.2;
+
+std::optional<LossReport> parse_loss_stats(std::string_view payload) {
+  if (payload.size() < sizeof(ControlLossStatsPacket)) {
+    return std::nullopt;
+  }
+  auto pkt = (const ControlLossStatsPacket *)payload.data();
+  if (pkt->header.type != pkts::LOSS_STATS) {
+    return std::nullopt;
+  }
+  auto interval_ms = boost::endian::little_to_native(pkt->interval_ms);
+  auto lost_frames = boost::endian::little_to_native(pkt->lost_frames);
+  if (interval_ms <= 0 || lost_frames < 0) {
+    return std::nullopt;
+  }
+  return LossReport{.lost_frames = lost_frames,
+                    .interval = std::chrono::milliseconds(interval_ms),
+                    .last_good_frame = boost::endian::little_to_native(pkt->last_good_frame)};
+}
+
+/**
+ * Scales the extra required FEC packets with the FEC percentage, from none at the min to the max at the max
+ */
+static int required_fec_packets(const FecController &controller, int fec_percentage) {
+  if (controller.max_percentage <= controller.min_percentage) {
+    return controller.client_min_required_fec_packets;
+  }
+  return controller.client_min_required_fec_packets +
+         (fec_percentage - controller.min_percentage) * FEC_MAX_EXTRA_REQUIRED_PACKETS /
+             (controller.max_percentage - controller.min_percentage);
+}
+
+FecController create_fec_controller(std::size_t session_id,
+                                    int fps,
+                                    int min_percentage,
+                                    int max_percentage,
+                                    int initial_percentage,
+                                    int client_min_required_fec_packets) {
+  // FEC is never turned on or off while streaming, the payloader relies on it when sending slices
+  if (initial_percentage <= 0) {
+    min_percentage = max_percentage = 0;
+  }
+  min_percentage = std::clamp(min_percentage, initial_percentage > 0 ? 1 : 0, 100);
+  max_percentage = std::clamp(max_percentage, min_percentage, 100);
+  FecController controller = {.session_id = session_id,
+                              .fps = std::max(fps, 1),
+                              .min_percentage = min_percentage,
+                              .max_percentage = max_percentage,
+                              .client_min_required_fec_packets = client_min_required_fec_packets,
+                              .fec_percentage = std::clamp(initial_percentage, min_percentage, max_percentage)};
+  controller.min_required_fec_packets = required_fec_packets(controller, controller.fec_percentage);
+  // The first loss is acted upon straight away
+  controller.since_last_increase = FEC_INCREASE_INTERVAL;
+  return controller;
+}
+
+std::optional<FecUpdate> on_loss_report(FecController &controller, const LossReport &report) {
+  controller.reports++;
+  controller.lost_frames += report.lost_frames;
+  controller.since_last_increase += report.interval;
+
+  auto expected_frames = std::max(1.0, (double)controller.fps * report.interval.count() / 1000.0);
+  auto loss = std::min(1.0, report.lost_frames / expected_frames);
+  controller.frame_loss = FRAME_LOSS_ALPHA * loss + (1 - FRAME_LOSS_ALPHA) * controller.frame_loss;
+
+  auto fec_percentage = controller.fec_percentage;
+  if (controller.frame_loss >= FEC_INCREASE_LOSS) {
+    controller.without_loss = 0ms;
+    if (controller.since_last_increase >= FEC_INCREASE_INTERVAL) {
+      fec_percentage = std::min(fec_percentage + FEC_INCREASE_STEP, controller.max_percentage);
+    }
+  } else if (controller.frame_loss >= FEC_DECREASE_LOSS) {
+    controller.without_loss = 0ms;
+  } else {
+    controller.without_loss += report.interval;
+    if (controller.without_loss >= FEC_DECREASE_AFTER) {
+      fec_percentage = std::max(fec_percentage - FEC_DECREASE_STEP, controller.min_percentage);
+      controller.without_loss = 0ms;
+    }
+  }
+
+  if (fec_percentage == controller.fec_percentage) {
+    return std::nullopt;
+  }
+
+  if (fec_percentage > controller.fec_percentage) {
+    controller.increases++;
+    controller.since_last_increase = 0ms;
+  } else {
+    controller.decreases++;
+  }
+  auto min_required_fec_packets = required_fec_packets(controller, fec_percentage);
+  logs::log(logs::info,
+            "[FEC] Session {} frame loss {:.1f}%, FEC percentage {}% -> {}%, min required FEC packets {} -> {}",
+            controller.session_id,
+            controller.frame_loss * 100,
+            controller.fec_percentage,
+            fec_percentage,
+            controller.min_required_fec_packets,
+            min_required_fec_packets);
+  controller.fec_percentage = fec_percentage;
+  controller.min_required_fec_packets = min_required_fec_packets;
+  return FecUpdate{.fec_percentage = fec_percentage, .min_required_fec_packets = min_required_fec_packets};
+}
+
+} // namespace streaming
@@ -0,0 +1,97 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <optional>
+#include <string_view>
+
+namespace streaming {
+
+using namespace std::chrono_literals;
+
+/**
+ * The FEC percentage is raised by this much when the average frame loss goes above FEC_INCREASE_LOSS
+ */
+constexpr int FEC_INCREASE_STEP = 10;
+constexpr double FEC_INCREASE_LOSS = 0.01;
+/**
+ * And lowered by this much after the average frame loss stays below FEC_DECREASE_LOSS for FEC_DECREASE_AFTER
+ */
+constexpr int FEC_DECREASE_STEP = 5;
+constexpr double FEC_DECREASE_LOSS = 0.002;
+constexpr auto FEC_DECREASE_AFTER = 2000ms;
+/**
+ * A change needs a bit of time to show up in the client reports, no other increase is made until then
+ */
+constexpr auto FEC_INCREASE_INTERVAL = 250ms;
+/**
+ * On top of what the client asks for, at most this many more FEC packets are required at the max FEC percentage.
+ * Small frames (few data shards) would otherwise get little to no parity at all
+ */
+constexpr int FEC_MAX_EXTRA_REQUIRED_PACKETS = 2;
+
+/**
+ * A parsed LOSS_STATS control packet
+ */
+struct LossReport {
+  int lost_frames;
+  std::chrono::milliseconds interval;
+  std::uint64_t last_good_frame;
+};
+
+/**
+ * @param payload: the decrypted control packet, including its header
+ */
+std::optional<LossReport> parse_loss_stats(std::string_view payload);
+
+struct FecUpdate {
+  int fec_percentage;
+  int min_required_fec_packets;
+};
+
+/**
+ * Tracks the frame loss reported by a single client and picks the FEC settings of its video stream:
+ * a sustained frame loss quickly raises the protection, it's slowly lowered again while the link stays clean.
+ * Decisions are based on a moving average so that a single late frame on a long report interval is ignored.
+ */
+struct FecController {
+  std::size_t session_id;
+  int fps;
+  /* Bounds of the FEC percentage, when they are equal nothing will ever be changed */
+  int min_percentage;
+  int max_percentage;
+  /* As requested by the client over RTSP, it's never lowered */
+  int client_min_required_fec_packets;
+
+  /* Current settings */
+  int fec_percentage;
+  int min_required_fec_packets;
+
+  /* Moving average of the fraction of frames that are lost */
+  double frame_loss = 0;
+  /* Reported time since the last increase and with the frame loss below FEC_DECREASE_LOSS */
+  std::chrono::milliseconds since_last_increase = 0ms;
+  std::chrono::milliseconds without_loss = 0ms;
+
+  /* Stats */
+  std::uint64_t reports = 0;
+  std::uint64_t lost_frames = 0;
+  std::uint64_t increases = 0;
+  std::uint64_t decreases = 0;
+};
+
+FecController create_fec_controller(std::size_t session_id,
+                                    int fps,
+                                    int min_percentage,
+                                    int max_percentage,
+                                    int initial_percentage,
+                                    int client_min_required_fec_packets);
+
+/**
+ * Updates the loss estimate with a new report from the client
+ *
+ * @return the new settings to be applied to the payloader, std::nullopt if nothing has to change
+ */
+std::optional<FecUpdate> on_loss_report(FecController &controller, const LossReport &report);
+
+} // namespace streaming
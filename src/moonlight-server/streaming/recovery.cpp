@@ -0,0 +1,131 @@
+#include <algorithm>
+#include <boost/endian/conversion.hpp>
+#include <helpers/logger.hpp>
+#include <moonlight/control.hpp>
+#include <streaming/recovery.hpp>
+
+namespace streaming {
+
+using namespace moonlight::control;
+
+std::optional<RefFramesInvalidation> parse_invalidate_ref_frames(std::string_view payload) {
+  if (payload.size() < sizeof(ControlInvalidateRefFramesPacket)) {
+    return std::nullopt;
+  }
+  auto pkt = (const ControlInvalidateRefFramesPacket *)payload.data();
+  if (pkt->header.type != pkts::INVALIDATE_REF_FRAMES) {
+    return std::nullopt;
+  }
+  auto first_frame = boost::endian::little_to_native(pkt->first_frame);
+  auto last_frame = boost::endian::little_to_native(pkt->last_frame);
+  if (first_frame > last_frame) {
+    return std::nullopt;
+  }
+  return RefFramesInvalidation{.first_frame = first_frame, .last_frame = last_frame};
+}
+
+RecoveryController create_recovery_controller(std::size_t session_id,
+                                              bool supports_ref_invalidation,
+                                              int frames_with_invalid_ref_threshold) {
+  return {.session_id = session_id,
+          .supports_ref_invalidation = supports_ref_invalidation,
+          .frames_with_invalid_ref_threshold = std::max(frames_with_invalid_ref_threshold, 0)};
+}
+
+RecoveryAction on_invalidate_ref_frames(RecoveryController &controller, const RefFramesInvalidation &invalidation) {
+  controller.invalidations++;
+
+  // The client keeps reporting the same loss until it gets a frame it can decode, there's no need to act twice
+  if (controller.last_invalidated_frame && invalidation.last_frame <= *controller.last_invalidated_frame) {
+    controller.redundant++;
+    return RecoveryAction::NONE;
+  }
+  controller.last_invalidated_frame = invalidation.last_frame;
+
+  auto invalid_frames = invalidation.last_frame - invalidation.first_frame + 1;
+  auto within_threshold = controller.frames_with_invalid_ref_threshold == 0 ||
+                          invalid_frames <= (std::uint64_t)controller.frames_with_invalid_ref_threshold;
+  if (controller.supports_ref_invalidation && within_threshold) {
+    controller.ref_invalidations++;
+    logs::log(logs::debug,
+              "[RFI] Session {} invalidating frames {}-{}",
+              controller.session_id,
+              invalidation.first_frame,
+              invalidation.last_frame);
+    return RecoveryAction::INVALIDATE_REF_FRAMES;
+  }
+
+  controller.idr_fallbacks++;
+  logs::log(logs::debug,
+            "[RFI] Session {} can't invalidate frames {}-{}, falling back to IDR",
+            controller.session_id,
+            invalidation.first_frame,
+            invalidation.last_frame);
+  return RecoveryAction::IDR;
+}
+
+KeyframeGovernor create_keyframe_governor(std::size_t session_id) {
+  return {.session_id = session_id};
+}
+
+static void update_last_key_frame(KeyframeGovernor &governor, std::optional<std::chrono::nanoseconds> last_key_frame) {
+  if (last_key_frame) {
+    governor.last_key_frame = last_key_frame;
+  }
+}
+
+/**
+ * @return true if a key frame went through the payloader after `since`
+ */
+static bool key_frame_after(const KeyframeGovernor &governor, std::chrono::nanoseconds since) {
+  return governor.last_key_frame && *governor.last_key_frame >= since;
+}
+
+std::optional<std::chrono::nanoseconds> on_keyframe_request(KeyframeGovernor &governor,
+                                                            std::chrono::nanoseconds now,
+                                                            std::optional<std::chrono::nanoseconds> last_key_frame) {
+  governor.received++;
+  update_last_key_frame(governor, last_key_frame);
+
+  auto pending = governor.requested_at && !key_frame_after(governor, *governor.requested_at) &&
+                 now < *governor.requested_at + KEYFRAME_COALESCE_WINDOW;
+  if (pending || governor.deferred_since) {
+    governor.coalesced++;
+    logs::log(logs::trace, "[KEYFRAME] Session {} request merged into the pending one", governor.session_id);
+    return std::nullopt;
+  }
+
+  if (governor.last_key_frame && now < *governor.last_key_frame + KEYFRAME_MIN_INTERVAL) {
+    governor.deferred_since = now;
+    auto delay = *governor.last_key_frame + KEYFRAME_MIN_INTERVAL - now;
+    logs::log(logs::debug,
+              "[KEYFRAME] Session {} deferring key frame by {}ms",
+              governor.session_id,
+              std::chrono::duration_cast<std::chrono::milliseconds>(delay).count());
+    return delay;
+  }
+
+  governor.honored++;
+  governor.requested_at = now;
+  return 0ns;
+}
+
+bool on_deferred_keyframe(KeyframeGovernor &governor,
+                          std::chrono::nanoseconds now,
+                          std::optional<std::chrono::nanoseconds> last_key_frame) {
+  update_last_key_frame(governor, last_key_frame);
+  auto deferred_since = governor.deferred_since.value_or(now);
+  governor.deferred_since = std::nullopt;
+
+  if (key_frame_after(governor, deferred_since)) {
+    governor.coalesced++;
+    return false;
+  }
+
+  governor.honored++;
+  governor.deferred++;
+  governor.requested_at = now;
+  return true;
+}
+
+} // namespace streaming
@@ -0,0 +1,112 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <optional>
+#include <string_view>
+
+namespace streaming {
+
+using namespace std::chrono_literals;
+
+/**
+ * Key frame requests that come in while the previous one has yet to produce its key frame are merged into it,
+ * unless it has been pending for longer than this
+ */
+constexpr auto KEYFRAME_COALESCE_WINDOW = 200ms;
+/**
+ * A new key frame is never produced sooner than this after the previous one, requests are deferred until then
+ */
+constexpr auto KEYFRAME_MIN_INTERVAL = 500ms;
+
+/**
+ * A parsed INVALIDATE_REF_FRAMES control packet
+ */
+struct RefFramesInvalidation {
+  std::uint64_t first_frame;
+  std::uint64_t last_frame;
+};
+
+/**
+ * @param payload: the decrypted control packet, including its header
+ */
+std::optional<RefFramesInvalidation> parse_invalidate_ref_frames(std::string_view payload);
+
+enum class RecoveryAction {
+  /* The encoder is already recovering from these frames */
+  NONE,
+  /* Ask the encoder to stop referencing the lost frames, the stream goes on with P-frames */
+  INVALIDATE_REF_FRAMES,
+  /* Fall back to a full IDR frame */
+  IDR
+};
+
+/**
+ * Decides how a single session recovers from the frames that the client has lost
+ */
+struct RecoveryController {
+  std::size_t session_id;
+  /* True if the encoder can recover without an IDR frame */
+  bool supports_ref_invalidation;
+  /* As negotiated over RTSP: invalidations of more frames than this fall back to IDR, 0 means no limit */
+  int frames_with_invalid_ref_threshold;
+
+  /* The last frame that the encoder has already been asked to recover from */
+  std::optional<std::uint64_t> last_invalidated_frame;
+
+  /* Stats */
+  std::uint64_t invalidations = 0;
+  std::uint64_t redundant = 0;
+  std::uint64_t ref_invalidations = 0;
+  std::uint64_t idr_fallbacks = 0;
+};
+
+RecoveryController create_recovery_controller(std::size_t session_id,
+                                              bool supports_ref_invalidation,
+                                              int frames_with_invalid_ref_threshold);
+
+RecoveryAction on_invalidate_ref_frames(RecoveryController &controller, const RefFramesInvalidation &invalidation);
+
+/**
+ * Keeps the key frames of a single session apart: clients tend to send several IDR requests in a row when they lose
+ * packets, and back to back key frames would only saturate the link (and cause more loss).
+ * All the times are CLOCK_MONOTONIC.
+ */
+struct KeyframeGovernor {
+  std::size_t session_id;
+
+  /* When the payloader has seen the last key frame go through */
+  std::optional<std::chrono::nanoseconds> last_key_frame;
+  /* When the encoder has last been asked for a key frame */
+  std::optional<std::chrono::nanoseconds> requested_at;
+  /* Set while a request is waiting for KEYFRAME_MIN_INTERVAL to pass */
+  std::optional<std::chrono::nanoseconds> deferred_since;
+
+  /* Stats */
+  std::uint64_t received = 0;
+  std::uint64_t coalesced = 0;
+  std::uint64_t honored = 0;
+  std::uint64_t deferred = 0;
+};
+
+KeyframeGovernor create_keyframe_governor(std::size_t session_id);
+
+/**
+ * @param last_key_frame: when the last key frame went through the payloader, std::nullopt if none did yet
+ *
+ * @return how long to wait before asking the encoder for a key frame (0 means right away),
+ *         std::nullopt if the request has been merged into a previous one.
+ *         After waiting, on_deferred_keyframe() has the final say.
+ */
+std::optional<std::chrono::nanoseconds> on_keyframe_request(KeyframeGovernor &governor,
+                                                            std::chrono::nanoseconds now,
+                                                            std::optional<std::chrono::nanoseconds> last_key_frame);
+
+/**
+ * @return true if the encoder has to be asked for a key frame, false if one has been produced in the meantime
+ */
+bool on_deferred_keyframe(KeyframeGovernor &governor,
+                          std::chrono::nanoseconds now,
+                          std::optional<std::chrono::nanoseconds> last_key_frame);
+
+} // namespace streaming
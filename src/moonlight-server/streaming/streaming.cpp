@@ -1,5 +1,6 @@
 #include <control/control.hpp>
 #include <core/gstreamer.hpp>
+#include <cstring>
 #include <functional>
 #include <gst-plugin/video.hpp>
 #include <gstreamer-1.0/gst/app/gstappsink.h>
@@ -8,7 +9,10 @@
 #include <immer/array_transient.hpp>
 #include <immer/box.hpp>
 #include <memory>
+#include <streaming/bitrate_control.hpp>
 #include <streaming/data-structures.hpp>
+#include <streaming/fec_control.hpp>
+#include <streaming/recovery.hpp>
 #include <streaming/streaming.hpp>
 
 namespace streaming {
@@ -90,16 +94,201 @@ static void app_src_enough_data(GstElement *pipeline, guint size, GstAppDataStat
 using namespace wolf::core::gstreamer;
 
 /**
- * Start VIDEO pipeline
+ * @return the first element of the pipeline (including nested bins) that matches, nullptr if there's none
  */
-void start_streaming_video(const immer::box<state::VideoSession> &video_session,
-                           const std::shared_ptr<dp::event_bus> &event_bus,
-                           wolf::core::virtual_display::wl_state_ptr wl_ptr,
-                           unsigned short client_port) {
-  std::string color_range = (static_cast<int>(video_session->color_range) == static_cast<int>(state::JPEG)) ? "jpeg"
-                                                                                                            : "mpeg2";
+static gst_element_ptr find_element(GstElement *pipeline, const std::function<bool(GstElement *)> &predicate) {
+  gst_element_ptr found;
+  auto it = gst_bin_iterate_recurse(GST_BIN(pipeline));
+  GValue item = G_VALUE_INIT;
+  while (!found && gst_iterator_next(it, &item) == GST_ITERATOR_OK) {
+    auto element = GST_ELEMENT(g_value_get_object(&item));
+    if (predicate(element)) {
+      found = gst_element_ptr(GST_ELEMENT(gst_object_ref(element)), ::gst_object_unref);
+    }
+    g_value_reset(&item);
+  }
+  g_value_unset(&item);
+  gst_iterator_free(it);
+  return found;
+}
+
+static bool is_element(GstElement *element, std::string_view factory_name) {
+  auto factory = gst_element_get_factory(element);
+  return factory && factory_name == gst_plugin_feature_get_name(GST_PLUGIN_FEATURE(factory));
+}
+
+/**
+ * @return the property that sets the bitrate (in Kbps) of a video encoder, nullptr if it's not a video encoder
+ */
+static const char *encoder_bitrate_property(GstElement *element) {
+  auto factory = gst_element_get_factory(element);
+  auto klass = factory ? gst_element_factory_get_metadata(factory, GST_ELEMENT_METADATA_KLASS) : nullptr;
+  if (!klass || !std::strstr(klass, "Encoder") || !std::strstr(klass, "Video")) {
+    return nullptr;
+  }
+  // av1enc (aom) and svtav1enc use target-bitrate, all the others bitrate
+  for (auto property : {"bitrate", "target-bitrate"}) {
+    if (g_object_class_find_property(G_OBJECT_GET_CLASS(element), property)) {
+      return property;
+    }
+  }
+  return nullptr;
+}
+
+/**
+ * GStreamer has no API to invalidate reference frames, but when intra-refresh is enabled x264enc answers a force key
+ * unit request by starting a new intra refresh cycle instead of producing an IDR frame.
+ *
+ * @return true if the encoder uses periodic intra refresh, and can then recover from lost frames without an IDR frame
+ */
+static bool uses_intra_refresh(GstElement *encoder) {
+  if (!encoder || !is_element(encoder, "x264enc")) {
+    return false;
+  }
+  gboolean intra_refresh = FALSE;
+  g_object_get(encoder, "intra-refresh", &intra_refresh, NULL);
+  return intra_refresh;
+}
+
+/**
+ * Asks the encoder for a new key unit; see: https://github.com/centricular/gstwebrtc-demos/issues/186
+ * https://gstreamer.freedesktop.org/documentation/additional/design/keyframe-force.html?gi-language=c
+ *
+ * The encoder copies `count` into the downstream GstForceKeyUnit event that it pushes with the frame answering it.
+ */
+static void force_key_unit(GstElement *pipeline, guint count) {
+  send_message(pipeline,
+               gst_structure_new("GstForceKeyUnit",
+                                 "all-headers",
+                                 G_TYPE_BOOLEAN,
+                                 TRUE,
+                                 "count",
+                                 G_TYPE_UINT,
+                                 count,
+                                 NULL));
+}
+
+/**
+ * The IDR requests of a video session, see KeyframeGovernor.
+ * They are all handled on the pipeline main loop so that deferred ones can simply wait there on a timeout source.
+ */
+struct KeyframeRequests {
+  KeyframeGovernor governor;
+  gst_element_ptr pipeline;
+  /* Where the key frames are seen going through, might be nullptr */
+  gst_element_ptr payloader;
+  /* Owned by run_pipeline(), valid until the event handlers have been unregistered */
+  GMainContext *context;
+  /* Set when the deferred request has to recover from a reference frame invalidation */
+  bool deferred_invalidation = false;
+};
+
+using keyframe_requests_ptr = std::shared_ptr<KeyframeRequests>;
+
+static std::optional<std::chrono::nanoseconds> last_key_frame(GstElement *payloader) {
+  guint64 last_key_frame_ns = 0;
+  if (payloader) {
+    g_object_get(payloader, "last_key_frame_ns", &last_key_frame_ns, NULL);
+  }
+  if (last_key_frame_ns == 0) {
+    return std::nullopt;
+  }
+  return std::chrono::nanoseconds(last_key_frame_ns);
+}
+
+/**
+ * Runs on_ready on the pipeline main loop, after the given delay
+ */
+static void on_pipeline_loop(const keyframe_requests_ptr &requests,
+                             std::chrono::nanoseconds delay,
+                             gboolean (*on_ready)(gpointer requests)) {
+  auto source = delay > 0ns ? g_timeout_source_new((guint)std::chrono::ceil<std::chrono::milliseconds>(delay).count())
+                            : g_idle_source_new();
+  g_source_set_callback(source, on_ready, new keyframe_requests_ptr(requests), [](gpointer data) {
+    delete (keyframe_requests_ptr *)data;
+  });
+  g_source_attach(source, requests->context);
+  g_source_unref(source);
+}
+
+/**
+ * Must only be called once the governor has let the request through: the key units are numbered after
+ * KeyframeGovernor::honored, the payloader will only mark the frame that answers the one that recovers from a
+ * reference frame invalidation.
+ */
+static void send_key_unit(KeyframeRequests &requests, bool invalidate_ref_frames) {
+  auto count = (guint)requests.governor.honored;
+  if (requests.payloader) {
+    // Any other key unit clears it: the frame answering it will be a regular (key) frame
+    g_object_set(requests.payloader.get(), "recovery_key_unit", invalidate_ref_frames ? count : 0u, NULL);
+  }
+  force_key_unit(requests.pipeline.get(), count);
+}
+
+static gboolean on_deferred_keyframe_ready(gpointer data) {
+  auto &requests = *(keyframe_requests_ptr *)data;
+  auto now = std::chrono::nanoseconds(monotonic_now_ns());
+  auto invalidate_ref_frames = std::exchange(requests->deferred_invalidation, false);
+  if (on_deferred_keyframe(requests->governor, now, last_key_frame(requests->payloader.get()))) {
+    logs::log(logs::debug, "[GSTREAMER] Forcing IDR (deferred)");
+    send_key_unit(*requests, invalidate_ref_frames);
+  }
+  return G_SOURCE_REMOVE;
+}
+
+/**
+ * @return true if the encoder has been asked for a key unit straight away. A request merged into a pending key unit
+ *         leaves the frame answering it unmarked, a deferred one is sent (or merged) later.
+ */
+static bool handle_keyframe_request(const keyframe_requests_ptr &requests, bool invalidate_ref_frames) {
+  auto now = std::chrono::nanoseconds(monotonic_now_ns());
+  auto delay = on_keyframe_request(requests->governor, now, last_key_frame(requests->payloader.get()));
+  if (!delay) {
+    return false;
+  }
+  if (*delay > 0ns) {
+    requests->deferred_invalidation |= invalidate_ref_frames;
+    on_pipeline_loop(requests, *delay, on_deferred_keyframe_ready);
+    return false;
+  }
+
+  logs::log(logs::debug, "[GSTREAMER] Forcing IDR");
+  send_key_unit(*requests, invalidate_ref_frames);
+  return true;
+}
+
+static gboolean on_keyframe_request_ready(gpointer data) {
+  handle_keyframe_request(*(keyframe_requests_ptr *)data, false);
+  return G_SOURCE_REMOVE;
+}
+
+static gboolean on_ref_frames_invalidation_ready(gpointer data) {
+  if (!handle_keyframe_request(*(keyframe_requests_ptr *)data, true)) {
+    logs::log(logs::debug, "[RFI] Recovery key unit merged or deferred by the keyframe governor");
+  }
+  return G_SOURCE_REMOVE;
+}
+
+/**
+ * Asks for an IDR frame, the request goes through the session KeyframeGovernor first
+ */
+static void request_keyframe(const keyframe_requests_ptr &requests) {
+  on_pipeline_loop(requests, 0ns, on_keyframe_request_ready);
+}
+
+/**
+ * Asks the encoder to stop referencing the lost frames (a new intra refresh cycle), as any other key unit it goes
+ * through the session KeyframeGovernor first
+ */
+static void request_ref_frames_invalidation(const keyframe_requests_ptr &requests) {
+  on_pipeline_loop(requests, 0ns, on_ref_frames_invalidation_ready);
+}
+
+std::string video_pipeline(const state::VideoSession &video_session, unsigned short client_port) {
+  std::string color_range = (static_cast<int>(video_session.color_range) == static_cast<int>(state::JPEG)) ? "jpeg"
+                                                                                                           : "mpeg2";
   std::string color_space;
-  switch (static_cast<int>(video_session->color_space)) {
+  switch (static_cast<int>(video_session.color_space)) {
   case state::BT601:
     color_space = "bt601";
     break;
@@ -111,20 +300,36 @@ void start_streaming_video(const immer::box<state::VideoSession> &video_session,
     break;
   }
 
-  auto pipeline = fmt::format(video_session->gst_pipeline,
-                              fmt::arg("width", video_session->display_mode.width),
-                              fmt::arg("height", video_session->display_mode.height),
-                              fmt::arg("fps", video_session->display_mode.refreshRate),
-                              fmt::arg("bitrate", video_session->bitrate_kbps),
-                              fmt::arg("client_port", client_port),
-                              fmt::arg("client_ip", video_session->client_ip),
-                              fmt::arg("payload_size", video_session->packet_size),
-                              fmt::arg("fec_percentage", video_session->fec_percentage),
-                              fmt::arg("min_required_fec_packets", video_session->min_required_fec_packets),
-                              fmt::arg("slices_per_frame", video_session->slices_per_frame),
-                              fmt::arg("color_space", color_space),
-                              fmt::arg("color_range", color_range),
-                              fmt::arg("host_port", video_session->port));
+  return fmt::format(video_session.gst_pipeline,
+                     fmt::arg("width", video_session.display_mode.width),
+                     fmt::arg("height", video_session.display_mode.height),
+                     fmt::arg("fps", video_session.display_mode.refreshRate),
+                     fmt::arg("bitrate", video_session.bitrate_kbps),
+                     fmt::arg("client_port", client_port),
+                     fmt::arg("client_ip", video_session.client_ip),
+                     fmt::arg("payload_size", video_session.packet_size),
+                     fmt::arg("fec_percentage", video_session.fec_percentage),
+                     fmt::arg("min_required_fec_packets", video_session.min_required_fec_packets),
+                     fmt::arg("fec_workers", video_session.fec_workers),
+                     fmt::arg("slices_per_frame", video_session.slices_per_frame),
+                     fmt::arg("intra_refresh", video_session.intra_refresh),
+                     // x264 only refreshes the picture once per keyint, without intra refresh IDRs are only on demand
+                     fmt::arg("x264_keyint",
+                              video_session.intra_refresh ? std::to_string(video_session.display_mode.refreshRate)
+                                                          : std::string("infinite")),
+                     fmt::arg("color_space", color_space),
+                     fmt::arg("color_range", color_range),
+                     fmt::arg("host_port", video_session.port));
+}
+
+/**
+ * Start VIDEO pipeline
+ */
+void start_streaming_video(const immer::box<state::VideoSession> &video_session,
+                           const std::shared_ptr<dp::event_bus> &event_bus,
+                           wolf::core::virtual_display::wl_state_ptr wl_ptr,
+                           unsigned short client_port) {
+  auto pipeline = video_pipeline(*video_session, client_port);
   logs::log(logs::debug, "Starting video pipeline: \n{}", pipeline);
 
   auto appsrc_state = custom_src::setup_app_src(video_session, std::move(wl_ptr));
@@ -156,18 +361,182 @@ void start_streaming_video(const immer::box<state::VideoSession> &video_session,
     /*
      * The force IDR event will be triggered by the control stream.
      * We have to pass this back into the gstreamer pipeline
-     * in order to force the encoder to produce a new IDR packet
+     * in order to force the encoder to produce a new IDR packet.
+     * Clients send them in bursts, see KeyframeGovernor.
      */
+    auto payloader =
+        find_element(pipeline.get(), [](GstElement *el) { return is_element(el, "rtpmoonlightpay_video"); });
+    auto keyframe_requests = keyframe_requests_ptr(
+        new KeyframeRequests{.governor = create_keyframe_governor(video_session->session_id),
+                             .pipeline = pipeline,
+                             .payloader = payloader,
+                             .context = g_main_loop_get_context(loop.get())},
+        [](const KeyframeRequests *requests) {
+          logs::log(logs::debug,
+                    "[KEYFRAME] Session {} IDR requests received: {}, coalesced: {}, honored: {} ({} deferred)",
+                    requests->governor.session_id,
+                    requests->governor.received,
+                    requests->governor.coalesced,
+                    requests->governor.honored,
+                    requests->governor.deferred);
+          delete requests;
+        });
     auto idr_handler = event_bus->register_handler<immer::box<control::ControlEvent>>(
-        [sess_id = video_session->session_id, pipeline](const immer::box<control::ControlEvent> &ctrl_ev) {
+        [sess_id = video_session->session_id, keyframe_requests](const immer::box<control::ControlEvent> &ctrl_ev) {
           if (ctrl_ev->session_id == sess_id) {
             if (ctrl_ev->type == moonlight::control::pkts::IDR_FRAME) {
-              logs::log(logs::debug, "[GSTREAMER] Forcing IDR");
-              // Force IDR event, see: https://github.com/centricular/gstwebrtc-demos/issues/186
-              // https://gstreamer.freedesktop.org/documentation/additional/design/keyframe-force.html?gi-language=c
-              wolf::core::gstreamer::send_message(
-                  pipeline.get(),
-                  gst_structure_new("GstForceKeyUnit", "all-headers", G_TYPE_BOOLEAN, TRUE, NULL));
+              request_keyframe(keyframe_requests);
+            }
+          }
+        });
+
+    /*
+     * The client periodically reports how many frames have been lost,
+     * the FEC settings of the payloader are adjusted accordingly
+     */
+    auto fec_controller = std::shared_ptr<FecController>(
+        new FecController(create_fec_controller(video_session->session_id,
+                                                video_session->display_mode.refreshRate,
+                                                video_session->fec_percentage_min,
+                                                video_session->fec_percentage_max,
+                                                video_session->fec_percentage,
+                                                video_session->min_required_fec_packets)),
+        [](const FecController *controller) {
+          logs::log(logs::debug,
+                    "[FEC] Session {} loss reports: {}, lost frames: {}, FEC increases: {}, decreases: {}, "
+                    "final FEC percentage: {}%",
+                    controller->session_id,
+                    controller->reports,
+                    controller->lost_frames,
+                    controller->increases,
+                    controller->decreases,
+                    controller->fec_percentage);
+          delete controller;
+        });
+    /*
+     * The encoder bitrate follows the link capacity, see BitrateController.
+     * When no min bitrate is set it'll stay at the bitrate negotiated with the client.
+     */
+    auto bitrate_controller = std::shared_ptr<BitrateController>(
+        new BitrateController(create_bitrate_controller(
+            video_session->session_id,
+            video_session->display_mode.refreshRate,
+            video_session->bitrate_min_kbps > 0 ? video_session->bitrate_min_kbps : video_session->bitrate_kbps,
+            video_session->bitrate_kbps)),
+        [](const BitrateController *controller) {
+          logs::log(logs::debug,
+                    "[BITRATE] Session {} samples: {}, congested: {}, increases: {}, decreases: {}, "
+                    "final bitrate: {} Kbps",
+                    controller->session_id,
+                    controller->samples,
+                    controller->congested_samples,
+                    controller->increases,
+                    controller->decreases,
+                    controller->bitrate_kbps);
+          delete controller;
+        });
+    auto encoder = find_element(pipeline.get(), [](GstElement *el) { return encoder_bitrate_property(el) != nullptr; });
+    auto udp_sink = find_element(pipeline.get(), [](GstElement *el) { return is_element(el, "moonlightudpsink"); });
+    if (!encoder && bitrate_controller->min_kbps < bitrate_controller->max_kbps) {
+      logs::log(logs::warning, "[BITRATE] Unable to find the video encoder, the bitrate will not be adjusted");
+    }
+
+    auto link_handler = event_bus->register_handler<immer::box<control::ClientStatsEvent>>(
+        [sess_id = video_session->session_id, bitrate_controller, encoder, udp_sink](
+            const immer::box<control::ClientStatsEvent> &ev) {
+          if (ev->session_id != sess_id || !encoder) {
+            return;
+          }
+          guint64 queued_bytes = 0;
+          if (udp_sink) {
+            g_object_get(udp_sink.get(), "queued-bytes", &queued_bytes, NULL);
+          }
+          auto sample =
+              LinkSample{.elapsed = control::CLIENT_STATS_INTERVAL, .rtt = ev->rtt, .queued_bytes = queued_bytes};
+          if (auto bitrate_kbps = on_link_sample(*bitrate_controller, sample)) {
+            GValue value = G_VALUE_INIT;
+            g_value_init(&value, G_TYPE_INT);
+            g_value_set_int(&value, (int)*bitrate_kbps);
+            // Converted to whatever type the encoder uses (int or uint)
+            g_object_set_property(G_OBJECT(encoder.get()), encoder_bitrate_property(encoder.get()), &value);
+            g_value_unset(&value);
+          }
+        });
+
+    /*
+     * With periodic intra refresh there are no key frames after the first one, frame sizes stay flat:
+     * IDR requests start a new refresh cycle and P-frames are marked as carrying intra refresh blocks
+     */
+    auto intra_refresh = uses_intra_refresh(encoder.get());
+    if (payloader) {
+      g_object_set(payloader.get(), "intra_refresh", (gboolean)intra_refresh, NULL);
+    }
+    if (video_session->intra_refresh && !intra_refresh) {
+      logs::log(logs::warning, "[GSTREAMER] The video encoder doesn't support intra refresh, using IDR frames");
+    }
+
+    /*
+     * When the client loses a frame it asks for the following ones to stop referencing it.
+     * Encoders that can't do that will produce an IDR frame instead.
+     */
+    auto recovery_controller = std::shared_ptr<RecoveryController>(
+        new RecoveryController(create_recovery_controller(video_session->session_id,
+                                                          intra_refresh,
+                                                          video_session->frames_with_invalid_ref_threshold)),
+        [](const RecoveryController *controller) {
+          logs::log(logs::debug,
+                    "[RFI] Session {} invalidations: {}, redundant: {}, recovered with P-frames: {}, with IDR: {}",
+                    controller->session_id,
+                    controller->invalidations,
+                    controller->redundant,
+                    controller->ref_invalidations,
+                    controller->idr_fallbacks);
+          delete controller;
+        });
+    auto rfi_handler = event_bus->register_handler<immer::box<control::ControlEvent>>(
+        [sess_id = video_session->session_id, recovery_controller, keyframe_requests](
+            const immer::box<control::ControlEvent> &ctrl_ev) {
+          if (ctrl_ev->session_id != sess_id || ctrl_ev->type != moonlight::control::pkts::INVALIDATE_REF_FRAMES) {
+            return;
+          }
+          auto invalidation = parse_invalidate_ref_frames(ctrl_ev->raw_packet);
+          if (!invalidation) {
+            logs::log(logs::warning, "[RFI] Invalid packet of {} bytes", ctrl_ev->raw_packet.size());
+            return;
+          }
+          switch (on_invalidate_ref_frames(*recovery_controller, *invalidation)) {
+          case RecoveryAction::NONE:
+            break;
+          case RecoveryAction::INVALIDATE_REF_FRAMES:
+            request_ref_frames_invalidation(keyframe_requests);
+            break;
+          case RecoveryAction::IDR:
+            request_keyframe(keyframe_requests);
+            break;
+          }
+        });
+
+    auto loss_handler = event_bus->register_handler<immer::box<control::ControlEvent>>(
+        [sess_id = video_session->session_id, pipeline, fec_controller, bitrate_controller](
+            const immer::box<control::ControlEvent> &ctrl_ev) {
+          if (ctrl_ev->session_id != sess_id || ctrl_ev->type != moonlight::control::pkts::LOSS_STATS) {
+            return;
+          }
+          auto report = parse_loss_stats(ctrl_ev->raw_packet);
+          if (!report) {
+            logs::log(logs::warning, "[FEC] Invalid loss stats packet of {} bytes", ctrl_ev->raw_packet.size());
+            return;
+          }
+          record_loss(*bitrate_controller, *report);
+          if (auto update = on_loss_report(*fec_controller, *report)) {
+            if (auto payloader = gst_bin_get_by_name(GST_BIN(pipeline.get()), "moonlight_pay")) {
+              g_object_set(payloader,
+                           "fec_percentage",
+                           update->fec_percentage,
+                           "min_required_fec_packets",
+                           update->min_required_fec_packets,
+                           NULL);
+              gst_object_unref(payloader);
             }
           }
         });
@@ -202,6 +571,9 @@ void start_streaming_video(const immer::box<state::VideoSession> &video_session,
         });
 
     return immer::array<immer::box<dp::handler_registration>>{std::move(idr_handler),
+                                                              std::move(rfi_handler),
+                                                              std::move(loss_handler),
+                                                              std::move(link_handler),
                                                               std::move(pause_handler),
                                                               std::move(stop_handler)};
   });
@@ -4,6 +4,7 @@
 #include <core/virtual-display.hpp>
 #include <fmt/core.h>
 #include <fmt/format.h>
+#include <gst-plugin/gstmoonlightudpsink.hpp>
 #include <gst-plugin/gstrtpmoonlightpay_audio.hpp>
 #include <gst-plugin/gstrtpmoonlightpay_video.hpp>
 #include <gst/gst.h>
@@ -13,6 +14,11 @@
 
 namespace streaming {
 
+/**
+ * @return the GStreamer pipeline of the video session, with all the placeholders filled in
+ */
+std::string video_pipeline(const state::VideoSession &video_session, unsigned short client_port);
+
 void start_streaming_video(const immer::box<state::VideoSession> &video_session,
                            const std::shared_ptr<dp::event_bus> &event_bus,
                            wolf::core::virtual_display::wl_state_ptr wl_state,
@@ -50,7 +56,11 @@ inline void init() {
   GstPlugin *audio_plugin = gst_plugin_load_by_name("rtpmoonlightpay_audio");
   gst_element_register(audio_plugin, "rtpmoonlightpay_audio", GST_RANK_PRIMARY, gst_TYPE_rtp_moonlight_pay_audio);
 
+  GstPlugin *udp_sink_plugin = gst_plugin_load_by_name("moonlightudpsink");
+  gst_element_register(udp_sink_plugin, "moonlightudpsink", GST_RANK_NONE, gst_TYPE_moonlight_udp_sink);
+
   moonlight::fec::init();
+  logs::log(logs::info, "FEC kernel: {}", moonlight::fec::kernel_name());
 }
 
 } // namespace streaming
\ No newline at end of file
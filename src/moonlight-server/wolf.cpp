@@ -79,7 +79,7 @@ auto initialize(std::string_view config_file, std::string_view pkey_filename, st
       .host = host,
       .pairing_cache = std::make_shared<immer::atom<immer::map<std::string, state::PairCache>>>(),
       .event_bus = event_bus,
-      .running_sessions = std::make_shared<immer::atom<immer::vector<state::StreamSession>>>()};
+      .running_sessions = std::make_shared<immer::atom<state::SessionsRegistry>>()};
   return immer::box<state::AppState>(state);
 }
 
@@ -153,9 +153,8 @@ auto setup_sessions_handlers(const immer::box<state::AppState> &app_state,
   handlers.push_back(app_state->event_bus->register_handler<immer::box<StopStreamEvent>>(
       [&app_state, wayland_sessions, plugged_devices_queue](const immer::box<StopStreamEvent> &ev) {
         // Remove session from app state so that HTTP/S applist gets updated
-        app_state->running_sessions->update([&ev](const immer::vector<state::StreamSession> &ses_v) {
-          return remove_session(ses_v, {.session_id = ev->session_id});
-        });
+        app_state->running_sessions->update(
+            [&ev](const state::SessionsRegistry &sessions) { return remove_session(sessions, ev->session_id); });
 
         // On termination cleanup the WaylandSession; since this is the only reference to it
         // this will effectively destroy the virtual Wayland session
@@ -459,8 +458,9 @@ void run() {
   }).detach();
 
   // Control
-  std::thread([sessions = local_state->running_sessions, ev_bus = local_state->event_bus]() {
-    control::run_control(state::CONTROL_PORT, sessions, ev_bus);
+  auto control_workers = std::stoul(utils::get_env("WOLF_CONTROL_WORKERS", "1"));
+  std::thread([sessions = local_state->running_sessions, ev_bus = local_state->event_bus, control_workers]() {
+    control::run_control(state::CONTROL_PORT, sessions, ev_bus, 20, 1000ms, "0.0.0.0", control_workers);
   }).detach();
 
   auto audio_server = setup_audio_server(runtime_dir);
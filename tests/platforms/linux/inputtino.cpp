@@ -7,6 +7,7 @@
 #include <catch2/matchers/catch_matchers_vector.hpp>
 #include <chrono>
 #include <control/input_handler.hpp>
+#include <fstream>
 #include <platforms/input.hpp>
 #include <platforms/linux/uinput/uinput.hpp>
 #include <thread>
@@ -349,6 +350,123 @@ TEST_CASE("uinput - joypad", "[UINPUT]") {
   }
 }
 
+static XboxOneJoypad create_xbox_joypad() {
+  auto result = XboxOneJoypad::create(
+      {.name = "Wolf X-Box One (virtual) pad", .vendor_id = 0x045E, .product_id = 0x02EA, .version = 0x0408});
+  if (!result) {
+    FAIL(result.getErrorMessage());
+  }
+  return XboxOneJoypad(std::move(*result));
+}
+
+static std::string event_node(const std::vector<std::string> &nodes) {
+  for (const auto &node : nodes) {
+    if (node.find("event") != std::string::npos) {
+      return node;
+    }
+  }
+  return {};
+}
+
+TEST_CASE("uinput - joypad batched state", "[UINPUT]") {
+  auto joypad = create_xbox_joypad();
+  libevdev_ptr joypad_dev(libevdev_new(), ::libevdev_free);
+  link_devnode(joypad_dev.get(), event_node(joypad.get_nodes()));
+
+  auto state = JoypadState{.buttons = inputtino::Joypad::A | inputtino::Joypad::DPAD_UP, .ls_x = 1000, .ls_y = 2000};
+  joypad.set_state(state);
+  auto events = fetch_events_debug(joypad_dev);
+  REQUIRE(events.size() == 4);
+  REQUIRE_THAT(libevdev_event_code_get_name(events[0]->type, events[0]->code), Equals("ABS_HAT0Y"));
+  REQUIRE(events[0]->value == -1);
+  REQUIRE_THAT(libevdev_event_code_get_name(events[1]->type, events[1]->code), Equals("BTN_SOUTH"));
+  REQUIRE(events[1]->value == 1);
+  REQUIRE_THAT(libevdev_event_code_get_name(events[2]->type, events[2]->code), Equals("ABS_X"));
+  REQUIRE(events[2]->value == 1000);
+  REQUIRE_THAT(libevdev_event_code_get_name(events[3]->type, events[3]->code), Equals("ABS_Y"));
+  REQUIRE(events[3]->value == -2000);
+
+  // Nothing has changed, nothing should be written
+  joypad.set_state(state);
+  REQUIRE(fetch_events_debug(joypad_dev).empty());
+
+  // Only the changes are written
+  state.buttons = inputtino::Joypad::A;
+  state.right_trigger = 255;
+  joypad.set_state(state);
+  events = fetch_events_debug(joypad_dev);
+  REQUIRE(events.size() == 2);
+  REQUIRE_THAT(libevdev_event_code_get_name(events[0]->type, events[0]->code), Equals("ABS_HAT0Y"));
+  REQUIRE(events[0]->value == 0);
+  REQUIRE_THAT(libevdev_event_code_get_name(events[1]->type, events[1]->code), Equals("ABS_RZ"));
+  REQUIRE(events[1]->value == 255);
+
+  // The pressed buttons are shared with the inputtino setters
+  joypad.set_pressed_buttons(0);
+  events = fetch_events_debug(joypad_dev);
+  REQUIRE(events.size() == 1);
+  REQUIRE_THAT(libevdev_event_code_get_name(events[0]->type, events[0]->code), Equals("BTN_SOUTH"));
+  REQUIRE(events[0]->value == 0);
+
+  joypad.set_state(state);
+  events = fetch_events_debug(joypad_dev);
+  REQUIRE(events.size() == 1);
+  REQUIRE_THAT(libevdev_event_code_get_name(events[0]->type, events[0]->code), Equals("BTN_SOUTH"));
+  REQUIRE(events[0]->value == 1);
+}
+
+/**
+ * The number of write() syscalls made so far by this process
+ */
+static long write_syscalls() {
+  std::ifstream io("/proc/self/io");
+  std::string key;
+  long value;
+  while (io >> key >> value) {
+    if (key == "syscw:") {
+      return value;
+    }
+  }
+  return -1;
+}
+
+TEST_CASE("uinput - joypad syscalls per packet", "[UINPUT][.benchmark]") {
+  auto joypad = create_xbox_joypad();
+  constexpr int nr_packets = 1000;
+
+  // A typical stream: the left stick moving on every packet, a button pressed every now and then
+  auto packet_state = [](int i) {
+    return JoypadState{.buttons = (i / 50) % 2 ? (unsigned int)inputtino::Joypad::A : 0u,
+                       .ls_x = (short)(i * 10),
+                       .ls_y = (short)(-i * 10),
+                       .left_trigger = 0,
+                       .right_trigger = 0};
+  };
+
+  auto before = write_syscalls();
+  for (int i = 0; i < nr_packets; i++) {
+    auto state = packet_state(i);
+    joypad.set_pressed_buttons(state.buttons);
+    joypad.set_stick(inputtino::Joypad::LS, state.ls_x, state.ls_y);
+    joypad.set_stick(inputtino::Joypad::RS, state.rs_x, state.rs_y);
+    joypad.set_triggers(state.left_trigger, state.right_trigger);
+  }
+  auto per_packet_writes = (double)(write_syscalls() - before) / nr_packets;
+
+  before = write_syscalls();
+  for (int i = 0; i < nr_packets; i++) {
+    joypad.set_state(packet_state(i));
+  }
+  auto batched_writes = (double)(write_syscalls() - before) / nr_packets;
+
+  logs::log(logs::info,
+            "[BENCHMARK] Joypad write() syscalls per controller packet: {:.2f} unbatched, {:.2f} batched",
+            per_packet_writes,
+            batched_writes);
+  REQUIRE(batched_writes <= 1.0);
+  REQUIRE(batched_writes < per_packet_writes);
+}
+
 TEST_CASE("uinput - paste UTF8", "[UINPUT]") {
 
   SECTION("UTF8 to HEX") {
@@ -1,9 +1,27 @@
+#include <catch2/benchmark/catch_benchmark.hpp>
 #include <catch2/catch_test_macros.hpp>
 #include <catch2/matchers/catch_matchers_string.hpp>
 
 using Catch::Matchers::Equals;
 
+#include <climits>
+#include <cmath>
+#include <control/control.hpp>
+#include <control/input_dispatcher.hpp>
+#include <control/outbound.hpp>
+#include <enet/enet.h>
+#include <future>
+#include <map>
 #include <moonlight/control.hpp>
+#include <mutex>
+#include <numeric>
+#include <random>
+#include <set>
+#include <state/sessions.hpp>
+#include <streaming/bitrate_control.hpp>
+#include <streaming/fec_control.hpp>
+#include <streaming/recovery.hpp>
+#include <thread>
 using namespace moonlight::control;
 
 static std::string to_string(const ControlEncryptedPacket &packet) {
@@ -78,6 +96,67 @@ TEST_CASE("Control AES Encryption", "CONTROL") {
   }
 }
 
+TEST_CASE("Control AES re-usable contexts", "CONTROL") {
+  std::string aes_key = "EDF04A215C4FBEA20934120C8480D855";
+  auto cipher = create_cipher(aes_key);
+
+  // Should be byte for byte the same as the packets built with a new context every time
+  for (std::uint32_t seq = 0; seq < 300; seq++) {
+    auto payload = crypto::random(1 + seq % MAX_PAYLOAD_SIZE);
+
+    auto expected = *encrypt_packet(aes_key, seq, payload);
+    ControlEncryptedPacket encrypted_packet;
+    encrypt_packet(cipher, seq, payload, encrypted_packet);
+    REQUIRE_THAT(crypto::str_to_hex(to_string(encrypted_packet)), Equals(crypto::str_to_hex(to_string(expected))));
+
+    decrypted_buffer decrypted_data;
+    auto decrypted = decrypt_packet(encrypted_packet, cipher, decrypted_data);
+    REQUIRE_THAT(std::string(decrypted), Equals(decrypt_packet(expected, aes_key)));
+    REQUIRE_THAT(std::string(decrypted), Equals(payload));
+  }
+
+  SECTION("Tampered packets are refused") {
+    ControlEncryptedPacket encrypted_packet;
+    encrypt_packet(cipher, 1, crypto::hex_to_str("0703010000"), encrypted_packet);
+    encrypted_packet.payload[0] ^= 0x01;
+
+    decrypted_buffer decrypted_data;
+    REQUIRE_THROWS(decrypt_packet(encrypted_packet, cipher, decrypted_data));
+
+    // The context can still be used after a failure
+    encrypted_packet.payload[0] ^= 0x01;
+    REQUIRE_THAT(std::string(decrypt_packet(encrypted_packet, cipher, decrypted_data)),
+                 Equals(crypto::hex_to_str("0703010000")));
+  }
+}
+
+TEST_CASE("Control AES Encryption benchmark", "[CONTROL][.benchmark]") {
+  std::string aes_key = "EDF04A215C4FBEA20934120C8480D855";
+  auto cipher = create_cipher(aes_key);
+  // A relative mouse movement
+  auto payload = crypto::hex_to_str("060212000000000E05000000033400C00000059F0329");
+  auto encrypted_packet = *encrypt_packet(aes_key, 6, payload);
+
+  BENCHMARK("Decrypt, new context") {
+    return decrypt_packet(encrypted_packet, aes_key);
+  };
+
+  BENCHMARK("Decrypt, re-used context") {
+    decrypted_buffer decrypted_data;
+    return decrypt_packet(encrypted_packet, cipher, decrypted_data).size();
+  };
+
+  BENCHMARK("Encrypt, new context") {
+    return encrypt_packet(aes_key, 6, payload);
+  };
+
+  BENCHMARK("Encrypt, re-used context") {
+    ControlEncryptedPacket packet;
+    encrypt_packet(cipher, 6, payload, packet);
+    return packet.full_size();
+  };
+}
+
 TEST_CASE("control joypad input packets") {
   std::string payload =
       crypto::hex_to_str("060222000000001E0C0000001A000000010014000010000000000000000000009C0000005500");
@@ -88,4 +167,975 @@ TEST_CASE("control joypad input packets") {
   REQUIRE(input_data->type == pkts::CONTROLLER_MULTI);
   REQUIRE(input_data->active_gamepad_mask == 1);
   REQUIRE(pressed_btns & pkts::CONTROLLER_BTN::A);
-}
\ No newline at end of file
+}
+
+static std::string rumble_payload(std::uint16_t controller_number, std::uint16_t low_freq) {
+  auto pkt = ControlRumblePacket{
+      .header = {.type = pkts::RUMBLE_DATA, .length = sizeof(ControlRumblePacket) - sizeof(ControlPacket)},
+      .controller_number = boost::endian::native_to_little(controller_number),
+      .low_freq = boost::endian::native_to_little(low_freq),
+      .high_freq = 0};
+  return {(char *)&pkt, sizeof(pkt)};
+}
+
+TEST_CASE("Control outbound queue", "CONTROL") {
+  using namespace std::chrono_literals;
+  control::OutboundQueue queue;
+  std::vector<std::pair<std::uint32_t, std::string>> sent;
+  auto send = [&sent](std::uint32_t seq, std::string_view payload) { sent.emplace_back(seq, payload); };
+
+  auto terminate_pkt = ControlTerminatePacket{};
+  auto terminate = std::string{(char *)&terminate_pkt, sizeof(terminate_pkt)};
+
+  REQUIRE(control::coalescing_key(rumble_payload(0, 1)) == control::coalescing_key(rumble_payload(0, 2)));
+  REQUIRE(control::coalescing_key(rumble_payload(0, 1)) != control::coalescing_key(rumble_payload(1, 1)));
+  REQUIRE(!control::coalescing_key(terminate));
+
+  for (std::uint16_t i = 0; i < 1000; i++) {
+    control::queue_message(queue, rumble_payload(0, i));
+  }
+  control::queue_message(queue, rumble_payload(1, 42));
+  control::queue_message(queue, terminate);
+
+  auto now = std::chrono::steady_clock::now();
+  REQUIRE(control::flush_queue(queue, now, send) == 3);
+  REQUIRE(queue.queued == 1002);
+  REQUIRE(queue.dropped == 999);
+  REQUIRE(queue.sent == 3);
+
+  // Messages that must be delivered go first, then the latest state of each controller
+  REQUIRE(sent[0] == std::make_pair(0u, terminate));
+  REQUIRE(sent[1] == std::make_pair(1u, rumble_payload(0, 999)));
+  REQUIRE(sent[2] == std::make_pair(2u, rumble_payload(1, 42)));
+
+  // Coalesced updates are rate limited, everything else is not
+  control::queue_message(queue, rumble_payload(0, 1));
+  control::queue_message(queue, terminate);
+  REQUIRE(control::flush_queue(queue, now + 1ms, send) == 1);
+  REQUIRE(sent.back() == std::make_pair(3u, terminate));
+
+  REQUIRE(control::flush_queue(queue, now + control::OUTBOUND_FLUSH_INTERVAL, send) == 1);
+  REQUIRE(sent.back() == std::make_pair(4u, rumble_payload(0, 1)));
+
+  REQUIRE(control::flush_queue(queue, now + 2 * control::OUTBOUND_FLUSH_INTERVAL, send) == 0);
+
+  // The control thread is woken up as soon as something is queued
+  int wakeups = 0;
+  queue.on_queued = [&wakeups]() { wakeups++; };
+  control::queue_message(queue, rumble_payload(0, 2));
+  control::queue_message(queue, terminate);
+  REQUIRE(wakeups == 2);
+}
+
+TEST_CASE("Control feedback delivery", "CONTROL") {
+  auto terminate_pkt = ControlTerminatePacket{};
+  auto terminate = std::string{(char *)&terminate_pkt, sizeof(terminate_pkt)};
+  auto nr_channels = control::CONTROL_CHANNEL_GAMEPAD_BASE + control::CONTROL_MAX_GAMEPADS;
+
+  auto rumble_delivery = control::message_delivery(rumble_payload(2, 100), nr_channels);
+  REQUIRE(!rumble_delivery.reliable);
+  REQUIRE(rumble_delivery.channel == control::CONTROL_CHANNEL_GAMEPAD_BASE + 2);
+
+  // Old clients only have the generic channel
+  REQUIRE(control::message_delivery(rumble_payload(2, 100), 1).reliable);
+  REQUIRE(control::message_delivery(rumble_payload(2, 100), 1).channel == control::CONTROL_CHANNEL_GENERIC);
+
+  REQUIRE(control::message_delivery(terminate, nr_channels).reliable);
+  REQUIRE(control::message_delivery(terminate, nr_channels).channel == control::CONTROL_CHANNEL_GENERIC);
+
+  SECTION("The latest state is sent again when unreliable") {
+    control::OutboundQueue queue;
+    queue.unreliable_feedback = true;
+    std::vector<std::string> sent;
+    auto send = [&sent](std::uint32_t seq, std::string_view payload) { sent.emplace_back(payload); };
+
+    auto now = std::chrono::steady_clock::now();
+    control::queue_message(queue, rumble_payload(0, 0));
+    REQUIRE(control::flush_queue(queue, now, send) == 1);
+    for (int tick = 1; tick <= control::OUTBOUND_UNRELIABLE_RESENDS; tick++) {
+      REQUIRE(control::flush_queue(queue, now + tick * control::OUTBOUND_FLUSH_INTERVAL, send) == 1);
+    }
+    REQUIRE(control::flush_queue(queue, now + 10 * control::OUTBOUND_FLUSH_INTERVAL, send) == 0);
+    REQUIRE(sent.size() == 1 + control::OUTBOUND_UNRELIABLE_RESENDS);
+  }
+}
+
+/**
+ * A server and a client ENet host connected over loopback, the server is bound to an ephemeral port
+ */
+struct LocalEnetLink {
+  ENetHost *server;
+  ENetHost *client;
+  ENetPeer *server_peer;
+};
+
+static LocalEnetLink connect_local_enet(std::size_t channel_count) {
+  using namespace std::chrono_literals;
+  REQUIRE(enet_initialize() == 0);
+
+  ENetAddress server_address;
+  enet_address_set_host(&server_address, "127.0.0.1");
+  enet_address_set_port(&server_address, 0);
+  auto server = enet_host_create(AF_INET, &server_address, 1, 0, 0, 0);
+  auto client = enet_host_create(AF_INET, nullptr, 1, 0, 0, 0);
+  REQUIRE(server != nullptr);
+  REQUIRE(client != nullptr);
+  // ENet reads back the address that the socket has been bound to
+  enet_host_connect(client, &server->address, channel_count, 0);
+
+  ENetEvent event;
+  ENetPeer *server_peer = nullptr;
+  bool client_connected = false;
+  auto deadline = std::chrono::steady_clock::now() + 2s;
+  while ((server_peer == nullptr || !client_connected) && std::chrono::steady_clock::now() < deadline) {
+    if (enet_host_service(server, &event, 1) > 0 && event.type == ENET_EVENT_TYPE_CONNECT) {
+      server_peer = event.peer;
+    }
+    if (enet_host_service(client, &event, 1) > 0 && event.type == ENET_EVENT_TYPE_CONNECT) {
+      client_connected = true;
+    }
+  }
+  REQUIRE(server_peer != nullptr);
+  REQUIRE(client_connected);
+  return {.server = server, .client = client, .server_peer = server_peer};
+}
+
+TEST_CASE("Control feedback channels", "CONTROL") {
+  using namespace std::chrono_literals;
+  auto link = connect_local_enet(control::CONTROL_CHANNEL_GAMEPAD_BASE + control::CONTROL_MAX_GAMEPADS);
+  auto server = link.server, client = link.client;
+  auto server_peer = link.server_peer;
+  REQUIRE(server_peer->channelCount > control::CONTROL_CHANNEL_GAMEPAD_BASE + 2);
+
+  auto terminate_pkt = ControlTerminatePacket{};
+  auto terminate = std::string{(char *)&terminate_pkt, sizeof(terminate_pkt)};
+  for (const auto &payload : {terminate, rumble_payload(0, 1), rumble_payload(2, 2)}) {
+    REQUIRE(control::send_packet(payload, server_peer, control::message_delivery(payload, server_peer->channelCount)));
+  }
+  enet_host_flush(server);
+
+  struct Received {
+    enet_uint8 channel;
+    bool reliable;
+  };
+  // Packets on different channels can be delivered in any order
+  std::map<std::string, Received> received;
+  ENetEvent event;
+  auto deadline = std::chrono::steady_clock::now() + 2s;
+  while (received.size() < 3 && std::chrono::steady_clock::now() < deadline) {
+    enet_host_service(server, &event, 0);
+    if (enet_host_service(client, &event, 1) > 0 && event.type == ENET_EVENT_TYPE_RECEIVE) {
+      received[std::string{(char *)event.packet->data, event.packet->dataLength}] = {
+          .channel = event.channelID,
+          .reliable = (event.packet->flags & ENET_PACKET_FLAG_RELIABLE) != 0};
+      enet_packet_destroy(event.packet);
+    }
+  }
+  REQUIRE(received.size() == 3);
+
+  REQUIRE(received[terminate].channel == control::CONTROL_CHANNEL_GENERIC);
+  REQUIRE(received[terminate].reliable);
+  // Each gamepad gets its own unreliable channel, a lost rumble update doesn't hold up anything else
+  REQUIRE(received[rumble_payload(0, 1)].channel == control::CONTROL_CHANNEL_GAMEPAD_BASE);
+  REQUIRE_FALSE(received[rumble_payload(0, 1)].reliable);
+  REQUIRE(received[rumble_payload(2, 2)].channel == control::CONTROL_CHANNEL_GAMEPAD_BASE + 2);
+  REQUIRE_FALSE(received[rumble_payload(2, 2)].reliable);
+
+  enet_host_destroy(client);
+  enet_host_destroy(server);
+}
+
+TEST_CASE("Control feedback latency under packet loss", "[CONTROL][.benchmark]") {
+  using namespace std::chrono_literals;
+  auto link = connect_local_enet(control::CONTROL_CHANNEL_GAMEPAD_BASE + control::CONTROL_MAX_GAMEPADS);
+  auto server = link.server, client = link.client;
+  auto server_peer = link.server_peer;
+  ENetEvent event;
+  std::chrono::steady_clock::time_point deadline;
+
+  // Drop 20% of the datagrams that reach the client
+  client->intercept = [](ENetHost *host, ENetEvent *event) -> int {
+    static std::mt19937 rng(42);
+    return rng() % 5 == 0 ? 1 : 0;
+  };
+
+  struct DeliveryStats {
+    int received = 0;
+    bool in_order = true;
+    double avg_latency_ms = 0;
+    double max_latency_ms = 0;
+  };
+
+  // A rumble update every ms, the payload carries the index of the update
+  auto measure = [&](bool reliable) {
+    constexpr int nr_updates = 200;
+    std::vector<std::chrono::steady_clock::time_point> sent_at(nr_updates);
+    DeliveryStats stats;
+    int last_received = -1;
+
+    auto receive = [&]() {
+      enet_host_service(server, &event, 0);
+      while (enet_host_service(client, &event, 0) > 0) {
+        if (event.type == ENET_EVENT_TYPE_RECEIVE) {
+          auto idx = boost::endian::little_to_native(((ControlRumblePacket *)event.packet->data)->low_freq);
+          double latency_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - sent_at[idx])
+                                  .count();
+          stats.in_order = stats.in_order && idx > last_received;
+          last_received = idx;
+          stats.received++;
+          stats.avg_latency_ms += latency_ms;
+          stats.max_latency_ms = std::max(stats.max_latency_ms, latency_ms);
+          enet_packet_destroy(event.packet);
+        }
+      }
+    };
+
+    for (int idx = 0; idx < nr_updates; idx++) {
+      auto payload = rumble_payload(0, idx);
+      auto delivery = reliable ? control::Delivery{.reliable = true, .channel = control::CONTROL_CHANNEL_GENERIC}
+                               : control::message_delivery(payload, server_peer->channelCount);
+      sent_at[idx] = std::chrono::steady_clock::now();
+      control::send_packet(payload, server_peer, delivery);
+      enet_host_flush(server);
+      receive();
+      std::this_thread::sleep_for(1ms);
+    }
+
+    // Wait for retransmissions
+    deadline = std::chrono::steady_clock::now() + 2s;
+    while (last_received < nr_updates - 1 && std::chrono::steady_clock::now() < deadline) {
+      receive();
+      std::this_thread::sleep_for(1ms);
+    }
+
+    stats.avg_latency_ms /= std::max(stats.received, 1);
+    logs::log(logs::info,
+              "[BENCHMARK] Rumble over a {} channel with 20% loss: {}/{} received, avg latency {:.2f}ms, max {:.2f}ms",
+              reliable ? "reliable" : "unreliable sequenced",
+              stats.received,
+              nr_updates,
+              stats.avg_latency_ms,
+              stats.max_latency_ms);
+    return stats;
+  };
+
+  auto reliable = measure(true);
+  auto unreliable = measure(false);
+
+  REQUIRE(reliable.in_order);
+  // Late updates are dropped, never delivered after newer ones
+  REQUIRE(unreliable.in_order);
+
+  client->intercept = nullptr;
+  enet_host_destroy(client);
+  enet_host_destroy(server);
+}
+
+static std::string mouse_move_payload(short delta_x) {
+  auto pkt = pkts::MOUSE_MOVE_REL_PACKET{};
+  pkt.type = pkts::MOUSE_MOVE_REL;
+  pkt.delta_x = delta_x;
+  return {(char *)&pkt, sizeof(pkt)};
+}
+
+template <typename Predicate> static bool wait_for(Predicate predicate, std::chrono::milliseconds timeout) {
+  auto deadline = std::chrono::steady_clock::now() + timeout;
+  while (!predicate()) {
+    if (std::chrono::steady_clock::now() > deadline) {
+      return false;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  return true;
+}
+
+TEST_CASE("Control input dispatcher", "CONTROL") {
+  using namespace std::chrono_literals;
+  std::vector<short> applied;
+
+  SECTION("A slow device doesn't hold up the control thread") {
+    auto dispatcher = control::start_input_dispatcher(1, [&applied](pkts::INPUT_PKT *pkt) {
+      if (applied.empty()) {
+        std::this_thread::sleep_for(50ms); // Like creating a new PS5 joypad
+      }
+      applied.push_back(((pkts::MOUSE_MOVE_REL_PACKET *)pkt)->delta_x);
+    });
+
+    auto start = std::chrono::steady_clock::now();
+    for (short i = 0; i < 10; i++) {
+      REQUIRE(control::dispatch_input(*dispatcher, mouse_move_payload(i)));
+    }
+    REQUIRE(std::chrono::steady_clock::now() - start < 10ms);
+
+    REQUIRE(wait_for([&dispatcher]() { return dispatcher->dispatched == 10; }, 1s));
+    REQUIRE(applied == std::vector<short>{0, 1, 2, 3, 4, 5, 6, 7, 8, 9});
+    REQUIRE(dispatcher->queued == 10);
+    REQUIRE(dispatcher->dropped == 0);
+    REQUIRE(dispatcher->max_queue_depth >= 1);
+    REQUIRE(dispatcher->latency_max_us >= 40'000);
+
+    // The worker goes to sleep and wakes up again on new input
+    std::this_thread::sleep_for(5ms);
+    REQUIRE(control::dispatch_input(*dispatcher, mouse_move_payload(10)));
+    REQUIRE(wait_for([&dispatcher]() { return dispatcher->dispatched == 11; }, 1s));
+    REQUIRE(applied.back() == 10);
+
+    control::stop_input_dispatcher(*dispatcher);
+  }
+
+  SECTION("Stopping waits for the worker") {
+    std::atomic<bool> applying = false;
+    auto dispatcher = control::start_input_dispatcher(5, [&](pkts::INPUT_PKT *pkt) {
+      applying = true;
+      std::this_thread::sleep_for(50ms);
+      applied.push_back(((pkts::MOUSE_MOVE_REL_PACKET *)pkt)->delta_x);
+      applying = false;
+    });
+
+    REQUIRE(control::dispatch_input(*dispatcher, mouse_move_payload(0)));
+    REQUIRE(wait_for([&applying]() { return applying.load(); }, 1s));
+    control::stop_input_dispatcher(*dispatcher);
+
+    // A new dispatcher for the same session will never run alongside this one
+    REQUIRE_FALSE(applying);
+    REQUIRE_FALSE(dispatcher->worker.joinable());
+    REQUIRE(applied == std::vector<short>{0});
+  }
+
+  SECTION("Movements are dropped when the queue is full") {
+    std::promise<void> unblock;
+    auto blocked = unblock.get_future().share();
+    auto dispatcher = control::start_input_dispatcher(2, [blocked](pkts::INPUT_PKT *pkt) { blocked.wait(); });
+
+    auto nr_packets = control::INPUT_QUEUE_SIZE + 10;
+    for (std::size_t i = 0; i < nr_packets; i++) {
+      control::dispatch_input(*dispatcher, mouse_move_payload((short)i));
+    }
+    REQUIRE(dispatcher->queued == nr_packets);
+    REQUIRE(dispatcher->dropped > 0);
+    REQUIRE(dispatcher->max_queue_depth == control::INPUT_QUEUE_SIZE);
+
+    unblock.set_value();
+    REQUIRE(wait_for([&]() { return dispatcher->dispatched + dispatcher->dropped == nr_packets; }, 1s));
+    control::stop_input_dispatcher(*dispatcher);
+  }
+
+  SECTION("Buttons and keys are never dropped") {
+    auto key = [](short key_code, bool pressed) {
+      auto pkt = pkts::KEYBOARD_PACKET{};
+      pkt.type = pressed ? pkts::KEY_PRESS : pkts::KEY_RELEASE;
+      pkt.key_code = key_code;
+      return std::string{(char *)&pkt, sizeof(pkt)};
+    };
+
+    std::promise<void> unblock;
+    auto blocked = unblock.get_future().share();
+    std::vector<pkts::INPUT_PKT> applied_types;
+    auto dispatcher = control::start_input_dispatcher(4, [blocked, &applied_types](pkts::INPUT_PKT *pkt) {
+      blocked.wait();
+      applied_types.push_back(*pkt);
+    });
+
+    // Wait for the worker to be stuck on the first packet, then fill up the queue
+    control::dispatch_input(*dispatcher, mouse_move_payload(0));
+    REQUIRE(wait_for([&dispatcher]() { return dispatcher->queue.read_available() == 0; }, 1s));
+    for (std::size_t i = 0; i < control::INPUT_QUEUE_SIZE; i++) {
+      REQUIRE(control::dispatch_input(*dispatcher, mouse_move_payload((short)i)));
+    }
+    REQUIRE(control::dispatch_input(*dispatcher, key(0x41, true)));
+    // Movements that come after can't overtake the overflow
+    REQUIRE_FALSE(control::dispatch_input(*dispatcher, mouse_move_payload(1)));
+    REQUIRE(control::dispatch_input(*dispatcher, key(0x41, false)));
+    REQUIRE(dispatcher->overflowed == 2);
+
+    unblock.set_value();
+    REQUIRE(wait_for([&]() { return dispatcher->dispatched + dispatcher->dropped == dispatcher->queued; }, 1s));
+    REQUIRE(applied_types.size() >= 2);
+    REQUIRE(applied_types[applied_types.size() - 2].type == pkts::KEY_PRESS);
+    REQUIRE(applied_types.back().type == pkts::KEY_RELEASE);
+
+    // Once the overflow has been applied the queue is used again
+    auto dispatched = dispatcher->dispatched.load();
+    REQUIRE(control::dispatch_input(*dispatcher, mouse_move_payload(1)));
+    REQUIRE(wait_for([&]() { return dispatcher->dispatched == dispatched + 1; }, 1s));
+    REQUIRE(applied_types.back().type == pkts::MOUSE_MOVE_REL);
+    REQUIRE(dispatcher->overflowed == 2);
+    control::stop_input_dispatcher(*dispatcher);
+  }
+}
+
+static control::InputEvent to_input_event(const std::string &payload) {
+  control::InputEvent event = {.received = std::chrono::steady_clock::now(), .size = (std::uint16_t)payload.size()};
+  std::copy(payload.begin(), payload.end(), event.data.begin());
+  return event;
+}
+
+template <typename T> static T from_input_event(const control::InputEvent &event) {
+  return *(T *)event.data.data();
+}
+
+TEST_CASE("Control input coalescing", "CONTROL") {
+  auto rel_move = [](short delta_x, short delta_y) {
+    auto pkt = pkts::MOUSE_MOVE_REL_PACKET{};
+    pkt.type = pkts::MOUSE_MOVE_REL;
+    pkt.delta_x = boost::endian::native_to_big(delta_x);
+    pkt.delta_y = boost::endian::native_to_big(delta_y);
+    return to_input_event({(char *)&pkt, sizeof(pkt)});
+  };
+  auto scroll = [](short amount) {
+    auto pkt = pkts::MOUSE_SCROLL_PACKET{};
+    pkt.type = pkts::MOUSE_SCROLL;
+    pkt.scroll_amt1 = boost::endian::native_to_big(amount);
+    return to_input_event({(char *)&pkt, sizeof(pkt)});
+  };
+  auto button = [](unsigned char btn) {
+    auto pkt = pkts::MOUSE_BUTTON_PACKET{};
+    pkt.type = pkts::MOUSE_BUTTON_PRESS;
+    pkt.button = btn;
+    return to_input_event({(char *)&pkt, sizeof(pkt)});
+  };
+  auto touch = [](pkts::TOUCH_EVENT_TYPE type, std::uint32_t pointer_id, std::uint16_t rotation) {
+    auto pkt = pkts::TOUCH_PACKET{};
+    pkt.type = pkts::TOUCH;
+    pkt.event_type = type;
+    pkt.pointer_id = boost::endian::native_to_little(pointer_id);
+    pkt.rotation = rotation;
+    return to_input_event({(char *)&pkt, sizeof(pkt)});
+  };
+  auto delta_x = [](const control::InputEvent &event) {
+    return boost::endian::big_to_native(from_input_event<pkts::MOUSE_MOVE_REL_PACKET>(event).delta_x);
+  };
+
+  SECTION("Relative movements and scrolls are added up, up to the next button") {
+    std::vector<control::InputEvent> events = {rel_move(1, 2),
+                                               scroll(10),
+                                               rel_move(3, 4),
+                                               scroll(-5),
+                                               button(1),
+                                               rel_move(5, 6),
+                                               rel_move(SHRT_MAX, 0)};
+    REQUIRE(control::coalesce_input(events) == 2);
+    REQUIRE(events.size() == 5);
+
+    REQUIRE(delta_x(events[0]) == 4);
+    REQUIRE(boost::endian::big_to_native(from_input_event<pkts::MOUSE_MOVE_REL_PACKET>(events[0]).delta_y) == 6);
+    REQUIRE(boost::endian::big_to_native(from_input_event<pkts::MOUSE_SCROLL_PACKET>(events[1]).scroll_amt1) == 5);
+    REQUIRE(from_input_event<pkts::INPUT_PKT>(events[2]).type == pkts::MOUSE_BUTTON_PRESS);
+    // Merging would overflow
+    REQUIRE(delta_x(events[3]) == 5);
+    REQUIRE(delta_x(events[4]) == SHRT_MAX);
+  }
+
+  SECTION("Only the latest position of each touch pointer is kept") {
+    std::vector<control::InputEvent> events = {touch(pkts::TOUCH_EVENT_DOWN, 1, 0),
+                                               touch(pkts::TOUCH_EVENT_MOVE, 1, 10),
+                                               touch(pkts::TOUCH_EVENT_MOVE, 2, 20),
+                                               touch(pkts::TOUCH_EVENT_MOVE, 1, 11),
+                                               touch(pkts::TOUCH_EVENT_MOVE, 2, 21),
+                                               touch(pkts::TOUCH_EVENT_UP, 1, 0),
+                                               touch(pkts::TOUCH_EVENT_MOVE, 2, 22)};
+    REQUIRE(control::coalesce_input(events) == 2);
+    REQUIRE(events.size() == 5);
+
+    auto touch_at = [&events](std::size_t idx) { return from_input_event<pkts::TOUCH_PACKET>(events[idx]); };
+    REQUIRE(touch_at(0).event_type == pkts::TOUCH_EVENT_DOWN);
+    REQUIRE(touch_at(1).rotation == 11);
+    REQUIRE(touch_at(2).rotation == 21);
+    REQUIRE(touch_at(3).event_type == pkts::TOUCH_EVENT_UP);
+    REQUIRE(touch_at(4).rotation == 22);
+  }
+
+  SECTION("The dispatcher merges movements within the window") {
+    using namespace std::chrono_literals;
+    std::vector<short> applied;
+    auto dispatcher = control::start_input_dispatcher(
+        3,
+        [&applied, &delta_x](pkts::INPUT_PKT *pkt) {
+          if (pkt->type == pkts::MOUSE_MOVE_REL) {
+            control::InputEvent event = {.size = sizeof(pkts::MOUSE_MOVE_REL_PACKET)};
+            std::copy((char *)pkt, (char *)pkt + event.size, event.data.begin());
+            applied.push_back(delta_x(event));
+          } else {
+            applied.push_back(-1);
+          }
+        },
+        20ms);
+
+    for (int i = 0; i < 10; i++) {
+      auto event = rel_move(1, 0);
+      control::dispatch_input(*dispatcher, {event.data.data(), event.size});
+    }
+    auto click = button(1);
+    control::dispatch_input(*dispatcher, {click.data.data(), click.size});
+
+    REQUIRE(wait_for([&dispatcher]() { return dispatcher->dispatched + dispatcher->merged == 11; }, 1s));
+    // The button press flushes the movements straight away, in order
+    REQUIRE(applied.back() == -1);
+    REQUIRE(std::accumulate(applied.begin(), applied.end() - 1, 0) == 10);
+    REQUIRE(dispatcher->merged == 11 - applied.size());
+    control::stop_input_dispatcher(*dispatcher);
+  }
+}
+
+TEST_CASE("Control server workers", "CONTROL") {
+  using namespace std::chrono_literals;
+  REQUIRE(enet_initialize() == 0);
+
+  constexpr int nr_clients = 200;
+  constexpr std::size_t nr_workers = 4;
+  constexpr std::uint16_t port = 48200;
+
+  auto event_bus = std::make_shared<dp::event_bus>();
+  auto sessions = std::make_shared<immer::atom<state::SessionsRegistry>>();
+  auto aes_key = std::string(16, 'k');
+  // Each client gets its own loopback address, that's how the server matches it to its session
+  auto client_ip = [](int i) { return fmt::format("127.0.{}.{}", 1 + i / 250, 1 + i % 250); };
+  for (int i = 0; i < nr_clients; i++) {
+    auto session = state::StreamSession{.event_bus = event_bus,
+                                        .app = std::make_shared<state::App>(),
+                                        .aes_key = aes_key,
+                                        .aes_iv = std::string(16, 'i'),
+                                        .session_id = (std::size_t)i,
+                                        .ip = client_ip(i)};
+    sessions->update([&session](const state::SessionsRegistry &registry) { return add_session(registry, session); });
+  }
+
+  std::mutex m;
+  std::set<std::thread::id> worker_threads;
+  std::atomic<int> resumed = 0;
+  auto resume_ev = event_bus->register_handler<immer::box<control::ResumeStreamEvent>>(
+      [&](const immer::box<control::ResumeStreamEvent> &ev) {
+        std::lock_guard lock(m);
+        worker_threads.insert(std::this_thread::get_id());
+        resumed++;
+      });
+
+  auto stop = std::make_shared<std::atomic<bool>>(false);
+  auto server = std::thread([&]() {
+    control::run_control(port, sessions, event_bus, nr_clients, 1000ms, "0.0.0.0", nr_workers, stop);
+  });
+  // Clients must not connect while the SO_REUSEPORT group is still growing, or they could be moved to another worker
+  std::this_thread::sleep_for(100ms);
+
+  ENetAddress server_address;
+  enet_address_set_host(&server_address, "127.0.0.1");
+  enet_address_set_port(&server_address, port);
+  std::vector<ENetHost *> clients;
+  for (int i = 0; i < nr_clients; i++) {
+    ENetAddress client_address;
+    enet_address_set_host(&client_address, client_ip(i).c_str());
+    enet_address_set_port(&client_address, 0);
+    auto client = enet_host_create(AF_INET, &client_address, 1, 0, 0, 0);
+    REQUIRE(client != nullptr);
+    REQUIRE(enet_host_connect(client, &server_address, 1, 0) != nullptr);
+    clients.push_back(client);
+  }
+
+  ENetEvent event;
+  auto start = std::chrono::steady_clock::now();
+  int connected = 0;
+  while (connected < nr_clients && std::chrono::steady_clock::now() - start < 5s) {
+    for (auto client : clients) {
+      while (enet_host_service(client, &event, 0) > 0) {
+        if (event.type == ENET_EVENT_TYPE_CONNECT) {
+          connected++;
+        }
+      }
+    }
+    std::this_thread::sleep_for(1ms);
+  }
+  REQUIRE(connected == nr_clients);
+  REQUIRE(wait_for([&resumed]() { return resumed == nr_clients; }, 2s));
+  auto connect_time = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+
+  // Each session must be found by the worker that owns its client, which will send the termination packet
+  for (int i = 0; i < nr_clients; i++) {
+    event_bus->fire_event(immer::box<control::StopStreamEvent>(control::StopStreamEvent{.session_id = (std::size_t)i}));
+  }
+
+  auto cipher = create_cipher(aes_key);
+  std::vector<bool> terminated(nr_clients, false);
+  int nr_terminated = 0;
+  auto deadline = std::chrono::steady_clock::now() + 5s;
+  while (nr_terminated < nr_clients && std::chrono::steady_clock::now() < deadline) {
+    for (int i = 0; i < nr_clients; i++) {
+      while (enet_host_service(clients[i], &event, 0) > 0) {
+        if (event.type == ENET_EVENT_TYPE_RECEIVE) {
+          decrypted_buffer decrypted_data;
+          auto decrypted = decrypt_packet(*(ControlEncryptedPacket *)event.packet->data, cipher, decrypted_data);
+          if (((ControlPacket *)decrypted.data())->type == pkts::TERMINATION && !terminated[i]) {
+            terminated[i] = true;
+            nr_terminated++;
+          }
+          enet_packet_destroy(event.packet);
+        }
+      }
+    }
+    std::this_thread::sleep_for(1ms);
+  }
+
+  stop->store(true);
+  server.join();
+  resume_ev.unregister();
+  for (auto client : clients) {
+    enet_host_destroy(client);
+  }
+
+  REQUIRE(nr_terminated == nr_clients);
+  // The kernel spreads the clients across the workers
+  REQUIRE(worker_threads.size() > 1);
+  logs::log(logs::info,
+            "[BENCHMARK] {} clients connected to {} control workers in {}ms, {} workers used",
+            nr_clients,
+            nr_workers,
+            connect_time.count(),
+            worker_threads.size());
+}
+
+TEST_CASE("Adaptive FEC", "CONTROL") {
+  using namespace std::chrono_literals;
+
+  SECTION("Parse loss stats") {
+    ControlLossStatsPacket pkt = {.header = {.type = pkts::LOSS_STATS,
+                                             .length = sizeof(ControlLossStatsPacket) - sizeof(ControlPacket)},
+                                  .lost_frames = boost::endian::native_to_little(3),
+                                  .interval_ms = boost::endian::native_to_little(50),
+                                  .unknown = boost::endian::native_to_little(1000),
+                                  .last_good_frame = boost::endian::native_to_little(std::uint64_t{1234}),
+                                  .zero = {0, 0},
+                                  .unknown_2 = boost::endian::native_to_little(0x14)};
+    auto report = streaming::parse_loss_stats({(char *)&pkt, sizeof(pkt)});
+    REQUIRE(report);
+    REQUIRE(report->lost_frames == 3);
+    REQUIRE(report->interval == 50ms);
+    REQUIRE(report->last_good_frame == 1234);
+
+    REQUIRE_FALSE(streaming::parse_loss_stats({(char *)&pkt, sizeof(pkt) - 1}));
+    pkt.interval_ms = 0;
+    REQUIRE_FALSE(streaming::parse_loss_stats({(char *)&pkt, sizeof(pkt)}));
+  }
+
+  auto clean = streaming::LossReport{.lost_frames = 0, .interval = 50ms};
+  auto lossy = streaming::LossReport{.lost_frames = 2, .interval = 50ms};
+
+  SECTION("A clean link slowly lowers the FEC percentage") {
+    auto controller = streaming::create_fec_controller(1, 60, 10, 50, 20, 2);
+    REQUIRE(controller.fec_percentage == 20);
+    REQUIRE(controller.min_required_fec_packets == 2);
+
+    std::vector<int> percentages;
+    for (auto elapsed = 0ms; elapsed < 10s; elapsed += clean.interval) {
+      if (auto update = streaming::on_loss_report(controller, clean)) {
+        percentages.push_back(update->fec_percentage);
+        REQUIRE(update->min_required_fec_packets == 2);
+      }
+    }
+    REQUIRE(percentages == std::vector<int>{15, 10});
+    REQUIRE(controller.decreases == 2);
+    REQUIRE(controller.frame_loss == 0);
+  }
+
+  SECTION("Losses quickly raise the FEC percentage up to the max") {
+    auto controller = streaming::create_fec_controller(1, 60, 10, 50, 20, 2);
+
+    // The first loss is acted upon straight away
+    auto update = streaming::on_loss_report(controller, lossy);
+    REQUIRE(update);
+    REQUIRE(update->fec_percentage == 30);
+    REQUIRE(update->min_required_fec_packets == 3);
+
+    // Then it waits for the change to show up in the reports
+    for (auto elapsed = lossy.interval; elapsed < streaming::FEC_INCREASE_INTERVAL; elapsed += lossy.interval) {
+      REQUIRE_FALSE(streaming::on_loss_report(controller, lossy));
+    }
+    REQUIRE(streaming::on_loss_report(controller, lossy)->fec_percentage == 40);
+
+    for (int i = 0; i < 100; i++) {
+      streaming::on_loss_report(controller, lossy);
+    }
+    REQUIRE(controller.fec_percentage == 50);
+    REQUIRE(controller.min_required_fec_packets == 2 + streaming::FEC_MAX_EXTRA_REQUIRED_PACKETS);
+    REQUIRE(controller.increases == 3);
+    REQUIRE(controller.frame_loss > 0);
+
+    // The link recovers
+    for (auto elapsed = 0ms; elapsed < 20s; elapsed += clean.interval) {
+      streaming::on_loss_report(controller, clean);
+    }
+    REQUIRE(controller.fec_percentage == 10);
+    REQUIRE(controller.min_required_fec_packets == 2);
+  }
+
+  SECTION("Isolated losses are smoothed out") {
+    auto controller = streaming::create_fec_controller(1, 60, 10, 50, 20, 2);
+    // A single frame lost out of the 60 of a 1s report is below the threshold once averaged
+    auto isolated = streaming::LossReport{.lost_frames = 1, .interval = 1s};
+    REQUIRE_FALSE(streaming::on_loss_report(controller, isolated));
+    REQUIRE(controller.frame_loss > 0);
+    REQUIRE(controller.frame_loss < streaming::FEC_INCREASE_LOSS);
+
+    // It's still not clean enough to lower the protection until the average settles down
+    auto clean_1s = streaming::LossReport{.lost_frames = 0, .interval = 1s};
+    REQUIRE_FALSE(streaming::on_loss_report(controller, clean_1s));
+    REQUIRE_FALSE(streaming::on_loss_report(controller, clean_1s));
+    REQUIRE(controller.without_loss == 0ms);
+    for (int i = 0; i < 10; i++) {
+      streaming::on_loss_report(controller, clean_1s);
+    }
+    REQUIRE(controller.fec_percentage == 10);
+    REQUIRE(controller.increases == 0);
+  }
+
+  SECTION("Equal bounds disable it") {
+    auto controller = streaming::create_fec_controller(1, 60, 20, 20, 20, 2);
+    for (int i = 0; i < 100; i++) {
+      REQUIRE_FALSE(streaming::on_loss_report(controller, i % 2 ? lossy : clean));
+    }
+    REQUIRE(controller.fec_percentage == 20);
+    REQUIRE(controller.reports == 100);
+    REQUIRE(controller.lost_frames == 100);
+  }
+}
+
+TEST_CASE("Reference frame invalidation", "CONTROL") {
+  SECTION("Parse invalidate ref frames") {
+    ControlInvalidateRefFramesPacket pkt = {
+        .header = {.type = pkts::INVALIDATE_REF_FRAMES,
+                   .length = sizeof(ControlInvalidateRefFramesPacket) - sizeof(ControlPacket)},
+        .first_frame = boost::endian::native_to_little(std::uint64_t{120}),
+        .last_frame = boost::endian::native_to_little(std::uint64_t{123}),
+        .zero = 0};
+    auto invalidation = streaming::parse_invalidate_ref_frames({(char *)&pkt, sizeof(pkt)});
+    REQUIRE(invalidation);
+    REQUIRE(invalidation->first_frame == 120);
+    REQUIRE(invalidation->last_frame == 123);
+
+    REQUIRE_FALSE(streaming::parse_invalidate_ref_frames({(char *)&pkt, sizeof(pkt) - 1}));
+    pkt.first_frame = boost::endian::native_to_little(std::uint64_t{124});
+    REQUIRE_FALSE(streaming::parse_invalidate_ref_frames({(char *)&pkt, sizeof(pkt)}));
+  }
+
+  SECTION("Encoders that support it recover with P-frames") {
+    auto controller = streaming::create_recovery_controller(1, true, 0);
+    REQUIRE(streaming::on_invalidate_ref_frames(controller, {.first_frame = 10, .last_frame = 12}) ==
+            streaming::RecoveryAction::INVALIDATE_REF_FRAMES);
+    // Already recovering from these
+    REQUIRE(streaming::on_invalidate_ref_frames(controller, {.first_frame = 10, .last_frame = 12}) ==
+            streaming::RecoveryAction::NONE);
+    REQUIRE(streaming::on_invalidate_ref_frames(controller, {.first_frame = 11, .last_frame = 11}) ==
+            streaming::RecoveryAction::NONE);
+    // A new loss
+    REQUIRE(streaming::on_invalidate_ref_frames(controller, {.first_frame = 12, .last_frame = 20}) ==
+            streaming::RecoveryAction::INVALIDATE_REF_FRAMES);
+
+    REQUIRE(controller.invalidations == 4);
+    REQUIRE(controller.redundant == 2);
+    REQUIRE(controller.ref_invalidations == 2);
+    REQUIRE(controller.idr_fallbacks == 0);
+  }
+
+  SECTION("Falls back to IDR") {
+    auto controller = streaming::create_recovery_controller(1, false, 0);
+    REQUIRE(streaming::on_invalidate_ref_frames(controller, {.first_frame = 10, .last_frame = 12}) ==
+            streaming::RecoveryAction::IDR);
+    REQUIRE(streaming::on_invalidate_ref_frames(controller, {.first_frame = 10, .last_frame = 12}) ==
+            streaming::RecoveryAction::NONE);
+    REQUIRE(controller.idr_fallbacks == 1);
+
+    // Too many frames to invalidate
+    controller = streaming::create_recovery_controller(1, true, 5);
+    REQUIRE(streaming::on_invalidate_ref_frames(controller, {.first_frame = 10, .last_frame = 14}) ==
+            streaming::RecoveryAction::INVALIDATE_REF_FRAMES);
+    REQUIRE(streaming::on_invalidate_ref_frames(controller, {.first_frame = 15, .last_frame = 20}) ==
+            streaming::RecoveryAction::IDR);
+  }
+}
+
+TEST_CASE("Keyframe governor", "CONTROL") {
+  using namespace std::chrono_literals;
+  auto governor = streaming::create_keyframe_governor(1);
+  std::chrono::nanoseconds now = 10s;
+
+  // The first request goes through straight away, the following ones are merged into it
+  REQUIRE(streaming::on_keyframe_request(governor, now, std::nullopt) == 0ns);
+  REQUIRE_FALSE(streaming::on_keyframe_request(governor, now + 1ms, std::nullopt));
+  REQUIRE_FALSE(streaming::on_keyframe_request(governor, now + 10ms, std::nullopt));
+
+  // The key frame comes out, another request right after it has to wait for KEYFRAME_MIN_INTERVAL
+  std::chrono::nanoseconds key_frame = now + 20ms;
+  auto delay = streaming::on_keyframe_request(governor, now + 30ms, key_frame);
+  REQUIRE(delay == streaming::KEYFRAME_MIN_INTERVAL - 10ms);
+  // Merged into the deferred one
+  REQUIRE_FALSE(streaming::on_keyframe_request(governor, now + 40ms, key_frame));
+  REQUIRE(streaming::on_deferred_keyframe(governor, key_frame + streaming::KEYFRAME_MIN_INTERVAL, key_frame));
+
+  // The encoder never produced it, the next request isn't merged forever
+  now = key_frame + streaming::KEYFRAME_MIN_INTERVAL;
+  REQUIRE_FALSE(streaming::on_keyframe_request(governor, now + 50ms, key_frame));
+  REQUIRE(streaming::on_keyframe_request(governor, now + streaming::KEYFRAME_COALESCE_WINDOW, key_frame) == 0ns);
+
+  // A deferred request that is satisfied by a key frame in the meantime
+  now += 1s;
+  key_frame = now;
+  REQUIRE(streaming::on_keyframe_request(governor, now + 100ms, key_frame) == streaming::KEYFRAME_MIN_INTERVAL - 100ms);
+  REQUIRE_FALSE(streaming::on_deferred_keyframe(governor, now + 500ms, now + 200ms));
+
+  REQUIRE(governor.received == 8);
+  REQUIRE(governor.coalesced == 5);
+  REQUIRE(governor.honored == 3);
+  REQUIRE(governor.deferred == 1);
+}
+
+/**
+ * A bottleneck link with a drop tail queue: whatever is sent over its capacity builds up in the queue,
+ * which makes the RTT grow, until it overflows and frames are lost
+ */
+struct SimulatedLink {
+  double capacity_kbps;
+  std::chrono::milliseconds base_rtt = std::chrono::milliseconds(20);
+  std::chrono::milliseconds max_queue = std::chrono::milliseconds(200);
+  double queued_kbits = 0;
+
+  /**
+   * @return the lost frames
+   */
+  int send(double bitrate_kbps, int fps, std::chrono::milliseconds elapsed) {
+    queued_kbits = std::max(0.0, queued_kbits + (bitrate_kbps - capacity_kbps) * elapsed.count() / 1000.0);
+    auto max_queue_kbits = capacity_kbps * max_queue.count() / 1000.0;
+    if (queued_kbits <= max_queue_kbits) {
+      return 0;
+    }
+    auto dropped_kbits = queued_kbits - max_queue_kbits;
+    queued_kbits = max_queue_kbits;
+    return (int)std::ceil(dropped_kbits / (bitrate_kbps / fps));
+  }
+
+  std::chrono::milliseconds rtt() const {
+    return base_rtt + std::chrono::milliseconds((long)(queued_kbits * 1000 / capacity_kbps));
+  }
+};
+
+TEST_CASE("Adaptive bitrate simulation", "CONTROL") {
+  using namespace std::chrono_literals;
+  constexpr int fps = 60;
+  constexpr long max_kbps = 20000;
+  constexpr long min_kbps = 2000;
+
+  auto controller = streaming::create_bitrate_controller(1, fps, min_kbps, max_kbps);
+  REQUIRE(controller.bitrate_kbps == max_kbps);
+  SimulatedLink link = {.capacity_kbps = 20000};
+
+  struct Step {
+    std::chrono::milliseconds time;
+    long bitrate_kbps;
+    int lost_frames;
+  };
+  std::vector<Step> steps;
+  // Loss reports come every 50ms, link samples (RTT and host queue) every CLIENT_STATS_INTERVAL
+  auto run = [&](std::chrono::milliseconds until) {
+    auto now = steps.empty() ? 0ms : steps.back().time;
+    while (now < until) {
+      int lost_frames = 0;
+      for (auto elapsed = 0ms; elapsed < control::CLIENT_STATS_INTERVAL; elapsed += 50ms) {
+        auto lost = link.send(controller.bitrate_kbps, fps, 50ms);
+        streaming::record_loss(controller, {.lost_frames = lost, .interval = 50ms});
+        lost_frames += lost;
+      }
+      now += control::CLIENT_STATS_INTERVAL;
+      streaming::on_link_sample(controller,
+                                {.elapsed = control::CLIENT_STATS_INTERVAL, .rtt = link.rtt(), .queued_bytes = 0});
+      REQUIRE(controller.bitrate_kbps >= min_kbps);
+      REQUIRE(controller.bitrate_kbps <= max_kbps);
+      steps.push_back({.time = now, .bitrate_kbps = controller.bitrate_kbps, .lost_frames = lost_frames});
+    }
+  };
+  auto lost_between = [&](std::chrono::milliseconds from, std::chrono::milliseconds to) {
+    int lost = 0;
+    for (const auto &step : steps) {
+      lost += step.time > from && step.time <= to ? step.lost_frames : 0;
+    }
+    return lost;
+  };
+  auto avg_bitrate_between = [&](std::chrono::milliseconds from, std::chrono::milliseconds to) {
+    double sum = 0;
+    int count = 0;
+    for (const auto &step : steps) {
+      if (step.time > from && step.time <= to) {
+        sum += step.bitrate_kbps;
+        count++;
+      }
+    }
+    return sum / count;
+  };
+
+  // A clean link, nothing changes
+  run(10s);
+  REQUIRE(controller.bitrate_kbps == max_kbps);
+  REQUIRE(controller.decreases == 0);
+  REQUIRE(lost_between(0s, 10s) == 0);
+
+  // The capacity drops
+  link.capacity_kbps = 8000;
+  run(30s);
+  // It has to react within a few seconds
+  REQUIRE(std::find_if(steps.begin(), steps.end(), [](const Step &step) {
+            return step.time > 10s && step.bitrate_kbps < 8000;
+          })->time <= 14s);
+  // and then stay close to the capacity, without losing frames
+  REQUIRE(lost_between(15s, 30s) == 0);
+  REQUIRE(avg_bitrate_between(15s, 30s) > 8000 * 0.7);
+  REQUIRE(avg_bitrate_between(15s, 30s) < 8000);
+
+  // The capacity comes back, the bitrate slowly goes back up to the max
+  link.capacity_kbps = 20000;
+  run(60s);
+  REQUIRE(controller.bitrate_kbps == max_kbps);
+  REQUIRE(lost_between(30s, 60s) == 0);
+
+  // The host socket can't keep up
+  streaming::on_link_sample(controller,
+                            {.elapsed = control::CLIENT_STATS_INTERVAL, .rtt = 20ms, .queued_bytes = 1 << 20});
+  REQUIRE(controller.bitrate_kbps < max_kbps);
+
+  logs::log(logs::info,
+            "[BENCHMARK] Adaptive bitrate: {} lost frames after the capacity drop, avg {:.0f} Kbps on a 8000 Kbps link",
+            lost_between(10s, 30s),
+            avg_bitrate_between(15s, 30s));
+}
+
+TEST_CASE("Adaptive bitrate RTT baseline", "CONTROL") {
+  using namespace std::chrono_literals;
+  constexpr int fps = 60;
+  constexpr long max_kbps = 20000;
+  constexpr long min_kbps = 2000;
+
+  auto controller = streaming::create_bitrate_controller(1, fps, min_kbps, max_kbps);
+  SimulatedLink link = {.capacity_kbps = 40000};
+  auto run = [&](std::chrono::milliseconds duration) {
+    for (auto now = 0ms; now < duration; now += control::CLIENT_STATS_INTERVAL) {
+      link.send(controller.bitrate_kbps, fps, control::CLIENT_STATS_INTERVAL);
+      streaming::on_link_sample(controller,
+                                {.elapsed = control::CLIENT_STATS_INTERVAL, .rtt = link.rtt(), .queued_bytes = 0});
+    }
+  };
+
+  run(5s);
+  REQUIRE(controller.min_rtt == 20ms);
+  REQUIRE(controller.decreases == 0);
+
+  // The path gets slower for good (ex: a new route), there's plenty of capacity so this is not congestion
+  link.base_rtt = 80ms;
+  run(5s);
+  REQUIRE(controller.decreases > 0);
+  REQUIRE(controller.bitrate_kbps < max_kbps);
+
+  // After (at most) two windows the new RTT becomes the baseline and the bitrate goes back up to the max
+  run(2 * streaming::BITRATE_RTT_WINDOW + 20s);
+  REQUIRE(controller.min_rtt == 80ms);
+  REQUIRE(controller.bitrate_kbps == max_kbps);
+
+  // Lower RTTs are picked up straight away
+  link.base_rtt = 10ms;
+  run(control::CLIENT_STATS_INTERVAL);
+  REQUIRE(controller.min_rtt == 10ms);
+}
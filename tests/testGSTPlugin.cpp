@@ -1,4 +1,6 @@
+#include <catch2/benchmark/catch_benchmark.hpp>
 #include <catch2/catch_test_macros.hpp>
+#include <catch2/generators/catch_generators.hpp>
 #include <catch2/matchers/catch_matchers_container_properties.hpp>
 #include <catch2/matchers/catch_matchers_contains.hpp>
 #include <catch2/matchers/catch_matchers_string.hpp>
@@ -7,8 +9,18 @@
 using Catch::Matchers::Equals;
 
 #include <gst-plugin/audio.hpp>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <ctime>
+#include <fmt/format.h>
+#include <gst-plugin/pacing.hpp>
+#include <gst-plugin/udp.hpp>
 #include <gst-plugin/video.hpp>
+#include <gst/app/gstappsrc.h>
+#include <map>
 #include <moonlight/fec.hpp>
+#include <set>
 #include <string>
 
 using namespace std::string_literals;
@@ -40,6 +52,77 @@ static int get_buf_refcount(GstBuffer *buf) {
   return buf->mini_object.refcount;
 }
 
+/**
+ * A GstAllocator that counts how many memories are requested and delegates the actual work to the system allocator;
+ * install it as the default allocator in order to measure allocations.
+ */
+static std::atomic<int> allocations_count = 0;
+
+typedef struct {
+  GstAllocator parent;
+} CountingAllocator;
+
+typedef struct {
+  GstAllocatorClass parent_class;
+} CountingAllocatorClass;
+
+G_DEFINE_TYPE(CountingAllocator, counting_allocator, GST_TYPE_ALLOCATOR)
+
+static GstMemory *counting_allocator_alloc(GstAllocator *allocator, gsize size, GstAllocationParams *params) {
+  allocations_count++;
+  auto sysmem = gst_allocator_find(GST_ALLOCATOR_SYSMEM);
+  auto mem = gst_allocator_alloc(sysmem, size, params);
+  gst_object_unref(sysmem);
+  return mem;
+}
+
+static void counting_allocator_free(GstAllocator *allocator, GstMemory *mem) {
+  // Memories are owned by the system allocator, this will never be called
+}
+
+static void counting_allocator_class_init(CountingAllocatorClass *klass) {
+  auto allocator_class = GST_ALLOCATOR_CLASS(klass);
+  allocator_class->alloc = counting_allocator_alloc;
+  allocator_class->free = counting_allocator_free;
+}
+
+static void counting_allocator_init(CountingAllocator *allocator) {}
+
+/**
+ * A GstTracer that counts how many GstBuffer and GstMemory objects are created while counting_objects is set.
+ * Those are allocated by GStreamer itself (not through a GstAllocator), even when a memory only wraps existing data.
+ */
+static std::atomic<bool> counting_objects = false;
+static std::atomic<int> buffers_count = 0;
+static std::atomic<int> memories_count = 0;
+
+typedef struct {
+  GstTracer parent;
+} CountingTracer;
+
+typedef struct {
+  GstTracerClass parent_class;
+} CountingTracerClass;
+
+G_DEFINE_TYPE(CountingTracer, counting_tracer, GST_TYPE_TRACER)
+
+static void on_mini_object_created(GObject *tracer, GstClockTime ts, GstMiniObject *object) {
+  if (!counting_objects) {
+    return;
+  }
+  if (GST_IS_BUFFER(object)) {
+    buffers_count++;
+  } else if (GST_MINI_OBJECT_TYPE(object) == GST_TYPE_MEMORY) {
+    memories_count++;
+  }
+}
+
+static void counting_tracer_class_init(CountingTracerClass *klass) {}
+
+static void counting_tracer_init(CountingTracer *tracer) {
+  gst_tracing_register_hook(GST_TRACER(tracer), "mini-object-created", G_CALLBACK(on_mini_object_created));
+}
+
 class GStreamerTestsFixture {
 public:
   GStreamerTestsFixture() {
@@ -94,6 +177,102 @@ TEST_CASE_METHOD(GStreamerTestsFixture, "Encrypt GstBuffer", "[GSTPlugin]") {
   gst_buffer_unref(payload);
 }
 
+TEST_CASE_METHOD(GStreamerTestsFixture, "FEC encoder cache", "[GSTPlugin]") {
+  auto cache = moonlight::fec::RSCache(2);
+
+  auto rs = cache.get(10, 2);
+  REQUIRE(rs);
+  REQUIRE(cache.get(10, 2) == rs); // Same geometry, same encoder
+  REQUIRE(cache.get(10, 3) != rs);
+
+  auto stats = cache.stats();
+  REQUIRE(stats.hits == 1);
+  REQUIRE(stats.misses == 2);
+  REQUIRE(stats.evictions == 0);
+  REQUIRE(stats.size == 2);
+
+  // Going over the limit will evict the least recently used geometry: (10, 3)
+  cache.get(10, 2);
+  cache.get(20, 4);
+  stats = cache.stats();
+  REQUIRE(stats.evictions == 1);
+  REQUIRE(stats.size == 2);
+  REQUIRE(cache.get(10, 2) == rs);
+
+  SECTION("Audio encoders have their own parity matrix") {
+    auto audio_rs = audio_fec_cache().get(AUDIO_DATA_SHARDS, AUDIO_FEC_SHARDS);
+    REQUIRE(audio_rs != moonlight::fec::get_cached(AUDIO_DATA_SHARDS, AUDIO_FEC_SHARDS));
+    REQUIRE(memcmp(audio_rs->p, AUDIO_FEC_PARITY, sizeof(AUDIO_FEC_PARITY)) == 0);
+  }
+}
+
+TEST_CASE_METHOD(GStreamerTestsFixture, "FEC kernels", "[GSTPlugin]") {
+  constexpr int block_size = 1037; // Not a multiple of any vector size, will exercise the tails too
+  std::vector<uint8_t> src(block_size), expected(block_size), result(block_size);
+  auto scalar = rs_kernel_muladd(RS_KERNEL_SCALAR);
+
+  for (int kernel = RS_KERNEL_SCALAR; kernel < RS_KERNEL_MAX; kernel++) {
+    if (!rs_kernel_supported((rs_kernel_t)kernel)) {
+      WARN("Skipping unsupported FEC kernel: " << rs_kernel_name((rs_kernel_t)kernel));
+      continue;
+    }
+
+    INFO("FEC kernel: " << rs_kernel_name((rs_kernel_t)kernel));
+    auto muladd = rs_kernel_muladd((rs_kernel_t)kernel);
+    for (int c = 0; c < 256; c++) {
+      for (int i = 0; i < block_size; i++) {
+        src[i] = std::rand();
+        expected[i] = result[i] = std::rand();
+      }
+      scalar(expected.data(), src.data(), c, block_size);
+      muladd(result.data(), src.data(), c, block_size);
+      REQUIRE_THAT(result, Equals(expected));
+    }
+  }
+
+  SECTION("Encoding matches nanors") {
+    constexpr int data_shards = 20, parity_shards = 4, nr_shards = data_shards + parity_shards;
+    auto rs = moonlight::fec::create(data_shards, parity_shards);
+    std::vector<uint8_t> shards(nr_shards * block_size), expected_shards(nr_shards * block_size);
+    std::vector<uint8_t *> ptr(nr_shards), expected_ptr(nr_shards);
+    for (int i = 0; i < nr_shards * block_size; i++) {
+      shards[i] = expected_shards[i] = std::rand();
+    }
+    for (int i = 0; i < nr_shards; i++) {
+      ptr[i] = shards.data() + i * block_size;
+      expected_ptr[i] = expected_shards.data() + i * block_size;
+    }
+
+    REQUIRE(reed_solomon_encode_fn(rs.get(), expected_ptr.data(), nr_shards, block_size) == 0);
+    REQUIRE(moonlight::fec::encode(rs.get(), ptr.data(), nr_shards, block_size) == 0);
+    REQUIRE_THAT(shards, Equals(expected_shards));
+  }
+}
+
+TEST_CASE_METHOD(GStreamerTestsFixture, "FEC kernels throughput", "[GSTPlugin][.benchmark]") {
+  constexpr int block_size = 1024 * 1024;
+  constexpr int iterations = 200;
+  std::vector<uint8_t> src(block_size, 0xAB), dst(block_size, 0x00);
+
+  for (int kernel = RS_KERNEL_SCALAR; kernel < RS_KERNEL_MAX; kernel++) {
+    if (!rs_kernel_supported((rs_kernel_t)kernel)) {
+      continue;
+    }
+
+    auto muladd = rs_kernel_muladd((rs_kernel_t)kernel);
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; i++) {
+      muladd(dst.data(), src.data(), (uint8_t)(i | 0x02), block_size);
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    logs::log(logs::info,
+              "[BENCHMARK] FEC kernel {}: {:.2f} GB/s",
+              rs_kernel_name((rs_kernel_t)kernel),
+              ((double)block_size * iterations) / elapsed.count() / 1e9);
+  }
+}
+
 /*
  * VIDEO
  */
@@ -133,10 +312,10 @@ TEST_CASE_METHOD(GStreamerTestsFixture, "RTP VIDEO Splits", "[GSTPlugin]") {
   SECTION("Multi block FEC") {
     auto payload_buf_blocks = gst_buffer_new_and_fill(payload_str.size(), payload_str.c_str());
     auto rtp_packets_blocks = gst_moonlight_video::generate_rtp_packets(*rtpmoonlightpay, payload_buf_blocks);
-    auto final_packets = gst_moonlight_video::generate_fec_multi_blocks(rtpmoonlightpay,
-                                                                        rtp_packets_blocks,
-                                                                        (int)payload_expected_packets,
-                                                                        payload_buf_blocks);
+    auto plan = gst_moonlight_video::FEC_PLAN{.nr_blocks = 3,
+                                              .data_shards_per_block = (int)std::ceil(payload_expected_packets / 3)};
+    auto final_packets =
+        gst_moonlight_video::generate_fec_multi_blocks(rtpmoonlightpay, rtp_packets_blocks, plan, payload_buf_blocks);
 
     REQUIRE(gst_buffer_list_length(final_packets) ==
             payload_expected_packets + fec_expected_packets - 1); // TODO: why one less?
@@ -155,6 +334,80 @@ TEST_CASE_METHOD(GStreamerTestsFixture, "RTP VIDEO Splits", "[GSTPlugin]") {
   g_object_unref(payload_buf);
 }
 
+TEST_CASE_METHOD(GStreamerTestsFixture, "RTP VIDEO FEC blocks planner", "[GSTPlugin]") {
+  auto rtpmoonlightpay = (gst_rtp_moonlight_pay_video *)g_object_new(gst_TYPE_rtp_moonlight_pay_video, nullptr);
+  rtpmoonlightpay->fec_percentage = 20;
+  rtpmoonlightpay->min_required_fec_packets = 2;
+
+  // 150 + 30 parity fits in a single block
+  auto plan = gst_moonlight_video::plan_fec_blocks(*rtpmoonlightpay, 150);
+  REQUIRE(plan.nr_blocks == 1);
+  REQUIRE(plan.data_shards_per_block == 150);
+
+  // 300 + 60 parity doesn't, two blocks of 150 will do
+  plan = gst_moonlight_video::plan_fec_blocks(*rtpmoonlightpay, 300);
+  REQUIRE(plan.nr_blocks == 2);
+  REQUIRE(plan.data_shards_per_block == 150);
+
+  // Uneven split, the last block will have less data shards
+  plan = gst_moonlight_video::plan_fec_blocks(*rtpmoonlightpay, 500);
+  REQUIRE(plan.nr_blocks == 3);
+  REQUIRE(plan.data_shards_per_block == 167);
+
+  SECTION("Very large frames will lower the FEC percentage instead of dropping it") {
+    plan = gst_moonlight_video::plan_fec_blocks(*rtpmoonlightpay, 1000);
+    REQUIRE(plan.nr_blocks == MAX_FEC_BLOCKS);
+    REQUIRE(plan.data_shards_per_block == 250);
+
+    auto blocks = gst_moonlight_video::determine_split(*rtpmoonlightpay, plan.data_shards_per_block);
+    REQUIRE(blocks.data_shards + blocks.parity_shards == DATA_SHARDS_MAX);
+    REQUIRE(blocks.parity_shards == 5);
+    REQUIRE(blocks.fec_percentage == 2);
+  }
+
+  SECTION("Frames that can't fit the min required FEC packets are left unprotected") {
+    plan = gst_moonlight_video::plan_fec_blocks(*rtpmoonlightpay, 1100);
+    REQUIRE(plan.nr_blocks == 0);
+  }
+
+  /* Cleanup */
+  g_object_unref(rtpmoonlightpay);
+}
+
+TEST_CASE_METHOD(GStreamerTestsFixture, "RTP VIDEO parallel multi block FEC", "[GSTPlugin]") {
+  auto rtpmoonlightpay = (gst_rtp_moonlight_pay_video *)g_object_new(gst_TYPE_rtp_moonlight_pay_video, nullptr);
+  rtpmoonlightpay->payload_size = 32;
+  rtpmoonlightpay->fec_percentage = 20;
+
+  // 16 bytes of payload per packet, this will generate ~400 data shards split in 2 FEC blocks
+  auto payload = gst_buffer_new_and_fill(400 * 16, 0xAB);
+  auto encode = [&](int fec_workers) {
+    rtpmoonlightpay->fec_workers = fec_workers;
+    rtpmoonlightpay->cur_seq_number = 0;
+    rtpmoonlightpay->frame_num = 0;
+    return gst_moonlight_video::split_into_rtp(rtpmoonlightpay, payload);
+  };
+
+  auto inline_packets = encode(0);
+  auto parallel_packets = encode(2);
+  REQUIRE(gst_buffer_list_length(inline_packets) > gst_moonlight_video::PARALLEL_FEC_MIN_DATA_SHARDS);
+  REQUIRE(rtpmoonlightpay->cur_seq_number == gst_buffer_list_length(parallel_packets));
+  REQUIRE(rtpmoonlightpay->fec_layouts[2] == 2);
+
+  REQUIRE(gst_buffer_list_length(parallel_packets) == gst_buffer_list_length(inline_packets));
+  for (int i = 0; i < gst_buffer_list_length(parallel_packets); i++) {
+    REQUIRE_THAT(gst_buffer_copy_content(gst_buffer_list_get(parallel_packets, i)),
+                 Equals(gst_buffer_copy_content(gst_buffer_list_get(inline_packets, i))));
+  }
+
+  /* Cleanup */
+  gst_buffer_list_unref(inline_packets);
+  gst_buffer_list_unref(parallel_packets);
+  REQUIRE(get_buf_refcount(payload) == 1);
+  gst_buffer_unref(payload);
+  g_object_unref(rtpmoonlightpay);
+}
+
 TEST_CASE_METHOD(GStreamerTestsFixture, "Create RTP VIDEO packets", "[GSTPlugin]") {
   auto rtpmoonlightpay = (gst_rtp_moonlight_pay_video *)g_object_new(gst_TYPE_rtp_moonlight_pay_video, nullptr);
 
@@ -343,6 +596,601 @@ TEST_CASE_METHOD(GStreamerTestsFixture, "Create RTP VIDEO packets", "[GSTPlugin]
   g_object_unref(video_payload);
 }
 
+TEST_CASE_METHOD(GStreamerTestsFixture, "RTP VIDEO frame types", "[GSTPlugin]") {
+  auto rtpmoonlightpay = (gst_rtp_moonlight_pay_video *)g_object_new(gst_TYPE_rtp_moonlight_pay_video, nullptr);
+  auto frame_type = [&](bool is_key) {
+    auto payload = gst_buffer_new_and_fill(10, "$A PAYLOAD");
+    if (!is_key) {
+      GST_BUFFER_FLAG_SET(payload, GST_BUFFER_FLAG_DELTA_UNIT);
+    }
+    auto video_payload = gst_moonlight_video::prepend_video_header(*rtpmoonlightpay, payload);
+    auto content = gst_buffer_copy_content(video_payload);
+    gst_buffer_unref(video_payload);
+    gst_buffer_unref(payload);
+    return reinterpret_cast<gst_moonlight_video::VideoShortHeader *>(content.data())->frame_type;
+  };
+
+  guint64 last_key_frame_ns = 0;
+  g_object_get(rtpmoonlightpay, "last_key_frame_ns", &last_key_frame_ns, NULL);
+  REQUIRE(last_key_frame_ns == 0);
+
+  REQUIRE(frame_type(true) == 2);
+  g_object_get(rtpmoonlightpay, "last_key_frame_ns", &last_key_frame_ns, NULL);
+  REQUIRE(last_key_frame_ns > 0);
+  REQUIRE(frame_type(false) == 1);
+  REQUIRE(rtpmoonlightpay->last_key_frame_ns == last_key_frame_ns);
+
+  // What the encoder pushes right before the frame that answers a forced key unit
+  auto key_unit_answered = [&](guint count) {
+    auto event = gst_structure_new("GstForceKeyUnit", "count", G_TYPE_UINT, count, NULL);
+    gst_moonlight_video::on_force_key_unit(*rtpmoonlightpay, event);
+    gst_structure_free(event);
+  };
+
+  // Only the P-frame that answers the recovery key unit is marked
+  g_object_set(rtpmoonlightpay, "recovery_key_unit", 3, NULL);
+  REQUIRE(frame_type(false) == 1);
+  key_unit_answered(2);
+  REQUIRE(frame_type(false) == 1);
+  key_unit_answered(3);
+  REQUIRE(frame_type(false) == 5);
+  REQUIRE(frame_type(false) == 1);
+  REQUIRE_FALSE(rtpmoonlightpay->ref_frames_invalidated);
+  REQUIRE(rtpmoonlightpay->recovery_key_unit == 0);
+
+  // The encoder might still answer with a key frame
+  g_object_set(rtpmoonlightpay, "recovery_key_unit", 4, NULL);
+  key_unit_answered(4);
+  REQUIRE(frame_type(true) == 2);
+  REQUIRE(frame_type(false) == 1);
+
+  // A key unit that has been sent in the meantime clears it
+  g_object_set(rtpmoonlightpay, "recovery_key_unit", 5, NULL);
+  g_object_set(rtpmoonlightpay, "recovery_key_unit", 0, NULL);
+  key_unit_answered(5);
+  REQUIRE(frame_type(false) == 1);
+
+  // With periodic intra refresh all the P-frames carry intra refresh blocks
+  g_object_set(rtpmoonlightpay, "intra_refresh", TRUE, NULL);
+  REQUIRE(frame_type(true) == 2);
+  REQUIRE(frame_type(false) == 4);
+  g_object_set(rtpmoonlightpay, "recovery_key_unit", 6, NULL);
+  key_unit_answered(6);
+  REQUIRE(frame_type(false) == 5);
+  REQUIRE(frame_type(false) == 4);
+
+  g_object_unref(rtpmoonlightpay);
+}
+
+TEST_CASE_METHOD(GStreamerTestsFixture, "RTP VIDEO FEC settings", "[GSTPlugin]") {
+  auto rtpmoonlightpay = (gst_rtp_moonlight_pay_video *)g_object_new(gst_TYPE_rtp_moonlight_pay_video, nullptr);
+
+  // Changing the properties doesn't touch the frame that is being streamed
+  g_object_set(rtpmoonlightpay, "fec_percentage", 50, "min_required_fec_packets", 4, NULL);
+  REQUIRE(rtpmoonlightpay->fec_percentage == 20);
+  REQUIRE(rtpmoonlightpay->min_required_fec_packets == 2);
+
+  int fec_percentage = 0, min_required_fec_packets = 0;
+  g_object_get(rtpmoonlightpay,
+               "fec_percentage",
+               &fec_percentage,
+               "min_required_fec_packets",
+               &min_required_fec_packets,
+               NULL);
+  REQUIRE(fec_percentage == 50);
+  REQUIRE(min_required_fec_packets == 4);
+
+  // The next frame will pick them up
+  gst_moonlight_video::apply_fec_settings(*rtpmoonlightpay);
+  REQUIRE(rtpmoonlightpay->fec_percentage == 50);
+  REQUIRE(rtpmoonlightpay->min_required_fec_packets == 4);
+  REQUIRE_FALSE(rtpmoonlightpay->fec_settings_changed);
+
+  g_object_unref(rtpmoonlightpay);
+}
+
+TEST_CASE_METHOD(GStreamerTestsFixture, "RTP VIDEO packets slab", "[GSTPlugin]") {
+  auto rtpmoonlightpay = (gst_rtp_moonlight_pay_video *)g_object_new(gst_TYPE_rtp_moonlight_pay_video, nullptr);
+  rtpmoonlightpay->payload_size = 32;
+  rtpmoonlightpay->add_padding = GENERATE(true, false);
+
+  auto payload = gst_buffer_new_and_fill(100, "Never gonna give you up, never gonna let you down, "
+                                              "never gonna run around and desert you. Never gonna!");
+  auto video_payload = gst_moonlight_video::prepend_video_header(*rtpmoonlightpay, payload);
+
+  auto allocated_packets = gst_moonlight_video::allocate_rtp_packets(*rtpmoonlightpay, video_payload);
+  auto slab_packets = gst_moonlight_video::generate_rtp_packets(*rtpmoonlightpay, video_payload);
+  REQUIRE(rtpmoonlightpay->packets_pool != nullptr);
+
+  // The slab should produce exactly the same packets
+  REQUIRE(gst_buffer_list_length(slab_packets) == gst_buffer_list_length(allocated_packets));
+  for (int i = 0; i < gst_buffer_list_length(slab_packets); i++) {
+    REQUIRE_THAT(gst_buffer_copy_content(gst_buffer_list_get(slab_packets, i)),
+                 Equals(gst_buffer_copy_content(gst_buffer_list_get(allocated_packets, i))));
+  }
+
+  SECTION("FEC can be generated on top of slab packets") {
+    gst_moonlight_video::generate_fec_packets(*rtpmoonlightpay, slab_packets, payload);
+    gst_moonlight_video::generate_fec_packets(*rtpmoonlightpay, allocated_packets, payload);
+
+    REQUIRE(gst_buffer_list_length(slab_packets) == gst_buffer_list_length(allocated_packets));
+    for (int i = 0; i < gst_buffer_list_length(slab_packets); i++) {
+      REQUIRE_THAT(gst_buffer_copy_content(gst_buffer_list_get(slab_packets, i)),
+                   Equals(gst_buffer_copy_content(gst_buffer_list_get(allocated_packets, i))));
+    }
+  }
+
+  SECTION("A bigger frame will grow the slab") {
+    auto slab_size = rtpmoonlightpay->packets_slab_size;
+    auto big_payload = gst_buffer_new_and_fill(slab_size, 0xAB);
+    auto big_packets = gst_moonlight_video::generate_rtp_packets(*rtpmoonlightpay, big_payload);
+
+    REQUIRE(rtpmoonlightpay->packets_slab_size > slab_size);
+    REQUIRE(gst_buffer_list_length(big_packets) ==
+            std::ceil((float)slab_size / (rtpmoonlightpay->payload_size - MAX_RTP_HEADER_SIZE)));
+
+    gst_buffer_list_unref(big_packets);
+    gst_buffer_unref(big_payload);
+  }
+
+  /* Cleanup */
+  gst_buffer_list_unref(slab_packets);
+  gst_buffer_list_unref(allocated_packets);
+  gst_buffer_unref(video_payload);
+  REQUIRE(get_buf_refcount(payload) == 1);
+  gst_buffer_unref(payload);
+  g_object_unref(rtpmoonlightpay);
+}
+
+TEST_CASE_METHOD(GStreamerTestsFixture, "RTP VIDEO FEC without unfolding", "[GSTPlugin]") {
+  auto rtpmoonlightpay = (gst_rtp_moonlight_pay_video *)g_object_new(gst_TYPE_rtp_moonlight_pay_video, nullptr);
+  rtpmoonlightpay->payload_size = 32;
+  rtpmoonlightpay->fec_percentage = 50;
+  rtpmoonlightpay->add_padding = GENERATE(true, false);
+  auto rtp_header_size = sizeof(gst_moonlight_video::VideoRTPHeaders);
+
+  auto payload = gst_buffer_new_and_fill(100, "Never gonna give you up, never gonna let you down, "
+                                              "never gonna run around and desert you. Never gonna!");
+  auto video_payload = gst_moonlight_video::prepend_video_header(*rtpmoonlightpay, payload);
+  auto rtp_packets = gst_moonlight_video::generate_rtp_packets(*rtpmoonlightpay, video_payload);
+  auto data_shards = (int)gst_buffer_list_length(rtp_packets);
+  auto blocks = gst_moonlight_video::determine_split(*rtpmoonlightpay, data_shards);
+
+  // Reference: encode the packets as a single contiguous (zero padded) stream of bytes
+  std::vector<unsigned char> contiguous((blocks.data_shards + blocks.parity_shards) * blocks.block_size, 0x00);
+  for (int i = 0; i < data_shards; i++) {
+    auto packet = gst_buffer_copy_content(gst_buffer_list_get(rtp_packets, i));
+    std::copy(packet.begin(), packet.end(), contiguous.begin() + i * blocks.block_size);
+  }
+  std::vector<unsigned char *> ptr(blocks.data_shards + blocks.parity_shards);
+  for (int i = 0; i < ptr.size(); i++) {
+    ptr[i] = contiguous.data() + i * blocks.block_size;
+  }
+  auto rs = moonlight::fec::create(blocks.data_shards, blocks.parity_shards);
+  REQUIRE(moonlight::fec::encode(rs.get(), ptr.data(), ptr.size(), blocks.block_size) == 0);
+
+  gst_moonlight_video::generate_fec_packets(*rtpmoonlightpay, rtp_packets, payload);
+  REQUIRE(gst_buffer_list_length(rtp_packets) == blocks.data_shards + blocks.parity_shards);
+
+  for (int i = blocks.data_shards; i < ptr.size(); i++) {
+    auto fec_packet = gst_buffer_copy_content(gst_buffer_list_get(rtp_packets, i));
+    REQUIRE(fec_packet.size() == blocks.block_size);
+    REQUIRE_THAT(std::vector<unsigned char>(fec_packet.begin() + rtp_header_size, fec_packet.end()),
+                 Equals(std::vector<unsigned char>(ptr[i] + rtp_header_size, ptr[i] + blocks.block_size)));
+  }
+
+  /* Cleanup */
+  gst_buffer_list_unref(rtp_packets);
+  gst_buffer_unref(video_payload);
+  REQUIRE(get_buf_refcount(payload) == 1);
+  gst_buffer_unref(payload);
+  g_object_unref(rtpmoonlightpay);
+}
+
+TEST_CASE_METHOD(GStreamerTestsFixture, "RTP VIDEO multi block FEC without copies", "[GSTPlugin]") {
+  auto rtpmoonlightpay = (gst_rtp_moonlight_pay_video *)g_object_new(gst_TYPE_rtp_moonlight_pay_video, nullptr);
+  rtpmoonlightpay->payload_size = 32;
+  rtpmoonlightpay->fec_percentage = 20;
+  rtpmoonlightpay->fec_workers = GENERATE(0, 2);
+  auto rtp_header_size = sizeof(gst_moonlight_video::VideoRTPHeaders);
+
+  // 16 bytes of payload per packet, 401 data shards (with the frame header) split in 2 FEC blocks
+  auto payload = gst_buffer_new_and_fill(400 * 16, 0xAB);
+  auto video_payload = gst_moonlight_video::prepend_video_header(*rtpmoonlightpay, payload);
+  auto rtp_packets = gst_moonlight_video::generate_rtp_packets(*rtpmoonlightpay, video_payload);
+  auto data_shards = (int)gst_buffer_list_length(rtp_packets);
+  auto plan = gst_moonlight_video::plan_fec_blocks(*rtpmoonlightpay, data_shards);
+  REQUIRE(plan.nr_blocks == 2);
+
+  // Reference: a copy of the data packets as they come out of generate_rtp_packets() and where their data lives
+  std::vector<std::vector<unsigned char>> original_packets;
+  std::vector<unsigned char *> original_data;
+  for (int i = 0; i < data_shards; i++) {
+    auto packet = gst_buffer_list_get(rtp_packets, i);
+    original_packets.push_back(gst_buffer_copy_content(packet));
+    GstMapInfo info;
+    gst_buffer_map(packet, &info, GST_MAP_READ);
+    original_data.push_back(info.data);
+    gst_buffer_unmap(packet, &info);
+  }
+
+  auto final_packets = gst_moonlight_video::generate_fec_multi_blocks(rtpmoonlightpay, rtp_packets, plan, payload);
+
+  int packet_idx = 0;
+  for (int block_idx = 0; block_idx < plan.nr_blocks; block_idx++) {
+    auto block_start = block_idx * plan.data_shards_per_block;
+    auto block_data_shards = MIN(plan.data_shards_per_block, data_shards - block_start);
+    auto blocks = gst_moonlight_video::determine_split(*rtpmoonlightpay, block_data_shards);
+
+    std::vector<unsigned char> contiguous((blocks.data_shards + blocks.parity_shards) * blocks.block_size, 0x00);
+    std::vector<unsigned char *> ptr(blocks.data_shards + blocks.parity_shards);
+    for (int i = 0; i < ptr.size(); i++) {
+      ptr[i] = contiguous.data() + i * blocks.block_size;
+      if (i < blocks.data_shards) {
+        std::copy(original_packets[block_start + i].begin(), original_packets[block_start + i].end(), ptr[i]);
+      }
+    }
+    auto rs = moonlight::fec::create(blocks.data_shards, blocks.parity_shards);
+    REQUIRE(moonlight::fec::encode(rs.get(), ptr.data(), ptr.size(), blocks.block_size) == 0);
+
+    for (int i = 0; i < ptr.size(); i++, packet_idx++) {
+      auto packet = gst_buffer_list_get(final_packets, packet_idx);
+      auto content = gst_buffer_copy_content(packet);
+      REQUIRE(content.size() == blocks.block_size);
+      REQUIRE_THAT(std::vector<unsigned char>(content.begin() + rtp_header_size, content.end()),
+                   Equals(std::vector<unsigned char>(ptr[i] + rtp_header_size, ptr[i] + blocks.block_size)));
+
+      if (i < blocks.data_shards) {
+        // Writing the FEC info in the header didn't copy the packet
+        GstMapInfo info;
+        gst_buffer_map(packet, &info, GST_MAP_READ);
+        REQUIRE(info.data == original_data[block_start + i]);
+        gst_buffer_unmap(packet, &info);
+        REQUIRE(get_buf_refcount(packet) == 1);
+      }
+    }
+  }
+  REQUIRE(packet_idx == gst_buffer_list_length(final_packets));
+
+  /* Cleanup */
+  gst_buffer_list_unref(final_packets);
+  gst_buffer_unref(video_payload);
+  REQUIRE(get_buf_refcount(payload) == 1);
+  gst_buffer_unref(payload);
+  g_object_unref(rtpmoonlightpay);
+}
+
+TEST_CASE_METHOD(GStreamerTestsFixture, "RTP VIDEO FEC blocks interleaving", "[GSTPlugin]") {
+  using order = std::vector<std::pair<int, int>>;
+  REQUIRE(gst_moonlight_video::fec_send_order({3, 2}, false) == order{{0, 0}, {0, 1}, {0, 2}, {1, 0}, {1, 1}});
+  REQUIRE(gst_moonlight_video::fec_send_order({3, 2}, true) == order{{0, 0}, {1, 0}, {0, 1}, {1, 1}, {0, 2}});
+  REQUIRE(gst_moonlight_video::fec_send_order({2, 2}, true) == order{{0, 0}, {1, 0}, {0, 1}, {1, 1}});
+
+  auto rtpmoonlightpay = (gst_rtp_moonlight_pay_video *)g_object_new(gst_TYPE_rtp_moonlight_pay_video, nullptr);
+  rtpmoonlightpay->payload_size = 32; // 16 bytes of payload per packet
+  rtpmoonlightpay->fec_percentage = 20;
+  auto payload = gst_buffer_new_and_fill(700 * 16 - 8, 0xAB); // 700 data shards, split in 4 blocks
+
+  struct Shard {
+    int block;
+    bool parity;
+  };
+  auto send_frame = [&](bool interleave) {
+    rtpmoonlightpay->interleave_fec_blocks = interleave;
+    auto packets = gst_moonlight_video::split_into_rtp(rtpmoonlightpay, payload);
+    std::vector<Shard> shards;
+    for (int i = 0; i < gst_buffer_list_length(packets); i++) {
+      auto rtp_packet = (gst_moonlight_video::VideoRTPHeaders *)copy_buffer_data(gst_buffer_list_get(packets, i)).first;
+      auto shard_idx = (rtp_packet->packet.fecInfo >> 12) & 0x3FF;
+      auto data_shards = (rtp_packet->packet.fecInfo >> 22) & 0x3FF;
+      shards.push_back({.block = (rtp_packet->packet.multiFecBlocks >> 4) & 0x3, .parity = shard_idx >= data_shards});
+      delete[] (char *)rtp_packet;
+    }
+    gst_buffer_list_unref(packets);
+    return shards;
+  };
+
+  /**
+   * Drops burst_length consecutive packets, starting from each possible position in the frame, and returns
+   * how many times the frame could have been recovered: Reed Solomon can recover a block as long as the lost
+   * packets are not more than its parity packets.
+   */
+  auto recovered_frames = [](const std::vector<Shard> &shards, int burst_length) {
+    std::array<int, MAX_FEC_BLOCKS> parity = {};
+    for (auto shard : shards) {
+      parity[shard.block] += shard.parity;
+    }
+
+    int recovered = 0;
+    for (int burst_start = 0; burst_start + burst_length <= shards.size(); burst_start++) {
+      std::array<int, MAX_FEC_BLOCKS> lost = {};
+      for (int i = burst_start; i < burst_start + burst_length; i++) {
+        lost[shards[i].block]++;
+      }
+      bool ok = true;
+      for (int block = 0; block < MAX_FEC_BLOCKS; block++) {
+        ok &= lost[block] <= parity[block];
+      }
+      recovered += ok;
+    }
+    return recovered;
+  };
+
+  auto sequential = send_frame(false);
+  auto interleaved = send_frame(true);
+  REQUIRE(rtpmoonlightpay->fec_layouts[4] == 2);
+  REQUIRE(sequential.size() == interleaved.size());
+
+  for (int burst_length : {10, 20, 40, 80, 120}) {
+    auto frames = sequential.size() - burst_length + 1;
+    auto sequential_recovered = recovered_frames(sequential, burst_length);
+    auto interleaved_recovered = recovered_frames(interleaved, burst_length);
+    logs::log(logs::info,
+              "[FEC] Burst of {} lost packets, recovered frames: sequential {}/{}, interleaved {}/{}",
+              burst_length,
+              sequential_recovered,
+              frames,
+              interleaved_recovered,
+              frames);
+
+    REQUIRE(interleaved_recovered >= sequential_recovered);
+    if (burst_length == 80) {
+      // Each block has 35 parity packets: a burst of 80 is too much for a single block but not for all 4 of them
+      REQUIRE(sequential_recovered == 0);
+      REQUIRE(interleaved_recovered == frames);
+    }
+  }
+
+  /* Cleanup */
+  gst_buffer_unref(payload);
+  g_object_unref(rtpmoonlightpay);
+}
+
+TEST_CASE_METHOD(GStreamerTestsFixture, "RTP VIDEO slice mode", "[GSTPlugin]") {
+  auto rtpmoonlightpay = (gst_rtp_moonlight_pay_video *)g_object_new(gst_TYPE_rtp_moonlight_pay_video, nullptr);
+  rtpmoonlightpay->payload_size = 32; // 16 bytes of payload per packet
+  rtpmoonlightpay->fec_percentage = 20;
+  rtpmoonlightpay->slices_per_frame = 4;
+  REQUIRE(gst_moonlight_video::is_slice_mode(*rtpmoonlightpay));
+
+  std::vector<unsigned char> frame_payload;
+  for (int slice_idx = 0; slice_idx < 4; slice_idx++) {
+    auto slice = gst_buffer_new_and_fill(40, 0x10 + slice_idx);
+    GST_BUFFER_PTS(slice) = 0;
+    if (slice_idx == 3) {
+      GST_BUFFER_FLAG_SET(slice, GST_BUFFER_FLAG_MARKER);
+    }
+
+    // Every slice is sent straight away as its own FEC block
+    auto packets = gst_moonlight_video::split_slice_into_rtp(rtpmoonlightpay, slice);
+    REQUIRE(packets != nullptr);
+    REQUIRE(rtpmoonlightpay->frame_num == (slice_idx == 3 ? 1 : 0));
+
+    // 3 data packets (the first slice also carries the 8 bytes frame header) + 2 (min required) FEC packets
+    REQUIRE(gst_buffer_list_length(packets) == 5);
+    REQUIRE(gst_buffer_get_encoder_done(gst_buffer_list_get(packets, 0)).has_value() == (slice_idx == 0));
+
+    for (int packet_idx = 0; packet_idx < 5; packet_idx++) {
+      auto packet = gst_buffer_list_get(packets, packet_idx);
+      auto rtp_packet = (gst_moonlight_video::VideoRTPHeaders *)copy_buffer_data(packet).first;
+      REQUIRE(rtp_packet->packet.frameIndex == 0);
+      REQUIRE(rtp_packet->packet.multiFecBlocks == ((slice_idx << 4) | (3 << 6)));
+      REQUIRE(((rtp_packet->packet.fecInfo >> 12) & 0x3FF) == packet_idx);
+      REQUIRE(((rtp_packet->packet.fecInfo >> 22) & 0x3FF) == 3);
+
+      if (packet_idx < 3) {
+        REQUIRE(((rtp_packet->packet.flags & FLAG_SOF) != 0) == (slice_idx == 0 && packet_idx == 0));
+        REQUIRE(((rtp_packet->packet.flags & FLAG_EOF) != 0) == (slice_idx == 3 && packet_idx == 2));
+
+        auto content = gst_buffer_copy_content(packet, sizeof(gst_moonlight_video::VideoRTPHeaders));
+        frame_payload.insert(frame_payload.end(), content.begin(), content.end());
+      }
+      delete[] (char *)rtp_packet;
+    }
+
+    gst_buffer_list_unref(packets);
+    gst_buffer_unref(slice);
+  }
+
+  // The client will concatenate the data packets: frame header + slices (each one zero padded to the packet size)
+  REQUIRE(frame_payload.size() == 4 * 3 * 16);
+  REQUIRE(frame_payload[0] == 0x01);
+  REQUIRE(frame_payload[8] == 0x10);
+  REQUIRE(frame_payload[8 + 39] == 0x10);
+  REQUIRE(frame_payload[48] == 0x11);
+  REQUIRE(frame_payload[48 + 40] == 0x00);
+  REQUIRE(frame_payload[3 * 48] == 0x13);
+  REQUIRE(rtpmoonlightpay->cur_seq_number == 4 * 5);
+  REQUIRE(rtpmoonlightpay->fec_layouts[4] == 1);
+
+  SECTION("Without MARKER the frame is closed when the next one starts") {
+    // Parameter sets are not counted as slices, they'll not trigger sending a block
+    auto first = gst_buffer_new_and_fill(200, 0xAA);
+    GST_BUFFER_PTS(first) = 1;
+    GST_BUFFER_FLAG_SET(first, GST_BUFFER_FLAG_HEADER);
+    auto next_frame = gst_buffer_new_and_fill(10, 0xBB);
+    GST_BUFFER_PTS(next_frame) = 2;
+    GST_BUFFER_FLAG_SET(next_frame, GST_BUFFER_FLAG_HEADER);
+
+    REQUIRE(gst_moonlight_video::split_slice_into_rtp(rtpmoonlightpay, first) == nullptr);
+    auto packets = gst_moonlight_video::split_slice_into_rtp(rtpmoonlightpay, next_frame);
+    REQUIRE(packets != nullptr);
+    REQUIRE(rtpmoonlightpay->frame_num == 2);
+    // The whole frame ends up split in 4 blocks
+    REQUIRE(rtpmoonlightpay->fec_layouts[4] == 2);
+
+    auto last_packet = (gst_moonlight_video::VideoRTPHeaders *)copy_buffer_data(
+                           gst_buffer_list_get(packets, gst_buffer_list_length(packets) - 1))
+                           .first;
+    REQUIRE(last_packet->packet.multiFecBlocks == ((3 << 4) | (3 << 6)));
+    delete[] (char *)last_packet;
+
+    gst_buffer_list_unref(packets);
+    gst_buffer_unref(first);
+    gst_buffer_unref(next_frame);
+  }
+
+  /* Cleanup */
+  g_object_unref(rtpmoonlightpay);
+}
+
+TEST_CASE_METHOD(GStreamerTestsFixture, "RTP VIDEO slice mode large IDR", "[GSTPlugin]") {
+  auto rtpmoonlightpay = (gst_rtp_moonlight_pay_video *)g_object_new(gst_TYPE_rtp_moonlight_pay_video, nullptr);
+  rtpmoonlightpay->payload_size = 32; // 16 bytes of payload per packet
+  rtpmoonlightpay->fec_percentage = 20;
+
+  // Each slice is 300 packets: too big to be sent early as a single block
+  auto send_slices = [rtpmoonlightpay](int nr_slices) {
+    GstBufferList *packets = nullptr;
+    for (int slice_idx = 0; slice_idx < nr_slices; slice_idx++) {
+      auto slice = gst_buffer_new_and_fill(300 * 16, 0x10 + slice_idx);
+      GST_BUFFER_PTS(slice) = 0;
+      if (slice_idx == nr_slices - 1) {
+        GST_BUFFER_FLAG_SET(slice, GST_BUFFER_FLAG_MARKER);
+      }
+      packets = gst_moonlight_video::split_slice_into_rtp(rtpmoonlightpay, slice);
+      REQUIRE((packets != nullptr) == (slice_idx == nr_slices - 1));
+      gst_buffer_unref(slice);
+    }
+    return packets;
+  };
+
+  SECTION("The whole frame is re-planned when it doesn't fit the usual blocks") {
+    rtpmoonlightpay->slices_per_frame = 2;
+    auto packets = send_slices(2);
+
+    // 601 data packets (with the frame header) don't fit in 2 blocks, they'll go in 3 blocks of 201
+    std::map<int, int> block_packets;
+    for (int packet_idx = 0; packet_idx < gst_buffer_list_length(packets); packet_idx++) {
+      auto rtp_packet = (gst_moonlight_video::VideoRTPHeaders *)copy_buffer_data(
+                            gst_buffer_list_get(packets, packet_idx))
+                            .first;
+      REQUIRE((rtp_packet->packet.multiFecBlocks >> 6) == 2);
+      auto block_idx = (rtp_packet->packet.multiFecBlocks >> 4) & 0x3;
+      auto data_shards = (rtp_packet->packet.fecInfo >> 22) & 0x3FF;
+      REQUIRE(data_shards == (block_idx == 2 ? 199 : 201));
+      REQUIRE(((rtp_packet->packet.fecInfo >> 4) & 0xFF) > 0);
+      block_packets[block_idx]++;
+      delete[] (char *)rtp_packet;
+    }
+
+    REQUIRE(block_packets.size() == 3);
+    REQUIRE(block_packets[0] == 201 + 41);
+    REQUIRE(block_packets[1] == 201 + 41);
+    REQUIRE(block_packets[2] == 199 + 40);
+    REQUIRE(rtpmoonlightpay->fec_layouts[3] == 1);
+    REQUIRE(rtpmoonlightpay->cur_seq_number == 601 + 41 + 41 + 40);
+    gst_buffer_list_unref(packets);
+  }
+
+  SECTION("Remaining blocks that don't fit are sent without FEC") {
+    rtpmoonlightpay->slices_per_frame = 4;
+
+    // The first (small) slice is sent straight away as block 0: 2 data packets + 2 FEC packets
+    auto first_slice = gst_buffer_new_and_fill(10, 0x01);
+    GST_BUFFER_PTS(first_slice) = 0;
+    auto first_block = gst_moonlight_video::split_slice_into_rtp(rtpmoonlightpay, first_slice);
+    REQUIRE(gst_buffer_list_length(first_block) == 4);
+    gst_buffer_list_unref(first_block);
+    gst_buffer_unref(first_slice);
+
+    // The other 900 packets have to fill the 3 remaining blocks, 300 data packets each
+    auto packets = send_slices(3);
+    REQUIRE(gst_buffer_list_length(packets) == 900);
+
+    std::set<int> sequence_numbers;
+    for (int packet_idx = 0; packet_idx < gst_buffer_list_length(packets); packet_idx++) {
+      auto rtp_packet = (gst_moonlight_video::VideoRTPHeaders *)copy_buffer_data(
+                            gst_buffer_list_get(packets, packet_idx))
+                            .first;
+      auto block_idx = (rtp_packet->packet.multiFecBlocks >> 4) & 0x3;
+      auto shard_idx = (rtp_packet->packet.fecInfo >> 12) & 0x3FF;
+      REQUIRE((rtp_packet->packet.multiFecBlocks >> 6) == 3);
+      REQUIRE(block_idx == 1 + packet_idx / 300);
+      REQUIRE(shard_idx == packet_idx % 300);
+      REQUIRE(((rtp_packet->packet.fecInfo >> 22) & 0x3FF) == 300);
+      REQUIRE(((rtp_packet->packet.fecInfo >> 4) & 0xFF) == 0);
+      sequence_numbers.insert(boost::endian::big_to_native(rtp_packet->rtp.sequenceNumber));
+      delete[] (char *)rtp_packet;
+    }
+
+    REQUIRE(sequence_numbers.size() == 900);
+    REQUIRE(*sequence_numbers.begin() == 4);
+    REQUIRE(*sequence_numbers.rbegin() == 903);
+    REQUIRE(rtpmoonlightpay->cur_seq_number == 904);
+    // The frame is not counted as protected
+    REQUIRE(rtpmoonlightpay->fec_layouts[0] == 1);
+    REQUIRE(rtpmoonlightpay->fec_layouts[4] == 0);
+    gst_buffer_list_unref(packets);
+  }
+
+  /* Cleanup */
+  g_object_unref(rtpmoonlightpay);
+}
+
+TEST_CASE_METHOD(GStreamerTestsFixture, "RTP VIDEO packets allocations", "[GSTPlugin][.benchmark]") {
+  auto rtpmoonlightpay = (gst_rtp_moonlight_pay_video *)g_object_new(gst_TYPE_rtp_moonlight_pay_video, nullptr);
+  auto payload = gst_buffer_new_and_fill(128 * 1024, 0xAB); // ~130 RTP packets
+  auto video_payload = gst_moonlight_video::prepend_video_header(*rtpmoonlightpay, payload);
+
+  constexpr auto nr_frames = 100;
+  struct PerFrame {
+    double allocations;
+    double buffers;
+    double memories;
+  };
+  auto allocations_per_frame = [&](auto generate_packets) {
+    allocations_count = 0;
+    buffers_count = 0;
+    memories_count = 0;
+    counting_objects = true;
+    for (int frame = 0; frame < nr_frames; frame++) {
+      gst_buffer_list_unref(generate_packets(*rtpmoonlightpay, video_payload));
+    }
+    counting_objects = false;
+    return PerFrame{.allocations = (double)allocations_count / nr_frames,
+                    .buffers = (double)buffers_count / nr_frames,
+                    .memories = (double)memories_count / nr_frames};
+  };
+
+  // Hooks can't be removed, the tracer lives for the whole test run and only counts when asked to
+  static auto tracer = g_object_new(counting_tracer_get_type(), nullptr);
+  REQUIRE(tracer != nullptr);
+  gst_allocator_set_default(GST_ALLOCATOR(gst_object_ref_sink(g_object_new(counting_allocator_get_type(), nullptr))));
+  auto per_packet = allocations_per_frame(gst_moonlight_video::allocate_rtp_packets);
+  auto slab = allocations_per_frame(gst_moonlight_video::generate_rtp_packets);
+  gst_allocator_set_default(gst_allocator_find(GST_ALLOCATOR_SYSMEM));
+
+  logs::log(logs::info,
+            "[BENCHMARK] Per frame, per packet: {} memory allocations, {} GstBuffer, {} GstMemory - "
+            "slab: {} memory allocations, {} GstBuffer, {} GstMemory",
+            per_packet.allocations,
+            per_packet.buffers,
+            per_packet.memories,
+            slab.allocations,
+            slab.buffers,
+            slab.memories);
+  REQUIRE(slab.allocations < 1);
+  REQUIRE(slab.allocations < per_packet.allocations);
+  // Each packet is still a GstBuffer wrapping its own part of the slab, but nothing else is created
+  REQUIRE(slab.buffers <= per_packet.buffers);
+  REQUIRE(slab.memories < per_packet.memories);
+  REQUIRE(slab.buffers + slab.memories < per_packet.buffers + per_packet.memories);
+
+  BENCHMARK("Per packet allocation") {
+    gst_buffer_list_unref(gst_moonlight_video::allocate_rtp_packets(*rtpmoonlightpay, video_payload));
+  };
+
+  BENCHMARK("Slab allocation") {
+    gst_buffer_list_unref(gst_moonlight_video::generate_rtp_packets(*rtpmoonlightpay, video_payload));
+  };
+
+  /* Cleanup */
+  gst_buffer_unref(video_payload);
+  gst_buffer_unref(payload);
+  g_object_unref(rtpmoonlightpay);
+}
+
 /*
  * AUDIO
  */
@@ -498,3 +1346,382 @@ TEST_CASE_METHOD(GStreamerTestsFixture, "Audio RTP packet creation", "[GSTPlugin
     }
   }
 }
+
+TEST_CASE_METHOD(GStreamerTestsFixture, "Audio RTP packets from the FEC shards", "[GSTPlugin]") {
+  auto rtpmoonlightpay = (gst_rtp_moonlight_pay_audio *)g_object_new(gst_TYPE_rtp_moonlight_pay_audio, nullptr);
+  rtpmoonlightpay->encrypt = GENERATE(true, false);
+  rtpmoonlightpay->aes_key = "0123456789012345";
+  rtpmoonlightpay->aes_iv = "12345678";
+
+  // Should be byte for byte the same as the packets built with the old code path
+  for (auto payload_size : {1, 15, 16, 17, 240, 1000}) {
+    auto payload = gst_buffer_new_and_fill(payload_size, 0x42 + payload_size);
+    for (int packet = 0; packet < 8; packet++) {
+      auto legacy = audio::create_rtp_audio_buffer(*rtpmoonlightpay, payload);
+      auto in_place = audio::create_rtp_audio_packet(*rtpmoonlightpay, payload);
+
+      REQUIRE(gst_buffer_get_size(in_place) == gst_buffer_get_size(legacy));
+      REQUIRE(gst_buffer_copy_content(in_place) == gst_buffer_copy_content(legacy));
+
+      gst_buffer_unref(legacy);
+      gst_buffer_unref(in_place);
+      rtpmoonlightpay->cur_seq_number++;
+    }
+    gst_buffer_unref(payload);
+  }
+
+  // Payloads that don't fit in a shard are still handled
+  auto big_payload = gst_buffer_new_and_fill(AUDIO_MAX_BLOCK_SIZE, 0x01);
+  auto big_packet = audio::create_rtp_audio_packet(*rtpmoonlightpay, big_payload);
+  REQUIRE(gst_buffer_get_size(big_packet) > AUDIO_MAX_BLOCK_SIZE);
+  gst_buffer_unref(big_packet);
+  gst_buffer_unref(big_payload);
+
+  // Changing the key (from any thread) doesn't touch the cipher context that might be in use
+  auto cipher_ctx = rtpmoonlightpay->cipher_ctx.get();
+  g_object_set(rtpmoonlightpay, "aes_key", "AABBCCDDEEFF00112233445566778899", nullptr);
+  REQUIRE(rtpmoonlightpay->cipher_ctx.get() == cipher_ctx);
+
+  // the streaming thread will pick up the new key with the next packet
+  auto payload = gst_buffer_new_and_fill(16, 0x42);
+  auto legacy = audio::create_rtp_audio_buffer(*rtpmoonlightpay, payload);
+  auto in_place = audio::create_rtp_audio_packet(*rtpmoonlightpay, payload);
+  REQUIRE(gst_buffer_copy_content(in_place) == gst_buffer_copy_content(legacy));
+  gst_buffer_unref(legacy);
+  gst_buffer_unref(in_place);
+  gst_buffer_unref(payload);
+
+  g_object_unref(rtpmoonlightpay);
+}
+
+TEST_CASE_METHOD(GStreamerTestsFixture, "Audio RTP FEC ring", "[GSTPlugin]") {
+  auto rtpmoonlightpay = (gst_rtp_moonlight_pay_audio *)g_object_new(gst_TYPE_rtp_moonlight_pay_audio, nullptr);
+  rtpmoonlightpay->encrypt = false;
+  auto payload = gst_buffer_new_and_fill(240, 0xAB);
+
+  auto send_fec_block = [&]() {
+    GstBufferList *packets = gst_buffer_list_new();
+    for (int i = 0; i < AUDIO_DATA_SHARDS; i++) {
+      auto rtp_packets = audio::split_into_rtp(rtpmoonlightpay, payload);
+      for (guint idx = 0; idx < gst_buffer_list_length(rtp_packets); idx++) {
+        gst_buffer_list_add(packets, gst_buffer_ref(gst_buffer_list_get(rtp_packets, idx)));
+      }
+      gst_buffer_list_unref(rtp_packets);
+    }
+    return packets;
+  };
+
+  SECTION("Packets point straight into the shards") {
+    auto packets = send_fec_block();
+    REQUIRE(gst_buffer_list_length(packets) == AUDIO_TOTAL_SHARDS);
+
+    for (int shard = 0; shard < AUDIO_TOTAL_SHARDS; shard++) {
+      GstMapInfo info;
+      gst_buffer_map(gst_buffer_list_get(packets, shard), &info, GST_MAP_READ);
+      if (shard < AUDIO_DATA_SHARDS) {
+        REQUIRE(info.data == rtpmoonlightpay->packets_buffer[shard]);
+      } else { // The FEC header sits right in front of the parity payload
+        REQUIRE(info.data + audio::FEC_HEADER_SIZE ==
+                rtpmoonlightpay->packets_buffer[shard] + audio::RTP_HEADER_SIZE);
+        auto fec_packet = (audio::AudioFECPacket *)info.data;
+        REQUIRE(fec_packet->rtp.packetType == 127);
+        REQUIRE(fec_packet->fec_header.fecShardIndex == shard - AUDIO_DATA_SHARDS);
+      }
+      gst_buffer_unmap(gst_buffer_list_get(packets, shard), &info);
+    }
+    gst_buffer_list_unref(packets);
+  }
+
+  SECTION("Shards are re-used only once released") {
+    auto ring = std::vector<audio::FECShards *>(std::begin(rtpmoonlightpay->fec_ring),
+                                                std::end(rtpmoonlightpay->fec_ring));
+
+    // Nothing held downstream: the same sets are used over and over
+    for (int block = 0; block < AUDIO_FEC_RING_SIZE * 2; block++) {
+      gst_buffer_list_unref(send_fec_block());
+    }
+    REQUIRE(std::equal(ring.begin(), ring.end(), std::begin(rtpmoonlightpay->fec_ring)));
+
+    // Hold on to more blocks than the ring can fit, packets must never be overwritten
+    std::vector<std::pair<GstBufferList *, std::vector<unsigned char>>> held;
+    for (int block = 0; block < AUDIO_FEC_RING_SIZE * 2; block++) {
+      auto packets = send_fec_block();
+      held.emplace_back(packets, gst_buffer_copy_content(gst_buffer_list_get(packets, 0)));
+    }
+    for (auto &[packets, content] : held) {
+      REQUIRE(gst_buffer_copy_content(gst_buffer_list_get(packets, 0)) == content);
+      gst_buffer_list_unref(packets);
+    }
+  }
+
+  SECTION("FEC covers the packets that are not written in place") {
+    // Too big for the in place encryption, but the packet still fits in a shard
+    gst_buffer_unref(payload);
+    payload = gst_buffer_new_and_fill(AUDIO_MAX_BLOCK_SIZE - audio::RTP_HEADER_SIZE, 0xCD);
+
+    auto packets = send_fec_block();
+    REQUIRE(gst_buffer_list_length(packets) == AUDIO_TOTAL_SHARDS);
+    for (int shard = 0; shard < AUDIO_DATA_SHARDS; shard++) {
+      auto content = gst_buffer_copy_content(gst_buffer_list_get(packets, shard));
+      REQUIRE(std::equal(content.begin(), content.end(), rtpmoonlightpay->packets_buffer[shard]));
+    }
+    gst_buffer_list_unref(packets);
+
+    // It doesn't fit: the whole set is sent without FEC
+    gst_buffer_unref(payload);
+    payload = gst_buffer_new_and_fill(AUDIO_MAX_BLOCK_SIZE, 0xCD);
+    packets = send_fec_block();
+    REQUIRE(gst_buffer_list_length(packets) == AUDIO_DATA_SHARDS);
+    gst_buffer_list_unref(packets);
+  }
+
+  gst_buffer_unref(payload);
+  g_object_unref(rtpmoonlightpay);
+}
+
+TEST_CASE_METHOD(GStreamerTestsFixture, "Audio RTP encryption", "[GSTPlugin][.benchmark]") {
+  auto rtpmoonlightpay = (gst_rtp_moonlight_pay_audio *)g_object_new(gst_TYPE_rtp_moonlight_pay_audio, nullptr);
+  rtpmoonlightpay->encrypt = true;
+  rtpmoonlightpay->aes_key = "0123456789012345";
+  rtpmoonlightpay->aes_iv = "12345678";
+  auto payload = gst_buffer_new_and_fill(240, 0xAB); // 5ms of 2ch Opus at ~384kbps
+
+  constexpr auto nr_packets = 100000;
+  auto ns_per_packet = [&](auto create_packet) {
+    auto start = std::chrono::steady_clock::now();
+    for (int packet = 0; packet < nr_packets; packet++) {
+      gst_buffer_unref(create_packet(*rtpmoonlightpay, payload));
+      rtpmoonlightpay->cur_seq_number++;
+    }
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    return (double)std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count() / nr_packets;
+  };
+
+  auto legacy = ns_per_packet(audio::create_rtp_audio_buffer);
+  auto in_place = ns_per_packet(audio::create_rtp_audio_packet);
+  logs::log(logs::info, "[BENCHMARK] Audio packet creation, legacy: {:.0f}ns - in place: {:.0f}ns", legacy, in_place);
+  REQUIRE(in_place < legacy);
+
+  gst_buffer_unref(payload);
+  g_object_unref(rtpmoonlightpay);
+}
+
+/*
+ * UDP SINK
+ */
+
+/**
+ * Binds a UDP socket on localhost, returns the socket and the port that has been assigned
+ */
+static std::pair<int, int> bind_local_receiver() {
+  int fd = socket(AF_INET, SOCK_DGRAM, 0);
+  sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = 0;
+  bind(fd, (sockaddr *)&addr, sizeof(addr));
+
+  timeval timeout = {.tv_sec = 1, .tv_usec = 0};
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  int rcv_buf = 8 * 1024 * 1024;
+  setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcv_buf, sizeof(rcv_buf));
+
+  socklen_t addr_len = sizeof(addr);
+  getsockname(fd, (sockaddr *)&addr, &addr_len);
+  return {fd, ntohs(addr.sin_port)};
+}
+
+TEST_CASE_METHOD(GStreamerTestsFixture, "UDP sink batching", "[GSTPlugin]") {
+  auto [receiver, port] = bind_local_receiver();
+  auto udp_sink = (gst_moonlight_udp_sink *)g_object_new(gst_TYPE_moonlight_udp_sink, nullptr);
+  g_object_set(udp_sink, "host", "127.0.0.1", "port", port, "gso", GENERATE(true, false), "dscp", 46, nullptr);
+  REQUIRE(gst_moonlight_udp::open_socket(*udp_sink));
+
+  // 100 packets of the same size, a shorter one and then a few more; the shorter one will break GSO segments
+  GstBufferList *packets = gst_buffer_list_new();
+  for (int i = 0; i < 105; i++) {
+    auto size = i == 100 ? 100 : 1000;
+    gst_buffer_list_add(packets, gst_buffer_new_and_fill(size, i));
+  }
+  gst_buffer_set_encoder_done(gst_buffer_list_get(packets, 0), monotonic_now_ns());
+  REQUIRE(gst_moonlight_udp::send_packets(*udp_sink, packets) == GST_FLOW_OK);
+  REQUIRE(udp_sink->latency_frames == 1);
+  REQUIRE(udp_sink->packets_sent == 105);
+  REQUIRE(udp_sink->send_errors == 0);
+  REQUIRE(udp_sink->send_calls == 1);
+
+  // Packets should arrive one by one, in order
+  std::vector<unsigned char> received(2000);
+  for (int i = 0; i < 105; i++) {
+    auto size = recv(receiver, received.data(), received.size(), 0);
+    REQUIRE(size == (i == 100 ? 100 : 1000));
+    REQUIRE(received[0] == i);
+    REQUIRE(received[size - 1] == i);
+  }
+
+  /* Cleanup */
+  gst_buffer_list_unref(packets);
+  gst_moonlight_udp::close_socket(*udp_sink);
+  g_object_unref(udp_sink);
+  close(receiver);
+}
+
+TEST_CASE("UDP sink pacing schedule", "[GSTPlugin]") {
+  SECTION("Packets are spread evenly over the window") {
+    // 50 packets over 5ms: one every 100us
+    auto schedule = gst_moonlight_udp::pacing_schedule(5 * GST_MSECOND, 50);
+    REQUIRE(schedule.burst_size == 1);
+    REQUIRE(schedule.send_offset_ns(0) == 0);
+    REQUIRE(schedule.send_offset_ns(1) == 100 * GST_USECOND);
+    REQUIRE(schedule.send_offset_ns(25) == 2500 * GST_USECOND);
+    REQUIRE(schedule.send_offset_ns(49) == 4900 * GST_USECOND);
+  }
+
+  SECTION("Short gaps are merged into bursts") {
+    // 500 packets over 5ms would be one every 10us, we send bursts of 5 every 50us instead
+    auto schedule = gst_moonlight_udp::pacing_schedule(5 * GST_MSECOND, 500);
+    REQUIRE(schedule.burst_size == 5);
+    REQUIRE(schedule.send_offset_ns(5) - schedule.send_offset_ns(0) >= gst_moonlight_udp::MIN_PACING_INTERVAL_NS);
+    REQUIRE(schedule.send_offset_ns(495) == 4950 * GST_USECOND);
+  }
+
+  SECTION("No pacing window") {
+    auto schedule = gst_moonlight_udp::pacing_schedule(0, 50);
+    // The whole frame goes out in a single burst
+    REQUIRE(schedule.burst_size >= 50);
+    REQUIRE(schedule.send_offset_ns(49) == 0);
+  }
+}
+
+TEST_CASE_METHOD(GStreamerTestsFixture, "UDP sink pacing", "[GSTPlugin]") {
+  auto [receiver, port] = bind_local_receiver();
+  auto udp_sink = (gst_moonlight_udp_sink *)g_object_new(gst_TYPE_moonlight_udp_sink, nullptr);
+  // 100 FPS, half of the frame interval: packets should be spread over 5ms
+  g_object_set(udp_sink, "host", "127.0.0.1", "port", port, "refresh-rate", 100, "pacing", 0.5, nullptr);
+  REQUIRE(gst_moonlight_udp::pacing_window_ns(*udp_sink) == 5 * GST_MSECOND);
+  REQUIRE(gst_moonlight_udp::open_socket(*udp_sink));
+  gst_moonlight_udp::start_pacer(*udp_sink);
+
+  GstBufferList *packets = gst_buffer_list_new();
+  for (int i = 0; i < 50; i++) {
+    gst_buffer_list_add(packets, gst_buffer_new_and_fill(1000, i));
+  }
+  gst_moonlight_udp::queue_frame(*udp_sink, packets);
+
+  std::vector<unsigned char> received(2000);
+  for (int i = 0; i < 50; i++) {
+    REQUIRE(recv(receiver, received.data(), received.size(), 0) == 1000);
+    REQUIRE(received[0] == i);
+  }
+
+  gst_moonlight_udp::stop_pacer(*udp_sink);
+  // Timings depend on the scheduler, we only check that every packet went through the paced path
+  REQUIRE(udp_sink->paced_frames == 1);
+  REQUIRE(udp_sink->flushed_frames == 0);
+  REQUIRE(udp_sink->pacing_gaps == 49);
+
+  /* Cleanup */
+  gst_buffer_list_unref(packets);
+  gst_moonlight_udp::close_socket(*udp_sink);
+  g_object_unref(udp_sink);
+  close(receiver);
+}
+
+TEST_CASE_METHOD(GStreamerTestsFixture, "UDP sink pacing accuracy", "[GSTPlugin][.benchmark]") {
+  auto [receiver, port] = bind_local_receiver();
+  auto udp_sink = (gst_moonlight_udp_sink *)g_object_new(gst_TYPE_moonlight_udp_sink, nullptr);
+  g_object_set(udp_sink, "host", "127.0.0.1", "port", port, "refresh-rate", 100, "pacing", 0.5, nullptr);
+  REQUIRE(gst_moonlight_udp::open_socket(*udp_sink));
+  gst_moonlight_udp::start_pacer(*udp_sink);
+
+  GstBufferList *packets = gst_buffer_list_new();
+  for (int i = 0; i < 50; i++) {
+    gst_buffer_list_add(packets, gst_buffer_new_and_fill(1000, i));
+  }
+  gst_moonlight_udp::queue_frame(*udp_sink, packets);
+
+  std::vector<unsigned char> received(2000);
+  std::chrono::steady_clock::time_point first_received;
+  for (int i = 0; i < 50; i++) {
+    REQUIRE(recv(receiver, received.data(), received.size(), 0) == 1000);
+    if (i == 0) {
+      first_received = std::chrono::steady_clock::now();
+    }
+  }
+  std::chrono::duration<double, std::micro> elapsed = std::chrono::steady_clock::now() - first_received;
+  gst_moonlight_udp::stop_pacer(*udp_sink);
+
+  auto mean_gap_us = (double)udp_sink->pacing_gap_sum_ns / udp_sink->pacing_gaps / GST_USECOND;
+  logs::log(logs::info,
+            "[BENCHMARK] pacing: frame spread over {:.0f}us, gaps mean {:.1f}us min {:.1f}us max {:.1f}us",
+            elapsed.count(),
+            mean_gap_us,
+            (double)udp_sink->pacing_gap_min_ns / GST_USECOND,
+            (double)udp_sink->pacing_gap_max_ns / GST_USECOND);
+  // The last packet is sent 49/50 of the way through the window
+  REQUIRE(elapsed.count() >= 4500);
+  REQUIRE(mean_gap_us >= 90);
+
+  /* Cleanup */
+  gst_buffer_list_unref(packets);
+  gst_moonlight_udp::close_socket(*udp_sink);
+  g_object_unref(udp_sink);
+  close(receiver);
+}
+
+TEST_CASE_METHOD(GStreamerTestsFixture, "UDP sink throughput", "[GSTPlugin][.benchmark]") {
+  gst_element_register(nullptr, "moonlightudpsink", GST_RANK_NONE, gst_TYPE_moonlight_udp_sink);
+  auto [receiver, port] = bind_local_receiver();
+  constexpr int nr_frames = 2000;
+  constexpr int packets_per_frame = 200;
+  constexpr int packet_size = 1024;
+
+  GstBufferList *frame = gst_buffer_list_new();
+  for (int i = 0; i < packets_per_frame; i++) {
+    gst_buffer_list_add(frame, gst_buffer_new_and_fill(packet_size, i));
+  }
+
+  auto run_sink = [&](const std::string &sink) {
+    GError *error = nullptr;
+    auto pipeline_str = fmt::format("appsrc name=src ! {} host=127.0.0.1 port={} sync=false", sink, port);
+    auto pipeline = gst_parse_launch(pipeline_str.c_str(), &error);
+    REQUIRE(error == nullptr);
+    auto src = gst_bin_get_by_name(GST_BIN(pipeline), "src");
+    gst_element_set_state(pipeline, GST_STATE_PLAYING);
+
+    auto cpu_start = std::clock();
+    auto wall_start = std::chrono::steady_clock::now();
+    for (int i = 0; i < nr_frames; i++) {
+      gst_app_src_push_buffer_list(GST_APP_SRC(src), gst_buffer_list_copy(frame));
+    }
+    gst_app_src_end_of_stream(GST_APP_SRC(src));
+    auto bus = gst_element_get_bus(pipeline);
+    auto msg =
+        gst_bus_timed_pop_filtered(bus, GST_CLOCK_TIME_NONE, (GstMessageType)(GST_MESSAGE_EOS | GST_MESSAGE_ERROR));
+    REQUIRE(GST_MESSAGE_TYPE(msg) == GST_MESSAGE_EOS);
+
+    std::chrono::duration<double> wall = std::chrono::steady_clock::now() - wall_start;
+    auto cpu = (double)(std::clock() - cpu_start) / CLOCKS_PER_SEC;
+    auto packets = (double)nr_frames * packets_per_frame;
+    auto gbits = packets * packet_size * 8 / 1e9;
+    logs::log(logs::info,
+              "[BENCHMARK] {}: {:.0f} packets/s, {:.3f} CPU seconds per Gbit",
+              sink,
+              packets / wall.count(),
+              cpu / gbits);
+
+    gst_message_unref(msg);
+    gst_object_unref(bus);
+    gst_element_set_state(pipeline, GST_STATE_NULL);
+    gst_object_unref(src);
+    gst_object_unref(pipeline);
+  };
+
+  run_sink("udpsink");
+  run_sink("moonlightudpsink gso=false");
+  run_sink("moonlightudpsink gso=true");
+
+  /* Cleanup */
+  gst_buffer_list_unref(frame);
+  close(receiver);
+}
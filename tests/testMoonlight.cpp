@@ -1,3 +1,4 @@
+#include <catch2/benchmark/catch_benchmark.hpp>
 #include <catch2/catch_test_macros.hpp>
 #include <catch2/matchers/catch_matchers_container_properties.hpp>
 #include <catch2/matchers/catch_matchers_contains.hpp>
@@ -63,6 +64,36 @@ TEST_CASE("LocalState load TOML", "[LocalState]") {
   }
 }
 
+TEST_CASE("Video pipeline placeholders", "[LocalState]") {
+  // The default x264 encoder pipeline
+  auto session = state::VideoSession{
+      .display_mode = {.width = 1920, .height = 1080, .refreshRate = 60},
+      .gst_pipeline = "x264enc option-string=\"slices={slices_per_frame}:keyint={x264_keyint}:open-gop=0\" "
+                      "intra-refresh={intra_refresh} bitrate={bitrate}",
+      .fec_workers = 4,
+      .bitrate_kbps = 15500,
+      .slices_per_frame = 2,
+      .intra_refresh = false};
+
+  SECTION("Key frames are only produced on demand") {
+    REQUIRE_THAT(streaming::video_pipeline(session, 1234),
+                 Equals("x264enc option-string=\"slices=2:keyint=infinite:open-gop=0\" "
+                        "intra-refresh=false bitrate=15500"));
+  }
+
+  SECTION("Intra refresh refreshes the picture once per second") {
+    session.intra_refresh = true;
+    REQUIRE_THAT(streaming::video_pipeline(session, 1234),
+                 Equals("x264enc option-string=\"slices=2:keyint=60:open-gop=0\" "
+                        "intra-refresh=true bitrate=15500"));
+  }
+
+  SECTION("The FEC workers are set on the payloader") {
+    session.gst_pipeline = "rtpmoonlightpay_video fec_workers={fec_workers}";
+    REQUIRE_THAT(streaming::video_pipeline(session, 1234), Equals("rtpmoonlightpay_video fec_workers=4"));
+  }
+}
+
 TEST_CASE("LocalState pairing information", "[LocalState]") {
   auto event_bus = std::make_shared<dp::event_bus>();
   auto clients_atom = std::make_shared<immer::atom<state::PairedClientList>>();
@@ -359,7 +390,7 @@ TEST_CASE("Multiple users", "[HTTP]") {
       .host = {},
       .pairing_cache = std::make_shared<immer::atom<immer::map<std::string, state::PairCache>>>(),
       .event_bus = event_bus,
-      .running_sessions = std::make_shared<immer::atom<immer::vector<state::StreamSession>>>()};
+      .running_sessions = std::make_shared<immer::atom<state::SessionsRegistry>>()};
 
   auto client1 = state::PairedClient{.app_state_folder = "test"};
   auto app1 = state::App{.base = moonlight::App{.title = "test_app"}};
@@ -370,7 +401,7 @@ TEST_CASE("Multiple users", "[HTTP]") {
   REQUIRE(session1.video_stream_port == 48100);
   REQUIRE(session1.audio_stream_port == 48200);
 
-  app_state.running_sessions->update([session1](auto &sessions) { return sessions.push_back(session1); });
+  app_state.running_sessions->update([session1](auto &sessions) { return add_session(sessions, session1); });
   auto session2 = endpoints::https::create_run_session(client1_headers, client1_ip, client1, app_state, app1);
 
   REQUIRE(session2.video_stream_port == 48101);
@@ -378,7 +409,7 @@ TEST_CASE("Multiple users", "[HTTP]") {
 
   // Saving only the second session
   app_state.running_sessions->update(
-      [session2](auto &sessions) { return immer::vector<state::StreamSession>{session2}; });
+      [session2](auto &sessions) { return add_session(state::SessionsRegistry{}, session2); });
   // We should now assign back the now available [48100, 48200] ports
   auto session3 = endpoints::https::create_run_session(client1_headers, client1_ip, client1, app_state, app1);
 
@@ -387,7 +418,7 @@ TEST_CASE("Multiple users", "[HTTP]") {
 
   // Saving all 3 sessions (even if one is a duplicate)
   app_state.running_sessions->update([session1, session2, session3](auto &sessions) {
-    return immer::vector<state::StreamSession>{session1, session2, session3};
+    return add_session(add_session(add_session(state::SessionsRegistry{}, session1), session2), session3);
   });
   // We should now assign the 2nd port (even if we have 3 sessions) because of port clash
   auto session4 = endpoints::https::create_run_session(client1_headers, client1_ip, client1, app_state, app1);
@@ -395,3 +426,107 @@ TEST_CASE("Multiple users", "[HTTP]") {
   REQUIRE(session4.video_stream_port == 48102);
   REQUIRE(session4.audio_stream_port == 48202);
 }
+
+TEST_CASE("Sessions registry", "[HTTP]") {
+  auto session1 = state::StreamSession{.session_id = 1, .ip = "192.168.1.1"};
+  auto session2 = state::StreamSession{.session_id = 2, .ip = "192.168.1.2"};
+  auto session3 = state::StreamSession{.session_id = 3, .ip = "192.168.1.1"};
+  auto session4 = state::StreamSession{.session_id = 4, .ip = "192.168.1.1"};
+
+  auto sessions = add_session(add_session(state::SessionsRegistry{}, session1), session2);
+  REQUIRE(get_session_by_id(sessions, 1)->ip == "192.168.1.1");
+  REQUIRE(get_session_by_ip(sessions, "192.168.1.2")->session_id == 2);
+  REQUIRE(get_session_by_id(sessions, 3) == nullptr);
+  REQUIRE(get_session_by_ip(sessions, "192.168.1.3") == nullptr);
+
+  // Lookups share the same session instead of copying it
+  REQUIRE(get_session_by_id(sessions, 2) == get_session_by_ip(sessions, "192.168.1.2"));
+
+  // Multiple sessions for the same IP: the oldest one is returned
+  sessions = add_session(add_session(sessions, session3), session4);
+  REQUIRE(sessions.sessions.size() == 4);
+  REQUIRE(get_session_by_ip(sessions, "192.168.1.1")->session_id == 1);
+
+  // Removing a newer one doesn't change anything
+  sessions = remove_session(sessions, 4);
+  REQUIRE(get_session_by_id(sessions, 4) == nullptr);
+  REQUIRE(get_session_by_ip(sessions, "192.168.1.1")->session_id == 1);
+
+  // Removing the oldest one, the next oldest takes over
+  sessions = add_session(sessions, session4);
+  sessions = remove_session(sessions, 1);
+  REQUIRE(sessions.sessions.size() == 3);
+  REQUIRE(get_session_by_id(sessions, 1) == nullptr);
+  REQUIRE(get_session_by_ip(sessions, "192.168.1.1")->session_id == 3);
+
+  sessions = remove_session(remove_session(remove_session(sessions, 3), 4), 2);
+  REQUIRE(sessions.sessions.empty());
+  REQUIRE(sessions.by_id.empty());
+  REQUIRE(sessions.by_ip.empty());
+}
+
+TEST_CASE("Sessions lookup benchmark", "[HTTP][.benchmark]") {
+  constexpr int nr_sessions = 64;
+  auto event_bus = std::make_shared<dp::event_bus>();
+  auto sessions = std::make_shared<immer::atom<state::SessionsRegistry>>();
+  auto sessions_v = immer::vector<state::StreamSession>{};
+  for (int i = 0; i < nr_sessions; i++) {
+    auto session = state::StreamSession{.event_bus = event_bus,
+                                        .app = std::make_shared<state::App>(),
+                                        .aes_key = std::string(16, 'k'),
+                                        .aes_iv = std::string(16, 'i'),
+                                        .session_id = (std::size_t)i,
+                                        .ip = "10.0.0." + std::to_string(i)};
+    sessions->update([&session](const state::SessionsRegistry &registry) { return add_session(registry, session); });
+    sessions_v = sessions_v.push_back(session);
+  }
+  auto last_ip = "10.0.0." + std::to_string(nr_sessions - 1);
+
+  // How lookups used to work: a linear scan that copies the matching session out
+  auto linear_scan = [&sessions_v](const std::string &ip) {
+    auto results = sessions_v                                                                   //
+                   | views::filter([&ip](const state::StreamSession &s) { return s.ip == ip; }) //
+                   | views::take(1)                                                             //
+                   | to_vector;                                                                 //
+    return results.empty() ? std::optional<state::StreamSession>{} : results[0];
+  };
+
+  // Every session looking up its own IP at the same time, like the RTSP and control threads would do
+  auto concurrently = [nr_sessions](const auto &lookup) {
+    std::vector<std::thread> threads;
+    std::atomic<int> found = 0;
+    for (int i = 0; i < nr_sessions; i++) {
+      threads.emplace_back([&lookup, &found, ip = "10.0.0." + std::to_string(i)]() {
+        for (int j = 0; j < 100; j++) {
+          if (lookup(ip)) {
+            found++;
+          }
+        }
+      });
+    }
+    for (auto &thread : threads) {
+      thread.join();
+    }
+    return found.load();
+  };
+
+  BENCHMARK("Linear scan, copy") {
+    return linear_scan(last_ip);
+  };
+
+  BENCHMARK("Indexed, by IP") {
+    return get_session_by_ip(sessions->load(), last_ip);
+  };
+
+  BENCHMARK("Indexed, by ID") {
+    return get_session_by_id(sessions->load(), nr_sessions - 1);
+  };
+
+  BENCHMARK("Linear scan, concurrent") {
+    return concurrently(linear_scan);
+  };
+
+  BENCHMARK("Indexed, concurrent") {
+    return concurrently([&sessions](const std::string &ip) { return get_session_by_ip(sessions->load(), ip); });
+  };
+}
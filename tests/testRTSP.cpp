@@ -262,7 +262,7 @@ state::SessionsAtoms test_init_state() {
       .video_stream_port = 1234,
       .audio_stream_port = 1235,
   };
-  return std::make_shared<immer::atom<immer::vector<StreamSession>>>(immer::vector<StreamSession>{session});
+  return std::make_shared<immer::atom<state::SessionsRegistry>>(add_session(state::SessionsRegistry{}, session));
 }
 
 TEST_CASE("Commands", "[RTSP]") {